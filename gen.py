@@ -27,6 +27,10 @@ CONFIGS = {
         'cflags': '-g -O2 -fsanitize=undefined',
         'ldflags': '-fsanitize=undefined',
     },
+    'tsan': {
+        'cflags': '-g -O2 -fsanitize=thread',
+        'ldflags': '-fsanitize=thread',
+    },
 }
 
 SPECIAL = re.compile(r'[$ ]')
@@ -62,29 +66,42 @@ rule ar
 
 LIB_SOURCES = '''
 appledouble.c
+binhex.c
+copyfile.c
+crc16.c
 data.c
 error.c
 forkedfile.c
+ioqueue.c
 macbinary.c
 macroman.c
+packbits.c
 pict.c
 pixdata.c
 resourcefork.c
+scan.c
+simd.c
 type.c
+unshuffle.c
 '''.split()
 
 EXE_TARGETS = [
 ('unrez',
- ['cflags = $unrez_cflags'],
- ['libs = $unrez_libs'],
+ ['cflags = -pthread $unrez_cflags'],
+ ['libs = -pthread $unrez_libs'],
  [], '''
 cat.c
+dedupe.c
+filejob.c
 info.c
 ls.c
+manifest.c
 opts.c
 pictdump.c
 png.c
+pool.c
 resx.c
+scan.c
 size.c
 unrez.c
 util.c
@@ -93,6 +110,75 @@ util.c
 size.c
 size_test.c
 '''.split()),
+('binhex_test', [], [], ['libunrez.a'], '''
+binhex_test.c
+synth.c
+util.c
+'''.split()),
+('copy_test', [], [], ['libunrez.a'], '''
+copy_test.c
+synth.c
+util.c
+'''.split()),
+('crc_test', [], [], ['libunrez.a'], '''
+crc_test.c
+'''.split()),
+('dedupe_test', [], [], ['libunrez.a'], '''
+dedupe.c
+dedupe_test.c
+util.c
+'''.split()),
+('index_test', [], [], ['libunrez.a'], '''
+index_test.c
+synth.c
+util.c
+'''.split()),
+('json_test', [], [], ['libunrez.a'], '''
+filejob.c
+json_test.c
+util.c
+'''.split()),
+('manifest_test', [], [], ['libunrez.a'], '''
+dedupe.c
+manifest.c
+manifest_test.c
+util.c
+'''.split()),
+('pict_test', [], [], ['libunrez.a'], '''
+pict_test.c
+synth.c
+util.c
+'''.split()),
+('png_test',
+ ['cflags = $unrez_cflags'],
+ ['libs = $unrez_libs'],
+ ['libunrez.a'], '''
+png.c
+png_test.c
+util.c
+'''.split()),
+('scan_test', [], [], ['libunrez.a'], '''
+scan_test.c
+synth.c
+util.c
+'''.split()),
+('thread_test',
+ ['cflags = -pthread $cflags'],
+ ['libs = -pthread $libs'],
+ ['libunrez.a'], '''
+synth.c
+thread_test.c
+util.c
+'''.split()),
+('bench',
+ ['cflags = $unrez_cflags'],
+ ['libs = $unrez_libs'],
+ ['libunrez.a'], '''
+bench.c
+png.c
+synth.c
+util.c
+'''.split()),
 ]
 
 def run():
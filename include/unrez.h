@@ -153,7 +153,8 @@ void unrez_data_destroy(struct unrez_data *d);
   BinHex is an encoding designed to preserve Mac files over channels that are
   not 8-bit clean. It encodes both forks and metadata into ASCII and includes
   checksums. Neither fork can be read without decoding the file. Like MacBinary,
-  it was very popular for transferring files over the internet.
+  it was very popular for transferring files over the internet. This library
+  decodes BinHex files into memory.
 
   Resource forks may also be supported by the underlying network share or
   filesystem. Without relying on Apple's "Carbon" interface, you can access
@@ -170,20 +171,82 @@ void unrez_data_destroy(struct unrez_data *d);
 struct unrez_fork {
     /*
      * The file descriptor for the file containing this fork, or -1 if this fork
-     * is not present. Different forks may share the same file descriptor.
+     * is not present or is in memory. Different forks may share the same file
+     * descriptor.
      */
     int file;
     /* The offset of the fork within the file. */
     int64_t offset;
     /* The size of the fork. */
     int64_t size;
+    /*
+     * For forks which had to be decoded, such as forks in BinHex files, the
+     * decoded fork data, or NULL otherwise. The memory belongs to the forked
+     * file, and the offset is zero.
+     */
+    const void *mem;
 };
 
 /*
- * unrez_fork_read reads an entire fork of a file into memory.
+ * unrez_fork_read reads an entire fork of a file into memory. Forks which are
+ * already in memory are copied, so the result does not depend on the forked
+ * file staying open.
  */
 int unrez_fork_read(const struct unrez_fork *fork, struct unrez_data *d);
 
+/*
+ * Expected access patterns for data read from a fork, passed to the kernel as
+ * advice for mapped forks.
+ */
+enum {
+    kUnrezAdviseNormal,
+    /* The data will be read from start to end, such as a picture. */
+    kUnrezAdviseSequential,
+    /* The data will be read in small pieces, such as a resource map. */
+    kUnrezAdviseRandom
+};
+
+/*
+ * Flags for reading forks.
+ */
+enum {
+    /* Never map forks, always read them. */
+    kUnrezReadNoMmap = 1,
+    /* Fault in the whole mapping at once, where supported. */
+    kUnrezReadPopulate = 2,
+    /* Start reading the whole mapping in the background. */
+    kUnrezReadWillNeed = 4,
+    /*
+     * Ask for huge pages, where supported. Large buffers which are read instead
+     * of mapped are aligned to huge page boundaries.
+     */
+    kUnrezReadHugePages = 8
+};
+
+/*
+ * An unrez_readopts controls how forks are read into memory. All of these are
+ * hints, and the data is the same no matter what options are used. A zeroed
+ * structure gives the defaults.
+ */
+struct unrez_readopts {
+    /*
+     * Forks at least this large are mapped instead of read, or 0 for the
+     * default of 16 KiB.
+     */
+    size_t mmap_minimum;
+    /* One of the kUnrezAdvise constants. */
+    int advice;
+    /* A combination of the kUnrezRead flags. */
+    int flags;
+};
+
+/*
+ * unrez_fork_readopts reads an entire fork of a file into memory, like
+ * unrez_fork_read. If opts is NULL, the defaults are used.
+ */
+int unrez_fork_readopts(const struct unrez_fork *fork, struct unrez_data *d,
+                        const struct unrez_readopts *opts);
+
 /*
  * An unrez_type_t represents the possible ways a resource fork can be accessed
  * from disk.
@@ -199,6 +262,8 @@ typedef enum {
     kUnrezTypeAppleSingle,
     /* The file has forks at the native filesystem level. */
     kUnrezTypeNative,
+    /* The file is a BinHex 4.0 encoded file. */
+    kUnrezTypeBinHex,
 } unrez_type_t;
 
 /*
@@ -245,6 +310,13 @@ struct unrez_metadata {
     int64_t rsrc_size;
 };
 
+/*
+ * unrez_crc16 updates a CRC-16 with more data. This is the CRC used by
+ * MacBinary II and BinHex 4.0, with the CCITT polynomial and the most
+ * significant bit first, also known as CRC-16/XMODEM. Start with a CRC of 0.
+ */
+uint16_t unrez_crc16(uint16_t crc, const void *data, size_t size);
+
 /*
  * unrez_macbinary_parse parses a MacBinary file, and fills in the metadata
  * structure. Returns 0 on success, or an error code on failure.  The fsize
@@ -261,6 +333,16 @@ int unrez_macbinary_parse(struct unrez_metadata *mdata, int fdes,
 int unrez_applefile_parse(struct unrez_metadata *mdata, int fdes,
                           int64_t fsize);
 
+/*
+ * unrez_binhex_decode decodes a BinHex 4.0 file in memory, and fills in the
+ * metadata structure, including the filename. On success, forks is set to a
+ * buffer allocated with malloc, containing the data fork followed by the
+ * resource fork. Returns 0 on success, kUnrezErrFormat if there is no encoded
+ * data, or another error code on failure.
+ */
+int unrez_binhex_decode(struct unrez_metadata *mdata, void **forks,
+                        const void *data, size_t size);
+
 /*
  * An unrez_forkedfile is a file which may have a data fork, resource fork, or
  * both. This does not distinguish between an empty fork and a missing fork,
@@ -273,19 +355,24 @@ struct unrez_forkedfile {
     struct unrez_fork rsrc;
     /* Additional metadata for the file. */
     struct unrez_metadata metadata;
+    /* Memory for forks which were decoded into memory. Private. */
+    void *mem;
 };
 
 /*
  * unrez_forkedfile_open opens both forks of a file, if present. The encoding
  * for the data fork and resource fork are determined automatically using
  * heruistics: MacBinary is tried if the filename ends with ".bin", AppleDouble
- * is tried if the filename starts with "._", and finally the native filesystem
- * is used. This order attempts to preserve the user's intent, since MacBinary
- * is the most intentional way to attach a resource fork to a file. Although it
- * should be rare that the same file would have an actual resource fork attached
- * to it in multiple ways, it is easy to imagine a MacBinary file getting an
- * AppleDouble file paired with it if the MacBinary file is copied from a Mac to
- * another system, since AppleDouble is also used to preserve metedata.
+ * is tried if the filename starts with "._", BinHex is tried if the filename
+ * ends with ".hqx" or the file starts with the BinHex tag line, and finally the
+ * native filesystem is used. BinHex files are decoded into memory, and their
+ * forks have no file descriptor. This order attempts to preserve the user's
+ * intent, since MacBinary is the most intentional way to attach a resource fork
+ * to a file. Although it should be rare that the same file would have an actual
+ * resource fork attached to it in multiple ways, it is easy to imagine a
+ * MacBinary file getting an AppleDouble file paired with it if the MacBinary
+ * file is copied from a Mac to another system, since AppleDouble is also used
+ * to preserve metedata.
  *
  * Returns 0 on success, or a nonzero error code on failure.
  */
@@ -301,11 +388,208 @@ int unrez_forkedfile_open(struct unrez_forkedfile *forks, const char *path);
 int unrez_forkedfile_openat(struct unrez_forkedfile *forks, int dirfd,
                             const char *path);
 
+/*
+ * Flags for unrez_forkedfile_probeat, which describe what the caller already
+ * knows about the file's directory.
+ */
+enum {
+    /*
+     * The caller has listed the directory. Only look for an AppleDouble header
+     * file "._<name>" if kUnrezProbeAppleDouble is also set.
+     */
+    kUnrezProbeListed = 1,
+    /* The directory contains an AppleDouble header file "._<name>". */
+    kUnrezProbeAppleDouble = 2,
+    /* Do not look for native resource forks. */
+    kUnrezProbeNoNative = 4
+};
+
+/*
+ * unrez_forkedfile_probeat is the same as unrez_forkedfile_openat, but the
+ * flags can rule out places where the resource fork might be, so they are not
+ * opened. With no flags, it behaves exactly like unrez_forkedfile_openat.
+ *
+ * Returns 0 on success, or a nonzero error code on failure.
+ */
+int unrez_forkedfile_probeat(struct unrez_forkedfile *forks, int dirfd,
+                             const char *path, int flags);
+
+/*
+ * unrez_forkedfile_probefd is the same as unrez_forkedfile_probeat, for a file
+ * which the caller has already opened and read the start of, such as with an
+ * unrez_ioqueue. The header contains the first size bytes of the file, and
+ * should be at least 256 bytes unless the file is shorter. The path is still
+ * used to find AppleDouble and native forks. The forked file takes ownership
+ * of the file descriptor, which is closed on failure.
+ *
+ * Returns 0 on success, or a nonzero error code on failure.
+ */
+int unrez_forkedfile_probefd(struct unrez_forkedfile *forks, int dirfd,
+                             const char *path, int flags, int fd,
+                             const void *header, size_t size);
+
 /*
  * unrez_forkedfile_close closes a forked file.
  */
 void unrez_forkedfile_close(struct unrez_forkedfile *forks);
 
+/*
+ * An unrez_scanfile is a file found by unrez_scan.
+ */
+struct unrez_scanfile {
+    /*
+     * The directory containing the file. This is only open until the callback
+     * returns, so duplicate it to use it later.
+     */
+    int dirfd;
+    /*
+     * The path to the file, starting with the path passed to unrez_scan, for
+     * messages.
+     */
+    const char *path;
+    /*
+     * The name of the file to pass to unrez_forkedfile_probeat with the
+     * kUnrezProbeListed flag. If the file has an AppleDouble header file
+     * "._<name>" in the same directory, this is the name of the header file,
+     * so both files are opened without searching for them again. The path is
+     * still the path to the data file.
+     */
+    const char *name;
+    /* Nonzero if the file has a separate AppleDouble header file. */
+    int appledouble;
+};
+
+/*
+ * Callbacks for unrez_scan. Each callback returns 0 to continue scanning, or
+ * nonzero to stop. The directory and error callbacks may be NULL.
+ */
+struct unrez_scan_callbacks {
+    /* Context parameter to pass to callbacks. */
+    void *ctx;
+    /*
+     * Called before passing files to the file callback whenever the directory
+     * containing them changes, including when returning to a directory after
+     * scanning a subdirectory. The file descriptor is the same one passed with
+     * the files.
+     */
+    int (*directory)(void *ctx, int dirfd, const char *path);
+    /* Called for each file. */
+    int (*file)(void *ctx, const struct unrez_scanfile *file);
+    /*
+     * Called if a directory inside the tree cannot be read. If there is no
+     * error callback, the directory is skipped.
+     */
+    int (*error)(void *ctx, int err, const char *path);
+};
+
+/*
+ * unrez_scan walks a directory tree and passes every regular file to the
+ * callbacks. Entries are visited in order by name, and subdirectories are
+ * visited when they are found. AppleDouble header files are paired with the
+ * data file of the same name using the directory listing, and only reported
+ * once. Symbolic links are skipped, so the scan cannot loop.
+ *
+ * Returns 0 on success, an error code if the directory cannot be opened, or
+ * the nonzero value returned by a callback which stopped the scan.
+ */
+int unrez_scan(const char *path, const struct unrez_scan_callbacks *cb);
+
+/*
+ * unrez_scanat is the same as unrez_scan, except the path is relative to the
+ * directory represented by the file descriptor dirfd, or the working directory
+ * if dirfd is AT_FDCWD.
+ */
+int unrez_scanat(int dirfd, const char *path,
+                 const struct unrez_scan_callbacks *cb);
+
+/*
+  When scanning many small files on a cold disk, most of the time is spent
+  waiting for the disk, one request at a time. An I/O queue keeps many opens
+  and reads waiting at once, and returns their results in whatever order they
+  complete. On Linux, the queue uses io_uring. Where io_uring is not available,
+  operations are done synchronously when they are queued, so the same code
+  works everywhere, just without the overlap.
+
+  An I/O queue may only be used by one thread at a time.
+*/
+
+/*
+ * An unrez_ioqueue is a queue of asynchronous file operations.
+ */
+struct unrez_ioqueue;
+
+/*
+ * Flags for unrez_ioqueue_create.
+ */
+enum {
+    /* Do not use io_uring, even if it is available. */
+    kUnrezIoNoUring = 1
+};
+
+/*
+ * An unrez_iocompletion is the result of a queued operation.
+ */
+struct unrez_iocompletion {
+    /* The tag given when the operation was queued. */
+    void *tag;
+    /*
+     * For opens, the new file descriptor. For reads, the number of bytes read,
+     * which is short at the end of the file. On failure, -1.
+     */
+    long result;
+    /* 0 on success, or an error code on failure. */
+    int err;
+};
+
+/*
+ * unrez_ioqueue_create creates a queue which holds up to depth operations.
+ * Returns 0 on success, or an error code on failure. Failing to set up
+ * io_uring is not an error.
+ */
+int unrez_ioqueue_create(struct unrez_ioqueue **qp, int depth, int flags);
+
+/*
+ * unrez_ioqueue_destroy frees a queue. There must be no pending operations.
+ */
+void unrez_ioqueue_destroy(struct unrez_ioqueue *q);
+
+/*
+ * unrez_ioqueue_isasync returns nonzero if the queue runs operations
+ * asynchronously.
+ */
+int unrez_ioqueue_isasync(const struct unrez_ioqueue *q);
+
+/*
+ * unrez_ioqueue_pending returns the number of operations which have been
+ * queued and whose results have not been collected.
+ */
+int unrez_ioqueue_pending(const struct unrez_ioqueue *q);
+
+/*
+ * unrez_ioqueue_openat queues opening a file for reading. The path must remain
+ * valid until the result is collected. Returns 0 on success, or EBUSY if the
+ * queue is full.
+ */
+int unrez_ioqueue_openat(struct unrez_ioqueue *q, int dirfd, const char *path,
+                         void *tag);
+
+/*
+ * unrez_ioqueue_read queues reading from a file at an offset. The buffer must
+ * remain valid until the result is collected. Reads are not retried, so the
+ * result may be short. Returns 0 on success, or EBUSY if the queue is full.
+ */
+int unrez_ioqueue_read(struct unrez_ioqueue *q, int fd, void *buf,
+                       size_t size, int64_t offset, void *tag);
+
+/*
+ * unrez_ioqueue_wait starts queued operations, then collects up to max
+ * results, waiting until at least one is available if any operations are
+ * pending. The number of results is stored in count. Returns 0 on success, or
+ * an error code on failure.
+ */
+int unrez_ioqueue_wait(struct unrez_ioqueue *q, struct unrez_iocompletion *c,
+                       int max, int *count);
+
 /*
   A Macintosh resource fork can contain an arbitrary stream of bytes.  However,
   this is exceptionally rare. The resource fork of a file almost always contains
@@ -325,7 +609,14 @@ void unrez_forkedfile_close(struct unrez_forkedfile *forks);
 
   These functions load the entire resource fork into memory before doing
   anything. This isn't actually too bad, the maximum size of a resource fork is
-  about 16 MB.
+  about 16 MB. If you only need a few resources, or just want to list them,
+  unrez_resourcefork_openstream reads only the resource map, and resource data
+  is read from the file on demand.
+
+  An open resource fork may be shared between threads. Every function except
+  unrez_resourcefork_close may be called on the same fork from multiple threads
+  at once, without locking. Data which is loaded lazily is published
+  atomically, and once loaded, it does not change until the fork is closed.
 */
 
 /*
@@ -347,6 +638,18 @@ struct unrez_resourcefork {
     /* List of resource types. */
     struct unrez_resourcetype *types;
     int32_t type_count;
+    /* Resources for all types, if loaded by loadall. Private. */
+    struct unrez_resource *resources;
+    int32_t resource_count;
+    /*
+     * For forks opened with unrez_resourcefork_openstream, the file containing
+     * the fork and the offset of the data section in that file. Otherwise, the
+     * file is -1. Private.
+     */
+    int file;
+    int64_t data_offset;
+    /* Lookup index, or NULL if no index has been built. Private. */
+    struct unrez_resourceindex *index;
     /* Owner of the fork's data. */
     struct unrez_data owner;
 };
@@ -367,7 +670,8 @@ struct unrez_resourcetype {
  * An unrez_resource is a resource in a resource fork. The size will be -1 at
  * first because the resource's size is stored in a separate location from the
  * rest of the information about the resource. Once the resource is loaded, its
- * size will be filled in.
+ * size will be filled in. Sizes are filled in immediately by
+ * unrez_resourcefork_loadall.
  */
 struct unrez_resource {
     int16_t id;
@@ -395,6 +699,31 @@ int unrez_resourcefork_openmem(struct unrez_resourcefork *rfork,
 int unrez_resourcefork_openfork(struct unrez_resourcefork *rfork,
                                 const struct unrez_fork *fork);
 
+/*
+ * unrez_resourcefork_openforkopts opens a resource fork from an open forked
+ * file, like unrez_resourcefork_openfork, with options for reading the fork.
+ * When extracting every resource, kUnrezAdviseSequential with
+ * kUnrezReadWillNeed avoids most page faults. When looking up a few
+ * resources, kUnrezAdviseRandom avoids reading ahead data which is never used.
+ */
+int unrez_resourcefork_openforkopts(struct unrez_resourcefork *rfork,
+                                    const struct unrez_fork *fork,
+                                    const struct unrez_readopts *opts);
+
+/*
+ * unrez_resourcefork_openstream opens a resource fork from an open forked file
+ * without reading the whole fork into memory. Only the fork header and the
+ * resource map are read. Resource data is read from the file on demand with
+ * unrez_resourcefork_getsize and unrez_resourcefork_readdata, and
+ * unrez_resourcefork_getdata cannot be used. The file descriptor is
+ * duplicated, so the forked file may be safely closed while the resource fork
+ * is still being used. Forks which are already in memory, such as forks decoded
+ * from BinHex, are opened as with unrez_resourcefork_openfork instead. Returns
+ * 0 on success, or an error code on failure.
+ */
+int unrez_resourcefork_openstream(struct unrez_resourcefork *rfork,
+                                  const struct unrez_fork *fork);
+
 /*
  * unrez_resourcefork_open opens a resource fork from the file at the given
  * path. Returns 0 on success, or an error code on failure.
@@ -432,6 +761,17 @@ int unrez_resourcefork_findtype(struct unrez_resourcefork *rfork,
 int unrez_resourcefork_loadtype(struct unrez_resourcefork *rfork,
                                 struct unrez_resourcetype *type);
 
+/*
+ * unrez_resourcefork_loadall loads the resource map for every type in one pass,
+ * and fills in the size of every resource. All resources are stored in a
+ * single allocation. This is faster than loading types one at a time if you
+ * are going to look at most of the fork, such as when listing or extracting
+ * all resources. Types which are already loaded are left alone. Types which
+ * cannot be loaded are skipped, and unrez_resourcefork_loadtype will report an
+ * error for them. Returns 0 on success, or an error code on failure.
+ */
+int unrez_resourcefork_loadall(struct unrez_resourcefork *rfork);
+
 /*
  * unrez_resourcefork_findrsrc finds a resource with the given type code and ID.
  * Returns 0 on success or an error code on failure. Returns
@@ -441,15 +781,57 @@ int unrez_resourcefork_findrsrc(struct unrez_resourcefork *rfork,
                                 struct unrez_resource **rsrc,
                                 uint32_t type_code, int rsrc_id);
 
+/*
+ * unrez_resourcefork_buildindex builds a hash index for the resource fork, so
+ * unrez_resourcefork_findtype and unrez_resourcefork_findrsrc take constant
+ * time instead of scanning the type and resource lists. This loads every type
+ * in the fork. Types which cannot be loaded are left out of the index, and
+ * looking them up will report the same error as before. Calling this more than
+ * once has no effect. This is worthwhile if you are going to look up more than
+ * a handful of resources by ID. Returns 0 on success, or an error code on
+ * failure, in which case lookups still work but are not indexed.
+ */
+int unrez_resourcefork_buildindex(struct unrez_resourcefork *rfork);
+
 /*
  * unrez_resourcefork_getdata gets the data for a resource. The returned pointer
  * points into the resource fork's memory. Returns 0 on success, or an error
- * code on failure.
+ * code on failure. Returns EINVAL for forks opened with
+ * unrez_resourcefork_openstream.
  */
 int unrez_resourcefork_getdata(struct unrez_resourcefork *rfork,
                                struct unrez_resource *rsrc, const void **data,
                                uint32_t *size);
 
+/*
+ * unrez_resourcefork_getsize gets the size of a resource. For streaming forks,
+ * this may read from the file. Returns 0 on success, or an error code on
+ * failure.
+ */
+int unrez_resourcefork_getsize(struct unrez_resourcefork *rfork,
+                               struct unrez_resource *rsrc, uint32_t *size);
+
+/*
+ * unrez_resourcefork_readdata copies count bytes of a resource's data, starting
+ * at the given offset within the resource, into a buffer supplied by the
+ * caller. This works for all resource forks, and is the only way to get
+ * resource data from streaming forks. Returns 0 on success, or an error code on
+ * failure. Returns EINVAL if the range is outside the resource.
+ */
+int unrez_resourcefork_readdata(struct unrez_resourcefork *rfork,
+                                struct unrez_resource *rsrc, uint32_t offset,
+                                void *buf, uint32_t count);
+
+/*
+ * unrez_resourcefork_copydata writes a resource's data to the current position
+ * of a file. For streaming forks, the data is copied from the fork's file by
+ * the kernel where the system allows, with copy_file_range or sendfile, so it
+ * does not pass through memory. Returns 0 on success, or an error code on
+ * failure.
+ */
+int unrez_resourcefork_copydata(struct unrez_resourcefork *rfork,
+                                struct unrez_resource *rsrc, int fdes);
+
 /*
  * unrez_resourcefork_getname gets the name of a resource, if it exists. On
  * success, sets name and size, which will be NULL and 0 if the name does not
@@ -461,6 +843,36 @@ int unrez_resourcefork_getname(struct unrez_resourcefork *rfork,
                                struct unrez_resource *rsrc, const char **name,
                                size_t *size);
 
+/*
+ * SIMD instruction sets which the picture decoder can use.
+ */
+enum {
+    /* Portable C code only. */
+    kUnrezSimdNone,
+    /* x86 SSE2. */
+    kUnrezSimdSSE2,
+    /* x86 AVX2. */
+    kUnrezSimdAVX2,
+    /* ARM NEON. */
+    kUnrezSimdNEON
+};
+
+/*
+ * unrez_simd_get returns the SIMD instruction set which the picture decoder
+ * uses. By default, this is the most capable instruction set the processor
+ * supports.
+ */
+int unrez_simd_get(void);
+
+/*
+ * unrez_simd_set sets the SIMD instruction set which the picture decoder
+ * uses. This is for testing and benchmarking, since every instruction set gives
+ * the same results. If the processor does not support the requested instruction
+ * set, the most capable instruction set which is supported is used instead.
+ * Returns the instruction set which will be used.
+ */
+int unrez_simd_set(int level);
+
 /*
  * unrez_pict_opname gets the name of a picture opcode, or returns NULL if the
  * opcode is reserved, unknown, or out of range.
@@ -494,7 +906,9 @@ struct unrez_color {
  */
 struct unrez_pixdata {
     /*
-     * Unpacked pixel data, and the size of each unpacked pixel in bits.
+     * Unpacked pixel data, and the size of each unpacked pixel in bits. 16-bit
+     * pixels are in native byte order. 32-bit pixels are stored as red, green,
+     * blue, and alpha bytes. Alpha is zero unless cmpCount is 4.
      */
     void *data;
     /*
@@ -536,10 +950,28 @@ void unrez_pixdata_destroy(struct unrez_pixdata *pix);
  */
 int unrez_pixdata_16to32(struct unrez_pixdata *pix);
 
+/*
+ * unrez_convert_16to32 converts a row of n 16-bit pixels to 32-bit pixels, the
+ * same way as unrez_pixdata_16to32. The destination must have room for 4n
+ * bytes. The SIMD instruction set is chosen by unrez_simd_get.
+ */
+void unrez_convert_16to32(uint8_t *dest, const uint16_t *src, int n);
+
+/*
+ * Formats for pixel data which is passed one row at a time.
+ */
+enum {
+    /* Rows are in the same format as the data in unrez_pixdata. */
+    kUnrezRowNative,
+    /* 16-bit rows are converted to 32-bit, like unrez_pixdata_16to32. */
+    kUnrezRowExpand16
+};
+
 /*
  * An unrez_pict_callbacks contains callbacks for processing a QuickDraw
- * picture. All callbacks must be set. Callbacks that return an integer should
- * return 0 to continue processing the picture, or nonzero to stop.
+ * picture. All callbacks must be set, except for the row callbacks, which are
+ * optional. Callbacks that return an integer should return 0 to continue
+ * processing the picture, or nonzero to stop.
  */
 struct unrez_pict_callbacks {
     /* Context parameter to pass to callbacks. */
@@ -561,6 +993,23 @@ struct unrez_pict_callbacks {
      * error code will always be nonzero.
      */
     void (*error)(void *ctx, int err, int opcode, const char *msg);
+    /*
+     * Handle pixel data one row at a time. If row is set, then the pixel data
+     * is passed to these callbacks instead of the pixels callback, which may
+     * be NULL, and only one row of pixels is kept in memory at a time.
+     *
+     * First, begin_rows is called with a description of the pixel data, with
+     * the data pointer set to NULL. The pixelSize and rowBytes fields describe
+     * the rows after conversion to row_format. Then, row is called for each
+     * row from top to bottom, and the data is only valid until it returns.
+     * Finally, end_rows is called. If there is an error in the pixel data, the
+     * error callback is called instead of end_rows, possibly after some rows
+     * have already been passed to the row callback.
+     */
+    int row_format;
+    int (*begin_rows)(void *ctx, int opcode, const struct unrez_pixdata *pix);
+    int (*row)(void *ctx, int y, const void *data);
+    int (*end_rows)(void *ctx, int opcode);
 };
 
 enum {
@@ -580,6 +1029,45 @@ enum {
 void unrez_pict_decode(const struct unrez_pict_callbacks *cb, const void *data,
                        size_t size);
 
+enum {
+    /* Number of buffers kept by an unrez_pict_decoder. */
+    kUnrezPictBufferCount = 5
+};
+
+/*
+ * An unrez_pict_decoder keeps the memory used for decoding pictures, so it can
+ * be reused for the next picture. Once the buffers are large enough, decoding
+ * pictures does not allocate any memory. A zeroed structure is ready to use. A
+ * decoder may only be used by one thread at a time.
+ */
+struct unrez_pict_decoder {
+    /*
+     * The number of times the decoder has allocated memory, and the total
+     * number of bytes allocated.
+     */
+    long alloc_count;
+    size_t alloc_size;
+    /* Private fields for the buffers. */
+    void *buf[kUnrezPictBufferCount];
+    size_t bufsize[kUnrezPictBufferCount];
+};
+
+/*
+ * unrez_pict_decoder_decode decodes a QuickDraw picture like unrez_pict_decode,
+ * but reuses memory from previous pictures. The pixel data passed to the pixels
+ * callback belongs to the decoder. The callback may still keep the pixel data
+ * by setting the pointers to NULL, or convert it with unrez_pixdata_16to32, but
+ * then the memory cannot be reused.
+ */
+void unrez_pict_decoder_decode(struct unrez_pict_decoder *dec,
+                               const struct unrez_pict_callbacks *cb,
+                               const void *data, size_t size);
+
+/*
+ * unrez_pict_decoder_destroy frees memory used by a picture decoder.
+ */
+void unrez_pict_decoder_destroy(struct unrez_pict_decoder *dec);
+
 #ifdef __cplusplus
 }
 #endif
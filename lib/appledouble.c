@@ -6,6 +6,7 @@
  */
 #include "unrez.h"
 
+#include "applefile.h"
 #include "binary.h"
 
 #include <errno.h>
@@ -51,43 +52,33 @@ enum {
     kEntryData = 1,
     kEntryRsrc = 2,
 
-    /* This should be a reasonable maximum.  */
+    /*
+     * This should be a reasonable maximum. The header with this many entries
+     * must fit in kUnrezHeaderSize.
+     */
     kMaxEntries = 16,
     kHeaderSize = 26,
     kEntrySize = 12
 };
 
-int unrez_applefile_parse(struct unrez_metadata *mdata, int fdes,
-                          int64_t fsize) {
-    unsigned char header[kHeaderSize + kEntrySize * kMaxEntries];
+int unrez_applefile_parseheader(struct unrez_metadata *mdata,
+                                const unsigned char *header, size_t size,
+                                int64_t fsize) {
     const unsigned char *eptr;
-    ssize_t amt;
     uint32_t version, eid, eoffset, esize;
-    int num_entries, r, header_size, i;
+    int num_entries, header_size, i;
     int has_data = 0, has_rsrc = 0;
-    struct stat st;
+    unrez_type_t type;
 
-    if (fsize < 0) {
-        r = fstat(fdes, &st);
-        if (r == -1) {
-            return errno;
-        }
-        fsize = st.st_size;
-    }
-
-    amt = pread(fdes, header, sizeof(header), 0);
-    if (amt < 0) {
-        return errno;
-    }
-    if (amt < kHeaderSize) {
+    if (size < kHeaderSize) {
         return kUnrezErrFormat;
     }
 
     /* Read magic header */
     if (memcmp(header, kAppleDoubleMagic, 4) == 0) {
-        mdata->type = kUnrezTypeAppleDouble;
+        type = kUnrezTypeAppleDouble;
     } else if (memcmp(header, kAppleSingleMagic, 4) == 0) {
-        mdata->type = kUnrezTypeAppleSingle;
+        type = kUnrezTypeAppleSingle;
     } else {
         return kUnrezErrFormat;
     }
@@ -108,10 +99,11 @@ int unrez_applefile_parse(struct unrez_metadata *mdata, int fdes,
     if (num_entries > kMaxEntries) {
         return kUnrezErrUnsupported;
     }
-    if (header_size > amt) {
+    if ((size_t)header_size > size) {
         return kUnrezErrInvalid;
     }
     memset(mdata, 0, sizeof(*mdata));
+    mdata->type = type;
     for (i = 0; i < num_entries; i++) {
         eptr = header + kHeaderSize + kEntrySize * i;
         eid = read_u32(eptr);
@@ -141,3 +133,25 @@ int unrez_applefile_parse(struct unrez_metadata *mdata, int fdes,
     }
     return 0;
 }
+
+int unrez_applefile_parse(struct unrez_metadata *mdata, int fdes,
+                          int64_t fsize) {
+    unsigned char header[kHeaderSize + kEntrySize * kMaxEntries];
+    ssize_t amt;
+    int r;
+    struct stat st;
+
+    if (fsize < 0) {
+        r = fstat(fdes, &st);
+        if (r == -1) {
+            return errno;
+        }
+        fsize = st.st_size;
+    }
+
+    amt = pread(fdes, header, sizeof(header), 0);
+    if (amt < 0) {
+        return errno;
+    }
+    return unrez_applefile_parseheader(mdata, header, amt, fsize);
+}
@@ -0,0 +1,41 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+struct unrez_metadata;
+
+enum {
+    /*
+     * The number of bytes at the start of a file which are enough to recognize
+     * MacBinary, AppleSingle, and AppleDouble files.
+     */
+    kUnrezHeaderSize = 256
+};
+
+/*
+ * Parse a MacBinary header which has been read from the start of a file. The
+ * size is the number of bytes read, and fsize is the size of the file.
+ */
+int unrez_macbinary_parseheader(struct unrez_metadata *mdata,
+                                const unsigned char *header, size_t size,
+                                int64_t fsize);
+
+/*
+ * Parse an AppleSingle or AppleDouble header which has been read from the start
+ * of a file. The size is the number of bytes read, and fsize is the size of the
+ * file.
+ */
+int unrez_applefile_parseheader(struct unrez_metadata *mdata,
+                                const unsigned char *header, size_t size,
+                                int64_t fsize);
+
+/*
+ * Check whether the start of a file contains the BinHex 4.0 tag line. Returns
+ * nonzero if it does.
+ */
+int unrez_binhex_check(const unsigned char *header, size_t size);
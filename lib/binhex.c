@@ -0,0 +1,370 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include "unrez.h"
+
+#include "applefile.h"
+#include "binhex.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A BinHex 4.0 file is decoded in a single pass, with three stages working
+ * together on one block at a time. The characters are decoded to bytes with a
+ * table lookup, four characters at a time where possible. Runs are expanded.
+ * Finally the bytes are copied to the header or to the forks, and the CRC is
+ * updated while the copied bytes are still in the cache. Both forks are
+ * decoded into one allocation, made as soon as the header gives their sizes.
+ *
+ * The decoded stream is: the header, the data fork, and the resource fork,
+ * each followed by a CRC-16. The header contains the filename as a Pascal
+ * string, a version byte, the type and creator codes, the Finder flags, and
+ * the sizes of the two forks.
+ */
+
+static const char kTag[] = "(This file must be converted with BinHex";
+
+enum {
+    kTagLen = sizeof(kTag) - 1,
+    /* Bytes in the header after the name length and the name. */
+    kHeaderFixed = 19,
+    kMaxNameLen = 63,
+    kRunMarker = 0x90,
+    /* Size of blocks between the character decoder and the run decoder. */
+    kBlockSize = 4096,
+    /*
+     * The most bytes a single character can expand to. Each run after the
+     * first takes two bytes, or 8/3 characters, and produces up to 254 bytes.
+     */
+    kMaxExpansion = 96
+};
+
+/* Sections of the decoded stream, in order. */
+enum {
+    kSectionLength,
+    kSectionHeader,
+    kSectionHeaderCRC,
+    kSectionData,
+    kSectionDataCRC,
+    kSectionRsrc,
+    kSectionRsrcCRC,
+    kSectionDone
+};
+
+struct binhex {
+    int section;
+    /* Where the rest of the current section goes, and how much is left. */
+    uint8_t *out;
+    size_t remain;
+    uint16_t crc;
+    uint8_t crcbuf[2];
+    uint8_t header[1 + kMaxNameLen + kHeaderFixed];
+    /* The decoded forks. */
+    uint8_t *mem;
+    uint32_t data_size;
+    uint32_t rsrc_size;
+    /* The size of the encoded input, to reject absurd fork sizes. */
+    size_t input_size;
+    /* Run decoder state. */
+    int have_last;
+    int marker;
+    uint8_t last;
+};
+
+static uint32_t read_u32(const uint8_t *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | p[3];
+}
+
+/* Move to the next section of the decoded stream. */
+static int next_section(struct binhex *bh) {
+    const uint8_t *p;
+    uint64_t total;
+    size_t namelen;
+    switch (bh->section) {
+    case kSectionLength:
+        if (bh->header[0] == 0 || bh->header[0] > kMaxNameLen) {
+            return kUnrezErrInvalid;
+        }
+        bh->out = bh->header + 1;
+        bh->remain = bh->header[0] + kHeaderFixed;
+        break;
+    case kSectionHeader:
+    case kSectionData:
+    case kSectionRsrc:
+        bh->out = bh->crcbuf;
+        bh->remain = 2;
+        break;
+    case kSectionHeaderCRC:
+    case kSectionDataCRC:
+    case kSectionRsrcCRC:
+        if (((bh->crcbuf[0] << 8) | bh->crcbuf[1]) != bh->crc) {
+            return kUnrezErrInvalid;
+        }
+        bh->crc = 0;
+        if (bh->section == kSectionHeaderCRC) {
+            namelen = bh->header[0];
+            p = bh->header + 1 + namelen + 11;
+            bh->data_size = read_u32(p);
+            bh->rsrc_size = read_u32(p + 4);
+            total = (uint64_t)bh->data_size + bh->rsrc_size;
+            if (total > (uint64_t)bh->input_size * kMaxExpansion) {
+                return kUnrezErrInvalid;
+            }
+            if (total > (size_t)-1) {
+                return kUnrezErrTooLarge;
+            }
+            bh->mem = malloc(total > 0 ? total : 1);
+            if (bh->mem == NULL) {
+                return errno;
+            }
+            bh->out = bh->mem;
+            bh->remain = bh->data_size;
+        } else if (bh->section == kSectionDataCRC) {
+            bh->out = bh->mem + bh->data_size;
+            bh->remain = bh->rsrc_size;
+        } else {
+            bh->out = NULL;
+            bh->remain = 0;
+        }
+        break;
+    default:
+        return kUnrezErrInvalid;
+    }
+    bh->section++;
+    return 0;
+}
+
+/*
+ * Write decoded bytes to the current section. If data is NULL, write count
+ * copies of the byte c instead. Bytes after the end are ignored.
+ */
+static int put(struct binhex *bh, const uint8_t *data, int c, size_t count) {
+    size_t n;
+    int err;
+    while (count > 0) {
+        while (bh->remain == 0) {
+            if (bh->section == kSectionDone) {
+                return 0;
+            }
+            err = next_section(bh);
+            if (err != 0) {
+                return err;
+            }
+        }
+        n = count < bh->remain ? count : bh->remain;
+        if (data != NULL) {
+            memcpy(bh->out, data, n);
+            data += n;
+        } else {
+            memset(bh->out, c, n);
+        }
+        if (bh->section != kSectionHeaderCRC &&
+            bh->section != kSectionDataCRC && bh->section != kSectionRsrcCRC) {
+            bh->crc = unrez_crc16(bh->crc, bh->out, n);
+        }
+        bh->out += n;
+        bh->remain -= n;
+        count -= n;
+    }
+    return 0;
+}
+
+/* Expand runs in a block of bytes. */
+static int expand(struct binhex *bh, const uint8_t *data, size_t size) {
+    const uint8_t *p = data, *e = data + size, *m;
+    int err;
+    while (p < e) {
+        if (!bh->marker) {
+            m = memchr(p, kRunMarker, e - p);
+            if (m == NULL) {
+                m = e;
+            }
+            if (m > p) {
+                err = put(bh, p, 0, m - p);
+                if (err != 0) {
+                    return err;
+                }
+                bh->last = m[-1];
+                bh->have_last = 1;
+            }
+            if (m == e) {
+                break;
+            }
+            /* The count may be in the next block. */
+            bh->marker = 1;
+            p = m + 1;
+            if (p == e) {
+                break;
+            }
+        }
+        bh->marker = 0;
+        if (*p == 0) {
+            /* A marker with a count of zero is a literal marker byte. */
+            bh->last = kRunMarker;
+            bh->have_last = 1;
+            err = put(bh, &bh->last, 0, 1);
+        } else if (!bh->have_last) {
+            err = kUnrezErrInvalid;
+        } else {
+            /* The count includes the byte before the marker. */
+            err = put(bh, NULL, bh->last, *p - 1);
+        }
+        if (err != 0) {
+            return err;
+        }
+        p++;
+    }
+    return 0;
+}
+
+/* Find the tag line, or return NULL. */
+static const uint8_t *find_tag(const uint8_t *data, size_t size) {
+    const uint8_t *p = data, *e = data + size;
+    for (; (size_t)(e - p) >= kTagLen; p++) {
+        p = memchr(p, kTag[0], e - p - kTagLen + 1);
+        if (p == NULL) {
+            break;
+        }
+        if (memcmp(p, kTag, kTagLen) == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Find the colon which starts the encoded data. Anything may come before the
+ * tag line, such as mail headers. Without the tag line, the colon must start a
+ * line.
+ */
+static const uint8_t *find_start(const uint8_t *data, size_t size) {
+    const uint8_t *p, *e = data + size;
+    p = find_tag(data, size);
+    if (p != NULL) {
+        p = memchr(p + kTagLen, ':', e - p - kTagLen);
+        return p != NULL ? p + 1 : NULL;
+    }
+    for (p = data; p < e; p++) {
+        if (*p == ':' && (p == data || p[-1] == '\n' || p[-1] == '\r')) {
+            return p + 1;
+        }
+    }
+    return NULL;
+}
+
+int unrez_binhex_check(const unsigned char *header, size_t size) {
+    return find_tag(header, size) != NULL;
+}
+
+int unrez_binhex_decode(struct unrez_metadata *mdata, void **forks,
+                        const void *data, size_t size) {
+    struct binhex bh;
+    uint8_t block[kBlockSize], *out, *oend = block + kBlockSize;
+    const uint8_t *p, *e = (const uint8_t *)data + size, *h;
+    unsigned v0, v1, v2, v3;
+    uint32_t acc = 0, x;
+    int nbits = 0, done = 0, err;
+    size_t namelen;
+    char *filename;
+
+    p = find_start(data, size);
+    if (p == NULL) {
+        return kUnrezErrFormat;
+    }
+    memset(&bh, 0, sizeof(bh));
+    bh.section = kSectionLength;
+    bh.out = bh.header;
+    bh.remain = 1;
+    bh.input_size = size;
+    while (!done) {
+        out = block;
+        while (out + 3 <= oend) {
+            if (nbits == 0 && e - p >= 4) {
+                v0 = kBinHexDecode[p[0]];
+                v1 = kBinHexDecode[p[1]];
+                v2 = kBinHexDecode[p[2]];
+                v3 = kBinHexDecode[p[3]];
+                if (((v0 | v1 | v2 | v3) & 0xc0) == 0) {
+                    x = (v0 << 18) | (v1 << 12) | (v2 << 6) | v3;
+                    out[0] = x >> 16;
+                    out[1] = x >> 8;
+                    out[2] = x;
+                    out += 3;
+                    p += 4;
+                    continue;
+                }
+            }
+            /* Line breaks, the end, and errors go one at a time. */
+            if (p == e) {
+                done = 1;
+                break;
+            }
+            v0 = kBinHexDecode[*p++];
+            if (v0 == kBinHexSkip) {
+                continue;
+            } else if (v0 == kBinHexEnd) {
+                done = 1;
+                break;
+            } else if (v0 == kBinHexInvalid) {
+                err = kUnrezErrInvalid;
+                goto error;
+            }
+            acc = (acc << 6) | v0;
+            nbits += 6;
+            if (nbits >= 8) {
+                nbits -= 8;
+                *out++ = acc >> nbits;
+                acc &= (1u << nbits) - 1;
+            }
+        }
+        err = expand(&bh, block, out - block);
+        if (err != 0) {
+            goto error;
+        }
+    }
+    /* Move past empty sections at the end. */
+    err = 0;
+    while (err == 0 && bh.remain == 0 && bh.section != kSectionDone) {
+        err = next_section(&bh);
+    }
+    if (err != 0) {
+        goto error;
+    }
+    if (bh.section != kSectionDone) {
+        err = kUnrezErrInvalid;
+        goto error;
+    }
+
+    namelen = bh.header[0];
+    filename = malloc(namelen + 1);
+    if (filename == NULL) {
+        err = errno;
+        goto error;
+    }
+    memcpy(filename, bh.header + 1, namelen);
+    filename[namelen] = '\0';
+    h = bh.header + 1 + namelen + 1;
+    memset(mdata, 0, sizeof(*mdata));
+    mdata->type = kUnrezTypeBinHex;
+    mdata->filename_length = namelen;
+    mdata->filename = filename;
+    mdata->type_code = read_u32(h);
+    mdata->creator_code = read_u32(h + 4);
+    mdata->finder_flags = (h[8] << 8) | h[9];
+    mdata->data_offset = 0;
+    mdata->data_size = bh.data_size;
+    mdata->rsrc_offset = bh.data_size;
+    mdata->rsrc_size = bh.rsrc_size;
+    *forks = bh.mem;
+    return 0;
+
+error:
+    free(bh.mem);
+    return err;
+}
@@ -0,0 +1,36 @@
+#!/usr/bin/env python3
+import sys
+
+# The BinHex 4.0 alphabet. Each character encodes six bits.
+ALPHABET = (
+    '!"#$%&\'()*+,-012345689@ABCDEFGHIJKLMNPQRSTUVXYZ[`abcdefhijklmpqr')
+# Line breaks and other whitespace are ignored.
+SKIP = 0x40
+# The colon marks the start and end of the encoded data.
+END = 0x41
+INVALID = 0x80
+
+def main():
+    assert len(ALPHABET) == 64
+    table = [INVALID] * 256
+    for i, c in enumerate(ALPHABET):
+        table[ord(c)] = i
+    for c in ' \t\r\n':
+        table[ord(c)] = SKIP
+    table[ord(':')] = END
+
+    write = sys.stdout.write
+    write('/* This file is automatically generated by binhex.py. */\n')
+    write('\nenum {\n')
+    write('    kBinHexSkip = 0x{:02x},\n'.format(SKIP))
+    write('    kBinHexEnd = 0x{:02x},\n'.format(END))
+    write('    kBinHexInvalid = 0x{:02x},\n'.format(INVALID))
+    write('};\n')
+    write('\nstatic const uint8_t kBinHexDecode[256] = {')
+    for i in range(0, 256, 16):
+        write('\n' if i == 0 else ',\n')
+        write(','.join('0x{:02x}'.format(x) for x in table[i:i+16]))
+    write('\n};\n')
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,136 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#define _DEFAULT_SOURCE 1
+
+#include "unrez.h"
+
+#include "copyfile.h"
+
+#include <errno.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/*
+ * On Linux, copy_file_range copies between regular files, and may share the
+ * blocks instead of copying them. It fails for other destinations, like
+ * pipes, and for files on different filesystems before Linux 5.3. Then
+ * sendfile works for any destination. The system call is made directly, since
+ * the C library only declares it with _GNU_SOURCE, and only recent versions
+ * have it at all.
+ */
+#if defined __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#define HAVE_SENDFILE 1
+#if defined __NR_copy_file_range
+#define HAVE_COPY_FILE_RANGE 1
+#endif
+#endif
+
+#ifndef HAVE_SENDFILE
+#define HAVE_SENDFILE 0
+#endif
+#ifndef HAVE_COPY_FILE_RANGE
+#define HAVE_COPY_FILE_RANGE 0
+#endif
+
+enum {
+    /* Largest amount to copy with one call. */
+    kMaxCopy = 1 << 30,
+    /* Buffer size for copying through memory. */
+    kBufferSize = 64 * 1024
+};
+
+int unrez_writeall(int dest, const void *data, size_t size) {
+    size_t pos;
+    ssize_t amt;
+    int err;
+    for (pos = 0; pos < size;) {
+        amt = write(dest, (const char *)data + pos, size - pos);
+        if (amt < 0) {
+            err = errno;
+            if (err == EINTR) {
+                continue;
+            }
+            return err;
+        }
+        pos += amt;
+    }
+    return 0;
+}
+
+/*
+ * Test whether a copy system call failed because it cannot copy between these
+ * files, rather than because of an I/O error.
+ */
+static int copy_unsupported(int err) {
+    return err == EINVAL || err == EXDEV || err == ENOSYS ||
+           err == EOPNOTSUPP || err == EBADF;
+}
+
+int unrez_copyfile(int dest, int src, int64_t offset, int64_t size) {
+    unsigned char buf[kBufferSize];
+    size_t chunk;
+    ssize_t amt;
+    int err, method = 0;
+#if HAVE_COPY_FILE_RANGE
+    int64_t loff;
+#endif
+#if HAVE_SENDFILE
+    off_t off;
+#endif
+    while (size > 0) {
+        chunk = size < kMaxCopy ? (size_t)size : kMaxCopy;
+        switch (method) {
+#if HAVE_COPY_FILE_RANGE
+        case 0:
+            loff = offset;
+            amt = syscall(__NR_copy_file_range, src, &loff, dest, NULL, chunk,
+                          0);
+            break;
+#endif
+#if HAVE_SENDFILE
+        case 1:
+            off = offset;
+            amt = sendfile(dest, src, &off, chunk);
+            break;
+#endif
+        case 2:
+            if (chunk > sizeof(buf)) {
+                chunk = sizeof(buf);
+            }
+            amt = pread(src, buf, chunk, offset);
+            if (amt > 0) {
+                err = unrez_writeall(dest, buf, amt);
+                if (err != 0) {
+                    return err;
+                }
+            }
+            break;
+        default:
+            method++;
+            continue;
+        }
+        if (amt < 0) {
+            err = errno;
+            if (err == EINTR) {
+                continue;
+            }
+            /* Nothing has been written, so try the next way to copy. */
+            if (method < 2 && copy_unsupported(err)) {
+                method++;
+                continue;
+            }
+            return err;
+        } else if (amt == 0) {
+            return kUnrezErrInvalid;
+        }
+        offset += amt;
+        size -= amt;
+    }
+    return 0;
+}
@@ -0,0 +1,23 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Copy size bytes, starting at the given offset in the source file, to the
+ * current position of the destination file. Where the system allows, the data
+ * is copied by the kernel without passing through our memory. Returns 0 on
+ * success, or an error code on failure. Returns kUnrezErrInvalid if the source
+ * ends first.
+ */
+int unrez_copyfile(int dest, int src, int64_t offset, int64_t size);
+
+/*
+ * Write size bytes from memory to the current position of a file. Returns 0 on
+ * success, or an error code on failure.
+ */
+int unrez_writeall(int dest, const void *data, size_t size);
@@ -0,0 +1,33 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include "unrez.h"
+
+#include "crc16.h"
+
+/*
+ * This uses the "slice-by-8" method: each table gives the CRC of a byte
+ * followed by a number of zero bytes, so the CRC of eight bytes is the
+ * exclusive or of eight table lookups, and the lookups do not depend on each
+ * other. Table 0 is the usual byte-at-a-time table, used for the remainder.
+ */
+
+uint16_t unrez_crc16(uint16_t crc, const void *data, size_t size) {
+    const unsigned char *p = data, *e = p + size;
+    unsigned c = crc;
+    while (e - p >= 8) {
+        c = kCrc16Table[7][p[0] ^ (c >> 8)] ^
+            kCrc16Table[6][p[1] ^ (c & 0xff)] ^ kCrc16Table[5][p[2]] ^
+            kCrc16Table[4][p[3]] ^ kCrc16Table[3][p[4]] ^
+            kCrc16Table[2][p[5]] ^ kCrc16Table[1][p[6]] ^
+            kCrc16Table[0][p[7]];
+        p += 8;
+    }
+    for (; p != e; p++) {
+        c = ((c << 8) & 0xffff) ^ kCrc16Table[0][*p ^ (c >> 8)];
+    }
+    return c;
+}
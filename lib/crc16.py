@@ -0,0 +1,40 @@
+#!/usr/bin/env python3
+import sys
+
+# CRC-16 with the CCITT polynomial x^16 + x^12 + x^5 + 1, most significant bit
+# first, also known as CRC-16/XMODEM. Table k gives the CRC contribution of a
+# byte followed by k zero bytes, so eight bytes can be processed at once.
+POLY = 0x1021
+TABLES = 8
+
+def byte_crc(b):
+    crc = b << 8
+    for _ in range(8):
+        if crc & 0x8000:
+            crc = ((crc << 1) ^ POLY) & 0xffff
+        else:
+            crc = (crc << 1) & 0xffff
+    return crc
+
+def main():
+    tables = [[byte_crc(b) for b in range(256)]]
+    for k in range(1, TABLES):
+        prev = tables[-1]
+        tables.append([((x << 8) & 0xffff) ^ tables[0][x >> 8] for x in prev])
+
+    write = sys.stdout.write
+    write('/* This file is automatically generated by crc16.py. */\n')
+    write('\nstatic const uint16_t kCrc16Table[{}][256] = {{'.format(TABLES))
+    delim = '\n'
+    for table in tables:
+        write(delim)
+        write('{')
+        for i in range(0, 256, 8):
+            write('\n' if i == 0 else ',\n')
+            write(','.join('0x{:04x}'.format(x) for x in table[i:i+8]))
+        write('\n}')
+        delim = ',\n'
+    write('\n};\n')
+
+if __name__ == '__main__':
+    main()
@@ -4,15 +4,20 @@
  * This file is part of UnRez. UnRez is licensed under the terms of the MIT
  * license. For more information, see LICENSE.txt.
  */
+/* MAP_POPULATE and MADV_HUGEPAGE are not part of POSIX. */
+#define _DEFAULT_SOURCE 1
+
 #include "unrez.h"
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
 enum {
     kMmapMinimum = 16 * 1024,
+    kHugePageSize = 2 * 1024 * 1024,
 };
 
 enum {
@@ -32,13 +37,64 @@ void unrez_data_destroy(struct unrez_data *d) {
     }
 }
 
+/* Give the kernel advice about how mapped data will be used. */
+static void advise(void *ptr, size_t size, const struct unrez_readopts *opts) {
+    /* Advice is only a hint, so errors are ignored. */
+    switch (opts->advice) {
+    case kUnrezAdviseSequential:
+        posix_madvise(ptr, size, POSIX_MADV_SEQUENTIAL);
+        break;
+    case kUnrezAdviseRandom:
+        posix_madvise(ptr, size, POSIX_MADV_RANDOM);
+        break;
+    }
+    if ((opts->flags & kUnrezReadWillNeed) != 0) {
+        posix_madvise(ptr, size, POSIX_MADV_WILLNEED);
+    }
+#ifdef MADV_HUGEPAGE
+    if ((opts->flags & kUnrezReadHugePages) != 0) {
+        madvise(ptr, size, MADV_HUGEPAGE);
+    }
+#endif
+}
+
+/*
+ * Allocate a buffer to read a fork into. Large buffers are aligned to huge
+ * pages if requested, and can still be freed with free().
+ */
+static void *alloc_buffer(size_t size, const struct unrez_readopts *opts) {
+    void *ptr;
+    int err;
+    if ((opts->flags & kUnrezReadHugePages) == 0 || size < kHugePageSize) {
+        return malloc(size);
+    }
+    err = posix_memalign(&ptr, kHugePageSize, size);
+    if (err != 0) {
+        errno = err;
+        return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+    return ptr;
+}
+
 int unrez_fork_read(const struct unrez_fork *fork, struct unrez_data *d) {
+    return unrez_fork_readopts(fork, d, NULL);
+}
+
+int unrez_fork_readopts(const struct unrez_fork *fork, struct unrez_data *d,
+                        const struct unrez_readopts *opts) {
+    static const struct unrez_readopts kDefaultOpts;
     static long page_size;
     void *ptr;
     off_t start, end, map_start;
-    size_t map_size, size, pos;
+    size_t map_size, size, pos, minimum;
     ssize_t amt;
-    int err;
+    int err, mflags;
+    if (opts == NULL) {
+        opts = &kDefaultOpts;
+    }
     if (fork->size < 0) {
         return EINVAL;
     }
@@ -49,18 +105,33 @@ int unrez_fork_read(const struct unrez_fork *fork, struct unrez_data *d) {
     }
 #pragma GCC diagnostic pop
     size = fork->size;
+    if (fork->mem != NULL) {
+        ptr = malloc(size);
+        if (ptr == NULL) {
+            return errno;
+        }
+        memcpy(ptr, fork->mem, size);
+        goto done;
+    }
     start = fork->offset;
     end = fork->offset + fork->size;
-    if (size >= kMmapMinimum) {
+    minimum = opts->mmap_minimum != 0 ? opts->mmap_minimum : kMmapMinimum;
+    if (size >= minimum && size > 0 &&
+        (opts->flags & kUnrezReadNoMmap) == 0) {
         if (page_size == 0) {
             page_size = sysconf(_SC_PAGESIZE);
         }
         map_start = start & ~(off_t)(page_size - 1);
         map_size = end - map_start;
-        size = fork->size;
-        ptr =
-            mmap(NULL, map_size, PROT_READ, MAP_SHARED, fork->file, map_start);
+        mflags = MAP_SHARED;
+#ifdef MAP_POPULATE
+        if ((opts->flags & kUnrezReadPopulate) != 0) {
+            mflags |= MAP_POPULATE;
+        }
+#endif
+        ptr = mmap(NULL, map_size, PROT_READ, mflags, fork->file, map_start);
         if (ptr != MAP_FAILED) {
+            advise(ptr, map_size, opts);
             d->data = (char *)ptr + (start - map_start);
             d->size = size;
             d->type = kTypeMmap;
@@ -69,7 +140,7 @@ int unrez_fork_read(const struct unrez_fork *fork, struct unrez_data *d) {
             return 0;
         }
     }
-    ptr = malloc(size);
+    ptr = alloc_buffer(size, opts);
     if (ptr == NULL) {
         return errno;
     }
@@ -88,6 +159,7 @@ int unrez_fork_read(const struct unrez_fork *fork, struct unrez_data *d) {
         }
         pos += amt;
     }
+done:
     d->data = ptr;
     d->size = size;
     d->type = kTypeMalloc;
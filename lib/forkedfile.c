@@ -6,6 +6,8 @@
  */
 #include "unrez.h"
 
+#include "applefile.h"
+
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
@@ -25,90 +27,127 @@ static const char *const kForkPaths[] = {kForkPath1, kForkPath2};
 
 static const char kAppleDoublePrefix[] = "._";
 
+enum {
+    kPrefixLen = sizeof(kAppleDoublePrefix) - 1,
+    /* Names shorter than this are built on the stack. */
+    kNameBufSize = 256
+};
+
+/*
+ * Open a regular file and get its size. Returns ENOENT if the file exists but
+ * is not a regular file or directory, so it is treated as missing.
+ */
+static int open_regular(int dirfd, const char *path, int *fdp,
+                        int64_t *sizep) {
+    struct stat st;
+    int fd, err;
+    fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return errno;
+    }
+    if (fstat(fd, &st) == -1) {
+        err = errno;
+        close(fd);
+        return err;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        close(fd);
+        return S_ISDIR(st.st_mode) ? EISDIR : ENOENT;
+    }
+    *fdp = fd;
+    *sizep = st.st_size;
+    return 0;
+}
+
+/*
+ * Decode a BinHex file. Both forks are decoded into memory, so the file is not
+ * needed afterwards.
+ */
+static int open_binhex(struct unrez_forkedfile *forks, int fd, int64_t size) {
+    struct unrez_fork fork;
+    struct unrez_data d;
+    struct unrez_metadata mdata;
+    void *mem;
+    int err;
+    fork.file = fd;
+    fork.offset = 0;
+    fork.size = size;
+    fork.mem = NULL;
+    err = unrez_fork_read(&fork, &d);
+    if (err != 0) {
+        return err;
+    }
+    err = unrez_binhex_decode(&mdata, &mem, d.data, d.size);
+    unrez_data_destroy(&d);
+    if (err != 0) {
+        return err;
+    }
+    forks->data.file = -1;
+    forks->data.offset = 0;
+    forks->data.size = mdata.data_size;
+    forks->data.mem = mem;
+    forks->rsrc.file = -1;
+    forks->rsrc.offset = 0;
+    forks->rsrc.size = mdata.rsrc_size;
+    forks->rsrc.mem = (char *)mem + mdata.data_size;
+    forks->metadata = mdata;
+    forks->mem = mem;
+    return 0;
+}
+
 int unrez_forkedfile_open(struct unrez_forkedfile *forks, const char *path) {
-    return unrez_forkedfile_openat(forks, AT_FDCWD, path);
+    return unrez_forkedfile_probeat(forks, AT_FDCWD, path, 0);
 }
 
 int unrez_forkedfile_openat(struct unrez_forkedfile *forks, int dirfd,
                             const char *path) {
-    const char *sep;
-    char *tmp = NULL;
-    size_t len;
-    int fd1 = -1, fd2 = -1, i, close_dir = 0, err, r;
-    struct stat st1, st2;
+    return unrez_forkedfile_probeat(forks, dirfd, path, 0);
+}
+
+/*
+ * Find the forks of a file, given the main file, which may be -1 if it does not
+ * exist, and the start of its contents. Takes ownership of the main file.
+ */
+static int probe(struct unrez_forkedfile *forks, int dirfd, const char *path,
+                 int flags, int fd1, int64_t size1,
+                 const unsigned char *header, size_t amt) {
+    unsigned char header2[kUnrezHeaderSize];
+    char namebuf[kNameBufSize], *tmp = namebuf;
+    const char *name;
+    size_t dirlen, namelen, len;
+    ssize_t amt2;
+    int64_t size2;
+    int fd2 = -1, i, err;
     struct unrez_metadata mdata;
 
+    forks->data.mem = NULL;
+    forks->rsrc.mem = NULL;
+    forks->mem = NULL;
+
     /*
-     * Rather than do any significant path manipulation, we open the directory
-     * containing the file and use openat() everywhere.
+     * Sibling files are opened with a path built from the directory part of
+     * the path, rather than opening the directory itself.
      */
-    sep = strrchr(path, '/');
-    if (sep != NULL) {
-        len = sep + 1 - path;
-        tmp = malloc(len + 1);
+    name = strrchr(path, '/');
+    name = name != NULL ? name + 1 : path;
+    dirlen = name - path;
+    namelen = strlen(name);
+    len = dirlen + namelen;
+    /* Scratch buffer for generating filenames. */
+    if (len + sizeof(kForkPath1) > sizeof(namebuf)) {
+        tmp = malloc(len + sizeof(kForkPath1));
         if (tmp == NULL) {
             err = errno;
             goto error;
         }
-        memcpy(tmp, path, len);
-        tmp[len] = '\0';
-        dirfd = openat(dirfd, tmp, O_RDONLY | O_CLOEXEC);
-        if (dirfd == -1) {
-            err = errno;
-            goto error;
-        }
-        close_dir = 1;
-        r = fstat(dirfd, &st1);
-        if (r == -1) {
-            err = errno;
-            goto error;
-        }
-        if (!S_ISDIR(st1.st_mode)) {
-            err = ENOTDIR;
-            goto error;
-        }
-        free(tmp);
-        tmp = NULL;
-        path = sep + 1;
-    }
-
-    /* Open the main file, if it exists. It might not exist. */
-    fd1 = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
-    if (fd1 == -1) {
-        err = errno;
-        if (err != ENOENT) {
-            goto error;
-        }
-    } else {
-        r = fstat(fd1, &st1);
-        if (r == -1) {
-            err = errno;
-            goto error;
-        }
-        if (!S_ISREG(st1.st_mode)) {
-            if (S_ISDIR(st1.st_mode)) {
-                err = EISDIR;
-            } else {
-                err = ENOENT;
-            }
-            goto error;
-        }
-    }
-
-    /* Scratch buffer for generating filenames.  */
-    len = strlen(path);
-    tmp = malloc(len + sizeof(kForkPath1));
-    if (tmp == NULL) {
-        err = errno;
-        goto error;
     }
 
+    /* The header is read once, and checked for every format. */
     if (fd1 != -1) {
         /* Check if the file itself is AppleDouble or AppleSingle. */
-        if (len > sizeof(kAppleDoublePrefix) - 1 &&
-            memcmp(path, kAppleDoublePrefix, sizeof(kAppleDoublePrefix) - 1) ==
-                0) {
-            err = unrez_applefile_parse(&mdata, fd1, st1.st_size);
+        if (namelen > kPrefixLen &&
+            memcmp(name, kAppleDoublePrefix, kPrefixLen) == 0) {
+            err = unrez_applefile_parseheader(&mdata, header, amt, size1);
             if (err != 0) {
                 if (err != kUnrezErrFormat) {
                     goto error;
@@ -119,11 +158,11 @@ int unrez_forkedfile_openat(struct unrez_forkedfile *forks, int dirfd,
                     forks->data.offset = mdata.data_offset;
                     forks->data.size = mdata.data_size;
                 } else {
-                    memcpy(tmp, path + sizeof(kAppleDoublePrefix) - 1,
-                           len + 1 - (sizeof(kAppleDoublePrefix) - 1));
-                    fd2 = openat(dirfd, tmp, O_RDONLY);
-                    if (fd2 == -1) {
-                        err = errno;
+                    memcpy(tmp, path, dirlen);
+                    memcpy(tmp + dirlen, name + kPrefixLen,
+                           namelen + 1 - kPrefixLen);
+                    err = open_regular(dirfd, tmp, &fd2, &size2);
+                    if (err != 0) {
                         if (err != ENOENT) {
                             goto error;
                         }
@@ -131,22 +170,9 @@ int unrez_forkedfile_openat(struct unrez_forkedfile *forks, int dirfd,
                         forks->data.offset = 0;
                         forks->data.size = 0;
                     } else {
-                        r = fstat(fd2, &st2);
-                        if (r == -1) {
-                            err = errno;
-                            goto error;
-                        }
-                        if (!S_ISREG(st2.st_mode)) {
-                            if (S_ISDIR(st2.st_mode)) {
-                                err = EISDIR;
-                            } else {
-                                err = ENOENT;
-                            }
-                            goto error;
-                        }
                         forks->data.file = fd2;
                         forks->data.offset = 0;
-                        forks->data.size = st2.st_size;
+                        forks->data.size = size2;
                     }
                 }
                 forks->rsrc.file = fd1;
@@ -164,8 +190,8 @@ int unrez_forkedfile_openat(struct unrez_forkedfile *forks, int dirfd,
          * with a header of 512 zeroes. Parsed as a MacBinary file, the checksum
          * will match. So we use less magic here.
          */
-        if (len > 4 && memcmp(path + (len - 4), ".bin", 4) == 0) {
-            err = unrez_macbinary_parse(&mdata, fd1, st1.st_size);
+        if (namelen > 4 && memcmp(name + (namelen - 4), ".bin", 4) == 0) {
+            err = unrez_macbinary_parseheader(&mdata, header, amt, size1);
             if (err != 0) {
                 if (err != kUnrezErrFormat) {
                     goto error;
@@ -182,8 +208,22 @@ int unrez_forkedfile_openat(struct unrez_forkedfile *forks, int dirfd,
             }
         }
 
+        /* Check for BinHex, by name or by the tag line. */
+        if ((namelen > 4 && memcmp(name + (namelen - 4), ".hqx", 4) == 0) ||
+            unrez_binhex_check(header, amt)) {
+            err = open_binhex(forks, fd1, size1);
+            if (err != 0) {
+                if (err != kUnrezErrFormat) {
+                    goto error;
+                }
+            } else {
+                close(fd1);
+                goto success;
+            }
+        }
+
         /* Check for AppleDouble or AppleSingle. */
-        err = unrez_applefile_parse(&mdata, fd1, st1.st_size);
+        err = unrez_applefile_parseheader(&mdata, header, amt, size1);
         if (err != 0) {
             if (err != kUnrezErrFormat) {
                 goto error;
@@ -201,79 +241,62 @@ int unrez_forkedfile_openat(struct unrez_forkedfile *forks, int dirfd,
     }
 
     /* Check for a separate AppleDouble. */
-    memcpy(tmp, kAppleDoublePrefix, sizeof(kAppleDoublePrefix) - 1);
-    memcpy(tmp + sizeof(kAppleDoublePrefix) - 1, path, len + 1);
-    fd2 = openat(dirfd, tmp, O_RDONLY | O_CLOEXEC);
-    if (fd2 == -1) {
-        err = errno;
-        if (err != ENOENT) {
-            goto error;
-        }
-    } else {
-        r = fstat(fd2, &st2);
-        if (r == -1) {
-            err = errno;
-            goto error;
-        }
-        if (!S_ISREG(st2.st_mode)) {
-            if (S_ISDIR(st2.st_mode)) {
-                err = EISDIR;
-            } else {
-                err = ENOENT;
-            }
-            goto error;
-        }
-        err = unrez_applefile_parse(&mdata, fd2, st2.st_size);
+    if ((flags & kUnrezProbeListed) == 0 ||
+        (flags & kUnrezProbeAppleDouble) != 0) {
+        memcpy(tmp, path, dirlen);
+        memcpy(tmp + dirlen, kAppleDoublePrefix, kPrefixLen);
+        memcpy(tmp + dirlen + kPrefixLen, name, namelen + 1);
+        err = open_regular(dirfd, tmp, &fd2, &size2);
         if (err != 0) {
-            if (err != kUnrezErrFormat) {
+            if (err != ENOENT) {
                 goto error;
             }
-            close(fd2);
-            forks->rsrc.file = -1;
-            forks->rsrc.offset = 0;
-            forks->rsrc.size = 0;
-            memset(&forks->metadata, 0, sizeof(forks->metadata));
         } else {
-            forks->rsrc.file = fd2;
-            forks->rsrc.offset = mdata.rsrc_offset;
-            forks->rsrc.size = mdata.rsrc_size;
-            forks->metadata = mdata;
+            amt2 = pread(fd2, header2, sizeof(header2), 0);
+            if (amt2 < 0) {
+                err = errno;
+                goto error;
+            }
+            err = unrez_applefile_parseheader(&mdata, header2, amt2, size2);
+            if (err != 0) {
+                if (err != kUnrezErrFormat) {
+                    goto error;
+                }
+                close(fd2);
+                forks->rsrc.file = -1;
+                forks->rsrc.offset = 0;
+                forks->rsrc.size = 0;
+                memset(&forks->metadata, 0, sizeof(forks->metadata));
+            } else {
+                forks->rsrc.file = fd2;
+                forks->rsrc.offset = mdata.rsrc_offset;
+                forks->rsrc.size = mdata.rsrc_size;
+                forks->metadata = mdata;
+            }
+            forks->data.file = fd1;
+            forks->data.offset = 0;
+            forks->data.size = size1;
+            goto success;
         }
-        forks->data.file = fd1;
-        forks->data.offset = 0;
-        forks->data.size = st1.st_size;
-        goto success;
     }
 
     /* Check for native forks. */
-    for (i = 0; i < 2; i++) {
+    for (i = 0; i < 2 && (flags & kUnrezProbeNoNative) == 0; i++) {
         memcpy(tmp, path, len);
         strcpy(tmp + len, kForkPaths[i]);
-        fd2 = openat(dirfd, tmp, O_RDONLY | O_CLOEXEC);
-        if (fd2 == -1) {
-            err = errno;
+        err = open_regular(dirfd, tmp, &fd2, &size2);
+        if (err != 0) {
             if (err != ENOENT && err != ENOTDIR) {
                 goto error;
             }
         } else {
-            r = fstat(fd2, &st2);
-            if (r == -1) {
-                err = errno;
-                goto error;
-            }
-            if (fd1 != -1) {
-                /* Not sure if this is even possible. */
-                forks->data.file = fd1;
-                forks->data.offset = 0;
-                forks->data.size = st1.st_size;
-            } else {
-                forks->data.file = -1;
-                forks->data.offset = 0;
-                forks->data.size = 0;
-            }
+            /* Not sure if a data fork is even possible. */
+            forks->data.file = fd1;
+            forks->data.offset = 0;
+            forks->data.size = size1;
             forks->rsrc.file = fd2;
             forks->rsrc.offset = 0;
-            forks->rsrc.size = st2.st_size;
+            forks->rsrc.size = size2;
             memset(&forks->metadata, 0, sizeof(forks->metadata));
             goto success;
         }
@@ -286,7 +309,7 @@ int unrez_forkedfile_openat(struct unrez_forkedfile *forks, int dirfd,
     }
     forks->data.file = fd1;
     forks->data.offset = 0;
-    forks->data.size = st1.st_size;
+    forks->data.size = size1;
     forks->rsrc.file = -1;
     forks->rsrc.offset = 0;
     forks->rsrc.size = 0;
@@ -294,22 +317,68 @@ int unrez_forkedfile_openat(struct unrez_forkedfile *forks, int dirfd,
     goto success;
 
 success:
-    free(tmp);
-    if (close_dir)
-        close(dirfd);
+    if (tmp != namebuf) {
+        free(tmp);
+    }
     return 0;
 
 error:
-    free(tmp);
+    if (tmp != namebuf) {
+        free(tmp);
+    }
     if (fd1 != -1)
         close(fd1);
     if (fd2 != -1)
         close(fd2);
-    if (close_dir)
-        close(dirfd);
     return err;
 }
 
+int unrez_forkedfile_probeat(struct unrez_forkedfile *forks, int dirfd,
+                             const char *path, int flags) {
+    unsigned char header[kUnrezHeaderSize];
+    int64_t size = 0;
+    ssize_t amt = 0;
+    int fd = -1, err;
+    /* Open the main file, if it exists. It might not exist. */
+    err = open_regular(dirfd, path, &fd, &size);
+    if (err != 0) {
+        if (err != ENOENT) {
+            return err;
+        }
+        fd = -1;
+        size = 0;
+    } else {
+        amt = pread(fd, header, sizeof(header), 0);
+        if (amt < 0) {
+            err = errno;
+            close(fd);
+            return err;
+        }
+    }
+    return probe(forks, dirfd, path, flags, fd, size, header, amt);
+}
+
+int unrez_forkedfile_probefd(struct unrez_forkedfile *forks, int dirfd,
+                             const char *path, int flags, int fd,
+                             const void *header, size_t size) {
+    struct stat st;
+    int err;
+    if (fstat(fd, &st) == -1) {
+        err = errno;
+        close(fd);
+        return err;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        /* As with probeat, the file is treated as missing. */
+        close(fd);
+        if (S_ISDIR(st.st_mode)) {
+            return EISDIR;
+        }
+        return probe(forks, dirfd, path, flags, -1, 0, header, 0);
+    }
+    return probe(forks, dirfd, path, flags, fd, st.st_size, header, size);
+}
+
 void unrez_forkedfile_close(struct unrez_forkedfile *forks) {
     int data = forks->data.file, rsrc = forks->rsrc.file;
     if (data != -1) {
@@ -320,4 +389,5 @@ void unrez_forkedfile_close(struct unrez_forkedfile *forks) {
     }
     free(forks->metadata.comment);
     free(forks->metadata.filename);
+    free(forks->mem);
 }
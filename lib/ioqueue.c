@@ -0,0 +1,389 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+/* The syscall function is not part of POSIX. */
+#define _DEFAULT_SOURCE 1
+
+#include "unrez.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * On Linux, operations are queued on an io_uring, using the system calls
+ * directly so there is no dependency on liburing. Opens and reads both need
+ * Linux 5.6. Where io_uring is not available, either at compile time or at run
+ * time, each operation is done synchronously when it is queued, and its result
+ * is kept until it is collected by unrez_ioqueue_wait.
+ */
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_RW_CUR_POS)
+#define HAVE_URING 1
+#endif
+#endif
+#endif
+
+#ifndef HAVE_URING
+#define HAVE_URING 0
+#endif
+
+#if HAVE_URING
+
+enum {
+    kMaxRead = 1 << 30
+};
+
+/* The shared rings, as mapped into our address space. */
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    /* Entries added to the submission ring since the last enter. */
+    unsigned to_submit;
+};
+
+#endif
+
+struct unrez_ioqueue {
+    int depth;
+    /* Operations queued and not yet collected. */
+    int pending;
+#if HAVE_URING
+    int has_uring;
+    struct uring ring;
+#endif
+    /* Results of synchronous operations which have not been collected. */
+    struct unrez_iocompletion *done;
+    int done_count;
+};
+
+#if HAVE_URING
+
+static void uring_unmap(struct uring *r) {
+    if (r->sqes != NULL) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->cq_ring != NULL && r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    if (r->sq_ring != NULL) {
+        munmap(r->sq_ring, r->sq_ring_size);
+    }
+}
+
+/* Set up an io_uring. Returns 0 on success, or an error code. */
+static int uring_init(struct uring *r, unsigned entries) {
+    struct io_uring_params p;
+    void *ptr;
+    int fd, err;
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0) {
+        return errno;
+    }
+    /* Opens and reads on io_uring were added with this feature. */
+    if ((p.features & IORING_FEAT_RW_CUR_POS) == 0) {
+        close(fd);
+        return ENOSYS;
+    }
+    r->fd = fd;
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size =
+        p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+        if (r->cq_ring_size > r->sq_ring_size) {
+            r->sq_ring_size = r->cq_ring_size;
+        }
+        r->cq_ring_size = r->sq_ring_size;
+    }
+    ptr = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+               IORING_OFF_SQ_RING);
+    if (ptr == MAP_FAILED) {
+        goto error;
+    }
+    r->sq_ring = ptr;
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+        r->cq_ring = ptr;
+    } else {
+        ptr = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, IORING_OFF_CQ_RING);
+        if (ptr == MAP_FAILED) {
+            goto error;
+        }
+        r->cq_ring = ptr;
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ptr = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+               IORING_OFF_SQES);
+    if (ptr == MAP_FAILED) {
+        goto error;
+    }
+    r->sqes = ptr;
+    r->sq_head = (unsigned *)((char *)r->sq_ring + p.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)r->sq_ring + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->sq_ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((char *)r->sq_ring + p.sq_off.array);
+    r->cq_head = (unsigned *)((char *)r->cq_ring + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->cq_ring + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->cq_ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+    return 0;
+
+error:
+    err = errno;
+    uring_unmap(r);
+    close(fd);
+    return err;
+}
+
+/* Get an empty submission entry, or NULL if the ring is full. */
+static struct io_uring_sqe *uring_get(struct uring *r) {
+    unsigned tail = *r->sq_tail, head, idx;
+    struct io_uring_sqe *sqe;
+    head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head > *r->sq_mask) {
+        return NULL;
+    }
+    idx = tail & *r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    return sqe;
+}
+
+/* Make the entry from uring_get visible to the kernel. */
+static void uring_push(struct uring *r) {
+    __atomic_store_n(r->sq_tail, *r->sq_tail + 1, __ATOMIC_RELEASE);
+    r->to_submit++;
+}
+
+/*
+ * Submit queued entries, and wait for at least min_complete completions.
+ * Returns 0 on success, or an error code.
+ */
+static int uring_enter(struct uring *r, unsigned min_complete) {
+    long n;
+    for (;;) {
+        n = syscall(__NR_io_uring_enter, r->fd, r->to_submit, min_complete,
+                    min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n >= 0) {
+            r->to_submit -= n;
+            return 0;
+        }
+        if (errno != EINTR) {
+            return errno;
+        }
+    }
+}
+
+/* Collect up to max completions without waiting. */
+static int uring_reap(struct uring *r, struct unrez_iocompletion *c,
+                      int max) {
+    unsigned head = *r->cq_head, tail;
+    const struct io_uring_cqe *cqe;
+    int n = 0;
+    tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail && n < max) {
+        cqe = &r->cqes[head & *r->cq_mask];
+        c[n].tag = (void *)(uintptr_t)cqe->user_data;
+        if (cqe->res < 0) {
+            c[n].result = -1;
+            c[n].err = -cqe->res;
+        } else {
+            c[n].result = cqe->res;
+            c[n].err = 0;
+        }
+        head++;
+        n++;
+    }
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    return n;
+}
+
+#endif
+
+int unrez_ioqueue_create(struct unrez_ioqueue **qp, int depth, int flags) {
+    struct unrez_ioqueue *q;
+    if (depth < 1) {
+        return EINVAL;
+    }
+    q = malloc(sizeof(*q));
+    if (q == NULL) {
+        return errno;
+    }
+    q->depth = depth;
+    q->pending = 0;
+    q->done = NULL;
+    q->done_count = 0;
+#if HAVE_URING
+    q->has_uring = 0;
+    if ((flags & kUnrezIoNoUring) == 0 && uring_init(&q->ring, depth) == 0) {
+        q->has_uring = 1;
+        *qp = q;
+        return 0;
+    }
+#else
+    (void)flags;
+#endif
+    q->done = malloc(sizeof(*q->done) * depth);
+    if (q->done == NULL) {
+        free(q);
+        return errno;
+    }
+    *qp = q;
+    return 0;
+}
+
+void unrez_ioqueue_destroy(struct unrez_ioqueue *q) {
+    if (q == NULL) {
+        return;
+    }
+#if HAVE_URING
+    if (q->has_uring) {
+        uring_unmap(&q->ring);
+        close(q->ring.fd);
+    }
+#endif
+    free(q->done);
+    free(q);
+}
+
+int unrez_ioqueue_isasync(const struct unrez_ioqueue *q) {
+#if HAVE_URING
+    return q->has_uring;
+#else
+    (void)q;
+    return 0;
+#endif
+}
+
+int unrez_ioqueue_pending(const struct unrez_ioqueue *q) {
+    return q->pending;
+}
+
+/* Record the result of a synchronous operation. */
+static void sync_done(struct unrez_ioqueue *q, void *tag, long result) {
+    struct unrez_iocompletion *c = &q->done[q->done_count++];
+    c->tag = tag;
+    if (result < 0) {
+        c->result = -1;
+        c->err = errno;
+    } else {
+        c->result = result;
+        c->err = 0;
+    }
+}
+
+int unrez_ioqueue_openat(struct unrez_ioqueue *q, int dirfd, const char *path,
+                         void *tag) {
+#if HAVE_URING
+    struct io_uring_sqe *sqe;
+#endif
+    if (q->pending >= q->depth) {
+        return EBUSY;
+    }
+#if HAVE_URING
+    if (q->has_uring) {
+        sqe = uring_get(&q->ring);
+        if (sqe == NULL) {
+            return EBUSY;
+        }
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = dirfd;
+        sqe->addr = (uintptr_t)path;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        sqe->user_data = (uintptr_t)tag;
+        uring_push(&q->ring);
+        q->pending++;
+        return 0;
+    }
+#endif
+    sync_done(q, tag, openat(dirfd, path, O_RDONLY | O_CLOEXEC));
+    q->pending++;
+    return 0;
+}
+
+int unrez_ioqueue_read(struct unrez_ioqueue *q, int fd, void *buf,
+                       size_t size, int64_t offset, void *tag) {
+#if HAVE_URING
+    struct io_uring_sqe *sqe;
+#endif
+    ssize_t amt;
+    if (q->pending >= q->depth) {
+        return EBUSY;
+    }
+#if HAVE_URING
+    if (q->has_uring) {
+        sqe = uring_get(&q->ring);
+        if (sqe == NULL) {
+            return EBUSY;
+        }
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = (uintptr_t)buf;
+        /* The length is 32 bits, and short reads are allowed. */
+        sqe->len = size < kMaxRead ? size : kMaxRead;
+        sqe->off = offset;
+        sqe->user_data = (uintptr_t)tag;
+        uring_push(&q->ring);
+        q->pending++;
+        return 0;
+    }
+#endif
+    do {
+        amt = pread(fd, buf, size, offset);
+    } while (amt < 0 && errno == EINTR);
+    sync_done(q, tag, amt);
+    q->pending++;
+    return 0;
+}
+
+int unrez_ioqueue_wait(struct unrez_ioqueue *q, struct unrez_iocompletion *c,
+                       int max, int *count) {
+    int n;
+#if HAVE_URING
+    int err;
+#endif
+    *count = 0;
+    if (q->pending == 0 || max < 1) {
+        return 0;
+    }
+#if HAVE_URING
+    if (q->has_uring) {
+        n = uring_reap(&q->ring, c, max);
+        if (n == 0 || q->ring.to_submit > 0) {
+            err = uring_enter(&q->ring, n == 0 ? 1 : 0);
+            if (err != 0) {
+                return err;
+            }
+            n += uring_reap(&q->ring, c + n, max - n);
+        }
+        q->pending -= n;
+        *count = n;
+        return 0;
+    }
+#endif
+    n = q->done_count < max ? q->done_count : max;
+    memcpy(c, q->done, sizeof(*c) * n);
+    q->done_count -= n;
+    memmove(q->done, q->done + n, sizeof(*c) * q->done_count);
+    q->pending -= n;
+    *count = n;
+    return 0;
+}
@@ -6,6 +6,7 @@
  */
 #include "unrez.h"
 
+#include "applefile.h"
 #include "binary.h"
 
 #include <errno.h>
@@ -66,57 +67,20 @@ static int64_t align(int64_t value, int bits) {
     return (value + mask) & (~mask);
 }
 
-static uint16_t crc(const void *data, size_t length) {
-    const unsigned char *ptr = data;
-    uint16_t result = 0, d;
-    int bit;
-    for (; length > 0; --length, ++ptr) {
-        d = *ptr << 8;
-        /*
-         * Bit by bit is slow, but we are only calculating the CRC of a few
-         * bytes.
-         */
-        for (bit = 0; bit < 8; ++bit) {
-            if ((d ^ result) & 0x8000) {
-                result = (result << 1) ^ 0x1021;
-            } else {
-                result = (result << 1);
-            }
-            d <<= 1;
-        }
-    }
-    return result;
-}
-
-int unrez_macbinary_parse(struct unrez_metadata *mdata, int fdes,
-                          int64_t fsize) {
-    ssize_t amt;
-    unsigned char header[128];
+int unrez_macbinary_parseheader(struct unrez_metadata *mdata,
+                                const unsigned char *header, size_t size,
+                                int64_t fsize) {
     uint16_t file_crc, calculated_crc;
     uint32_t dsize, rsize;
     int64_t doff, roff;
-    int r;
-    struct stat st;
-
-    if (fsize < 0) {
-        r = fstat(fdes, &st);
-        if (r == -1) {
-            return errno;
-        }
-        fsize = st.st_size;
-    }
 
-    amt = pread(fdes, header, sizeof(header), 0);
-    if (amt < 0) {
-        return errno;
-    }
-    if ((size_t)amt < sizeof(header) || header[0] || header[74] || header[82] ||
+    if (size < 128 || header[0] || header[74] || header[82] ||
         header[1] > 63 || header[123] > 129) {
         return kUnrezErrFormat;
     }
     /* memcmp(header + 102, kSignature, 4) */
     file_crc = read_u16(header + 124);
-    calculated_crc = crc(header, 124);
+    calculated_crc = unrez_crc16(0, header, 124);
     if (file_crc != calculated_crc) {
         return kUnrezErrFormat;
     }
@@ -131,6 +95,7 @@ int unrez_macbinary_parse(struct unrez_metadata *mdata, int fdes,
     }
 
     memset(mdata, 0, sizeof(*mdata));
+    mdata->type = kUnrezTypeMacBinary;
     mdata->data_offset = doff;
     mdata->data_size = dsize;
     mdata->rsrc_offset = roff;
@@ -138,3 +103,25 @@ int unrez_macbinary_parse(struct unrez_metadata *mdata, int fdes,
 
     return 0;
 }
+
+int unrez_macbinary_parse(struct unrez_metadata *mdata, int fdes,
+                          int64_t fsize) {
+    ssize_t amt;
+    unsigned char header[128];
+    int r;
+    struct stat st;
+
+    if (fsize < 0) {
+        r = fstat(fdes, &st);
+        if (r == -1) {
+            return errno;
+        }
+        fsize = st.st_size;
+    }
+
+    amt = pread(fdes, header, sizeof(header), 0);
+    if (amt < 0) {
+        return errno;
+    }
+    return unrez_macbinary_parseheader(mdata, header, amt, fsize);
+}
@@ -0,0 +1,367 @@
+/*
+ * Copyright 2007-2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include "unrez.h"
+
+#include "binary.h"
+#include "packbits.h"
+#include "simd.h"
+
+#include <string.h>
+
+#if SIMD_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * See "TN1023: Understanding PackBits" (no longer accessible)
+ * http://developer.apple.com/technotes/tn/tn1023.html
+ *
+ * Runs are at most 128 units long, so most of the time is spent on the control
+ * bytes and on short copies. The SIMD versions copy and fill whole vectors at a
+ * time, writing past the end of the run if there is room before the end of the
+ * output. The extra data is overwritten by the next run, or by the zero fill at
+ * the end, so the output is the same as the portable version. Near the end of
+ * the input or output, they fall back to the portable code.
+ */
+
+static int unpack_8_c(uint8_t *dptr, uint8_t *dend, const uint8_t *sptr,
+                      const uint8_t *send) {
+    int control, runsize;
+    while (sptr < send) {
+        control = (int8_t)*sptr;
+        sptr++;
+        if (control > 0) {
+            /* Literal data follows. */
+            runsize = control + 1;
+            if (send - sptr < runsize) {
+                return kErrEof;
+            }
+            if (dend - dptr < runsize) {
+                return kErrBadPixels;
+            }
+            memcpy(dptr, sptr, runsize);
+            sptr += runsize;
+            dptr += runsize;
+        } else if (control != -128) {
+            /* Repeated data follows. */
+            runsize = (-control) + 1;
+            if (send - sptr < 1) {
+                return kErrEof;
+            }
+            if (dend - dptr < runsize) {
+                return kErrBadPixels;
+            }
+            memset(dptr, *sptr, runsize);
+            sptr++;
+            dptr += runsize;
+        }
+        /* Control 0x80 is ignored, see tech note. */
+    }
+    memset(dptr, 0, dend - dptr);
+    return 0;
+}
+
+static int unpack_16_c(uint16_t *dptr, uint16_t *dend, const uint8_t *sptr,
+                       const uint8_t *send) {
+    int control, runsize, i;
+    uint16_t v;
+    while (sptr < send) {
+        control = (int8_t)*sptr;
+        sptr++;
+        if (control > 0) {
+            /* Literal data follows. */
+            runsize = control + 1;
+            if (send - sptr < runsize * 2) {
+                return kErrEof;
+            }
+            if (dend - dptr < runsize) {
+                return kErrBadPixels;
+            }
+            for (i = 0; i < runsize; i++) {
+                dptr[i] = read_u16(sptr + i * 2);
+            }
+            sptr += runsize * 2;
+            dptr += runsize;
+        } else if (control != -128) {
+            /* Repeated data follows. */
+            runsize = (-control) + 1;
+            if (send - sptr < 2) {
+                return kErrEof;
+            }
+            if (dend - dptr < runsize) {
+                return kErrBadPixels;
+            }
+            v = read_u16(sptr);
+            sptr += 2;
+            for (i = 0; i < runsize; i++) {
+                dptr[i] = v;
+            }
+            dptr += runsize;
+        }
+        /* Control 0x80 is ignored, see tech note. */
+    }
+    memset(dptr, 0, (dend - dptr) * sizeof(*dptr));
+    return 0;
+}
+
+#if SIMD_X86
+
+__attribute__((target("sse2"))) static int unpack_8_sse2(uint8_t *dptr,
+                                                         uint8_t *dend,
+                                                         const uint8_t *sptr,
+                                                         const uint8_t *send) {
+    int control, runsize, vsize, i;
+    __m128i v;
+    while (sptr < send) {
+        control = (int8_t)*sptr;
+        sptr++;
+        if (control > 0) {
+            runsize = control + 1;
+            if (send - sptr < runsize) {
+                return kErrEof;
+            }
+            if (dend - dptr < runsize) {
+                return kErrBadPixels;
+            }
+            vsize = (runsize + 15) & ~15;
+            if (send - sptr >= vsize && dend - dptr >= vsize) {
+                for (i = 0; i < vsize; i += 16) {
+                    v = _mm_loadu_si128((const __m128i *)(sptr + i));
+                    _mm_storeu_si128((__m128i *)(dptr + i), v);
+                }
+            } else {
+                memcpy(dptr, sptr, runsize);
+            }
+            sptr += runsize;
+            dptr += runsize;
+        } else if (control != -128) {
+            runsize = (-control) + 1;
+            if (send - sptr < 1) {
+                return kErrEof;
+            }
+            if (dend - dptr < runsize) {
+                return kErrBadPixels;
+            }
+            vsize = (runsize + 15) & ~15;
+            if (dend - dptr >= vsize) {
+                v = _mm_set1_epi8(*sptr);
+                for (i = 0; i < vsize; i += 16) {
+                    _mm_storeu_si128((__m128i *)(dptr + i), v);
+                }
+            } else {
+                memset(dptr, *sptr, runsize);
+            }
+            sptr++;
+            dptr += runsize;
+        }
+    }
+    memset(dptr, 0, dend - dptr);
+    return 0;
+}
+
+__attribute__((target("sse2"))) static int unpack_16_sse2(
+    uint16_t *dptr, uint16_t *dend, const uint8_t *sptr, const uint8_t *send) {
+    int control, runsize, vsize, i;
+    uint16_t x;
+    __m128i v;
+    while (sptr < send) {
+        control = (int8_t)*sptr;
+        sptr++;
+        if (control > 0) {
+            runsize = control + 1;
+            if (send - sptr < runsize * 2) {
+                return kErrEof;
+            }
+            if (dend - dptr < runsize) {
+                return kErrBadPixels;
+            }
+            vsize = (runsize + 7) & ~7;
+            if (send - sptr >= vsize * 2 && dend - dptr >= vsize) {
+                for (i = 0; i < vsize; i += 8) {
+                    v = _mm_loadu_si128((const __m128i *)(sptr + i * 2));
+                    v = _mm_or_si128(_mm_slli_epi16(v, 8),
+                                     _mm_srli_epi16(v, 8));
+                    _mm_storeu_si128((__m128i *)(dptr + i), v);
+                }
+            } else {
+                for (i = 0; i < runsize; i++) {
+                    dptr[i] = read_u16(sptr + i * 2);
+                }
+            }
+            sptr += runsize * 2;
+            dptr += runsize;
+        } else if (control != -128) {
+            runsize = (-control) + 1;
+            if (send - sptr < 2) {
+                return kErrEof;
+            }
+            if (dend - dptr < runsize) {
+                return kErrBadPixels;
+            }
+            x = read_u16(sptr);
+            sptr += 2;
+            vsize = (runsize + 7) & ~7;
+            if (dend - dptr >= vsize) {
+                v = _mm_set1_epi16(x);
+                for (i = 0; i < vsize; i += 8) {
+                    _mm_storeu_si128((__m128i *)(dptr + i), v);
+                }
+            } else {
+                for (i = 0; i < runsize; i++) {
+                    dptr[i] = x;
+                }
+            }
+            dptr += runsize;
+        }
+    }
+    memset(dptr, 0, (dend - dptr) * sizeof(*dptr));
+    return 0;
+}
+
+__attribute__((target("avx2"))) static int unpack_8_avx2(uint8_t *dptr,
+                                                         uint8_t *dend,
+                                                         const uint8_t *sptr,
+                                                         const uint8_t *send) {
+    int control, runsize, vsize, i;
+    __m256i v;
+    while (sptr < send) {
+        control = (int8_t)*sptr;
+        sptr++;
+        if (control > 0) {
+            runsize = control + 1;
+            if (send - sptr < runsize) {
+                return kErrEof;
+            }
+            if (dend - dptr < runsize) {
+                return kErrBadPixels;
+            }
+            vsize = (runsize + 31) & ~31;
+            if (send - sptr >= vsize && dend - dptr >= vsize) {
+                for (i = 0; i < vsize; i += 32) {
+                    v = _mm256_loadu_si256((const __m256i *)(sptr + i));
+                    _mm256_storeu_si256((__m256i *)(dptr + i), v);
+                }
+            } else {
+                memcpy(dptr, sptr, runsize);
+            }
+            sptr += runsize;
+            dptr += runsize;
+        } else if (control != -128) {
+            runsize = (-control) + 1;
+            if (send - sptr < 1) {
+                return kErrEof;
+            }
+            if (dend - dptr < runsize) {
+                return kErrBadPixels;
+            }
+            vsize = (runsize + 31) & ~31;
+            if (dend - dptr >= vsize) {
+                v = _mm256_set1_epi8(*sptr);
+                for (i = 0; i < vsize; i += 32) {
+                    _mm256_storeu_si256((__m256i *)(dptr + i), v);
+                }
+            } else {
+                memset(dptr, *sptr, runsize);
+            }
+            sptr++;
+            dptr += runsize;
+        }
+    }
+    memset(dptr, 0, dend - dptr);
+    return 0;
+}
+
+__attribute__((target("avx2"))) static int unpack_16_avx2(
+    uint16_t *dptr, uint16_t *dend, const uint8_t *sptr, const uint8_t *send) {
+    int control, runsize, vsize, i;
+    uint16_t x;
+    __m256i v, swap;
+    swap = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15,
+                            14, 1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12,
+                            15, 14);
+    while (sptr < send) {
+        control = (int8_t)*sptr;
+        sptr++;
+        if (control > 0) {
+            runsize = control + 1;
+            if (send - sptr < runsize * 2) {
+                return kErrEof;
+            }
+            if (dend - dptr < runsize) {
+                return kErrBadPixels;
+            }
+            vsize = (runsize + 15) & ~15;
+            if (send - sptr >= vsize * 2 && dend - dptr >= vsize) {
+                for (i = 0; i < vsize; i += 16) {
+                    v = _mm256_loadu_si256((const __m256i *)(sptr + i * 2));
+                    v = _mm256_shuffle_epi8(v, swap);
+                    _mm256_storeu_si256((__m256i *)(dptr + i), v);
+                }
+            } else {
+                for (i = 0; i < runsize; i++) {
+                    dptr[i] = read_u16(sptr + i * 2);
+                }
+            }
+            sptr += runsize * 2;
+            dptr += runsize;
+        } else if (control != -128) {
+            runsize = (-control) + 1;
+            if (send - sptr < 2) {
+                return kErrEof;
+            }
+            if (dend - dptr < runsize) {
+                return kErrBadPixels;
+            }
+            x = read_u16(sptr);
+            sptr += 2;
+            vsize = (runsize + 15) & ~15;
+            if (dend - dptr >= vsize) {
+                v = _mm256_set1_epi16(x);
+                for (i = 0; i < vsize; i += 16) {
+                    _mm256_storeu_si256((__m256i *)(dptr + i), v);
+                }
+            } else {
+                for (i = 0; i < runsize; i++) {
+                    dptr[i] = x;
+                }
+            }
+            dptr += runsize;
+        }
+    }
+    memset(dptr, 0, (dend - dptr) * sizeof(*dptr));
+    return 0;
+}
+
+#endif
+
+int unrez_unpack_8(uint8_t *dptr, uint8_t *dend, const uint8_t *sptr,
+                   const uint8_t *send) {
+    switch (unrez_simd_get()) {
+#if SIMD_X86
+    case kUnrezSimdAVX2:
+        return unpack_8_avx2(dptr, dend, sptr, send);
+    case kUnrezSimdSSE2:
+        return unpack_8_sse2(dptr, dend, sptr, send);
+#endif
+    default:
+        return unpack_8_c(dptr, dend, sptr, send);
+    }
+}
+
+int unrez_unpack_16(uint16_t *dptr, uint16_t *dend, const uint8_t *sptr,
+                    const uint8_t *send) {
+    switch (unrez_simd_get()) {
+#if SIMD_X86
+    case kUnrezSimdAVX2:
+        return unpack_16_avx2(dptr, dend, sptr, send);
+    case kUnrezSimdSSE2:
+        return unpack_16_sse2(dptr, dend, sptr, send);
+#endif
+    default:
+        return unpack_16_c(dptr, dend, sptr, send);
+    }
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include <stdint.h>
+
+/*
+ * Error return codes for the unpacking functions, unpack_XXX(), and bitmap
+ * decoding functions, read_XXX(). These are not used by the opcode handlers,
+ * data_XXX(), because those functions can signal errors through the callbacks.
+ */
+enum {
+    /* Unexpected end of file. */
+    kErrEof = -1,
+    /* Bad pixel data. */
+    kErrBadPixels = -2
+};
+
+/*
+ * Decode 8-bit run-length encoded data. This uses the PackBits compression
+ * scheme. The output is filled with zeroes if the input is too short. Returns 0
+ * on success, or a negative error code.
+ */
+int unrez_unpack_8(uint8_t *dptr, uint8_t *dend, const uint8_t *sptr,
+                   const uint8_t *send);
+
+/*
+ * Decode 16-bit run-length encoded data. This is similar to the PackBits
+ * compression scheme for 8-bit data, but operates on 16-bit units instead of
+ * 8-bit units. The control bytes are still 8-bit, however. This function will
+ * also convert data to native byte order.
+ */
+int unrez_unpack_16(uint16_t *dptr, uint16_t *dend, const uint8_t *sptr,
+                    const uint8_t *send);
@@ -7,6 +7,8 @@
 #include "unrez.h"
 
 #include "binary.h"
+#include "packbits.h"
+#include "unshuffle.h"
 
 #include <errno.h>
 #include <stdio.h>
@@ -105,10 +107,12 @@ static void read_rect(struct unrez_rect *r, const uint8_t *p) {
     r->right = read_i16(p + 6);
 }
 
-static ptrdiff_t data_version(const struct unrez_pict_callbacks *cb,
+static ptrdiff_t data_version(struct unrez_pict_decoder *dec,
+                              const struct unrez_pict_callbacks *cb,
                               int version, int opcode, const uint8_t *start,
                               const uint8_t *end) {
     int r;
+    (void)dec;
     if (start == end) {
         return pict_eof(cb, opcode);
     }
@@ -123,9 +127,11 @@ static ptrdiff_t data_version(const struct unrez_pict_callbacks *cb,
     return 1;
 }
 
-static ptrdiff_t data_end(const struct unrez_pict_callbacks *cb, int version,
+static ptrdiff_t data_end(struct unrez_pict_decoder *dec,
+                          const struct unrez_pict_callbacks *cb, int version,
                           int opcode, const uint8_t *start,
                           const uint8_t *end) {
+    (void)dec;
     (void)cb;
     (void)version;
     (void)opcode;
@@ -134,11 +140,13 @@ static ptrdiff_t data_end(const struct unrez_pict_callbacks *cb, int version,
     return -1;
 }
 
-static ptrdiff_t data_data16(const struct unrez_pict_callbacks *cb, int version,
+static ptrdiff_t data_data16(struct unrez_pict_decoder *dec,
+                             const struct unrez_pict_callbacks *cb, int version,
                              int opcode, const uint8_t *start,
                              const uint8_t *end) {
     const uint8_t *ptr = start;
     int size, r;
+    (void)dec;
     (void)version;
     if (end - ptr < 2) {
         return pict_eof(cb, opcode);
@@ -160,11 +168,13 @@ static ptrdiff_t data_data16(const struct unrez_pict_callbacks *cb, int version,
     return ptr - start;
 }
 
-static ptrdiff_t data_data32(const struct unrez_pict_callbacks *cb, int version,
+static ptrdiff_t data_data32(struct unrez_pict_decoder *dec,
+                             const struct unrez_pict_callbacks *cb, int version,
                              int opcode, const uint8_t *start,
                              const uint8_t *end) {
     const uint8_t *ptr = start;
     int size, r;
+    (void)dec;
     (void)version;
     if (end - ptr < 4) {
         return pict_eof(cb, opcode);
@@ -186,11 +196,13 @@ static ptrdiff_t data_data32(const struct unrez_pict_callbacks *cb, int version,
     return ptr - start;
 }
 
-static ptrdiff_t data_longcomment(const struct unrez_pict_callbacks *cb,
+static ptrdiff_t data_longcomment(struct unrez_pict_decoder *dec,
+                                  const struct unrez_pict_callbacks *cb,
                                   int version, int opcode, const uint8_t *start,
                                   const uint8_t *end) {
     const uint8_t *ptr = start;
     int size, r;
+    (void)dec;
     (void)version;
     if (end - ptr < 4) {
         return pict_eof(cb, opcode);
@@ -212,10 +224,12 @@ static ptrdiff_t data_longcomment(const struct unrez_pict_callbacks *cb,
     return ptr - start;
 }
 
-static ptrdiff_t data_region(const struct unrez_pict_callbacks *cb, int version,
+static ptrdiff_t data_region(struct unrez_pict_decoder *dec,
+                             const struct unrez_pict_callbacks *cb, int version,
                              int opcode, const uint8_t *start,
                              const uint8_t *end) {
     int size, r;
+    (void)dec;
     (void)version;
     if (end - start < 2) {
         return pict_eof(cb, opcode);
@@ -239,9 +253,11 @@ static ptrdiff_t data_region(const struct unrez_pict_callbacks *cb, int version,
     return size;
 }
 
-static ptrdiff_t data_pattern(const struct unrez_pict_callbacks *cb,
+static ptrdiff_t data_pattern(struct unrez_pict_decoder *dec,
+                              const struct unrez_pict_callbacks *cb,
                               int version, int opcode, const uint8_t *start,
                               const uint8_t *end) {
+    (void)dec;
     (void)version;
     (void)start;
     (void)end;
@@ -249,9 +265,11 @@ static ptrdiff_t data_pattern(const struct unrez_pict_callbacks *cb,
     return -1;
 }
 
-static ptrdiff_t data_text(const struct unrez_pict_callbacks *cb, int version,
+static ptrdiff_t data_text(struct unrez_pict_decoder *dec,
+                           const struct unrez_pict_callbacks *cb, int version,
                            int opcode, const uint8_t *start,
                            const uint8_t *end) {
+    (void)dec;
     (void)version;
     (void)start;
     (void)end;
@@ -259,9 +277,11 @@ static ptrdiff_t data_text(const struct unrez_pict_callbacks *cb, int version,
     return -1;
 }
 
-static ptrdiff_t data_not_determined(const struct unrez_pict_callbacks *cb,
+static ptrdiff_t data_not_determined(struct unrez_pict_decoder *dec,
+                                     const struct unrez_pict_callbacks *cb,
                                      int version, int opcode,
                                      const uint8_t *start, const uint8_t *end) {
+    (void)dec;
     (void)version;
     (void)start;
     (void)end;
@@ -270,9 +290,11 @@ static ptrdiff_t data_not_determined(const struct unrez_pict_callbacks *cb,
     return -1;
 }
 
-static ptrdiff_t data_polygon(const struct unrez_pict_callbacks *cb,
+static ptrdiff_t data_polygon(struct unrez_pict_decoder *dec,
+                              const struct unrez_pict_callbacks *cb,
                               int version, int opcode, const uint8_t *start,
                               const uint8_t *end) {
+    (void)dec;
     (void)version;
     (void)start;
     (void)end;
@@ -330,289 +352,208 @@ static void read_pixmap(struct unrez_pixdata *m, const uint8_t *p) {
     m->cmpSize = read_i16(p + 32);
 }
 
-/*
- * Error return codes for the unpacking functions, unpack_XXX(), and bitmap
- * decoding functions, read_XXX(). These are not used by the opcode handlers,
- * data_XXX(), because those functions can signal errors through the callbacks.
- */
-enum {
-    /* Unexpected end of file. */
-    kErrEof = -1,
-    /* Bad pixel data. */
-    kErrBadPixels = -2,
-    /* See errno. */
-    kErrErrno = -3
+/* Information for reading rows of pixel data. */
+struct rowinfo {
+    /* Size of a decoded row, and the number of pixels in it. */
+    int rowbytes;
+    int rowpix;
+    int cmpcount;
+    /* Buffer for one row of packed 32-bit data, before it is unshuffled. */
+    uint8_t *tmp;
 };
 
 /*
- * Decode 8-bit run-length encoded data. This uses the PackBits compression
- * scheme.
- *
- * See "TN1023: Understanding PackBits" (no longer accessible)
- * http://developer.apple.com/technotes/tn/tn1023.html
+ * A row reader decodes one row of pixel data from the picture into dest, and
+ * returns the number of bytes read, or a negative error code.
  */
-static int unpack_8(uint8_t *dptr, uint8_t *dend, const uint8_t *sptr,
-                    const uint8_t *send) {
-    int control, runsize;
-    while (sptr < send) {
-        control = (int8_t)*sptr;
-        sptr++;
-        if (control > 0) {
-            /* Literal data follows. */
-            runsize = control + 1;
-            if (send - sptr < runsize) {
-                return kErrEof;
-            }
-            if (dend - dptr < runsize) {
-                return kErrBadPixels;
-            }
-            memcpy(dptr, sptr, runsize);
-            sptr += runsize;
-            dptr += runsize;
-        } else if (control != -128) {
-            /* Repeated data follows. */
-            runsize = (-control) + 1;
-            if (send - sptr < 1) {
-                return kErrEof;
-            }
-            if (dend - dptr < runsize) {
-                return kErrBadPixels;
-            }
-            memset(dptr, *sptr, runsize);
-            sptr++;
-            dptr += runsize;
-        }
-        /* Control 0x80 is ignored, see tech note. */
-    }
-    memset(dptr, 0, dend - dptr);
-    return 0;
-}
+typedef ptrdiff_t (*row_reader_t)(const struct rowinfo *ri, void *dest,
+                                  const uint8_t *start, const uint8_t *end);
 
 /*
- * Decode 16-bit run-length encoded data. This is similar to the PackBits
- * compression scheme for 8-bit data, but operates on 16-bit units instead of
- * 8-bit units. The control bytes are still 8-bit, however. This function will
- * also convert data to native byte order.
- *
- * See "TN1023: Understanding PackBits" (no longer accessible)
- * http://developer.apple.com/technotes/tn/tn1023.html
+ * Read the size of a packed row. Returns the size, or a negative error code.
+ * The size is one byte if the unpacked rows are at most 250 bytes long, or two
+ * bytes otherwise.
  */
-static int unpack_16(uint16_t *dptr, uint16_t *dend, const uint8_t *sptr,
-                     const uint8_t *send) {
-    int control, runsize, i;
-    uint16_t v;
-    while (sptr < send) {
-        control = (int8_t)*sptr;
-        sptr++;
-        if (control > 0) {
-            /* Literal data follows. */
-            runsize = control + 1;
-            if (send - sptr < runsize * 2) {
-                return kErrEof;
-            }
-            if (dend - dptr < runsize) {
-                return kErrBadPixels;
-            }
-            for (i = 0; i < runsize; i++) {
-                dptr[i] = read_u16(sptr + i * 2);
-            }
-            sptr += runsize * 2;
-            dptr += runsize;
-        } else if (control != -128) {
-            /* Repeated data follows. */
-            runsize = (-control) + 1;
-            if (send - sptr < 2) {
-                return kErrEof;
-            }
-            if (dend - dptr < runsize) {
-                return kErrBadPixels;
-            }
-            v = read_u16(sptr);
-            sptr += 2;
-            for (i = 0; i < runsize; i++) {
-                dptr[i] = v;
-            }
-            dptr += runsize;
+static int read_rowsize(int rowbytes, const uint8_t **ptr,
+                        const uint8_t *end) {
+    const uint8_t *p = *ptr;
+    int rowsize;
+    if (rowbytes <= 250) {
+        if (end - p < 1) {
+            return kErrEof;
         }
-        /* Control 0x80 is ignored, see tech note. */
+        rowsize = *p;
+        p++;
+    } else {
+        if (end - p < 2) {
+            return kErrEof;
+        }
+        rowsize = read_u16(p);
+        p += 2;
+    }
+    if (end - p < rowsize) {
+        return kErrEof;
     }
-    memset(dptr, 0, (dend - dptr) * sizeof(*dptr));
-    return 0;
+    *ptr = p;
+    return rowsize;
 }
 
-/* Read an 8-bit packed image (pack type 0). */
-static ptrdiff_t read_packed_8(int rowcount, int rowbytes, uint8_t *dest,
+/* Read a row of an 8-bit packed image (pack type 0). */
+static ptrdiff_t read_packed_8(const struct rowinfo *ri, void *dest,
                                const uint8_t *start, const uint8_t *end) {
     const uint8_t *ptr = start;
-    int rowsize, i, r;
-    for (i = 0; i < rowcount; i++) {
-        if (rowbytes <= 250) {
-            if (end - ptr < 1) {
-                return kErrEof;
-            }
-            rowsize = *ptr;
-            ptr++;
-        } else {
-            if (end - ptr < 2) {
-                return kErrEof;
-            }
-            rowsize = read_u16(ptr);
-            ptr += 2;
-        }
-        if (end - ptr < rowsize) {
-            return kErrEof;
-        }
-        r = unpack_8(dest + i * rowbytes, dest + (i + 1) * rowbytes, ptr,
-                     ptr + rowsize);
-        if (r != 0) {
-            return r;
-        }
-        ptr += rowsize;
+    int rowsize, r;
+    rowsize = read_rowsize(ri->rowbytes, &ptr, end);
+    if (rowsize < 0) {
+        return rowsize;
     }
-    return ptr - start;
+    r = unrez_unpack_8(dest, (uint8_t *)dest + ri->rowbytes, ptr,
+                       ptr + rowsize);
+    if (r != 0) {
+        return r;
+    }
+    return ptr + rowsize - start;
 }
 
-/* Read an 8-bit unpacked image (pack type 1). */
-static ptrdiff_t read_unpacked_8(int rowcount, int rowbytes, uint8_t *dest,
+/*
+ * Read a row of an unpacked image with 8 or fewer bits per pixel (pack type 1).
+ */
+static ptrdiff_t read_unpacked_8(const struct rowinfo *ri, void *dest,
                                  const uint8_t *start, const uint8_t *end) {
-    int size = rowbytes * rowcount;
-    if (end - start < size) {
+    if (end - start < ri->rowbytes) {
         return kErrEof;
     }
-    memcpy(dest, start, size);
-    return size;
+    memcpy(dest, start, ri->rowbytes);
+    return ri->rowbytes;
 }
 
-/* Read a 16-bit packed image (pack type 3). */
-static ptrdiff_t read_packed_16(int rowcount, int rowbytes, uint16_t *dest,
+/* Read a row of a 16-bit packed image (pack type 3). */
+static ptrdiff_t read_packed_16(const struct rowinfo *ri, void *dest,
                                 const uint8_t *start, const uint8_t *end) {
     const uint8_t *ptr = start;
-    int rowpix, rowsize, i, r;
-    rowpix = rowbytes >> 1;
-    for (i = 0; i < rowcount; i++) {
-        if (rowbytes <= 250) {
-            if (end - ptr < 1) {
-                return kErrEof;
-            }
-            rowsize = *ptr;
-            ptr++;
-        } else {
-            if (end - ptr < 2) {
-                return kErrEof;
-            }
-            rowsize = read_u16(ptr);
-            ptr += 2;
-        }
-        if (end - ptr < rowsize) {
-            return kErrEof;
-        }
-        r = unpack_16(dest + i * rowpix, dest + (i + 1) * rowpix, ptr,
-                      ptr + rowsize);
-        if (r != 0) {
-            return r;
-        }
-        ptr += rowsize;
+    int rowsize, r;
+    rowsize = read_rowsize(ri->rowbytes, &ptr, end);
+    if (rowsize < 0) {
+        return rowsize;
     }
-    return ptr - start;
+    r = unrez_unpack_16(dest, (uint16_t *)dest + ri->rowpix, ptr,
+                        ptr + rowsize);
+    if (r != 0) {
+        return r;
+    }
+    return ptr + rowsize - start;
 }
 
-/* Read a 16-bit unpacked image (pack type 1). */
-static ptrdiff_t read_unpacked_16(int rowcount, int rowbytes, uint16_t *dest,
+/* Read a row of a 16-bit unpacked image (pack type 1). */
+static ptrdiff_t read_unpacked_16(const struct rowinfo *ri, void *dest,
                                   const uint8_t *start, const uint8_t *end) {
-    int pixcount, size, i;
-    size = rowbytes * rowcount;
-    pixcount = size >> 1;
-    if (end - start < size) {
+    uint16_t *dptr = dest;
+    int i;
+    if (end - start < ri->rowbytes) {
         return kErrEof;
     }
-    for (i = 0; i < pixcount; i++) {
-        dest[i] = read_u16(start + i * 2);
+    for (i = 0; i < ri->rowpix; i++) {
+        dptr[i] = read_u16(start + i * 2);
     }
-    return size;
+    return ri->rowbytes;
 }
 
 /*
- * Unshuffle shuffled 32-bit pixels. The pixels are stored by row, component,
- * then column. A row of pixels will be stored with all the red components, then
- * the green, then blue. This makes the compression more efficient.
+ * Read a row of a 32-bit unpacked image (pack type 1), with 3 or 4
+ * components. The components are stored in separate planes for each row, see
+ * unshuffle.c.
  */
-static void unshuffle_32(uint8_t *dest, const uint8_t *src, int n) {
-    int cmp, x;
-    for (cmp = 0; cmp < 3; ++cmp) {
-        for (x = 0; x < n; x++) {
-            dest[x * 4 + cmp] = src[cmp * n + x];
-        }
-    }
-    for (x = 0; x < n; x++) {
-        dest[x * 4 + 3] = 0;
-    }
-}
-
-/* Read a 32-bit unpacked image (pack type 1). */
-static ptrdiff_t read_unpacked_32(int rowcount, int rowbytes, uint8_t *dest,
+static ptrdiff_t read_unpacked_32(const struct rowinfo *ri, void *dest,
                                   const uint8_t *start, const uint8_t *end) {
-    int i, rowpix, srcrowbytes;
-    rowpix = rowbytes >> 2;
-    srcrowbytes = rowpix * 3;
-    if (end - start < srcrowbytes * rowcount) {
+    int srcrowbytes = ri->rowpix * ri->cmpcount;
+    if (end - start < srcrowbytes) {
         return kErrEof;
     }
-    for (i = 0; i < rowcount; i++) {
-        unshuffle_32(dest + i * rowbytes, start + i * srcrowbytes, rowpix);
-    }
-    return srcrowbytes * rowcount;
+    unrez_unshuffle_32(dest, start, ri->rowpix, ri->cmpcount);
+    return srcrowbytes;
 }
 
-/* Read a 32-bit packed image (pack type 4). */
-static ptrdiff_t read_packed_32(int rowcount, int rowbytes, uint8_t *dest,
+/*
+ * Read a row of a 32-bit packed image (pack type 4), with 3 or 4 components.
+ */
+static ptrdiff_t read_packed_32(const struct rowinfo *ri, void *dest,
                                 const uint8_t *start, const uint8_t *end) {
     const uint8_t *ptr = start;
-    uint8_t *tmp;
-    int rowpix, srcrowbytes, rowsize, i, r;
-    rowpix = rowbytes >> 2;
-    srcrowbytes = rowpix * 3;
-    tmp = malloc(srcrowbytes);
-    if (tmp == NULL) {
-        return kErrErrno;
+    int rowsize, r;
+    rowsize = read_rowsize(ri->rowbytes, &ptr, end);
+    if (rowsize < 0) {
+        return rowsize;
     }
-    for (i = 0; i < rowcount; i++) {
-        if (rowbytes <= 250) {
-            if (end - ptr < 1) {
-                r = kErrEof;
-                goto done;
-            }
-            rowsize = *ptr;
-            ptr++;
-        } else {
-            if (end - ptr < 2) {
-                r = kErrEof;
-                goto done;
-            }
-            rowsize = read_u16(ptr);
-            ptr += 2;
-        }
-        r = unpack_8(tmp, tmp + srcrowbytes, ptr, ptr + rowsize);
-        if (r != 0) {
-            goto done;
-        }
-        unshuffle_32(dest + i * rowbytes, tmp, rowpix);
-        ptr += rowsize;
+    r = unrez_unpack_8(ri->tmp, ri->tmp + ri->rowpix * ri->cmpcount, ptr,
+                       ptr + rowsize);
+    if (r != 0) {
+        return r;
     }
-    r = 0;
-    goto done;
+    unrez_unshuffle_32(dest, ri->tmp, ri->rowpix, ri->cmpcount);
+    return ptr + rowsize - start;
+}
 
-done:
-    free(tmp);
-    return r == 0 ? ptr - start : r;
+/* Buffers kept by a decoder. There are kUnrezPictBufferCount buffers. */
+enum {
+    kBufPixels,
+    kBufColors,
+    kBufTemp,
+    kBufRow,
+    kBufOutput
+};
+
+/*
+ * Get a decoder buffer with at least the given size. Returns NULL and sets
+ * errno on failure.
+ */
+static void *pict_getbuf(struct unrez_pict_decoder *dec, int which,
+                         size_t size) {
+    void *ptr;
+    if (dec->buf[which] != NULL && dec->bufsize[which] >= size) {
+        return dec->buf[which];
+    }
+    free(dec->buf[which]);
+    dec->buf[which] = NULL;
+    dec->bufsize[which] = 0;
+    ptr = malloc(size);
+    if (ptr == NULL) {
+        return NULL;
+    }
+    dec->buf[which] = ptr;
+    dec->bufsize[which] = size;
+    dec->alloc_count++;
+    dec->alloc_size += size;
+    return ptr;
+}
+
+/*
+ * Free memory in pixel data after the pixels callback, if it does not belong to
+ * the decoder. If the callback took or replaced the decoder's buffer, the
+ * decoder forgets about it.
+ */
+static void pict_release(struct unrez_pict_decoder *dec, int which,
+                         void *given, void *ptr) {
+    if (ptr == given) {
+        return;
+    }
+    if (given != NULL) {
+        dec->buf[which] = NULL;
+        dec->bufsize[which] = 0;
+    }
+    free(ptr);
 }
 
-static ptrdiff_t data_pixel_data(const struct unrez_pict_callbacks *cb,
+static ptrdiff_t data_pixel_data(struct unrez_pict_decoder *dec,
+                                 const struct unrez_pict_callbacks *cb,
                                  int version, int opcode, const uint8_t *start,
                                  const uint8_t *end) {
     char buf[128];
     const uint8_t *ptr = start;
-    struct unrez_pixdata pix = {0};
+    struct unrez_pixdata pix = {0}, info;
     struct unrez_color *colors = NULL;
+    struct rowinfo ri = {0};
+    row_reader_t readrow;
+    uint8_t *row, *pixels = NULL, *rowbuf = NULL, *outbuf = NULL;
     int success = 0;
     int has_ctable, has_region;
     int i, n, r, rowcount, rowbytes, align, packtype;
@@ -714,7 +655,7 @@ static ptrdiff_t data_pixel_data(const struct unrez_pict_callbacks *cb,
         if (end - ptr < 8 * n) {
             goto eof;
         }
-        colors = malloc(sizeof(*pix.ctTable) * n);
+        colors = pict_getbuf(dec, kBufColors, sizeof(*pix.ctTable) * n);
         if (colors == NULL) {
             cb->error(cb->ctx, errno, opcode, NULL);
             goto done;
@@ -759,30 +700,36 @@ static ptrdiff_t data_pixel_data(const struct unrez_pict_callbacks *cb,
         cb->error(cb->ctx, kUnrezErrInvalid, opcode, "invalid bounds");
         goto done;
     }
-    /* Can't overflow 32-bit signed int. */
-    pix.data = malloc(rowbytes * rowcount);
-    if (pix.data == NULL) {
-        cb->error(cb->ctx, errno, opcode, NULL);
+    if (pix.pixelSize == 32 && pix.cmpCount != 3 && pix.cmpCount != 4) {
+        snprintf(buf, sizeof(buf), "unsupported cmpCount value: %d",
+                 pix.cmpCount);
+        cb->error(cb->ctx, kUnrezErrUnsupported, opcode, buf);
         goto done;
     }
+    ri.rowbytes = rowbytes;
+    ri.rowpix = pix.pixelSize == 32   ? rowbytes >> 2
+                : pix.pixelSize == 16 ? rowbytes >> 1
+                                      : rowbytes;
+    ri.cmpcount = pix.cmpCount;
 
     switch (pix.rowBytes < 8 ? 1 : pix.packType) {
     case 0:
         if (pix.pixelSize > 8) {
             goto bad_packtype;
         }
-        pr = read_packed_8(rowcount, rowbytes, pix.data, ptr, end);
+        readrow = read_packed_8;
         break;
     case 1:
         switch (pix.pixelSize) {
+        case 1:
         case 8:
-            pr = read_unpacked_8(rowcount, rowbytes, pix.data, ptr, end);
+            readrow = read_unpacked_8;
             break;
         case 16:
-            pr = read_unpacked_16(rowcount, rowbytes, pix.data, ptr, end);
+            readrow = read_unpacked_16;
             break;
         case 32:
-            pr = read_unpacked_32(rowcount, rowbytes, pix.data, ptr, end);
+            readrow = read_unpacked_32;
             break;
         default:
             goto bad_packtype;
@@ -792,13 +739,18 @@ static ptrdiff_t data_pixel_data(const struct unrez_pict_callbacks *cb,
         if (pix.pixelSize != 16) {
             goto bad_packtype;
         }
-        pr = read_packed_16(rowcount, rowbytes, pix.data, ptr, end);
+        readrow = read_packed_16;
         break;
     case 4:
         if (pix.pixelSize != 32) {
             goto bad_packtype;
         }
-        pr = read_packed_32(rowcount, rowbytes, pix.data, ptr, end);
+        readrow = read_packed_32;
+        ri.tmp = pict_getbuf(dec, kBufTemp, ri.rowpix * ri.cmpcount);
+        if (ri.tmp == NULL) {
+            cb->error(cb->ctx, errno, opcode, NULL);
+            goto done;
+        }
         break;
     default:
         snprintf(buf, sizeof(buf), "unsupported packType value: %d",
@@ -806,34 +758,87 @@ static ptrdiff_t data_pixel_data(const struct unrez_pict_callbacks *cb,
         cb->error(cb->ctx, kUnrezErrUnsupported, opcode, buf);
         goto done;
     }
-    if (pr < 0) {
-        switch (pr) {
-        default:
-        case kErrEof:
-            goto eof;
-        case kErrBadPixels:
-            cb->error(cb->ctx, kUnrezErrInvalid, opcode, "invalid pixel data");
+
+    if (cb->row != NULL) {
+        /* Decode one row at a time into a buffer, and pass each row on. */
+        rowbuf = pict_getbuf(dec, kBufRow, rowbytes);
+        if (rowbuf == NULL) {
+            cb->error(cb->ctx, errno, opcode, NULL);
             goto done;
-        case kErrErrno:
+        }
+        info = pix;
+        if (cb->row_format == kUnrezRowExpand16 && pix.pixelSize == 16) {
+            outbuf = pict_getbuf(dec, kBufOutput, ri.rowpix * 4);
+            if (outbuf == NULL) {
+                cb->error(cb->ctx, errno, opcode, NULL);
+                goto done;
+            }
+            info.rowBytes = ri.rowpix * 4;
+            info.pixelSize = 32;
+            info.cmpSize = 8;
+        }
+        r = cb->begin_rows(cb->ctx, opcode, &info);
+        if (r != 0) {
+            goto done;
+        }
+    } else {
+        /* Can't overflow 32-bit signed int. */
+        pixels = pict_getbuf(dec, kBufPixels, rowbytes * rowcount);
+        if (pixels == NULL) {
             cb->error(cb->ctx, errno, opcode, NULL);
             goto done;
         }
+        pix.data = pixels;
+    }
+
+    for (i = 0; i < rowcount; i++) {
+        row = rowbuf != NULL ? rowbuf : (uint8_t *)pix.data + i * rowbytes;
+        pr = readrow(&ri, row, ptr, end);
+        if (pr < 0) {
+            goto bad_pixels;
+        }
+        ptr += pr;
+        if (rowbuf != NULL) {
+            if (outbuf != NULL) {
+                unrez_convert_16to32(outbuf, (const uint16_t *)rowbuf,
+                                     ri.rowpix);
+                row = outbuf;
+            }
+            r = cb->row(cb->ctx, i, row);
+            if (r != 0) {
+                goto done;
+            }
+        }
+    }
+    if (rowbuf != NULL) {
+        r = cb->end_rows(cb->ctx, opcode);
+    } else {
+        r = cb->pixels(cb->ctx, opcode, &pix);
     }
-    ptr += pr;
-    r = cb->pixels(cb->ctx, opcode, &pix);
     if (r == 0) {
         success = 1;
     }
     goto done;
 
 done:
-    unrez_pixdata_destroy(&pix);
+    pict_release(dec, kBufPixels, pixels, pix.data);
+    pict_release(dec, kBufColors, colors, pix.ctTable);
     return success ? ptr - start : -1;
 
 eof:
     pict_eof(cb, opcode);
     goto done;
 
+bad_pixels:
+    switch (pr) {
+    default:
+    case kErrEof:
+        goto eof;
+    case kErrBadPixels:
+        cb->error(cb->ctx, kUnrezErrInvalid, opcode, "invalid pixel data");
+        goto done;
+    }
+
 bad_rowbytes:
     snprintf(buf, sizeof(buf),
              "bad number of bytes per row: pixelSize=%d, rowBytes=%d",
@@ -849,7 +854,8 @@ bad_packtype:
     goto done;
 }
 
-typedef ptrdiff_t (*data_handler_t)(const struct unrez_pict_callbacks *cb,
+typedef ptrdiff_t (*data_handler_t)(struct unrez_pict_decoder *dec,
+                                    const struct unrez_pict_callbacks *cb,
                                     int version, int opcode,
                                     const uint8_t *start, const uint8_t *end);
 
@@ -861,6 +867,24 @@ static const data_handler_t kDataHandlers[] = {
 
 void unrez_pict_decode(const struct unrez_pict_callbacks *cb, const void *data,
                        size_t size) {
+    struct unrez_pict_decoder dec;
+    memset(&dec, 0, sizeof(dec));
+    unrez_pict_decoder_decode(&dec, cb, data, size);
+    unrez_pict_decoder_destroy(&dec);
+}
+
+void unrez_pict_decoder_destroy(struct unrez_pict_decoder *dec) {
+    int i;
+    for (i = 0; i < kUnrezPictBufferCount; i++) {
+        free(dec->buf[i]);
+        dec->buf[i] = NULL;
+        dec->bufsize[i] = 0;
+    }
+}
+
+void unrez_pict_decoder_decode(struct unrez_pict_decoder *dec,
+                               const struct unrez_pict_callbacks *cb,
+                               const void *data, size_t size) {
     const uint8_t *ptr = data, *end = ptr + size;
     int version, r, opcode, opdata;
     struct unrez_rect frame;
@@ -949,7 +973,7 @@ void unrez_pict_decode(const struct unrez_pict_callbacks *cb, const void *data,
             hr = opdata;
         } else {
             handler = kDataHandlers[-1 - opdata];
-            hr = handler(cb, version, opcode, ptr, end);
+            hr = handler(dec, cb, version, opcode, ptr, end);
             if (hr < 0) {
                 return;
             }
@@ -6,19 +6,148 @@
  */
 #include "unrez.h"
 
+#include "simd.h"
+
 #include <errno.h>
 #include <stdlib.h>
 
+#if SIMD_X86
+#include <immintrin.h>
+#endif
+#if SIMD_NEON
+#include <arm_neon.h>
+#endif
+
 void unrez_pixdata_destroy(struct unrez_pixdata *pix) {
     free(pix->data);
     free(pix->ctTable);
 }
 
+/*
+ * The SIMD versions expand a block of pixels at a time, with each component in
+ * a 16-bit lane, and finish the row with the portable code.
+ */
+
+static void convert_16to32_c(uint8_t *dest, const uint16_t *src, int n) {
+    int i;
+    unsigned v;
+    for (i = 0; i < n; i++) {
+        v = src[i];
+        dest[i * 4 + 0] = ((v >> 7) & 0xf8) | ((v >> 12) & 7);
+        dest[i * 4 + 1] = ((v >> 2) & 0xf8) | ((v >> 7) & 7);
+        dest[i * 4 + 2] = ((v << 3) & 0xf8) | ((v >> 2) & 7);
+        dest[i * 4 + 3] = 0;
+    }
+}
+
+#if SIMD_X86
+
+__attribute__((target("sse2"))) static int convert_16to32_sse2(
+    uint8_t *dest, const uint16_t *src, int n) {
+    __m128i v, r, g, b, rg, m8, m3;
+    int i;
+    m8 = _mm_set1_epi16(0xf8);
+    m3 = _mm_set1_epi16(7);
+    for (i = 0; i + 8 <= n; i += 8) {
+        v = _mm_loadu_si128((const __m128i *)(src + i));
+        r = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 7), m8),
+                         _mm_and_si128(_mm_srli_epi16(v, 12), m3));
+        g = _mm_or_si128(_mm_and_si128(_mm_srli_epi16(v, 2), m8),
+                         _mm_and_si128(_mm_srli_epi16(v, 7), m3));
+        b = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(v, 3), m8),
+                         _mm_and_si128(_mm_srli_epi16(v, 2), m3));
+        rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+        _mm_storeu_si128((__m128i *)(dest + i * 4),
+                         _mm_unpacklo_epi16(rg, b));
+        _mm_storeu_si128((__m128i *)(dest + i * 4 + 16),
+                         _mm_unpackhi_epi16(rg, b));
+    }
+    return i;
+}
+
+/*
+ * The AVX2 unpack instructions work within each 128-bit lane, so the first
+ * lane gets pixels 0-3 and 4-7, and the second lane gets pixels 8-11 and
+ * 12-15. The lanes are swapped before storing.
+ */
+__attribute__((target("avx2"))) static int convert_16to32_avx2(
+    uint8_t *dest, const uint16_t *src, int n) {
+    __m256i v, r, g, b, rg, lo, hi, m8, m3;
+    int i;
+    m8 = _mm256_set1_epi16(0xf8);
+    m3 = _mm256_set1_epi16(7);
+    for (i = 0; i + 16 <= n; i += 16) {
+        v = _mm256_loadu_si256((const __m256i *)(src + i));
+        r = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(v, 7), m8),
+                            _mm256_and_si256(_mm256_srli_epi16(v, 12), m3));
+        g = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi16(v, 2), m8),
+                            _mm256_and_si256(_mm256_srli_epi16(v, 7), m3));
+        b = _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi16(v, 3), m8),
+                            _mm256_and_si256(_mm256_srli_epi16(v, 2), m3));
+        rg = _mm256_or_si256(r, _mm256_slli_epi16(g, 8));
+        lo = _mm256_unpacklo_epi16(rg, b);
+        hi = _mm256_unpackhi_epi16(rg, b);
+        _mm256_storeu_si256((__m256i *)(dest + i * 4),
+                            _mm256_permute2x128_si256(lo, hi, 0x20));
+        _mm256_storeu_si256((__m256i *)(dest + i * 4 + 32),
+                            _mm256_permute2x128_si256(lo, hi, 0x31));
+    }
+    return i;
+}
+
+#endif
+
+#if SIMD_NEON
+
+static int convert_16to32_neon(uint8_t *dest, const uint16_t *src, int n) {
+    uint16x8_t v, m8, m3;
+    uint8x8x4_t p;
+    int i;
+    m8 = vdupq_n_u16(0xf8);
+    m3 = vdupq_n_u16(7);
+    p.val[3] = vdup_n_u8(0);
+    for (i = 0; i + 8 <= n; i += 8) {
+        v = vld1q_u16(src + i);
+        p.val[0] = vmovn_u16(vorrq_u16(vandq_u16(vshrq_n_u16(v, 7), m8),
+                                       vandq_u16(vshrq_n_u16(v, 12), m3)));
+        p.val[1] = vmovn_u16(vorrq_u16(vandq_u16(vshrq_n_u16(v, 2), m8),
+                                       vandq_u16(vshrq_n_u16(v, 7), m3)));
+        p.val[2] = vmovn_u16(vorrq_u16(vandq_u16(vshlq_n_u16(v, 3), m8),
+                                       vandq_u16(vshrq_n_u16(v, 2), m3)));
+        vst4_u8(dest + i * 4, p);
+    }
+    return i;
+}
+
+#endif
+
+void unrez_convert_16to32(uint8_t *dest, const uint16_t *src, int n) {
+    int i;
+    switch (unrez_simd_get()) {
+#if SIMD_X86
+    case kUnrezSimdAVX2:
+        i = convert_16to32_avx2(dest, src, n);
+        break;
+    case kUnrezSimdSSE2:
+        i = convert_16to32_sse2(dest, src, n);
+        break;
+#endif
+#if SIMD_NEON
+    case kUnrezSimdNEON:
+        i = convert_16to32_neon(dest, src, n);
+        break;
+#endif
+    default:
+        i = 0;
+        break;
+    }
+    convert_16to32_c(dest + i * 4, src + i, n - i);
+}
+
 int unrez_pixdata_16to32(struct unrez_pixdata *pix) {
     uint16_t *src;
     uint8_t *dest;
-    int i, width, height, pixcount;
-    unsigned v;
+    int width, height, pixcount;
     width = pix->rowBytes >> 1;
     height = pix->bounds.bottom - pix->bounds.top;
     if (pix->pixelSize != 16 || (pix->rowBytes & 1) != 0 || width <= 0 ||
@@ -31,13 +160,7 @@ int unrez_pixdata_16to32(struct unrez_pixdata *pix) {
     if (dest == NULL) {
         return errno;
     }
-    for (i = 0; i < pixcount; i++) {
-        v = src[i];
-        dest[i * 4 + 0] = ((v >> 7) & 0xf8) | ((v >> 12) & 7);
-        dest[i * 4 + 1] = ((v >> 2) & 0xf8) | ((v >> 7) & 7);
-        dest[i * 4 + 2] = ((v << 3) & 0xf8) | ((v >> 2) & 7);
-        dest[i * 4 + 3] = 0;
-    }
+    unrez_convert_16to32(dest, src, pixcount);
     free(src);
     pix->data = dest;
     pix->rowBytes = width * 4;
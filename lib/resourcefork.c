@@ -7,11 +7,13 @@
 #include "unrez.h"
 
 #include "binary.h"
+#include "copyfile.h"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 /*
 The resource fork format is found in Inside Macintosh: More Macintosh Toolbox
@@ -64,35 +66,74 @@ off len
  1  var name
 */
 
-int unrez_resourcefork_openmem(struct unrez_resourcefork *rfork,
-                               const void *data, size_t size) {
-    int32_t doff, moff, dsize, msize, tcount, toff, i, rmax;
-    const uint8_t *ptr = data, *mptr, *tptr;
-    struct unrez_resourcetype *type, *t;
+/*
+ * Data which is loaded lazily (type reference lists, resource sizes, and the
+ * index) is published with atomic operations, so one open fork can be shared
+ * between threads without locks. Each pointer changes at most once, from NULL
+ * to its final value. If two threads load the same data at the same time, the
+ * loser throws its copy away. Resource sizes change at most once, from -1 to
+ * the size read from the fork, and every thread reads the same size.
+ */
 
-    if (size < 16) {
-        return kUnrezErrInvalid;
-    }
+static struct unrez_resource *get_resources(
+    const struct unrez_resourcetype *type) {
+    return __atomic_load_n(&type->resources, __ATOMIC_ACQUIRE);
+}
+
+/* Set the resources for a type, returns 0 if already set. */
+static int set_resources(struct unrez_resourcetype *type,
+                         struct unrez_resource *resources) {
+    struct unrez_resource *expected = NULL;
+    return __atomic_compare_exchange_n(&type->resources, &expected, resources,
+                                       0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static int32_t get_size(const struct unrez_resource *rsrc) {
+    return __atomic_load_n(&rsrc->size, __ATOMIC_RELAXED);
+}
+
+static void set_size(struct unrez_resource *rsrc, int32_t size) {
+    __atomic_store_n(&rsrc->size, size, __ATOMIC_RELAXED);
+}
+
+/* Initialize the fields which are freed when the fork is closed. */
+static void init_fork(struct unrez_resourcefork *rfork) {
+    rfork->types = NULL;
+    rfork->type_count = 0;
+    rfork->resources = NULL;
+    rfork->resource_count = 0;
+    rfork->index = NULL;
+    rfork->file = -1;
+    rfork->data_offset = 0;
+    memset(&rfork->owner, 0, sizeof(rfork->owner));
+}
 
-    /* Read the header with the map and data offsets. */
-    doff = read_i32(ptr);
-    moff = read_i32(ptr + 4);
-    dsize = read_i32(ptr + 8);
-    msize = read_i32(ptr + 12);
-    if (moff < 0 || msize < 30 || (size_t)moff > size ||
-        (size_t)msize > size - moff) {
+/*
+ * Read the header with the map and data offsets, and check that they are
+ * within a fork of the given size.
+ */
+static int read_header(const uint8_t *ptr, int64_t size, int32_t *doff,
+                       int32_t *moff, int32_t *dsize, int32_t *msize) {
+    *doff = read_i32(ptr);
+    *moff = read_i32(ptr + 4);
+    *dsize = read_i32(ptr + 8);
+    *msize = read_i32(ptr + 12);
+    if (*moff < 0 || *msize < 30 || *moff > size || *msize > size - *moff) {
         /* Bad map location. */
         return kUnrezErrInvalid;
     }
-    if (doff < 0 || dsize < 0 || (size_t)doff > size ||
-        (size_t)dsize > size - doff) {
+    if (*doff < 0 || *dsize < 0 || *doff > size || *dsize > size - *doff) {
         /* Bad data location. */
         return kUnrezErrInvalid;
     }
-    rfork->map = mptr = ptr + moff;
-    rfork->map_size = msize;
-    rfork->data = ptr + doff;
-    rfork->data_size = dsize;
+    return 0;
+}
+
+/* Read the map header and type list, once the map is set. */
+static int read_map(struct unrez_resourcefork *rfork) {
+    int32_t msize = rfork->map_size, tcount, toff, i, rmax;
+    const uint8_t *mptr = rfork->map, *tptr;
+    struct unrez_resourcetype *type, *t;
 
     /* Read the map header */
     rfork->attr = read_u16(mptr + 22);
@@ -126,12 +167,38 @@ int unrez_resourcefork_openmem(struct unrez_resourcefork *rfork,
     }
     rfork->types = type;
     rfork->type_count = tcount;
-    memset(&rfork->owner, 0, sizeof(rfork->owner));
     return 0;
 }
 
+int unrez_resourcefork_openmem(struct unrez_resourcefork *rfork,
+                               const void *data, size_t size) {
+    int32_t doff, moff, dsize, msize;
+    const uint8_t *ptr = data;
+    int err;
+
+    init_fork(rfork);
+    if (size < 16) {
+        return kUnrezErrInvalid;
+    }
+    err = read_header(ptr, size, &doff, &moff, &dsize, &msize);
+    if (err != 0) {
+        return err;
+    }
+    rfork->map = ptr + moff;
+    rfork->map_size = msize;
+    rfork->data = ptr + doff;
+    rfork->data_size = dsize;
+    return read_map(rfork);
+}
+
 int unrez_resourcefork_openfork(struct unrez_resourcefork *rfork,
                                 const struct unrez_fork *fork) {
+    return unrez_resourcefork_openforkopts(rfork, fork, NULL);
+}
+
+int unrez_resourcefork_openforkopts(struct unrez_resourcefork *rfork,
+                                    const struct unrez_fork *fork,
+                                    const struct unrez_readopts *opts) {
     struct unrez_data d;
     int r;
     if (fork->size == 0) {
@@ -146,7 +213,7 @@ int unrez_resourcefork_openfork(struct unrez_resourcefork *rfork,
     } else if (fork->size < 16) {
         return kUnrezErrInvalid;
     }
-    r = unrez_fork_read(fork, &d);
+    r = unrez_fork_readopts(fork, &d, opts);
     if (r != 0) {
         return r;
     }
@@ -159,6 +226,83 @@ int unrez_resourcefork_openfork(struct unrez_resourcefork *rfork,
     return 0;
 }
 
+/*
+ * Read exactly size bytes from a file at the given offset. Returns 0 on
+ * success, or an error code on failure.
+ */
+static int read_at(int fdes, void *buf, size_t size, int64_t offset) {
+    size_t pos;
+    ssize_t amt;
+    int err;
+    for (pos = 0; pos < size;) {
+        amt = pread(fdes, (char *)buf + pos, size - pos, offset + pos);
+        if (amt < 0) {
+            err = errno;
+            if (err == EINTR) {
+                continue;
+            }
+            return err;
+        } else if (amt == 0) {
+            return kUnrezErrInvalid;
+        }
+        pos += amt;
+    }
+    return 0;
+}
+
+int unrez_resourcefork_openstream(struct unrez_resourcefork *rfork,
+                                  const struct unrez_fork *fork) {
+    static const struct unrez_readopts kMapOpts = {0, kUnrezAdviseRandom, 0};
+    uint8_t header[16];
+    struct unrez_fork mfork;
+    int32_t doff, moff, dsize, msize;
+    int err;
+
+    init_fork(rfork);
+    if (fork->size == 0) {
+        return kUnrezErrNoResourceFork;
+    } else if (fork->size < 16) {
+        return kUnrezErrInvalid;
+    } else if (fork->mem != NULL) {
+        /* There is nothing to gain from streaming a fork in memory. */
+        return unrez_resourcefork_openfork(rfork, fork);
+    }
+    err = read_at(fork->file, header, sizeof(header), fork->offset);
+    if (err != 0) {
+        return err;
+    }
+    err = read_header(header, fork->size, &doff, &moff, &dsize, &msize);
+    if (err != 0) {
+        return err;
+    }
+    mfork.file = fork->file;
+    mfork.offset = fork->offset + moff;
+    mfork.size = msize;
+    mfork.mem = NULL;
+    /* Lookups jump around the map, so read-ahead does not help. */
+    err = unrez_fork_readopts(&mfork, &rfork->owner, &kMapOpts);
+    if (err != 0) {
+        return err;
+    }
+    rfork->map = rfork->owner.data;
+    rfork->map_size = msize;
+    rfork->data = NULL;
+    rfork->data_size = dsize;
+    rfork->data_offset = fork->offset + doff;
+    rfork->file = fcntl(fork->file, F_DUPFD_CLOEXEC, 0);
+    if (rfork->file == -1) {
+        err = errno;
+        unrez_resourcefork_close(rfork);
+        return err;
+    }
+    err = read_map(rfork);
+    if (err != 0) {
+        unrez_resourcefork_close(rfork);
+        return err;
+    }
+    return 0;
+}
+
 int unrez_resourcefork_open(struct unrez_resourcefork *rfork,
                             const char *path) {
     return unrez_resourcefork_openat(rfork, AT_FDCWD, path);
@@ -179,18 +323,169 @@ int unrez_resourcefork_openat(struct unrez_resourcefork *rfork, int dirfd,
 
 void unrez_resourcefork_close(struct unrez_resourcefork *rfork) {
     struct unrez_resourcetype *type = rfork->types;
+    struct unrez_resource *r, *rs = rfork->resources,
+                              *re = rs + rfork->resource_count;
     int32_t ti, tn = rfork->type_count;
     for (ti = 0; ti < tn; ti++) {
-        free(type[ti].resources);
+        r = type[ti].resources;
+        /* Types loaded by loadall share one allocation. */
+        if (r < rs || r >= re) {
+            free(r);
+        }
     }
+    free(rs);
     free(type);
+    free(rfork->index);
+    if (rfork->file != -1) {
+        close(rfork->file);
+    }
+    unrez_data_destroy(&rfork->owner);
+}
+
+/*
+ * The index is two open addressing hash tables with linear probing, one for
+ * types and one for resources, stored in a single allocation. Each table has a
+ * power of two size and is at most half full. Where the fork has duplicate
+ * entries, only the first is indexed, which matches what a linear scan finds.
+ */
+struct unrez_resourceindex {
+    uint32_t type_mask;
+    uint32_t rsrc_mask;
+    /* Index of each type plus one, or 0 for an empty slot. */
+    int32_t *types;
+    struct unrez_indexslot *rsrcs;
+};
+
+/* A slot in the resource hash table. Empty slots have type_index -1. */
+struct unrez_indexslot {
+    uint32_t type_code;
+    int32_t type_index;
+    int32_t rsrc_index;
+    int32_t id;
+};
+
+static uint32_t hash_type(uint32_t type_code) {
+    uint32_t h = type_code * 0x9e3779b1u;
+    return h ^ (h >> 16);
+}
+
+static uint32_t hash_rsrc(uint32_t type_code, int id) {
+    uint32_t h = (type_code ^ ((uint32_t)id * 0x85ebca6bu)) * 0x9e3779b1u;
+    return h ^ (h >> 16);
+}
+
+/* Get the smallest power of two table size that is at most half full. */
+static uint32_t index_size(int32_t count) {
+    uint32_t size = 8;
+    while (size < (uint32_t)count * 2) {
+        size <<= 1;
+    }
+    return size;
+}
+
+int unrez_resourcefork_buildindex(struct unrez_resourcefork *rfork) {
+    struct unrez_resourceindex *index, *expected;
+    struct unrez_resourcetype *types = rfork->types, *type;
+    struct unrez_resource *rsrcs;
+    struct unrez_indexslot *slot;
+    int32_t i, j, n = rfork->type_count, total = 0;
+    uint32_t tsize, rsize, h;
+    int err;
+    if (__atomic_load_n(&rfork->index, __ATOMIC_ACQUIRE) != NULL) {
+        return 0;
+    }
+    for (i = 0; i < n; i++) {
+        err = unrez_resourcefork_loadtype(rfork, &types[i]);
+        if (err == 0) {
+            total += types[i].count;
+        } else if (err != kUnrezErrInvalid) {
+            return err;
+        }
+    }
+    tsize = index_size(n);
+    rsize = index_size(total);
+    index = malloc(sizeof(*index) + sizeof(*index->rsrcs) * rsize +
+                   sizeof(*index->types) * tsize);
+    if (index == NULL) {
+        return errno;
+    }
+    index->type_mask = tsize - 1;
+    index->rsrc_mask = rsize - 1;
+    index->rsrcs = (struct unrez_indexslot *)(index + 1);
+    index->types = (int32_t *)(index->rsrcs + rsize);
+    memset(index->types, 0, sizeof(*index->types) * tsize);
+    for (h = 0; h < rsize; h++) {
+        index->rsrcs[h].type_index = -1;
+    }
+    for (i = 0; i < n; i++) {
+        type = &types[i];
+        for (h = hash_type(type->type_code);; h++) {
+            h &= index->type_mask;
+            if (index->types[h] == 0) {
+                index->types[h] = i + 1;
+                break;
+            }
+            if (types[index->types[h] - 1].type_code == type->type_code) {
+                break;
+            }
+        }
+        /*
+         * If a type appears twice, lookups without the index only see the
+         * first copy, so leave the resources in the other copy out.
+         */
+        rsrcs = get_resources(type);
+        if (index->types[h] - 1 != i || rsrcs == NULL) {
+            continue;
+        }
+        for (j = 0; j < type->count; j++) {
+            for (h = hash_rsrc(type->type_code, rsrcs[j].id);; h++) {
+                slot = &index->rsrcs[h & index->rsrc_mask];
+                if (slot->type_index == -1) {
+                    slot->type_code = type->type_code;
+                    slot->type_index = i;
+                    slot->rsrc_index = j;
+                    slot->id = rsrcs[j].id;
+                    break;
+                }
+                if (slot->type_code == type->type_code &&
+                    slot->id == rsrcs[j].id) {
+                    break;
+                }
+            }
+        }
+    }
+    expected = NULL;
+    if (!__atomic_compare_exchange_n(&rfork->index, &expected, index, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(index);
+    }
+    return 0;
 }
 
 int unrez_resourcefork_findtype(struct unrez_resourcefork *rfork,
                                 struct unrez_resourcetype **type,
                                 uint32_t type_code) {
     struct unrez_resourcetype *types = rfork->types;
+    const struct unrez_resourceindex *index =
+        __atomic_load_n(&rfork->index, __ATOMIC_ACQUIRE);
     int32_t err, i, n = rfork->type_count;
+    uint32_t h;
+    if (index != NULL) {
+        for (h = hash_type(type_code);; h++) {
+            i = index->types[h & index->type_mask] - 1;
+            if (i < 0) {
+                return kUnrezErrResourceNotFound;
+            }
+            if (types[i].type_code == type_code) {
+                err = unrez_resourcefork_loadtype(rfork, &types[i]);
+                if (err != 0) {
+                    return err;
+                }
+                *type = &types[i];
+                return 0;
+            }
+        }
+    }
     for (i = 0; i < n; i++) {
         if (types[i].type_code == type_code) {
             err = unrez_resourcefork_loadtype(rfork, &types[i]);
@@ -204,28 +499,30 @@ int unrez_resourcefork_findtype(struct unrez_resourcefork *rfork,
     return kUnrezErrResourceNotFound;
 }
 
-int unrez_resourcefork_loadtype(struct unrez_resourcefork *rfork,
-                                struct unrez_resourcetype *type) {
-    struct unrez_resource *resources, *r;
-    int32_t count, roff, i;
-    const uint8_t *ptr, *rptr;
-    if (type->resources != NULL) {
-        return 0;
-    }
+/*
+ * Get a pointer to the reference list for a type, or NULL if the reference list
+ * is out of bounds.
+ */
+static const uint8_t *type_refs(struct unrez_resourcefork *rfork,
+                                const struct unrez_resourcetype *type) {
+    int32_t count, roff;
     if (type->ref_offset < 0) {
-        return kUnrezErrInvalid;
+        return NULL;
     }
     count = type->count;
     roff = rfork->toff + type->ref_offset;
     if (count * 12 > rfork->map_size || roff > rfork->map_size - count * 12) {
-        return kUnrezErrInvalid;
-    }
-    resources = malloc(sizeof(*resources) * count);
-    if (resources == NULL) {
-        return errno;
+        return NULL;
     }
-    ptr = rfork->map + roff;
-    *(volatile const uint8_t *)ptr;
+    return rfork->map + roff;
+}
+
+/* Decode a reference list. */
+static void read_refs(struct unrez_resource *resources, const uint8_t *ptr,
+                      int32_t count) {
+    struct unrez_resource *r;
+    const uint8_t *rptr;
+    int32_t i;
     for (i = 0; i < count; i++) {
         r = &resources[i];
         rptr = ptr + 12 * i;
@@ -236,7 +533,109 @@ int unrez_resourcefork_loadtype(struct unrez_resourcefork *rfork,
         r->offset = (rptr[5] << 16) | (rptr[6] << 8) | rptr[7];
         r->size = -1;
     }
-    type->resources = resources;
+}
+
+/*
+ * Read the size of a resource from the length prefix in the data section.
+ * Returns -1 if the resource is out of bounds.
+ */
+static int32_t read_size(struct unrez_resourcefork *rfork, int32_t roff) {
+    int32_t rsize, dsize = rfork->data_size;
+    if (dsize < 4 || roff > dsize - 4 || roff < 0) {
+        return -1;
+    }
+    rsize = read_i32(rfork->data + roff);
+    if (rsize > dsize - 4 - roff || rsize < 0) {
+        return -1;
+    }
+    return rsize;
+}
+
+int unrez_resourcefork_loadtype(struct unrez_resourcefork *rfork,
+                                struct unrez_resourcetype *type) {
+    struct unrez_resource *resources;
+    const uint8_t *ptr;
+    if (get_resources(type) != NULL) {
+        return 0;
+    }
+    ptr = type_refs(rfork, type);
+    if (ptr == NULL) {
+        return kUnrezErrInvalid;
+    }
+    resources = malloc(sizeof(*resources) * type->count);
+    if (resources == NULL) {
+        return errno;
+    }
+    *(volatile const uint8_t *)ptr;
+    read_refs(resources, ptr, type->count);
+    if (!set_resources(type, resources)) {
+        free(resources);
+    }
+    return 0;
+}
+
+int unrez_resourcefork_loadall(struct unrez_resourcefork *rfork) {
+    struct unrez_resourcetype *types = rfork->types, *type;
+    struct unrez_resource *resources, *r, *re, *expected;
+    const uint8_t *ptr;
+    int32_t i, n = rfork->type_count, total = 0;
+    if (__atomic_load_n(&rfork->resources, __ATOMIC_ACQUIRE) != NULL) {
+        return 0;
+    }
+    for (i = 0; i < n; i++) {
+        type = &types[i];
+        if (type_refs(rfork, type) != NULL) {
+            total += type->count;
+        }
+    }
+    if (total == 0) {
+        return 0;
+    }
+    resources = malloc(sizeof(*resources) * total);
+    if (resources == NULL) {
+        return errno;
+    }
+    r = resources;
+    for (i = 0; i < n; i++) {
+        type = &types[i];
+        ptr = type_refs(rfork, type);
+        if (ptr != NULL) {
+            read_refs(r, ptr, type->count);
+            r += type->count;
+        }
+    }
+    /*
+     * Resolving sizes in a separate pass keeps the map and data reads
+     * sequential. If the size is invalid, leave it unset, and getdata will
+     * report the error. Streaming forks resolve sizes on demand instead, since
+     * the data is not in memory.
+     */
+    re = resources + total;
+    if (rfork->data != NULL) {
+        for (r = resources; r != re; r++) {
+            r->size = read_size(rfork, r->offset);
+        }
+    }
+    /*
+     * Only one table is kept if several threads call loadall at once. Types
+     * which were already loaded keep their own lists, and their part of the
+     * table goes unused.
+     */
+    expected = NULL;
+    if (!__atomic_compare_exchange_n(&rfork->resources, &expected, resources,
+                                     0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free(resources);
+        return 0;
+    }
+    rfork->resource_count = total;
+    r = resources;
+    for (i = 0; i < n; i++) {
+        type = &types[i];
+        if (type_refs(rfork, type) != NULL) {
+            set_resources(type, r);
+            r += type->count;
+        }
+    }
     return 0;
 }
 
@@ -245,12 +644,35 @@ int unrez_resourcefork_findrsrc(struct unrez_resourcefork *rfork,
                                 uint32_t type_code, int rsrc_id) {
     struct unrez_resourcetype *type;
     struct unrez_resource *rsrcs;
+    const struct unrez_resourceindex *index =
+        __atomic_load_n(&rfork->index, __ATOMIC_ACQUIRE);
+    const struct unrez_indexslot *slot;
     int err, i, n;
+    uint32_t h;
+    if (index != NULL) {
+        for (h = hash_rsrc(type_code, rsrc_id);; h++) {
+            slot = &index->rsrcs[h & index->rsrc_mask];
+            if (slot->type_index == -1) {
+                break;
+            }
+            if (slot->type_code == type_code && slot->id == rsrc_id) {
+                *rsrc = &get_resources(&rfork->types[slot->type_index])
+                             [slot->rsrc_index];
+                return 0;
+            }
+        }
+        /*
+         * Not in the index. Either it does not exist, or its type could not be
+         * loaded, and findtype will report which.
+         */
+        err = unrez_resourcefork_findtype(rfork, &type, type_code);
+        return err != 0 ? err : kUnrezErrResourceNotFound;
+    }
     err = unrez_resourcefork_findtype(rfork, &type, type_code);
     if (err != 0) {
         return err;
     }
-    rsrcs = type->resources;
+    rsrcs = get_resources(type);
     n = type->count;
     for (i = 0; i < n; i++) {
         if (rsrcs[i].id == rsrc_id) {
@@ -264,25 +686,92 @@ int unrez_resourcefork_findrsrc(struct unrez_resourcefork *rfork,
 int unrez_resourcefork_getdata(struct unrez_resourcefork *rfork,
                                struct unrez_resource *rsrc, const void **data,
                                uint32_t *size) {
-    int32_t roff, rsize, dsize;
+    int32_t roff, rsize;
+    if (rfork->data == NULL) {
+        return EINVAL;
+    }
     roff = rsrc->offset;
-    rsize = rsrc->size;
+    rsize = get_size(rsrc);
     if (rsize < 0) {
-        dsize = rfork->data_size;
-        if (dsize < 4 || roff > dsize - 4 || roff < 0) {
+        rsize = read_size(rfork, roff);
+        if (rsize < 0) {
             return kUnrezErrInvalid;
         }
-        rsize = read_i32(rfork->data + roff);
-        if (rsize > dsize - 4 - roff || rsize < 0) {
+        set_size(rsrc, rsize);
+    }
+    *data = rfork->data + roff + 4;
+    *size = rsize;
+    return 0;
+}
+
+int unrez_resourcefork_getsize(struct unrez_resourcefork *rfork,
+                               struct unrez_resource *rsrc, uint32_t *size) {
+    uint8_t buf[4];
+    int32_t roff, rsize, dsize;
+    int err;
+    roff = rsrc->offset;
+    rsize = get_size(rsrc);
+    if (rsize < 0) {
+        if (rfork->data != NULL) {
+            rsize = read_size(rfork, roff);
+        } else {
+            dsize = rfork->data_size;
+            if (dsize < 4 || roff > dsize - 4 || roff < 0) {
+                return kUnrezErrInvalid;
+            }
+            err = read_at(rfork->file, buf, 4, rfork->data_offset + roff);
+            if (err != 0) {
+                return err;
+            }
+            rsize = read_i32(buf);
+            if (rsize > dsize - 4 - roff) {
+                rsize = -1;
+            }
+        }
+        if (rsize < 0) {
             return kUnrezErrInvalid;
         }
-        rsrc->size = rsize;
+        set_size(rsrc, rsize);
     }
-    *data = rfork->data + roff + 4;
     *size = rsize;
     return 0;
 }
 
+int unrez_resourcefork_readdata(struct unrez_resourcefork *rfork,
+                                struct unrez_resource *rsrc, uint32_t offset,
+                                void *buf, uint32_t count) {
+    uint32_t size;
+    int err;
+    err = unrez_resourcefork_getsize(rfork, rsrc, &size);
+    if (err != 0) {
+        return err;
+    }
+    if (offset > size || count > size - offset) {
+        return EINVAL;
+    }
+    if (rfork->data != NULL) {
+        memcpy(buf, rfork->data + rsrc->offset + 4 + offset, count);
+        return 0;
+    }
+    return read_at(rfork->file, buf, count,
+                   rfork->data_offset + rsrc->offset + 4 + offset);
+}
+
+int unrez_resourcefork_copydata(struct unrez_resourcefork *rfork,
+                                struct unrez_resource *rsrc, int fdes) {
+    uint32_t size;
+    int err;
+    err = unrez_resourcefork_getsize(rfork, rsrc, &size);
+    if (err != 0) {
+        return err;
+    }
+    if (rfork->data != NULL) {
+        return unrez_writeall(fdes, rfork->data + rsrc->offset + 4, size);
+    }
+    return unrez_copyfile(fdes, rfork->file,
+                          rfork->data_offset + rsrc->offset + 4, size);
+}
+
 int unrez_resourcefork_getname(struct unrez_resourcefork *rfork,
                                struct unrez_resource *rsrc, const char **name,
                                size_t *size) {
@@ -0,0 +1,352 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+/* The type field in directory entries is not part of POSIX. */
+#define _DEFAULT_SOURCE 1
+#define _DARWIN_C_SOURCE 1
+
+#include "unrez.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/*
+ * Each directory is read completely and sorted before anything in it is
+ * visited. This makes the order predictable, and lets us pair AppleDouble
+ * header files with their data files by searching the sorted names, instead of
+ * asking the filesystem whether the other file exists. Subdirectories are
+ * opened relative to their parent with openat(), so no path is ever resolved
+ * from the root more than once.
+ */
+
+static const char kAppleDoublePrefix[] = "._";
+
+enum {
+    kPrefixLen = sizeof(kAppleDoublePrefix) - 1,
+};
+
+/* Entry types, from the directory entry or from fstatat. */
+enum {
+    kEntryUnknown,
+    kEntryOther,
+    kEntryFile,
+    kEntryDir,
+};
+
+struct entry {
+    /* Offset of the name in the name buffer, later a pointer to it. */
+    size_t offset;
+    const char *name;
+    int type;
+    /* For data files, the index of the AppleDouble header, or -1. */
+    int header;
+    /* Set for AppleDouble headers which are reported with their data file. */
+    int paired;
+};
+
+struct scan {
+    const struct unrez_scan_callbacks *cb;
+    /* The path of the current directory, with room to append to it. */
+    char *path;
+    size_t pathlen, pathcap;
+};
+
+static int entry_cmp(const void *x, const void *y) {
+    const struct entry *ex = x, *ey = y;
+    return strcmp(ex->name, ey->name);
+}
+
+/* Find an entry by name in a sorted list, or return -1. */
+static int entry_find(const struct entry *ents, int count, const char *name) {
+    int lo = 0, hi = count, mid, c;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        c = strcmp(ents[mid].name, name);
+        if (c == 0) {
+            return mid;
+        } else if (c < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Append a name to the current path. Returns the old length of the path, to
+ * pass to path_pop, or -1 on failure.
+ */
+static long path_push(struct scan *sc, const char *name) {
+    size_t len = strlen(name), need = sc->pathlen + len + 2, ncap;
+    long old = sc->pathlen;
+    char *npath;
+    if (need > sc->pathcap) {
+        ncap = sc->pathcap * 2;
+        if (ncap < need) {
+            ncap = need;
+        }
+        npath = realloc(sc->path, ncap);
+        if (npath == NULL) {
+            return -1;
+        }
+        sc->path = npath;
+        sc->pathcap = ncap;
+    }
+    if (sc->pathlen > 0 && sc->path[sc->pathlen - 1] != '/') {
+        sc->path[sc->pathlen++] = '/';
+    }
+    memcpy(sc->path + sc->pathlen, name, len + 1);
+    sc->pathlen += len;
+    return old;
+}
+
+static void path_pop(struct scan *sc, long old) {
+    sc->pathlen = old;
+    sc->path[old] = '\0';
+}
+
+/* Report an error in the current path. */
+static int scan_error(struct scan *sc, int err) {
+    if (sc->cb->error == NULL) {
+        return 0;
+    }
+    return sc->cb->error(sc->cb->ctx, err, sc->path);
+}
+
+/*
+ * Read every entry in a directory, except "." and "..". The entries are
+ * returned sorted by name. The names are stored in a single buffer, returned
+ * in namebuf.
+ */
+static int scan_read(DIR *dir, struct entry **entsp, int *countp,
+                     char **namebufp) {
+    struct entry *ents = NULL, *nents;
+    struct dirent *de;
+    struct stat st;
+    char *names = NULL, *nnames;
+    size_t namelen = 0, namecap = 0, len, ncap;
+    int count = 0, cap = 0, ncount, i, err, type, fd = dirfd(dir);
+    for (;;) {
+        errno = 0;
+        de = readdir(dir);
+        if (de == NULL) {
+            err = errno;
+            if (err != 0) {
+                goto error;
+            }
+            break;
+        }
+        if (de->d_name[0] == '.' &&
+            (de->d_name[1] == '\0' ||
+             (de->d_name[1] == '.' && de->d_name[2] == '\0'))) {
+            continue;
+        }
+        if (count >= cap) {
+            ncount = cap == 0 ? 32 : cap * 2;
+            nents = realloc(ents, sizeof(*ents) * ncount);
+            if (nents == NULL) {
+                err = errno;
+                goto error;
+            }
+            ents = nents;
+            cap = ncount;
+        }
+        len = strlen(de->d_name) + 1;
+        if (len > namecap - namelen) {
+            ncap = namecap == 0 ? 1024 : namecap * 2;
+            while (len > ncap - namelen) {
+                ncap *= 2;
+            }
+            nnames = realloc(names, ncap);
+            if (nnames == NULL) {
+                err = errno;
+                goto error;
+            }
+            names = nnames;
+            namecap = ncap;
+        }
+        memcpy(names + namelen, de->d_name, len);
+        ents[count].offset = namelen;
+        namelen += len;
+        type = kEntryUnknown;
+#ifdef DT_UNKNOWN
+        switch (de->d_type) {
+        case DT_REG:
+            type = kEntryFile;
+            break;
+        case DT_DIR:
+            type = kEntryDir;
+            break;
+        case DT_UNKNOWN:
+            break;
+        default:
+            type = kEntryOther;
+            break;
+        }
+#endif
+        if (type == kEntryUnknown) {
+            /* Not every filesystem fills in the type. */
+            if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                (S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))) {
+                type = S_ISREG(st.st_mode) ? kEntryFile : kEntryDir;
+            } else {
+                type = kEntryOther;
+            }
+        }
+        ents[count].type = type;
+        ents[count].header = -1;
+        ents[count].paired = 0;
+        count++;
+    }
+    for (i = 0; i < count; i++) {
+        ents[i].name = names + ents[i].offset;
+    }
+    if (count > 0) {
+        qsort(ents, count, sizeof(*ents), entry_cmp);
+    }
+    *entsp = ents;
+    *countp = count;
+    *namebufp = names;
+    return 0;
+
+error:
+    free(ents);
+    free(names);
+    return err;
+}
+
+/* Scan a directory, and take ownership of its file descriptor. */
+static int scan_dir(struct scan *sc, int fd) {
+    const struct unrez_scan_callbacks *cb = sc->cb;
+    struct unrez_scanfile file;
+    struct entry *ents = NULL, *e;
+    char *names = NULL;
+    DIR *dir;
+    long old;
+    int count = 0, i, j, r, subfd, current = 0;
+
+    dir = fdopendir(fd);
+    if (dir == NULL) {
+        r = errno;
+        close(fd);
+        return scan_error(sc, r);
+    }
+    r = scan_read(dir, &ents, &count, &names);
+    if (r != 0) {
+        r = scan_error(sc, r);
+        goto done;
+    }
+
+    /* Pair AppleDouble header files with data files. */
+    for (i = 0; i < count; i++) {
+        e = &ents[i];
+        if (e->type != kEntryFile || strlen(e->name) <= (size_t)kPrefixLen ||
+            memcmp(e->name, kAppleDoublePrefix, kPrefixLen) != 0) {
+            continue;
+        }
+        j = entry_find(ents, count, e->name + kPrefixLen);
+        if (j >= 0 && ents[j].type == kEntryFile) {
+            ents[j].header = i;
+            e->paired = 1;
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        e = &ents[i];
+        if (e->type == kEntryOther || e->paired) {
+            continue;
+        }
+        if (e->type == kEntryFile && !current) {
+            current = 1;
+            if (cb->directory != NULL) {
+                r = cb->directory(cb->ctx, fd, sc->path);
+                if (r != 0) {
+                    goto done;
+                }
+            }
+        }
+        old = path_push(sc, e->name);
+        if (old < 0) {
+            r = scan_error(sc, ENOMEM);
+            if (r != 0) {
+                goto done;
+            }
+            continue;
+        }
+        if (e->type == kEntryDir) {
+            subfd = openat(fd, e->name,
+                           O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (subfd == -1) {
+                r = scan_error(sc, errno);
+            } else {
+                r = scan_dir(sc, subfd);
+            }
+            current = 0;
+        } else {
+            file.dirfd = fd;
+            file.path = sc->path;
+            if (e->header >= 0) {
+                file.name = ents[e->header].name;
+                file.appledouble = 1;
+            } else {
+                file.name = e->name;
+                file.appledouble = 0;
+            }
+            r = cb->file(cb->ctx, &file);
+        }
+        path_pop(sc, old);
+        if (r != 0) {
+            goto done;
+        }
+    }
+    r = 0;
+
+done:
+    closedir(dir);
+    free(ents);
+    free(names);
+    return r;
+}
+
+int unrez_scan(const char *path, const struct unrez_scan_callbacks *cb) {
+    return unrez_scanat(AT_FDCWD, path, cb);
+}
+
+int unrez_scanat(int dirfd, const char *path,
+                 const struct unrez_scan_callbacks *cb) {
+    struct scan sc;
+    size_t len;
+    int fd, r;
+    fd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return errno;
+    }
+    sc.cb = cb;
+    sc.path = NULL;
+    sc.pathlen = 0;
+    sc.pathcap = 0;
+    /* Remove trailing slashes, except for the root directory. */
+    len = strlen(path);
+    while (len > 1 && path[len - 1] == '/') {
+        len--;
+    }
+    if (path_push(&sc, path) < 0) {
+        close(fd);
+        return ENOMEM;
+    }
+    sc.pathlen = len;
+    sc.path[len] = '\0';
+    r = scan_dir(&sc, fd);
+    free(sc.path);
+    return r;
+}
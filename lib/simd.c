@@ -0,0 +1,51 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include "unrez.h"
+
+#include "simd.h"
+
+/*
+ * The SIMD level in use, or -1 if not yet chosen. This is accessed atomically
+ * because the decoders may run on several threads at once.
+ */
+static int simd_level = -1;
+
+/* Get the best SIMD level that the processor supports. */
+static int simd_detect(void) {
+#if SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return kUnrezSimdAVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return kUnrezSimdSSE2;
+    }
+#endif
+#if SIMD_NEON
+    return kUnrezSimdNEON;
+#endif
+    return kUnrezSimdNone;
+}
+
+int unrez_simd_get(void) {
+    int level = __atomic_load_n(&simd_level, __ATOMIC_RELAXED);
+    if (level < 0) {
+        level = simd_detect();
+        __atomic_store_n(&simd_level, level, __ATOMIC_RELAXED);
+    }
+    return level;
+}
+
+int unrez_simd_set(int level) {
+    int max = simd_detect();
+    if (level != kUnrezSimdNone && level != max &&
+        !(level == kUnrezSimdSSE2 && max == kUnrezSimdAVX2)) {
+        level = max;
+    }
+    __atomic_store_n(&simd_level, level, __ATOMIC_RELAXED);
+    return level;
+}
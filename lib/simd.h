@@ -0,0 +1,22 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+
+/*
+ * SIMD_X86 is defined if we can compile x86 SIMD code with the target
+ * attribute, and choose between implementations at runtime.
+ */
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+#define SIMD_X86 1
+#endif
+
+/*
+ * SIMD_NEON is defined if we can use ARM NEON. This is always available on
+ * 64-bit ARM, and is chosen at compile time elsewhere.
+ */
+#if defined __ARM_NEON || defined __ARM_NEON__
+#define SIMD_NEON 1
+#endif
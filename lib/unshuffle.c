@@ -0,0 +1,166 @@
+/*
+ * Copyright 2007-2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include "unrez.h"
+
+#include "simd.h"
+#include "unshuffle.h"
+
+#if SIMD_X86
+#include <immintrin.h>
+#endif
+#if SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+/*
+ * Pixels with 32-bit direct color are stored by row, component, then column. A
+ * row of pixels will be stored with all the red components, then the green,
+ * then blue. This makes the compression more efficient. If there is an alpha
+ * channel, it comes first.
+ *
+ * The SIMD versions interleave a block of pixels at a time in registers, and
+ * finish the row with the portable code.
+ */
+
+static void unshuffle_32_c(uint8_t *dest, const uint8_t *r, const uint8_t *g,
+                           const uint8_t *b, const uint8_t *a, int n) {
+    int x;
+    for (x = 0; x < n; x++) {
+        dest[x * 4 + 0] = r[x];
+        dest[x * 4 + 1] = g[x];
+        dest[x * 4 + 2] = b[x];
+        dest[x * 4 + 3] = a != NULL ? a[x] : 0;
+    }
+}
+
+#if SIMD_X86
+
+__attribute__((target("sse2"))) static int unshuffle_32_sse2(
+    uint8_t *dest, const uint8_t *r, const uint8_t *g, const uint8_t *b,
+    const uint8_t *a, int n) {
+    __m128i vr, vg, vb, va, rg, ba;
+    int x;
+    va = _mm_setzero_si128();
+    for (x = 0; x + 16 <= n; x += 16) {
+        vr = _mm_loadu_si128((const __m128i *)(r + x));
+        vg = _mm_loadu_si128((const __m128i *)(g + x));
+        vb = _mm_loadu_si128((const __m128i *)(b + x));
+        if (a != NULL) {
+            va = _mm_loadu_si128((const __m128i *)(a + x));
+        }
+        rg = _mm_unpacklo_epi8(vr, vg);
+        ba = _mm_unpacklo_epi8(vb, va);
+        _mm_storeu_si128((__m128i *)(dest + x * 4),
+                         _mm_unpacklo_epi16(rg, ba));
+        _mm_storeu_si128((__m128i *)(dest + x * 4 + 16),
+                         _mm_unpackhi_epi16(rg, ba));
+        rg = _mm_unpackhi_epi8(vr, vg);
+        ba = _mm_unpackhi_epi8(vb, va);
+        _mm_storeu_si128((__m128i *)(dest + x * 4 + 32),
+                         _mm_unpacklo_epi16(rg, ba));
+        _mm_storeu_si128((__m128i *)(dest + x * 4 + 48),
+                         _mm_unpackhi_epi16(rg, ba));
+    }
+    return x;
+}
+
+/*
+ * The AVX2 unpack instructions work within each 128-bit lane. The input is
+ * permuted first so that after unpacking, each lane holds the right pixels: the
+ * first lane gets pixels 0-3, 8-11, 16-19, and 24-27.
+ */
+__attribute__((target("avx2"))) static int unshuffle_32_avx2(
+    uint8_t *dest, const uint8_t *r, const uint8_t *g, const uint8_t *b,
+    const uint8_t *a, int n) {
+    __m256i vr, vg, vb, va, rg, ba, perm;
+    int x;
+    perm = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    va = _mm256_setzero_si256();
+    for (x = 0; x + 32 <= n; x += 32) {
+        vr = _mm256_loadu_si256((const __m256i *)(r + x));
+        vg = _mm256_loadu_si256((const __m256i *)(g + x));
+        vb = _mm256_loadu_si256((const __m256i *)(b + x));
+        vr = _mm256_permutevar8x32_epi32(vr, perm);
+        vg = _mm256_permutevar8x32_epi32(vg, perm);
+        vb = _mm256_permutevar8x32_epi32(vb, perm);
+        if (a != NULL) {
+            va = _mm256_loadu_si256((const __m256i *)(a + x));
+            va = _mm256_permutevar8x32_epi32(va, perm);
+        }
+        rg = _mm256_unpacklo_epi8(vr, vg);
+        ba = _mm256_unpacklo_epi8(vb, va);
+        _mm256_storeu_si256((__m256i *)(dest + x * 4),
+                            _mm256_unpacklo_epi16(rg, ba));
+        _mm256_storeu_si256((__m256i *)(dest + x * 4 + 32),
+                            _mm256_unpackhi_epi16(rg, ba));
+        rg = _mm256_unpackhi_epi8(vr, vg);
+        ba = _mm256_unpackhi_epi8(vb, va);
+        _mm256_storeu_si256((__m256i *)(dest + x * 4 + 64),
+                            _mm256_unpacklo_epi16(rg, ba));
+        _mm256_storeu_si256((__m256i *)(dest + x * 4 + 96),
+                            _mm256_unpackhi_epi16(rg, ba));
+    }
+    return x;
+}
+
+#endif
+
+#if SIMD_NEON
+
+static int unshuffle_32_neon(uint8_t *dest, const uint8_t *r, const uint8_t *g,
+                             const uint8_t *b, const uint8_t *a, int n) {
+    uint8x16x4_t v;
+    int x;
+    v.val[3] = vdupq_n_u8(0);
+    for (x = 0; x + 16 <= n; x += 16) {
+        v.val[0] = vld1q_u8(r + x);
+        v.val[1] = vld1q_u8(g + x);
+        v.val[2] = vld1q_u8(b + x);
+        if (a != NULL) {
+            v.val[3] = vld1q_u8(a + x);
+        }
+        vst4q_u8(dest + x * 4, v);
+    }
+    return x;
+}
+
+#endif
+
+void unrez_unshuffle_32(uint8_t *dest, const uint8_t *src, int n,
+                        int cmpcount) {
+    const uint8_t *r, *g, *b, *a;
+    int x;
+    if (cmpcount == 4) {
+        a = src;
+        src += n;
+    } else {
+        a = NULL;
+    }
+    r = src;
+    g = src + n;
+    b = src + n * 2;
+    switch (unrez_simd_get()) {
+#if SIMD_X86
+    case kUnrezSimdAVX2:
+        x = unshuffle_32_avx2(dest, r, g, b, a, n);
+        break;
+    case kUnrezSimdSSE2:
+        x = unshuffle_32_sse2(dest, r, g, b, a, n);
+        break;
+#endif
+#if SIMD_NEON
+    case kUnrezSimdNEON:
+        x = unshuffle_32_neon(dest, r, g, b, a, n);
+        break;
+#endif
+    default:
+        x = 0;
+        break;
+    }
+    unshuffle_32_c(dest + x * 4, r + x, g + x, b + x, a != NULL ? a + x : NULL,
+                   n - x);
+}
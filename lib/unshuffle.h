@@ -0,0 +1,16 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include <stdint.h>
+
+/*
+ * Unshuffle a row of n planar 32-bit pixels. The source has cmpcount planes of
+ * n bytes each, which is 3 for red, green, and blue, or 4 for alpha, red,
+ * green, and blue. The destination is n pixels of red, green, blue, and alpha,
+ * with alpha set to 0 if there are 3 planes.
+ */
+void unrez_unshuffle_32(uint8_t *dest, const uint8_t *src, int n,
+                        int cmpcount);
@@ -0,0 +1,980 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include "defs.h"
+
+#include "unrez.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+struct bench {
+    const char *name;
+    void (*run)(void);
+};
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Print results as tab-separated values instead of a table. */
+static int opt_tsv;
+
+/*
+ * Print the time per operation for a benchmark. If bytes is nonzero, it is the
+ * total amount of input data, and the throughput is printed too.
+ */
+static void report(const char *name, long count, double bytes,
+                   double elapsed) {
+    double mbps = bytes > 0 ? bytes * 1e-6 / elapsed : 0;
+    if (opt_tsv) {
+        printf("%s\t%ld\t%.6f\t%.1f\t%.1f\t", name, count, elapsed,
+               elapsed * 1e9 / count, count / elapsed);
+        if (bytes > 0) {
+            printf("%.1f", mbps);
+        }
+        putchar('\n');
+        return;
+    }
+    printf("%-24s %8ld ops %12.1f ns/op %12.1f op/s", name, count,
+           elapsed * 1e9 / count, count / elapsed);
+    if (bytes > 0) {
+        printf(" %8.1f MB/s", mbps);
+    }
+    putchar('\n');
+}
+
+/* Deterministic pseudorandom numbers, so runs are comparable. */
+static uint32_t rand_state = 1;
+
+static uint32_t rand_next(void) {
+    rand_state = rand_state * 1103515245u + 12345u;
+    return rand_state >> 8;
+}
+
+/*
+ * Build a fork with many types and resources, like a large application. Type
+ * codes are spread out and IDs are not sequential.
+ */
+static void make_fork(void **data, size_t *size, int type_count,
+                      int rsrc_count, uint32_t *types, int *ids) {
+    struct synth s;
+    unsigned char payload[16];
+    int i, j;
+    synth_init(&s);
+    memset(payload, 0xa5, sizeof(payload));
+    for (i = 0; i < type_count; i++) {
+        types[i] = UNREZ_TYPE('A' + i % 26, 'a' + i / 26 % 26, '0' + i % 10,
+                              '#');
+        for (j = 0; j < rsrc_count; j++) {
+            ids[i * rsrc_count + j] = 128 + j * 7;
+            synth_add(&s, types[i], 128 + j * 7, NULL, payload,
+                      1 + (i + j) % sizeof(payload));
+        }
+    }
+    synth_finish(&s, data, size);
+    synth_destroy(&s);
+}
+
+enum {
+    kLookupTypes = 64,
+    kLookupPerType = 40,
+    kLookupCount = 200000,
+};
+
+static void lookup_run(const char *name, struct unrez_resourcefork *rfork,
+                       const uint32_t *types, const int *ids) {
+    struct unrez_resource *rsrc;
+    double t0, t1;
+    long i;
+    int err, k;
+    rand_state = 1;
+    t0 = now();
+    for (i = 0; i < kLookupCount; i++) {
+        k = rand_next() % (kLookupTypes * kLookupPerType);
+        err = unrez_resourcefork_findrsrc(rfork, &rsrc,
+                                          types[k / kLookupPerType], ids[k]);
+        if (err != 0 || rsrc->id != ids[k]) {
+            die_errf(EX_SOFTWARE, err, "lookup failed");
+        }
+    }
+    t1 = now();
+    report(name, kLookupCount, 0, t1 - t0);
+}
+
+static void bench_lookup(void) {
+    struct unrez_resourcefork rfork;
+    uint32_t types[kLookupTypes];
+    int *ids;
+    void *data;
+    size_t size;
+    int err;
+    ids = malloc(sizeof(*ids) * kLookupTypes * kLookupPerType);
+    if (ids == NULL) {
+        die_errf(EX_OSERR, errno, "malloc");
+    }
+    make_fork(&data, &size, kLookupTypes, kLookupPerType, types, ids);
+    err = unrez_resourcefork_openmem(&rfork, data, size);
+    if (err != 0) {
+        die_errf(EX_SOFTWARE, err, "openmem");
+    }
+    lookup_run("lookup/linear", &rfork, types, ids);
+    err = unrez_resourcefork_buildindex(&rfork);
+    if (err != 0) {
+        die_errf(EX_SOFTWARE, err, "buildindex");
+    }
+    lookup_run("lookup/index", &rfork, types, ids);
+    unrez_resourcefork_close(&rfork);
+    free(data);
+    free(ids);
+}
+
+enum {
+    kEnumTypes = 400,
+    kEnumPerType = 6,
+    kEnumCount = 200,
+};
+
+/*
+ * Open a fork and get the size of every resource, the way "unrez ls" does,
+ * either loading each type lazily or loading everything at once.
+ */
+static void enum_run(const char *name, const void *data, size_t size,
+                     int eager) {
+    struct unrez_resourcefork rfork;
+    struct unrez_resourcetype *type;
+    const void *rdata;
+    uint32_t rsize;
+    double t0, t1;
+    int err, i, j, k;
+    t0 = now();
+    for (i = 0; i < kEnumCount; i++) {
+        err = unrez_resourcefork_openmem(&rfork, data, size);
+        if (err != 0) {
+            die_errf(EX_SOFTWARE, err, "openmem");
+        }
+        if (eager) {
+            err = unrez_resourcefork_loadall(&rfork);
+            if (err != 0) {
+                die_errf(EX_SOFTWARE, err, "loadall");
+            }
+        }
+        for (j = 0; j < rfork.type_count; j++) {
+            type = &rfork.types[j];
+            err = unrez_resourcefork_loadtype(&rfork, type);
+            if (err != 0) {
+                die_errf(EX_SOFTWARE, err, "loadtype");
+            }
+            for (k = 0; k < type->count; k++) {
+                err = unrez_resourcefork_getdata(&rfork, &type->resources[k],
+                                                 &rdata, &rsize);
+                if (err != 0) {
+                    die_errf(EX_SOFTWARE, err, "getdata");
+                }
+            }
+        }
+        unrez_resourcefork_close(&rfork);
+    }
+    t1 = now();
+    report(name, kEnumCount, (double)size * kEnumCount, t1 - t0);
+}
+
+static void bench_enum(void) {
+    uint32_t types[kEnumTypes];
+    int *ids;
+    void *data;
+    size_t size;
+    ids = malloc(sizeof(*ids) * kEnumTypes * kEnumPerType);
+    if (ids == NULL) {
+        die_errf(EX_OSERR, errno, "malloc");
+    }
+    make_fork(&data, &size, kEnumTypes, kEnumPerType, types, ids);
+    enum_run("enum/lazy", data, size, 0);
+    enum_run("enum/eager", data, size, 1);
+    free(data);
+    free(ids);
+}
+
+static int pict_header(void *ctx, int version, const struct unrez_rect *frame) {
+    (void)ctx;
+    (void)version;
+    (void)frame;
+    return 0;
+}
+
+static int pict_opcode(void *ctx, int opcode, const void *data, size_t size) {
+    (void)ctx;
+    (void)opcode;
+    (void)data;
+    (void)size;
+    return 0;
+}
+
+static int pict_pixels(void *ctx, int opcode, struct unrez_pixdata *pix) {
+    (void)ctx;
+    (void)opcode;
+    (void)pix;
+    return 0;
+}
+
+static void pict_error(void *ctx, int err, int opcode, const char *msg) {
+    (void)ctx;
+    (void)opcode;
+    die_errf(EX_SOFTWARE, err, "decode failed: %s", msg != NULL ? msg : "");
+}
+
+static const struct unrez_pict_callbacks kPictCallbacks = {
+    NULL, pict_header, pict_opcode, pict_pixels, pict_error,
+    kUnrezRowNative, NULL, NULL, NULL,
+};
+
+/*
+ * Callbacks for comparing the whole-image and row interfaces. Both convert
+ * 16-bit pixels to 32-bit.
+ */
+static int pict_pixels_expand(void *ctx, int opcode,
+                              struct unrez_pixdata *pix) {
+    int err;
+    (void)ctx;
+    (void)opcode;
+    if (pix->pixelSize == 16) {
+        err = unrez_pixdata_16to32(pix);
+        if (err != 0) {
+            die_errf(EX_SOFTWARE, err, "16to32");
+        }
+    }
+    return 0;
+}
+
+static int pict_begin_rows(void *ctx, int opcode,
+                           const struct unrez_pixdata *pix) {
+    (void)ctx;
+    (void)opcode;
+    (void)pix;
+    return 0;
+}
+
+static int pict_row(void *ctx, int y, const void *data) {
+    (void)ctx;
+    (void)y;
+    (void)data;
+    return 0;
+}
+
+static int pict_end_rows(void *ctx, int opcode) {
+    (void)ctx;
+    (void)opcode;
+    return 0;
+}
+
+static const struct unrez_pict_callbacks kPictImageCallbacks = {
+    NULL, pict_header, pict_opcode, pict_pixels_expand, pict_error,
+    kUnrezRowNative, NULL, NULL, NULL,
+};
+
+static const struct unrez_pict_callbacks kPictRowCallbacks = {
+    NULL, pict_header, pict_opcode, NULL, pict_error,
+    kUnrezRowExpand16, pict_begin_rows, pict_row, pict_end_rows,
+};
+
+static const char *const kSimdNames[] = {"none", "sse2", "avx2", "neon"};
+
+enum {
+    kPictWidth = 640,
+    kPictHeight = 480,
+    kPictCount = 200,
+};
+
+/*
+ * Decode a picture with each SIMD level that the processor supports.
+ */
+static void pict_run(const char *name, int pixel_size, int flags) {
+    char rname[32];
+    void *data;
+    size_t size;
+    double t0, t1;
+    int i, level, saved;
+    synth_pict(&data, &size, pixel_size, flags, kPictWidth, kPictHeight, 1);
+    saved = unrez_simd_get();
+    for (level = kUnrezSimdNone; level <= kUnrezSimdNEON; level++) {
+        if (unrez_simd_set(level) != level) {
+            continue;
+        }
+        t0 = now();
+        for (i = 0; i < kPictCount; i++) {
+            unrez_pict_decode(&kPictCallbacks, data, size);
+        }
+        t1 = now();
+        snprintf(rname, sizeof(rname), "%s/%s", name, kSimdNames[level]);
+        report(rname, kPictCount, (double)size * kPictCount, t1 - t0);
+    }
+    unrez_simd_set(saved);
+    free(data);
+}
+
+/* Decode a picture with the given callbacks. */
+static void pict_run_cb(const char *name, int pixel_size,
+                        const struct unrez_pict_callbacks *cb) {
+    void *data;
+    size_t size;
+    double t0, t1;
+    int i;
+    synth_pict(&data, &size, pixel_size, 0, kPictWidth, kPictHeight, 1);
+    t0 = now();
+    for (i = 0; i < kPictCount; i++) {
+        unrez_pict_decode(cb, data, size);
+    }
+    t1 = now();
+    report(name, kPictCount, (double)size * kPictCount, t1 - t0);
+    free(data);
+}
+
+static void bench_rows(void) {
+    pict_run_cb("image16", 16, &kPictImageCallbacks);
+    pict_run_cb("rows16", 16, &kPictRowCallbacks);
+    pict_run_cb("image32", 32, &kPictImageCallbacks);
+    pict_run_cb("rows32", 32, &kPictRowCallbacks);
+}
+
+enum {
+    kIconSize = 32,
+    kIconCount = 100000,
+};
+
+/*
+ * Decode a small picture many times, with and without reusing a decoder.
+ */
+static void icon_run(const char *name, int pixel_size) {
+    struct unrez_pict_decoder dec;
+    char rname[32];
+    void *data;
+    size_t size;
+    double t0, t1;
+    int i;
+    synth_pict(&data, &size, pixel_size, 0, kIconSize, kIconSize, 1);
+    t0 = now();
+    for (i = 0; i < kIconCount; i++) {
+        unrez_pict_decode(&kPictCallbacks, data, size);
+    }
+    t1 = now();
+    snprintf(rname, sizeof(rname), "%s/new", name);
+    report(rname, kIconCount, (double)size * kIconCount, t1 - t0);
+    memset(&dec, 0, sizeof(dec));
+    t0 = now();
+    for (i = 0; i < kIconCount; i++) {
+        unrez_pict_decoder_decode(&dec, &kPictCallbacks, data, size);
+    }
+    t1 = now();
+    snprintf(rname, sizeof(rname), "%s/reuse", name);
+    report(rname, kIconCount, (double)size * kIconCount, t1 - t0);
+    printf(opt_tsv ? "# %s: %ld allocations\n" : "%-24s %8ld allocations\n",
+           rname, dec.alloc_count);
+    unrez_pict_decoder_destroy(&dec);
+    free(data);
+}
+
+static void bench_icons(void) {
+    icon_run("icon8", 8);
+    icon_run("icon32", 32);
+}
+
+static void bench_unpack(void) {
+    pict_run("unpack8", 8, 0);
+    pict_run("unpack16", 16, 0);
+}
+
+static void bench_direct(void) {
+    pict_run("packed32", 32, 0);
+    pict_run("packed32a", 32, kSynthAlpha);
+    pict_run("unpacked32", 32, kSynthUnpacked);
+    pict_run("unpacked32a", 32, kSynthAlpha | kSynthUnpacked);
+}
+
+/*
+ * The corpus is a resource fork containing pictures in every supported format,
+ * and other resources, stored as MacBinary, AppleDouble, and a raw resource
+ * fork in a temporary directory.
+ */
+
+struct corpus_format {
+    const char *name;
+    int pixel_size;
+    int flags;
+};
+
+static const struct corpus_format kCorpusFormats[] = {
+    {"packed1", 1, 0},
+    {"unpacked1", 1, kSynthUnpacked},
+    {"packed8", 8, 0},
+    {"unpacked8", 8, kSynthUnpacked},
+    {"packed16", 16, 0},
+    {"unpacked16", 16, kSynthUnpacked},
+    {"packed32", 32, 0},
+    {"unpacked32", 32, kSynthUnpacked},
+};
+
+enum {
+    kCorpusFormatCount = sizeof(kCorpusFormats) / sizeof(*kCorpusFormats),
+    kCorpusPicts = 4,
+    kCorpusWidth = 256,
+    kCorpusHeight = 192,
+    kCorpusTypes = 64,
+    kCorpusPerType = 20,
+};
+
+/* Names of files in the corpus directory. */
+static const char *const kCorpusFiles[] = {
+    "corpus.bin", "corpus", "._corpus", "corpus.rsrc", "out.png",
+};
+
+static const uint32_t kPictType = UNREZ_TYPE('P', 'I', 'C', 'T');
+
+struct corpus {
+    char dir[32];
+    int dirfd;
+    void *rfork;
+    size_t rsize;
+};
+
+static struct corpus *corpus;
+
+/* Write a file in the corpus directory. */
+static void corpus_write(const char *name, const void *data, size_t size) {
+    const char *ptr = data;
+    ssize_t amt;
+    int fdes;
+    fdes = openat(corpus->dirfd, name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fdes == -1) {
+        die_errf(EX_CANTCREAT, errno, "%s", name);
+    }
+    while (size > 0) {
+        amt = write(fdes, ptr, size);
+        if (amt < 0) {
+            die_errf(EX_IOERR, errno, "%s", name);
+        }
+        ptr += amt;
+        size -= amt;
+    }
+    close(fdes);
+}
+
+/* Get the corpus, creating it if necessary. */
+static struct corpus *corpus_get(void) {
+    struct synth s;
+    unsigned char payload[64];
+    void *data;
+    size_t size;
+    int i, j;
+    if (corpus != NULL) {
+        return corpus;
+    }
+    corpus = calloc(1, sizeof(*corpus));
+    if (corpus == NULL) {
+        die_errf(EX_OSERR, errno, "calloc");
+    }
+    strcpy(corpus->dir, "/tmp/unrez_bench.XXXXXX");
+    if (mkdtemp(corpus->dir) == NULL) {
+        die_errf(EX_CANTCREAT, errno, "mkdtemp");
+    }
+    corpus->dirfd = open(corpus->dir, O_RDONLY);
+    if (corpus->dirfd == -1) {
+        die_errf(EX_CANTCREAT, errno, "%s", corpus->dir);
+    }
+
+    synth_init(&s);
+    for (i = 0; i < kCorpusFormatCount; i++) {
+        for (j = 0; j < kCorpusPicts; j++) {
+            synth_pict(&data, &size, kCorpusFormats[i].pixel_size,
+                       kCorpusFormats[i].flags, kCorpusWidth, kCorpusHeight,
+                       i * kCorpusPicts + j + 1);
+            synth_add(&s, kPictType, 128 + i * kCorpusPicts + j, NULL, data,
+                      size);
+            free(data);
+        }
+    }
+    memset(payload, 0x5a, sizeof(payload));
+    for (i = 0; i < kCorpusTypes; i++) {
+        for (j = 0; j < kCorpusPerType; j++) {
+            synth_add(&s,
+                      UNREZ_TYPE('a' + i % 26, 'A' + i / 26, 'x', '0' + j % 10),
+                      128 + j, NULL, payload, 1 + (i * 7 + j) % 64);
+        }
+    }
+    synth_finish(&s, &corpus->rfork, &corpus->rsize);
+    synth_destroy(&s);
+
+    synth_macbinary(&data, &size, "corpus", "data", 4, corpus->rfork,
+                    corpus->rsize);
+    corpus_write("corpus.bin", data, size);
+    free(data);
+    corpus_write("corpus", "data", 4);
+    synth_appledouble(&data, &size, corpus->rfork, corpus->rsize);
+    corpus_write("._corpus", data, size);
+    free(data);
+    corpus_write("corpus.rsrc", corpus->rfork, corpus->rsize);
+    return corpus;
+}
+
+static void corpus_destroy(void) {
+    int i;
+    if (corpus == NULL) {
+        return;
+    }
+    for (i = 0; i < (int)(sizeof(kCorpusFiles) / sizeof(*kCorpusFiles));
+         i++) {
+        unlinkat(corpus->dirfd, kCorpusFiles[i], 0);
+    }
+    close(corpus->dirfd);
+    rmdir(corpus->dir);
+    free(corpus->rfork);
+    free(corpus);
+    corpus = NULL;
+}
+
+/* Get the data for a picture in the corpus. */
+static void corpus_pict(struct unrez_resourcefork *rfork, int format, int n,
+                        const void **data, uint32_t *size) {
+    struct unrez_resource *rsrc;
+    int err;
+    err = unrez_resourcefork_findrsrc(rfork, &rsrc, kPictType,
+                                      128 + format * kCorpusPicts + n);
+    if (err == 0) {
+        err = unrez_resourcefork_getdata(rfork, rsrc, data, size);
+    }
+    if (err != 0) {
+        die_errf(EX_SOFTWARE, err, "corpus picture");
+    }
+}
+
+enum {
+    kOpenCount = 20000,
+    kOpenForkCount = 100,
+};
+
+static void open_run(const char *name, const char *path) {
+    struct unrez_forkedfile forks;
+    double t0, t1;
+    int i, err;
+    t0 = now();
+    for (i = 0; i < kOpenCount; i++) {
+        err = unrez_forkedfile_openat(&forks, corpus->dirfd, path);
+        if (err != 0) {
+            die_errf(EX_SOFTWARE, err, "%s", path);
+        }
+        unrez_forkedfile_close(&forks);
+    }
+    t1 = now();
+    report(name, kOpenCount, 0, t1 - t0);
+}
+
+static void bench_open(void) {
+    corpus_get();
+    open_run("open/macbinary", "corpus.bin");
+    open_run("open/appledouble", "._corpus");
+}
+
+static void openfork_run(const char *name, const struct unrez_fork *fork,
+                         const struct unrez_readopts *opts) {
+    struct unrez_resourcefork rfork;
+    double t0, t1;
+    int i, err;
+    t0 = now();
+    for (i = 0; i < kOpenForkCount; i++) {
+        err = unrez_resourcefork_openforkopts(&rfork, fork, opts);
+        if (err != 0) {
+            die_errf(EX_SOFTWARE, err, "openfork");
+        }
+        unrez_resourcefork_close(&rfork);
+    }
+    t1 = now();
+    report(name, kOpenForkCount, 0, t1 - t0);
+}
+
+static void bench_openfork(void) {
+    struct unrez_readopts opts;
+    struct unrez_forkedfile forks;
+    struct unrez_fork fork;
+    int err;
+    corpus_get();
+    err = unrez_forkedfile_openat(&forks, corpus->dirfd, "corpus.bin");
+    if (err != 0) {
+        die_errf(EX_SOFTWARE, err, "corpus.bin");
+    }
+    openfork_run("openfork/macbinary", &forks.rsrc, NULL);
+    unrez_forkedfile_close(&forks);
+    err = unrez_forkedfile_openat(&forks, corpus->dirfd, "._corpus");
+    if (err != 0) {
+        die_errf(EX_SOFTWARE, err, "._corpus");
+    }
+    openfork_run("openfork/appledouble", &forks.rsrc, NULL);
+    unrez_forkedfile_close(&forks);
+    fork.file = openat(corpus->dirfd, "corpus.rsrc", O_RDONLY);
+    if (fork.file == -1) {
+        die_errf(EX_NOINPUT, errno, "corpus.rsrc");
+    }
+    fork.offset = 0;
+    fork.size = corpus->rsize;
+    fork.mem = NULL;
+    openfork_run("openfork/raw", &fork, NULL);
+    memset(&opts, 0, sizeof(opts));
+    opts.flags = kUnrezReadNoMmap;
+    openfork_run("openfork/raw-read", &fork, &opts);
+    opts.flags = kUnrezReadPopulate;
+    openfork_run("openfork/raw-populate", &fork, &opts);
+    close(fork.file);
+}
+
+enum {
+    kDecodeRounds = 50,
+};
+
+static void bench_decode(void) {
+    struct unrez_resourcefork rfork;
+    const void *data[kCorpusPicts];
+    uint32_t size[kCorpusPicts];
+    char name[32];
+    double t0, t1, bytes;
+    int i, j, k, err;
+    corpus_get();
+    err = unrez_resourcefork_openmem(&rfork, corpus->rfork, corpus->rsize);
+    if (err != 0) {
+        die_errf(EX_SOFTWARE, err, "openmem");
+    }
+    for (i = 0; i < kCorpusFormatCount; i++) {
+        bytes = 0;
+        for (j = 0; j < kCorpusPicts; j++) {
+            corpus_pict(&rfork, i, j, &data[j], &size[j]);
+            bytes += size[j];
+        }
+        t0 = now();
+        for (k = 0; k < kDecodeRounds; k++) {
+            for (j = 0; j < kCorpusPicts; j++) {
+                unrez_pict_decode(&kPictCallbacks, data[j], size[j]);
+            }
+        }
+        t1 = now();
+        snprintf(name, sizeof(name), "decode/%s", kCorpusFormats[i].name);
+        report(name, kDecodeRounds * kCorpusPicts, bytes * kDecodeRounds,
+               t1 - t0);
+    }
+    unrez_resourcefork_close(&rfork);
+}
+
+/*
+ * State for timing a function called on pixel data from the pixels callback.
+ */
+struct pixtime {
+    double elapsed;
+    double bytes;
+    long count;
+    /* Copy of the last pixel data, if it is kept. */
+    int keep;
+    struct unrez_pixdata pix;
+};
+
+static int convert_pixels(void *ctx, int opcode, struct unrez_pixdata *pix) {
+    struct pixtime *pt = ctx;
+    double t0, t1;
+    int err;
+    (void)opcode;
+    pt->bytes += (double)pix->rowBytes * (pix->bounds.bottom - pix->bounds.top);
+    t0 = now();
+    err = unrez_pixdata_16to32(pix);
+    t1 = now();
+    if (err != 0) {
+        die_errf(EX_SOFTWARE, err, "16to32");
+    }
+    pt->elapsed += t1 - t0;
+    pt->count++;
+    return 0;
+}
+
+/* Convert 16-bit pictures to 32-bit with each SIMD level. */
+static void bench_convert(void) {
+    struct unrez_resourcefork rfork;
+    struct unrez_pict_callbacks cb = kPictCallbacks;
+    struct pixtime pt;
+    const void *data;
+    uint32_t size;
+    char name[32];
+    int i, j, k, err, level, saved;
+    corpus_get();
+    err = unrez_resourcefork_openmem(&rfork, corpus->rfork, corpus->rsize);
+    if (err != 0) {
+        die_errf(EX_SOFTWARE, err, "openmem");
+    }
+    cb.ctx = &pt;
+    cb.pixels = convert_pixels;
+    saved = unrez_simd_get();
+    for (level = kUnrezSimdNone; level <= kUnrezSimdNEON; level++) {
+        if (unrez_simd_set(level) != level) {
+            continue;
+        }
+        memset(&pt, 0, sizeof(pt));
+        for (i = 0; i < kCorpusFormatCount; i++) {
+            if (kCorpusFormats[i].pixel_size != 16) {
+                continue;
+            }
+            for (k = 0; k < kDecodeRounds; k++) {
+                for (j = 0; j < kCorpusPicts; j++) {
+                    corpus_pict(&rfork, i, j, &data, &size);
+                    unrez_pict_decode(&cb, data, size);
+                }
+            }
+        }
+        snprintf(name, sizeof(name), "convert/16to32/%s", kSimdNames[level]);
+        report(name, pt.count, pt.bytes, pt.elapsed);
+    }
+    unrez_simd_set(saved);
+    unrez_resourcefork_close(&rfork);
+}
+
+/* Keep the pixel data. The PNG writer takes 16-bit pixels as they are. */
+static int keep_pixels(void *ctx, int opcode, struct unrez_pixdata *pix) {
+    struct unrez_pixdata *out = ctx;
+    (void)opcode;
+    unrez_pixdata_destroy(out);
+    *out = *pix;
+    pix->data = NULL;
+    pix->ctTable = NULL;
+    return 0;
+}
+
+enum {
+    kPngRounds = 5,
+};
+
+static const char *const kPngPresets[] = {"default", "fast", "small"};
+
+static void bench_png(void) {
+    struct unrez_resourcefork rfork;
+    struct unrez_pict_callbacks cb = kPictCallbacks;
+    struct unrez_pixdata pix[kCorpusPicts];
+    struct wpng *w;
+    struct pngbuf buf = {0};
+    struct pngopts opts;
+    struct pngerr perr;
+    const void *data;
+    uint32_t size;
+    char name[32];
+    double t0, t1, bytes, outbytes;
+    int i, j, k, y, r, err, preset;
+    corpus_get();
+    err = unrez_resourcefork_openmem(&rfork, corpus->rfork, corpus->rsize);
+    if (err != 0) {
+        die_errf(EX_SOFTWARE, err, "openmem");
+    }
+    cb.pixels = keep_pixels;
+    for (i = 0; i < kCorpusFormatCount; i++) {
+        /* The output is the same for packed and unpacked pictures. */
+        if (kCorpusFormats[i].flags != 0) {
+            continue;
+        }
+        bytes = 0;
+        for (j = 0; j < kCorpusPicts; j++) {
+            memset(&pix[j], 0, sizeof(pix[j]));
+            cb.ctx = &pix[j];
+            corpus_pict(&rfork, i, j, &data, &size);
+            unrez_pict_decode(&cb, data, size);
+            if (pix[j].data == NULL) {
+                dief(EX_SOFTWARE, "no pixel data");
+            }
+            bytes += (double)pix[j].rowBytes *
+                     (pix[j].bounds.bottom - pix[j].bounds.top);
+        }
+        for (preset = 0; preset < (int)(sizeof(kPngPresets) /
+                                        sizeof(*kPngPresets));
+             preset++) {
+            opts.flags = 0;
+            pngopts_preset(&opts, preset);
+            outbytes = 0;
+            t0 = now();
+            for (k = 0; k < kPngRounds; k++) {
+                for (j = 0; j < kCorpusPicts; j++) {
+                    r = wpng_open(&w, corpus->dirfd, "out.png", &pix[j],
+                                  &buf, &opts, &perr);
+                    for (y = 0; r == 0 &&
+                                y < pix[j].bounds.bottom - pix[j].bounds.top;
+                         y++) {
+                        r = wpng_row(w, (const char *)pix[j].data +
+                                            (size_t)y * pix[j].rowBytes);
+                    }
+                    if (r == 0) {
+                        r = wpng_close(w);
+                    }
+                    if (r != 0) {
+                        pngerr_report(&perr);
+                        exit(r);
+                    }
+                    outbytes += buf.size;
+                }
+            }
+            t1 = now();
+            snprintf(name, sizeof(name), "png/%d/%s",
+                     kCorpusFormats[i].pixel_size, kPngPresets[preset]);
+            report(name, kPngRounds * kCorpusPicts, bytes * kPngRounds,
+                   t1 - t0);
+            if (!opt_tsv) {
+                printf("%-24s %8.1f%% of the pixel data\n", "",
+                       outbytes * 100 / (bytes * kPngRounds));
+            }
+        }
+        for (j = 0; j < kCorpusPicts; j++) {
+            unrez_pixdata_destroy(&pix[j]);
+        }
+    }
+    pngbuf_destroy(&buf);
+    unrez_resourcefork_close(&rfork);
+}
+
+enum {
+    kCrcSize = 1 << 20,
+    kCrcCount = 200,
+};
+
+/* Keeps the CRC from being optimized out. */
+static volatile unsigned crc_sink;
+
+/* The CRC one bit at a time, for comparison. */
+static unsigned crc_bitwise(const uint8_t *p, size_t n) {
+    unsigned crc = 0;
+    size_t i;
+    int bit;
+    for (i = 0; i < n; i++) {
+        crc ^= p[i] << 8;
+        for (bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) != 0 ? (crc << 1) ^ 0x1021 : crc << 1;
+            crc &= 0xffff;
+        }
+    }
+    return crc;
+}
+
+static void bench_crc(void) {
+    uint8_t *buf;
+    double t0, t1;
+    unsigned crc = 0;
+    int i;
+    buf = malloc(kCrcSize);
+    if (buf == NULL) {
+        die_errf(EX_OSERR, errno, "malloc");
+    }
+    rand_state = 1;
+    for (i = 0; i < kCrcSize; i++) {
+        buf[i] = rand_next();
+    }
+    t0 = now();
+    for (i = 0; i < kCrcCount / 20; i++) {
+        crc ^= crc_bitwise(buf, kCrcSize);
+    }
+    t1 = now();
+    report("crc/bitwise", kCrcCount / 20, (double)kCrcSize * (kCrcCount / 20),
+           t1 - t0);
+    t0 = now();
+    for (i = 0; i < kCrcCount; i++) {
+        crc ^= unrez_crc16(0, buf, kCrcSize);
+    }
+    t1 = now();
+    report("crc/table", kCrcCount, (double)kCrcSize * kCrcCount, t1 - t0);
+    crc_sink = crc;
+    free(buf);
+}
+
+enum {
+    kBinHexSize = 1 << 22,
+    kBinHexCount = 20,
+};
+
+static void bench_binhex(void) {
+    struct unrez_metadata mdata;
+    uint8_t *fork;
+    void *data, *forks;
+    size_t size;
+    double t0, t1;
+    int i, err;
+    fork = malloc(kBinHexSize);
+    if (fork == NULL) {
+        die_errf(EX_OSERR, errno, "malloc");
+    }
+    /* Noise, with some short runs so the run decoder has work to do. */
+    rand_state = 1;
+    for (i = 0; i < kBinHexSize; i++) {
+        fork[i] = (rand_next() & 0x700) == 0 && i > 0 ? fork[i - 1]
+                                                      : rand_next();
+    }
+    synth_binhex(&data, &size, "bench", fork, kBinHexSize / 2,
+                 fork + kBinHexSize / 2, kBinHexSize / 2);
+    t0 = now();
+    for (i = 0; i < kBinHexCount; i++) {
+        err = unrez_binhex_decode(&mdata, &forks, data, size);
+        if (err != 0) {
+            die_errf(EX_SOFTWARE, err, "unrez_binhex_decode");
+        }
+        free(mdata.filename);
+        free(forks);
+    }
+    t1 = now();
+    report("binhex", kBinHexCount, (double)size * kBinHexCount, t1 - t0);
+    free(data);
+    free(fork);
+}
+
+static const struct bench kBenchmarks[] = {
+    {"binhex", bench_binhex},
+    {"convert", bench_convert},
+    {"crc", bench_crc},
+    {"decode", bench_decode},
+    {"direct", bench_direct},
+    {"enum", bench_enum},
+    {"icons", bench_icons},
+    {"lookup", bench_lookup},
+    {"open", bench_open},
+    {"openfork", bench_openfork},
+    {"png", bench_png},
+    {"rows", bench_rows},
+    {"unpack", bench_unpack},
+};
+
+int main(int argc, char **argv) {
+    const struct bench *p = kBenchmarks,
+                       *e = p + sizeof(kBenchmarks) / sizeof(*kBenchmarks);
+    int i = 1;
+    if (i < argc && strcmp(argv[i], "-tsv") == 0) {
+        opt_tsv = 1;
+        i++;
+        puts("name\tops\tseconds\tns_per_op\tops_per_s\tmb_per_s");
+    }
+    if (i >= argc) {
+        for (; p != e; p++) {
+            p->run();
+        }
+        corpus_destroy();
+        return 0;
+    }
+    for (; i < argc; i++) {
+        for (p = kBenchmarks; p != e; p++) {
+            if (strcmp(p->name, argv[i]) == 0) {
+                break;
+            }
+        }
+        if (p == e) {
+            dief(EX_USAGE, "unknown benchmark '%s'", argv[i]);
+        }
+        p->run();
+    }
+    corpus_destroy();
+    return 0;
+}
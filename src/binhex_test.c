@@ -0,0 +1,327 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include "defs.h"
+
+#include "unrez.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+/*
+ * Test that BinHex files decode to the forks they were encoded from, with runs
+ * of every length and runs of the marker byte, with either line ending, and
+ * through unrez_forkedfile. Test that damaged and truncated files are rejected.
+ */
+
+static int test_count;
+static int failure_count;
+
+/* Fill a buffer with runs and noise, including runs of the marker byte. */
+static uint8_t *make_fork(size_t size, uint32_t seed) {
+    uint8_t *p;
+    size_t i, n;
+    uint32_t state = seed;
+    int c;
+    p = malloc(size > 0 ? size : 1);
+    if (p == NULL) {
+        die_errf(EX_OSERR, errno, "malloc");
+    }
+    for (i = 0; i < size; i += n) {
+        state = state * 1103515245u + 12345u;
+        n = (state >> 8) % 600 + 1;
+        if (n > size - i) {
+            n = size - i;
+        }
+        switch ((state >> 4) & 3) {
+        case 0:
+            memset(p + i, 0x90, n);
+            break;
+        case 1:
+            memset(p + i, state >> 20, n);
+            break;
+        default:
+            for (c = 0; c < (int)n; c++) {
+                state = state * 1103515245u + 12345u;
+                p[i + c] = (state & 0x100) != 0 ? 0x90 : state >> 16;
+            }
+            break;
+        }
+    }
+    return p;
+}
+
+/* Replace each LF with CR LF. */
+static void to_crlf(void **data, size_t *size) {
+    const uint8_t *p = *data;
+    uint8_t *q;
+    size_t i, n = 0;
+    q = malloc(*size * 2);
+    if (q == NULL) {
+        die_errf(EX_OSERR, errno, "malloc");
+    }
+    for (i = 0; i < *size; i++) {
+        if (p[i] == '\n') {
+            q[n++] = '\r';
+        }
+        q[n++] = p[i];
+    }
+    free(*data);
+    *data = q;
+    *size = n;
+}
+
+static void fail(const char *name, const char *msg) {
+    fprintf(stderr, "%s: %s\n", name, msg);
+    failure_count++;
+}
+
+/* Decode a file and check that the forks and metadata are correct. */
+static void check(const char *name, const void *data, size_t size,
+                  const uint8_t *dfork, size_t dsize, const uint8_t *rfork,
+                  size_t rsize) {
+    struct unrez_metadata mdata;
+    void *forks;
+    const uint8_t *p;
+    int err;
+    test_count++;
+    err = unrez_binhex_decode(&mdata, &forks, data, size);
+    if (err != 0) {
+        error_errf(err, "%s", name);
+        failure_count++;
+        return;
+    }
+    p = forks;
+    if (mdata.type != kUnrezTypeBinHex || mdata.filename_length != 4 ||
+        strcmp(mdata.filename, "file") != 0 ||
+        mdata.type_code != UNREZ_TYPE('B', 'I', 'N', 'A') ||
+        mdata.creator_code != UNREZ_TYPE('U', 'N', 'R', 'Z')) {
+        fail(name, "incorrect metadata");
+    } else if (mdata.data_offset != 0 || mdata.data_size != (int64_t)dsize ||
+               mdata.rsrc_offset != (int64_t)dsize ||
+               mdata.rsrc_size != (int64_t)rsize) {
+        fail(name, "incorrect fork sizes");
+    } else if ((dsize > 0 && memcmp(p, dfork, dsize) != 0) ||
+               (rsize > 0 && memcmp(p + dsize, rfork, rsize) != 0)) {
+        fail(name, "incorrect fork data");
+    }
+    free(mdata.filename);
+    free(forks);
+}
+
+/* Check that decoding a file fails. */
+static void check_fail(const char *name, const void *data, size_t size) {
+    struct unrez_metadata mdata;
+    void *forks;
+    int err;
+    test_count++;
+    err = unrez_binhex_decode(&mdata, &forks, data, size);
+    if (err == 0) {
+        fail(name, "damaged file was decoded");
+        free(mdata.filename);
+        free(forks);
+    }
+}
+
+static const size_t kSizes[] = {0, 1, 2, 3, 4, 255, 256, 1000, 5000, 100000};
+
+static void test_decode(void) {
+    struct unrez_metadata mdata;
+    uint8_t *dfork, *rfork, *copy;
+    void *data;
+    size_t dsize, rsize, size, i, j, pos;
+    char name[64];
+    uint32_t state = 1;
+    int n = sizeof(kSizes) / sizeof(*kSizes);
+    for (i = 0; i < (size_t)n; i++) {
+        for (j = 0; j < (size_t)n; j += 3) {
+            dsize = kSizes[i];
+            rsize = kSizes[(i + j) % n];
+            dfork = make_fork(dsize, i * 100 + j + 1);
+            rfork = make_fork(rsize, i * 100 + j + 50);
+            synth_binhex(&data, &size, "file", dfork, dsize, rfork, rsize);
+            snprintf(name, sizeof(name), "data %d, rsrc %d", (int)dsize,
+                     (int)rsize);
+            check(name, data, size, dfork, dsize, rfork, rsize);
+
+            /*
+             * Change one character, after the colon and before the last
+             * character, which may contain padding bits.
+             */
+            copy = malloc(size);
+            if (copy == NULL) {
+                die_errf(EX_OSERR, errno, "malloc");
+            }
+            memcpy(copy, data, size);
+            pos = size;
+            while (pos == size || copy[pos] == '\n' || copy[pos] == ':' ||
+                   copy[pos] == copy[pos - 1]) {
+                state = state * 1103515245u + 12345u;
+                pos = 48 + (state >> 8) % (size - 51);
+            }
+            copy[pos] = copy[pos - 1];
+            snprintf(name, sizeof(name), "data %d, rsrc %d, corrupt",
+                     (int)dsize, (int)rsize);
+            check_fail(name, copy, size);
+            free(copy);
+
+            /* Truncate the file, removing at least the final CRC. */
+            for (pos = 50; pos + 6 < size; pos += size / 7 + 1) {
+                snprintf(name, sizeof(name), "data %d, rsrc %d, size %d",
+                         (int)dsize, (int)rsize, (int)pos);
+                check_fail(name, data, pos);
+            }
+
+            to_crlf(&data, &size);
+            snprintf(name, sizeof(name), "data %d, rsrc %d, CRLF", (int)dsize,
+                     (int)rsize);
+            check(name, data, size, dfork, dsize, rfork, rsize);
+            free(data);
+            free(dfork);
+            free(rfork);
+        }
+    }
+
+    test_count++;
+    if (unrez_binhex_decode(&mdata, &data, "no data\n", 8) !=
+        kUnrezErrFormat) {
+        fail("no data", "not rejected as the wrong format");
+    }
+}
+
+static char root[64];
+static int rootfd;
+
+static void write_file(const char *name, const void *data, size_t size) {
+    int fd;
+    fd = openat(rootfd, name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        die_errf(EX_CANTCREAT, errno, "%s", name);
+    }
+    if (write(fd, data, size) != (ssize_t)size) {
+        die_errf(EX_IOERR, errno, "%s", name);
+    }
+    close(fd);
+}
+
+/* Check that a fork read through the forked file has the right contents. */
+static void check_fork(const char *name, const struct unrez_fork *fork,
+                       const void *expect, size_t size) {
+    struct unrez_data d;
+    int err;
+    err = unrez_fork_read(fork, &d);
+    if (err != 0) {
+        error_errf(err, "%s", name);
+        failure_count++;
+        return;
+    }
+    if (d.size != size || memcmp(d.data, expect, size) != 0) {
+        fail(name, "incorrect fork data");
+    }
+    unrez_data_destroy(&d);
+}
+
+static const char *const kFileNames[] = {"file.hqx", "tagged"};
+
+/* Test that unrez_forkedfile recognizes and decodes BinHex files. */
+static void test_forkedfile(void) {
+    struct unrez_forkedfile forks;
+    struct unrez_resourcefork rfork;
+    struct synth s;
+    void *rdata, *data;
+    size_t rsize, size;
+    int i, err;
+    const char *name;
+
+    synth_init(&s);
+    synth_add(&s, UNREZ_TYPE('T', 'E', 'X', 'T'), 128, "name", "hello", 5);
+    synth_add(&s, UNREZ_TYPE('T', 'E', 'X', 'T'), 129, NULL, "world", 5);
+    synth_finish(&s, &rdata, &rsize);
+    synth_destroy(&s);
+    synth_binhex(&data, &size, "file", "data", 4, rdata, rsize);
+
+    strcpy(root, "/tmp/unrez_binhex.XXXXXX");
+    if (mkdtemp(root) == NULL) {
+        die_errf(EX_CANTCREAT, errno, "mkdtemp");
+    }
+    rootfd = open(root, O_RDONLY);
+    if (rootfd == -1) {
+        die_errf(EX_CANTCREAT, errno, "%s", root);
+    }
+    write_file("file.hqx", data, size);
+    /* Without the extension, the tag line identifies the file. */
+    write_file("tagged", data, size);
+    /* A file with the extension but no data is an ordinary file. */
+    write_file("empty.hqx", "", 0);
+
+    for (i = 0; i < (int)(sizeof(kFileNames) / sizeof(*kFileNames)); i++) {
+        name = kFileNames[i];
+        test_count++;
+        err = unrez_forkedfile_openat(&forks, rootfd, name);
+        if (err != 0) {
+            error_errf(err, "%s", name);
+            failure_count++;
+            continue;
+        }
+        if (forks.metadata.type != kUnrezTypeBinHex) {
+            fail(name, "not recognized as BinHex");
+        }
+        check_fork(name, &forks.data, "data", 4);
+        check_fork(name, &forks.rsrc, rdata, rsize);
+        /* Resource forks in memory can be opened for streaming. */
+        err = unrez_resourcefork_openstream(&rfork, &forks.rsrc);
+        unrez_forkedfile_close(&forks);
+        if (err != 0) {
+            error_errf(err, "%s", name);
+            failure_count++;
+            continue;
+        }
+        if (rfork.type_count != 1 || rfork.types[0].count != 2) {
+            fail(name, "incorrect resource fork");
+        }
+        unrez_resourcefork_close(&rfork);
+    }
+
+    test_count++;
+    err = unrez_forkedfile_openat(&forks, rootfd, "empty.hqx");
+    if (err != 0) {
+        error_errf(err, "empty.hqx");
+        failure_count++;
+    } else {
+        if (forks.metadata.type != kUnrezTypeNone || forks.data.file == -1) {
+            fail("empty.hqx", "not opened as an ordinary file");
+        }
+        unrez_forkedfile_close(&forks);
+    }
+
+    for (i = 0; i < (int)(sizeof(kFileNames) / sizeof(*kFileNames)); i++) {
+        unlinkat(rootfd, kFileNames[i], 0);
+    }
+    unlinkat(rootfd, "empty.hqx", 0);
+    close(rootfd);
+    rmdir(root);
+    free(data);
+    free(rdata);
+}
+
+int main(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    test_decode();
+    test_forkedfile();
+    if (failure_count > 0) {
+        fprintf(stderr, "%d of %d tests failed\n", failure_count, test_count);
+        fputs("FAILED\n", stderr);
+        return 1;
+    }
+    printf("%d tests passed\n", test_count);
+    return 0;
+}
@@ -8,64 +8,311 @@
 
 #include "unrez.h"
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
 #include <sysexits.h>
 #include <unistd.h>
 
+static int opt_all;
+static int opt_framed;
+
+static const struct option kOptions[] = {
+    {"all", &opt_all, 0, opt_parse_true},
+    {"framed", &opt_framed, 0, opt_parse_true},
+    {0},
+};
+
+enum {
+    /* Resources written with each writev call. */
+    kBatchSize = 256,
+    /* Largest frame header: type, ID, name, and size. */
+    kFrameHeaderSize = 4 + 2 + 1 + 255 + 4,
+    /* Build a lookup index for more resources than this. */
+    kIndexMinimum = 8
+};
+
 static void cat_usage(FILE *fp) {
-    fputs("usage: unrez cat <file> <type> <id>\n", fp);
+    fputs(
+        "usage: unrez cat <file> <type> <id>\n"
+        "       unrez cat [-framed] <file> <type> <id> [<type> <id>]...\n"
+        "       unrez cat -all <file>\n",
+        fp);
+}
+
+/*
+ * Resources waiting to be written. Each resource has an iovec for its data,
+ * and one for its frame header, if frames are written.
+ */
+struct batch {
+    int framed;
+    int count;
+    int iov_count;
+    struct iovec iov[kBatchSize * 2];
+    unsigned char header[kBatchSize][kFrameHeaderSize];
+};
+
+/* Write the batch to standard output. */
+static void batch_flush(struct batch *b) {
+    struct iovec *iov = b->iov;
+    int n = b->iov_count;
+    ssize_t amt;
+    size_t rem;
+    while (n > 0) {
+        amt = writev(STDOUT_FILENO, iov, n);
+        if (amt < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            die_errf(EX_OSERR, errno, "could not write output");
+        }
+        rem = amt;
+        while (n > 0 && rem >= iov->iov_len) {
+            rem -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (rem > 0) {
+            iov->iov_base = (char *)iov->iov_base + rem;
+            iov->iov_len -= rem;
+        }
+    }
+    b->count = 0;
+    b->iov_count = 0;
+}
+
+static void put_u32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+/*
+ * Add a resource to the batch. Returns 0 on success, or an error code if the
+ * resource cannot be loaded.
+ */
+static int batch_add(struct batch *b, struct unrez_resourcefork *rfork,
+                     uint32_t type_code, struct unrez_resource *rsrc) {
+    const void *data;
+    const char *name;
+    unsigned char *p;
+    uint32_t size;
+    size_t name_size;
+    int err;
+    err = unrez_resourcefork_getdata(rfork, rsrc, &data, &size);
+    if (err != 0) {
+        return err;
+    }
+    if (b->framed) {
+        err = unrez_resourcefork_getname(rfork, rsrc, &name, &name_size);
+        if (err != 0) {
+            return err;
+        }
+        p = b->header[b->count];
+        put_u32(p, type_code);
+        p[4] = (unsigned)rsrc->id >> 8;
+        p[5] = rsrc->id;
+        p[6] = name_size;
+        if (name_size > 0) {
+            memcpy(p + 7, name, name_size);
+        }
+        put_u32(p + 7 + name_size, size);
+        b->iov[b->iov_count].iov_base = p;
+        b->iov[b->iov_count].iov_len = 11 + name_size;
+        b->iov_count++;
+    }
+    b->iov[b->iov_count].iov_base = (void *)data;
+    b->iov[b->iov_count].iov_len = size;
+    b->iov_count++;
+    b->count++;
+    if (b->count == kBatchSize) {
+        batch_flush(b);
+    }
+    return 0;
+}
+
+/*
+ * Find the resource for a type and ID selector, and check that its data and
+ * name can be read, so that batch_add will not fail.
+ */
+static struct unrez_resource *find_rsrc(struct unrez_resourcefork *rfork,
+                                        uint32_t type_code, int rsrc_id,
+                                        int framed) {
+    struct unrez_resource *rsrc;
+    const void *data;
+    const char *name;
+    char stype[kUnrezTypeWidth];
+    uint32_t size;
+    size_t name_size;
+    int err;
+    err = unrez_resourcefork_findrsrc(rfork, &rsrc, type_code, rsrc_id);
+    if (err == 0) {
+        err = unrez_resourcefork_getdata(rfork, rsrc, &data, &size);
+    }
+    if (err == 0 && framed) {
+        err = unrez_resourcefork_getname(rfork, rsrc, &name, &name_size);
+    }
+    if (err != 0) {
+        unrez_type_tostring(stype, sizeof(stype), type_code);
+        die_errf(EX_DATAERR, err, "could not load resource %s #%d", stype,
+                 rsrc_id);
+    }
+    return rsrc;
+}
+
+/* Write every resource in the fork, in the order they appear in the map. */
+static int cat_all(struct batch *b, struct unrez_resourcefork *rfork) {
+    struct unrez_resourcetype *type;
+    char stype[kUnrezTypeWidth];
+    int i, j, err, failed = 0;
+    err = unrez_resourcefork_loadall(rfork);
+    if (err != 0) {
+        die_errf(EX_OSERR, err, "could not load resources");
+    }
+    for (i = 0; i < rfork->type_count; i++) {
+        type = &rfork->types[i];
+        unrez_type_tostring(stype, sizeof(stype), type->type_code);
+        err = unrez_resourcefork_loadtype(rfork, type);
+        if (err != 0) {
+            error_errf(err, "could not load %s resources", stype);
+            failed = 1;
+            continue;
+        }
+        for (j = 0; j < type->count; j++) {
+            err = batch_add(b, rfork, type->type_code, &type->resources[j]);
+            if (err != 0) {
+                error_errf(err, "could not load resource %s #%d", stype,
+                           type->resources[j].id);
+                failed = 1;
+            }
+        }
+    }
+    return failed;
 }
 
 void cat_exec(int argc, char **argv) {
+    struct unrez_readopts opts;
+    struct unrez_forkedfile forks;
     struct unrez_resourcefork rfork;
-    struct unrez_resource *rsrc;
+    struct unrez_resource **rsrcs;
+    struct batch *b;
     const char *file;
     uint32_t type_code;
-    int res_id, err;
-    const void *data;
-    uint32_t size, pos;
-    ssize_t amt;
-    char stype[kUnrezTypeWidth];
-    if (argc != 3) {
-        errorf("expected three arguments");
+    int i, n, err, failed = 0;
+    /* IDs may be negative, so options are only recognized before the file. */
+    for (n = 0; n < argc && argv[n][0] == '-'; n++) {
+        if (strcmp(argv[n], "--") == 0) {
+            break;
+        }
+    }
+    i = n;
+    parse_options(kOptions, &i, &argv);
+    argv += n;
+    argc -= n;
+    if (argc > 0 && strcmp(argv[0], "--") == 0) {
+        argv++;
+        argc--;
+    }
+    if (opt_all ? argc != 1 : argc < 3 || (argc & 1) == 0) {
+        errorf(opt_all ? "expected one argument"
+                       : "expected a file, then type and ID pairs");
         cat_usage(stderr);
         exit(EX_USAGE);
     }
     file = argv[0];
-    err = unrez_type_fromstring(&type_code, argv[1]);
-    if (err != 0) {
-        dief(EX_USAGE, "invalid type code: '%s'", argv[1]);
+    /* Check the syntax of every selector before reading the file. */
+    for (i = 1; i < argc; i += 2) {
+        if (unrez_type_fromstring(&type_code, argv[i]) != 0) {
+            dief(EX_USAGE, "invalid type code: '%s'", argv[i]);
+        }
+        parse_id(argv[i + 1]);
     }
-    unrez_type_tostring(stype, sizeof(stype), type_code);
-    res_id = parse_id(argv[2]);
-    err = unrez_resourcefork_open(&rfork, file);
-    if (err != 0) {
-        die_errf(err > 0 ? EX_NOINPUT : EX_DATAERR, err, "%s", file);
+    b = malloc(sizeof(*b));
+    if (b == NULL) {
+        die_errf(EX_OSERR, errno, "malloc");
     }
-    err = unrez_resourcefork_findrsrc(&rfork, &rsrc, type_code, res_id);
-    if (err != 0) {
-        die_errf(EX_DATAERR, err, "could not find resource %s #%d", stype,
-                 res_id);
+    b->framed = opt_framed || opt_all || argc > 3;
+    b->count = 0;
+    b->iov_count = 0;
+
+    /*
+     * The data is written straight from the fork's memory. When writing most
+     * of the fork, have the kernel start reading all of it now.
+     */
+    memset(&opts, 0, sizeof(opts));
+    if (opt_all) {
+        opts.advice = kUnrezAdviseSequential;
+        opts.flags = kUnrezReadWillNeed;
+    } else {
+        opts.advice = kUnrezAdviseRandom;
+    }
+    err = unrez_forkedfile_open(&forks, file);
+    if (err == 0) {
+        err = unrez_resourcefork_openforkopts(&rfork, &forks.rsrc, &opts);
+        unrez_forkedfile_close(&forks);
     }
-    err = unrez_resourcefork_getdata(&rfork, rsrc, &data, &size);
     if (err != 0) {
-        die_errf(EX_DATAERR, err, "could not load resource %s #%d", stype,
-                 res_id);
+        die_errf(err > 0 ? EX_NOINPUT : EX_DATAERR, err, "%s", file);
     }
-    for (pos = 0; pos < size;) {
-        amt =
-            write(STDOUT_FILENO, (const unsigned char *)data + pos, size - pos);
-        if (amt < 0) {
-            die_errf(EX_OSERR, err, "could not write output");
+
+    if (opt_all) {
+        failed = cat_all(b, &rfork);
+    } else {
+        if (argc / 2 > kIndexMinimum) {
+            unrez_resourcefork_buildindex(&rfork);
         }
-        pos += amt;
+        /*
+         * Find every resource before writing any, so a missing resource does
+         * not leave a partial stream.
+         */
+        rsrcs = malloc(sizeof(*rsrcs) * (argc / 2));
+        if (rsrcs == NULL) {
+            die_errf(EX_OSERR, errno, "malloc");
+        }
+        for (i = 1; i < argc; i += 2) {
+            unrez_type_fromstring(&type_code, argv[i]);
+            rsrcs[i / 2] = find_rsrc(&rfork, type_code, parse_id(argv[i + 1]),
+                                     b->framed);
+        }
+        for (i = 1; i < argc; i += 2) {
+            unrez_type_fromstring(&type_code, argv[i]);
+            err = batch_add(b, &rfork, type_code, rsrcs[i / 2]);
+            if (err != 0) {
+                die_errf(EX_SOFTWARE, err, "could not load resource");
+            }
+        }
+        free(rsrcs);
     }
+    batch_flush(b);
+    free(b);
     unrez_resourcefork_close(&rfork);
+    if (failed) {
+        exit(EX_DATAERR);
+    }
 }
 
 void cat_help(void) {
     cat_usage(stdout);
-    fputs("Print a resource from a file's resource fork to standard output.\n",
-          stdout);
+    fputs(
+        "Print resources from a file's resource fork to standard output.\n"
+        "\n"
+        "With one resource, the data is printed as is. With several\n"
+        "resources, -all, or -framed, each resource is printed as a frame:\n"
+        "\n"
+        "  4 bytes   type code\n"
+        "  2 bytes   ID\n"
+        "  1 byte    name length, then the name in Mac OS Roman\n"
+        "  4 bytes   data size, then the data\n"
+        "\n"
+        "Numbers are big-endian, and IDs are signed. Options must come\n"
+        "before the file, since IDs may be negative. If any resource cannot\n"
+        "be read, nothing is printed.\n"
+        "\n"
+        "options:\n"
+        "  -all          print every resource in the fork\n"
+        "  -framed       print frames, even for one resource\n",
+        stdout);
 }
@@ -0,0 +1,242 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include "defs.h"
+
+#include "unrez.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+/*
+ * Test that unrez_resourcefork_copydata copies resources exactly, from memory
+ * forks and from streaming forks which start partway into a file, to regular
+ * files and to pipes, which take different paths through the kernel.
+ */
+
+enum {
+    kCount = 8,
+    /* Bytes in the file before the fork. */
+    kForkOffset = 1000,
+    /* Resources small enough to copy into an empty pipe without blocking. */
+    kPipeLimit = 16 * 1024
+};
+
+static const uint32_t kSizes[kCount] = {
+    0, 1, 100, 4096, 12345, 65536, 65537, 300000,
+};
+
+static int failure_count;
+static int test_count;
+
+static uint32_t type_code(void) {
+    return UNREZ_TYPE('T', 'e', 's', 't');
+}
+
+static int rsrc_byte(int i, uint32_t k) {
+    return (i * 37 + k * 7 + (k >> 8)) & 0xff;
+}
+
+static int make_temp(void) {
+    char path[] = "/tmp/unrez_copy_test.XXXXXX";
+    int fdes = mkstemp(path);
+    if (fdes == -1) {
+        die_errf(EX_CANTCREAT, errno, "%s", path);
+    }
+    unlink(path);
+    return fdes;
+}
+
+static void write_all(int fdes, const void *data, size_t size) {
+    size_t pos;
+    ssize_t amt;
+    for (pos = 0; pos < size; pos += amt) {
+        amt = write(fdes, (const char *)data + pos, size - pos);
+        if (amt < 0) {
+            die_errf(EX_IOERR, errno, "write");
+        }
+    }
+}
+
+/* Read everything from a file descriptor. */
+static unsigned char *read_all(int fdes, size_t *size) {
+    unsigned char *buf;
+    size_t pos = 0, alloc = 1024;
+    ssize_t amt;
+    buf = malloc(alloc);
+    if (buf == NULL) {
+        die_errf(EX_OSERR, errno, "malloc");
+    }
+    for (;;) {
+        if (pos == alloc) {
+            alloc *= 2;
+            buf = realloc(buf, alloc);
+            if (buf == NULL) {
+                die_errf(EX_OSERR, errno, "realloc");
+            }
+        }
+        amt = read(fdes, buf + pos, alloc - pos);
+        if (amt < 0) {
+            die_errf(EX_IOERR, errno, "read");
+        }
+        if (amt == 0) {
+            break;
+        }
+        pos += amt;
+    }
+    *size = pos;
+    return buf;
+}
+
+/* Check that the data is the contents of resource i. */
+static void check_data(const char *what, int i, const unsigned char *data,
+                       size_t size) {
+    uint32_t k;
+    test_count++;
+    if (size != kSizes[i]) {
+        fprintf(stderr, "%s, resource %d: size is %lu, expected %lu\n", what,
+                i, (unsigned long)size, (unsigned long)kSizes[i]);
+        failure_count++;
+        return;
+    }
+    for (k = 0; k < size; k++) {
+        if (data[k] != rsrc_byte(i, k)) {
+            fprintf(stderr, "%s, resource %d: incorrect data at %lu\n", what,
+                    i, (unsigned long)k);
+            failure_count++;
+            return;
+        }
+    }
+}
+
+/* Copy every resource to a file and to a pipe, and check the results. */
+static void test_fork(const char *what, struct unrez_resourcefork *rfork) {
+    struct unrez_resource *rsrc;
+    unsigned char *data;
+    size_t size;
+    int i, err, out, pipes[2];
+    for (i = 0; i < kCount; i++) {
+        err = unrez_resourcefork_findrsrc(rfork, &rsrc, type_code(), i);
+        if (err != 0) {
+            die_errf(EX_SOFTWARE, err, "findrsrc");
+        }
+        out = make_temp();
+        /* The data goes at the current position, after this. */
+        write_all(out, "x", 1);
+        err = unrez_resourcefork_copydata(rfork, rsrc, out);
+        if (err != 0) {
+            die_errf(EX_SOFTWARE, err, "%s: copydata", what);
+        }
+        if (lseek(out, 1, SEEK_SET) != 1) {
+            die_errf(EX_IOERR, errno, "lseek");
+        }
+        data = read_all(out, &size);
+        check_data(what, i, data, size);
+        free(data);
+        close(out);
+
+        if (kSizes[i] > kPipeLimit) {
+            continue;
+        }
+        if (pipe(pipes) != 0) {
+            die_errf(EX_OSERR, errno, "pipe");
+        }
+        err = unrez_resourcefork_copydata(rfork, rsrc, pipes[1]);
+        if (err != 0) {
+            die_errf(EX_SOFTWARE, err, "%s: copydata to pipe", what);
+        }
+        close(pipes[1]);
+        data = read_all(pipes[0], &size);
+        check_data(what, i, data, size);
+        free(data);
+        close(pipes[0]);
+    }
+}
+
+int main(int argc, char **argv) {
+    struct synth s;
+    struct unrez_fork fork;
+    struct unrez_resourcefork rfork;
+    struct unrez_resource *rsrc;
+    unsigned char *payload, junk[kForkOffset];
+    void *data;
+    size_t size;
+    uint32_t k;
+    int i, err, fdes, out;
+    (void)argc;
+    (void)argv;
+
+    payload = malloc(kSizes[kCount - 1]);
+    if (payload == NULL) {
+        die_errf(EX_OSERR, errno, "malloc");
+    }
+    synth_init(&s);
+    for (i = 0; i < kCount; i++) {
+        for (k = 0; k < kSizes[i]; k++) {
+            payload[k] = rsrc_byte(i, k);
+        }
+        synth_add(&s, type_code(), i, NULL, payload, kSizes[i]);
+    }
+    synth_finish(&s, &data, &size);
+    synth_destroy(&s);
+    free(payload);
+
+    err = unrez_resourcefork_openmem(&rfork, data, size);
+    if (err != 0) {
+        die_errf(EX_SOFTWARE, err, "openmem");
+    }
+    test_fork("memory fork", &rfork);
+    unrez_resourcefork_close(&rfork);
+
+    fdes = make_temp();
+    memset(junk, 0xaa, sizeof(junk));
+    write_all(fdes, junk, sizeof(junk));
+    write_all(fdes, data, size);
+    fork.file = fdes;
+    fork.offset = kForkOffset;
+    fork.size = size;
+    fork.mem = NULL;
+    err = unrez_resourcefork_openstream(&rfork, &fork);
+    if (err != 0) {
+        die_errf(EX_SOFTWARE, err, "openstream");
+    }
+    test_fork("streaming fork", &rfork);
+
+    /*
+     * Cut the file short after the map has been read. Copying the last
+     * resource should fail, rather than copy less data than it should.
+     */
+    err = unrez_resourcefork_findrsrc(&rfork, &rsrc, type_code(), kCount - 1);
+    if (err != 0) {
+        die_errf(EX_SOFTWARE, err, "findrsrc");
+    }
+    if (ftruncate(fdes, kForkOffset + size / 2) != 0) {
+        die_errf(EX_IOERR, errno, "ftruncate");
+    }
+    out = make_temp();
+    err = unrez_resourcefork_copydata(&rfork, rsrc, out);
+    test_count++;
+    if (err != kUnrezErrInvalid) {
+        fprintf(stderr, "truncated fork: copydata returned %d\n", err);
+        failure_count++;
+    }
+    close(out);
+    unrez_resourcefork_close(&rfork);
+    close(fdes);
+    free(data);
+
+    if (failure_count > 0) {
+        fprintf(stderr, "%d of %d tests failed\n", failure_count, test_count);
+        fputs("FAILED\n", stderr);
+        return 1;
+    }
+    printf("%d tests passed\n", test_count);
+    return 0;
+}
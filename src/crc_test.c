@@ -0,0 +1,84 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include "unrez.h"
+
+#include <stdio.h>
+
+/*
+ * Test that the table-driven CRC matches a bit-at-a-time CRC for every length
+ * and alignment, and when the data is split into pieces.
+ */
+
+static unsigned crc_ref(const unsigned char *p, size_t n) {
+    unsigned crc = 0;
+    size_t i;
+    int bit;
+    for (i = 0; i < n; i++) {
+        crc ^= p[i] << 8;
+        for (bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) != 0 ? (crc << 1) ^ 0x1021 : crc << 1;
+            crc &= 0xffff;
+        }
+    }
+    return crc;
+}
+
+static unsigned char buf[1024];
+
+int main(int argc, char **argv) {
+    uint32_t state = 1;
+    unsigned expect, got;
+    size_t off, len, cut;
+    int failures = 0, count = 0;
+    (void)argc;
+    (void)argv;
+
+    /* The standard check value for CRC-16/XMODEM. */
+    got = unrez_crc16(0, "123456789", 9);
+    count++;
+    if (got != 0x31c3) {
+        fprintf(stderr, "check value: got 0x%04x, expected 0x31c3\n", got);
+        failures++;
+    }
+
+    for (off = 0; off < sizeof(buf); off++) {
+        state = state * 1103515245u + 12345u;
+        buf[off] = state >> 16;
+    }
+    for (off = 0; off < 8; off++) {
+        for (len = 0; len <= 300; len++) {
+            expect = crc_ref(buf + off, len);
+            got = unrez_crc16(0, buf + off, len);
+            count++;
+            if (got != expect) {
+                fprintf(stderr,
+                        "offset %d, length %d: got 0x%04x, expected 0x%04x\n",
+                        (int)off, (int)len, got, expect);
+                failures++;
+            }
+            cut = len / 3;
+            got = unrez_crc16(unrez_crc16(0, buf + off, cut), buf + off + cut,
+                              len - cut);
+            count++;
+            if (got != expect) {
+                fprintf(stderr,
+                        "offset %d, length %d, split at %d: got 0x%04x, "
+                        "expected 0x%04x\n",
+                        (int)off, (int)len, (int)cut, got, expect);
+                failures++;
+            }
+        }
+    }
+
+    if (failures > 0) {
+        fprintf(stderr, "%d of %d tests failed\n", failures, count);
+        fputs("FAILED\n", stderr);
+        return 1;
+    }
+    printf("%d tests passed\n", count);
+    return 0;
+}
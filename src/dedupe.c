@@ -0,0 +1,158 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include "defs.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+/*
+ * The table uses open addressing with linear probing, and is kept at most half
+ * full. Entries with the same hash and size are compared byte for byte, so
+ * the hash only needs to be fast, not strong.
+ */
+
+struct dedupe_entry {
+    const void *data;
+    size_t size;
+    uint32_t hash;
+    void *value;
+};
+
+struct dedupe {
+    struct dedupe_entry *entries;
+    size_t count;
+    /* Number of entries, a power of two. */
+    size_t alloc;
+};
+
+enum {
+    kInitialSize = 64
+};
+
+static uint32_t rotl(uint32_t x, int n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+/* MurmurHash3, 32-bit version. */
+uint32_t dedupe_hash(const void *data, size_t size) {
+    const unsigned char *p = data;
+    uint32_t h = 0, k;
+    size_t i, n = size & ~(size_t)3;
+    for (i = 0; i < n; i += 4) {
+        k = (uint32_t)p[i] | ((uint32_t)p[i + 1] << 8) |
+            ((uint32_t)p[i + 2] << 16) | ((uint32_t)p[i + 3] << 24);
+        k *= 0xcc9e2d51u;
+        k = rotl(k, 15);
+        k *= 0x1b873593u;
+        h ^= k;
+        h = rotl(h, 13);
+        h = h * 5 + 0xe6546b64u;
+    }
+    if (n < size) {
+        k = 0;
+        for (i = size; i > n; i--) {
+            k = (k << 8) | p[i - 1];
+        }
+        k *= 0xcc9e2d51u;
+        k = rotl(k, 15);
+        k *= 0x1b873593u;
+        h ^= k;
+    }
+    h ^= (uint32_t)size;
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static struct dedupe_entry *alloc_entries(size_t count) {
+    struct dedupe_entry *e = calloc(count, sizeof(*e));
+    if (e == NULL) {
+        die_errf(EX_OSERR, errno, "calloc");
+    }
+    return e;
+}
+
+struct dedupe *dedupe_create(void) {
+    struct dedupe *d = malloc(sizeof(*d));
+    if (d == NULL) {
+        die_errf(EX_OSERR, errno, "malloc");
+    }
+    d->entries = alloc_entries(kInitialSize);
+    d->count = 0;
+    d->alloc = kInitialSize;
+    return d;
+}
+
+void dedupe_destroy(struct dedupe *d) {
+    free(d->entries);
+    free(d);
+}
+
+/* Double the size of the table. */
+static void dedupe_grow(struct dedupe *d) {
+    struct dedupe_entry *old = d->entries, *e;
+    size_t i, j, mask, old_alloc = d->alloc;
+    d->alloc = old_alloc * 2;
+    d->entries = alloc_entries(d->alloc);
+    mask = d->alloc - 1;
+    for (i = 0; i < old_alloc; i++) {
+        if (old[i].value == NULL) {
+            continue;
+        }
+        for (j = old[i].hash & mask;; j = (j + 1) & mask) {
+            e = &d->entries[j];
+            if (e->value == NULL) {
+                *e = old[i];
+                break;
+            }
+        }
+    }
+    free(old);
+}
+
+/* Find the entry for data, or the empty entry where it would go. */
+static struct dedupe_entry *dedupe_lookup(struct dedupe *d, const void *data,
+                                          size_t size, uint32_t hash) {
+    struct dedupe_entry *e;
+    size_t i, mask = d->alloc - 1;
+    for (i = hash & mask;; i = (i + 1) & mask) {
+        e = &d->entries[i];
+        if (e->value == NULL ||
+            (e->hash == hash && e->size == size &&
+             (size == 0 || memcmp(e->data, data, size) == 0))) {
+            return e;
+        }
+    }
+}
+
+void *dedupe_find(struct dedupe *d, const void *data, size_t size) {
+    return dedupe_lookup(d, data, size, dedupe_hash(data, size))->value;
+}
+
+void *dedupe_add(struct dedupe *d, const void *data, size_t size,
+                 void *value) {
+    struct dedupe_entry *e;
+    uint32_t hash = dedupe_hash(data, size);
+    e = dedupe_lookup(d, data, size, hash);
+    if (e->value != NULL) {
+        return e->value;
+    }
+    e->data = data;
+    e->size = size;
+    e->hash = hash;
+    e->value = value;
+    d->count++;
+    if (d->count * 2 > d->alloc) {
+        dedupe_grow(d);
+    }
+    return NULL;
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include "defs.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+/*
+ * Test that the dedupe table finds copies of data stored at other addresses,
+ * and only those, as the table grows.
+ */
+
+struct hcase {
+    const char *data;
+    uint32_t hash;
+};
+
+/* Published test vectors for MurmurHash3, with seed 0. */
+static const struct hcase kHashCases[] = {
+    {"", 0},
+    {"test", 0xba6bd213},
+    {"Hello, world!", 0xc0363e43},
+    {"The quick brown fox jumps over the lazy dog", 0x2e4ff723},
+};
+
+enum {
+    /* Number of distinct buffers. */
+    kCount = 1000,
+    kMaxSize = 64
+};
+
+static int failure_count;
+static int test_count;
+
+static void test_hash(void) {
+    const struct hcase *c;
+    uint32_t hash;
+    int i;
+    for (i = 0; i < (int)(sizeof(kHashCases) / sizeof(*kHashCases)); i++) {
+        c = &kHashCases[i];
+        test_count++;
+        hash = dedupe_hash(c->data, strlen(c->data));
+        if (hash != c->hash) {
+            fprintf(stderr, "hash \"%s\": got 0x%08lx, expected 0x%08lx\n",
+                    c->data, (unsigned long)hash, (unsigned long)c->hash);
+            failure_count++;
+        }
+    }
+}
+
+/*
+ * Fill buffer i. Many buffers share a size, and buffers with the same size
+ * differ in only one byte.
+ */
+static size_t fill(unsigned char *buf, int i) {
+    size_t size = i % kMaxSize + 1;
+    memset(buf, 0x55, kMaxSize);
+    buf[(i / kMaxSize) % size] = i / kMaxSize;
+    return size;
+}
+
+static void check(const char *what, int i, void *value, void *expect) {
+    test_count++;
+    if (value != expect) {
+        fprintf(stderr, "%s %d: incorrect value\n", what, i);
+        failure_count++;
+    }
+}
+
+static void test_table(void) {
+    struct dedupe *d;
+    unsigned char *first, *copy;
+    size_t size;
+    int i;
+    first = malloc(kCount * kMaxSize);
+    copy = malloc(kMaxSize);
+    if (first == NULL || copy == NULL) {
+        die_errf(EX_OSERR, errno, "malloc");
+    }
+    d = dedupe_create();
+    for (i = 0; i < kCount; i++) {
+        size = fill(first + i * kMaxSize, i);
+        check("add", i, dedupe_add(d, first + i * kMaxSize, size, &first[i]),
+              NULL);
+    }
+    for (i = 0; i < kCount; i++) {
+        size = fill(copy, i);
+        check("find", i, dedupe_find(d, copy, size), &first[i]);
+        check("copy", i, dedupe_add(d, copy, size, copy), &first[i]);
+    }
+    memset(copy, 0xaa, kMaxSize);
+    check("find missing", 0, dedupe_find(d, copy, kMaxSize), NULL);
+    check("add missing", 0, dedupe_add(d, copy, kMaxSize, copy), NULL);
+    check("find added", 0, dedupe_find(d, copy, kMaxSize), copy);
+    dedupe_destroy(d);
+    free(first);
+    free(copy);
+}
+
+int main(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    test_hash();
+    test_table();
+    if (failure_count > 0) {
+        fprintf(stderr, "%d of %d tests failed\n", failure_count, test_count);
+        fputs("FAILED\n", stderr);
+        return 1;
+    }
+    printf("%d tests passed\n", test_count);
+    return 0;
+}
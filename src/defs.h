@@ -9,6 +9,7 @@
 #include <stdarg.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
 
 /* Utility Functions */
 
@@ -64,6 +65,9 @@ void pictdump_help(void);
 void resx_exec(int argc, char **argv);
 void resx_help(void);
 
+void scan_exec(int argc, char **argv);
+void scan_help(void);
+
 /* Argument Parsing */
 
 /*
@@ -91,6 +95,12 @@ int sprint_size(char *buf, size_t bufsize, int64_t size);
  */
 int parse_id(const char *s);
 
+/*
+ * parse_jobs parses a string as a number of worker threads, or prints an error
+ * and exits the program. Zero means one thread per processor.
+ */
+int parse_jobs(const char *s);
+
 /*
  * An options the specification for a command-line option flag.
  */
@@ -125,9 +135,439 @@ void parse_options(const struct option *opt, int *argc, char ***argv);
 
 struct unrez_pixdata;
 
+struct wpng;
+
+/*
+ * A pngbuf holds an encoded PNG file until it is written, so the file is
+ * written with one call instead of one per chunk. A pngbuf can be reused for
+ * many files, one at a time, and starts out zeroed.
+ */
+struct pngbuf {
+    unsigned char *data;
+    size_t size;
+    size_t alloc;
+};
+
+/*
+ * pngbuf_destroy frees the memory used by a PNG buffer.
+ */
+void pngbuf_destroy(struct pngbuf *buf);
+
+/*
+ * Flags for PNG options.
+ */
+enum {
+    /*
+     * Write to a temporary file and rename it into place, so the file never
+     * appears partially written.
+     */
+    kPngAtomic = 1,
+    /*
+     * Always write direct color pictures as direct color, instead of using a
+     * palette when there are at most 256 colors.
+     */
+    kPngNoIndex = 2
+};
+
+/*
+ * Presets for PNG options.
+ */
+enum {
+    /* The LibPNG defaults. */
+    kPngPresetDefault,
+    /* Fast compression, for bulk extraction. */
+    kPngPresetFast,
+    /* The smallest files, for archival. */
+    kPngPresetSmall
+};
+
+/*
+ * Options for encoding PNG files. For the level, filters, and strategy, -1
+ * means that LibPNG chooses.
+ */
+struct pngopts {
+    int flags;
+    /* The zlib compression level, from 0 to 9. */
+    int level;
+    /* A mask of PNG_FILTER_* values, only used for direct color pictures. */
+    int filters;
+    /* The zlib strategy, such as Z_RLE. */
+    int strategy;
+    /*
+     * The filters and strategy for 16-bit pictures, or -1 to use the ones
+     * above. Their 5-bit channels repeat exactly, which filtering can hide.
+     */
+    int filters16;
+    int strategy16;
+};
+
+/*
+ * pngopts_preset sets PNG options from a preset, leaving the flags unchanged.
+ */
+void pngopts_preset(struct pngopts *opts, int preset);
+
+/*
+ * The pngopts_parse functions parse option values for PNG options, or print an
+ * error and exit. A preset is "default", "fast", or "small". Filters are a
+ * comma-separated list of "none", "sub", "up", "avg", and "paeth", or "all". A
+ * strategy is "default", "filtered", "huffman", "rle", or "fixed".
+ */
+int pngopts_parse_preset(const char *s);
+int pngopts_parse_level(const char *s);
+int pngopts_parse_filters(const char *s);
+int pngopts_parse_strategy(const char *s);
+
+/*
+ * A pngerr describes an error writing a PNG file. The PNG writer does not exit
+ * or print messages itself, since it may run on a worker thread.
+ */
+struct pngerr {
+    /* The exit status for the error, such as EX_CANTCREAT. */
+    int status;
+    /* An errno value, or 0 if there is none. */
+    int code;
+    /* What failed, such as a file name, or the message from LibPNG. */
+    char msg[256];
+};
+
+/*
+ * pngerr_report prints a PNG writer error to stderr.
+ */
+void pngerr_report(const struct pngerr *err);
+
+/*
+ * wpng_open starts a PNG file for pixel data which will be written one row at
+ * a time. The data pointer in pix is not used. The file is encoded into the
+ * buffer and created by wpng_close. Errors from this writer are stored in err.
+ *
+ * wpng_open, wpng_row, and wpng_close return 0 on success, or the exit status
+ * for the error on failure. After wpng_open or wpng_close fails, the writer is
+ * freed, and after wpng_row fails, it must be freed with wpng_abort.
+ */
+int wpng_open(struct wpng **wp, int dirfd, const char *name,
+              const struct unrez_pixdata *pix, struct pngbuf *buf,
+              const struct pngopts *opts, struct pngerr *err);
+
+/*
+ * wpng_row writes the next row of pixel data to a PNG file.
+ */
+int wpng_row(struct wpng *w, const void *row);
+
+/*
+ * wpng_close finishes writing a PNG file after all rows are written, and frees
+ * the writer.
+ */
+int wpng_close(struct wpng *w);
+
+/*
+ * wpng_abort discards an incomplete PNG file without creating it.
+ */
+void wpng_abort(struct wpng *w);
+
+/* Work Pool */
+
+/*
+ * A job is a unit of work for a pool. Jobs are run in any order, possibly at
+ * the same time, but they are finished in the order they were submitted.
+ */
+struct job {
+    /*
+     * Run the job. Called on a worker thread, or on the submitting thread if
+     * the pool has no workers.
+     */
+    void (*run)(struct job *job);
+    /*
+     * Finish the job, after run() returns. Always called on the submitting
+     * thread, one job at a time, in the order that jobs were submitted. The job
+     * may be freed here.
+     */
+    void (*finish)(struct job *job);
+    /* Private fields. */
+    struct job *next_pending, *next_order;
+    int done;
+};
+
+struct pool;
+
+/*
+ * pool_create creates a pool with the given number of worker threads. If the
+ * count is 1 or less, jobs are run on the submitting thread as they are
+ * submitted.
+ */
+struct pool *pool_create(int thread_count);
+
+/*
+ * pool_submit adds a job to the pool. This may finish earlier jobs, and waits
+ * if too many jobs are in progress.
+ */
+void pool_submit(struct pool *pool, struct job *job);
+
+/*
+ * pool_destroy finishes all remaining jobs, stops the worker threads, and frees
+ * the pool.
+ */
+void pool_destroy(struct pool *pool);
+
+/*
+ * A filejob is a job which reads one input file and prints a report about it.
+ * Jobs print to out, which is standard output when running one job at a time,
+ * and a memory buffer otherwise, so reports appear in the order of the files.
+ * A failure stops the report for that file, but not for other files.
+ */
+struct filejob {
+    struct job job;
+    const char *file;
+    /* If set, failures are reported as JSON records in the output. */
+    int json;
+    FILE *out;
+    char *outbuf;
+    size_t outsize;
+    /* Exit status for a failure, or 0. */
+    int status;
+    int err;
+    char msg[256];
+};
+
+/*
+ * filejob_start sets up the output for a job, at the start of its run
+ * function. The output is buffered if buffered is set.
+ */
+void filejob_start(struct filejob *j, int buffered);
+
+/*
+ * filejob_fail records that a job failed with the given exit status and error
+ * code, from errno or UnRez, which may be 0. If msg is NULL, the message is
+ * the filename.
+ */
+void filejob_fail(struct filejob *j, int status, int err, const char *msg,
+                  ...) __attribute__((format(printf, 4, 5)));
+
+/*
+ * filejob_finish prints the job's output and failure, from the job's finish
+ * function. Returns the job's exit status.
+ */
+int filejob_finish(struct filejob *j);
+
+/*
+ * fput_json writes a string as a JSON string literal. Valid UTF-8 is written as
+ * is, and other bytes are escaped as \u00XX, the Latin-1 character with the
+ * same value, so the output is always valid JSON.
+ */
+void fput_json(FILE *fp, const char *s, size_t len);
+
+/* Duplicate Data */
+
+struct dedupe;
+
+/*
+ * dedupe_create creates an empty table of data, for finding copies of data
+ * which has been seen before. The table does not copy the data, which must
+ * stay valid until the table is destroyed.
+ */
+struct dedupe *dedupe_create(void);
+
+/*
+ * dedupe_destroy frees a table of data.
+ */
+void dedupe_destroy(struct dedupe *d);
+
+/*
+ * dedupe_add looks for data in the table. If identical data was added before,
+ * returns the value it was added with. Otherwise, adds the data with the given
+ * value, which must not be NULL, and returns NULL.
+ */
+void *dedupe_add(struct dedupe *d, const void *data, size_t size, void *value);
+
+/*
+ * dedupe_find looks for data in the table without adding it. If identical data
+ * was added before, returns the value it was added with. Otherwise, returns
+ * NULL.
+ */
+void *dedupe_find(struct dedupe *d, const void *data, size_t size);
+
+/*
+ * dedupe_hash returns the hash used to look up data in the table, which is
+ * MurmurHash3 with a seed of 0.
+ */
+uint32_t dedupe_hash(const void *data, size_t size);
+
+/* Manifest */
+
+/*
+ * The identity of a file, for noticing when it changes.
+ */
+struct mstat {
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_sec;
+    long mtime_nsec;
+};
+
+/*
+ * mstat_get gets the identity of an open file, and mstat_getat gets the
+ * identity of a file by path. Returns 0 on success, or an errno value.
+ */
+int mstat_get(struct mstat *st, int fd);
+int mstat_getat(struct mstat *st, int dirfd, const char *path);
+
+/*
+ * mstat_equal returns nonzero if two identities are the same.
+ */
+int mstat_equal(const struct mstat *x, const struct mstat *y);
+
+enum {
+    /* The most files an input is read from, for its two forks. */
+    kMInputMaxFiles = 2
+};
+
+/*
+ * An minput is an input recorded in a manifest: the files it was read from,
+ * and the names of the output files made from it.
+ */
+struct minput {
+    char *path;
+    int file_count;
+    struct mstat files[kMInputMaxFiles];
+    /* Set if the input has a resource fork, with the hash of its map. */
+    int has_map;
+    uint32_t map_hash;
+    char **outputs;
+    int output_count;
+    int output_alloc;
+    /* Set if some output could not be made, so the input is not recorded. */
+    int failed;
+    /* Private. */
+    struct minput *next;
+};
+
+/*
+ * A manifest records the inputs converted by earlier runs, so later runs can
+ * skip inputs which have not changed. It is a text file in the output
+ * directory. The fields are private.
+ */
+struct manifest {
+    char *config;
+    struct minput *first, **last;
+    struct dedupe *index;
+};
+
+/*
+ * manifest_read reads a manifest from a directory. The config describes the
+ * options which affect the outputs. If the file does not exist, is invalid, or
+ * was written with a different config, returns an empty manifest.
+ */
+struct manifest *manifest_read(int dirfd, const char *name,
+                               const char *config);
+
+/*
+ * manifest_input returns the entry for an input, creating an empty entry if
+ * there is none. Empty entries are not written.
+ */
+struct minput *manifest_input(struct manifest *m, const char *path);
+
+/*
+ * minput_reset removes everything recorded about an input except its path,
+ * so it can be recorded again.
+ */
+void minput_reset(struct minput *in);
+
+/*
+ * minput_addoutput records an output file made from an input.
+ */
+void minput_addoutput(struct minput *in, const char *name);
+
+/*
+ * manifest_write writes a manifest to a directory, replacing the file
+ * atomically. Inputs which failed are left out, so they are tried again.
+ */
+void manifest_write(struct manifest *m, int dirfd, const char *name);
+
+/*
+ * manifest_destroy frees a manifest.
+ */
+void manifest_destroy(struct manifest *m);
+
+/* Synthetic Data */
+
+/*
+ * A synth builds a synthetic resource fork in memory, for tests and
+ * benchmarks. The fields are private.
+ */
+struct synth {
+    struct synth_entry *entries;
+    size_t entry_count, entry_cap;
+    uint8_t *data;
+    size_t data_size, data_cap;
+    uint8_t *names;
+    size_t names_size, names_cap;
+};
+
+/*
+ * synth_init initializes an empty resource fork builder.
+ */
+void synth_init(struct synth *s);
+
+/*
+ * synth_destroy frees memory used by a resource fork builder.
+ */
+void synth_destroy(struct synth *s);
+
+/*
+ * synth_add adds a resource to a resource fork builder. The name may be NULL.
+ * Resources are grouped by type when the fork is built, but otherwise stay in
+ * the order they were added.
+ */
+void synth_add(struct synth *s, uint32_t type_code, int id, const char *name,
+               const void *data, size_t size);
+
+/*
+ * synth_finish builds the resource fork, returning a buffer allocated with
+ * malloc. The builder can still be used or destroyed afterwards.
+ */
+void synth_finish(struct synth *s, void **data, size_t *size);
+
+/*
+ * Flags for synth_pict.
+ */
+enum {
+    /* Give 32-bit pixels an alpha channel. */
+    kSynthAlpha = 1,
+    /* Store pixels without compression. */
+    kSynthUnpacked = 2
+};
+
+/*
+ * synth_pict builds a version 2 QuickDraw picture containing one bitmap or
+ * pixmap with the given pixel size: 1, 8, 16, or 32. The picture does not have
+ * the 512-byte header. The image is pseudorandom, with flat areas and noise, so
+ * it compresses somewhat like a real picture. Returns a buffer allocated with
+ * malloc.
+ */
+void synth_pict(void **data, size_t *size, int pixel_size, int flags,
+                int width, int height, uint32_t seed);
+
+/*
+ * synth_macbinary encodes a file as MacBinary II. Returns a buffer allocated
+ * with malloc.
+ */
+void synth_macbinary(void **data, size_t *size, const char *name,
+                     const void *dfork, size_t dsize, const void *rfork,
+                     size_t rsize);
+
+/*
+ * synth_appledouble builds the AppleDouble header file, which contains the
+ * resource fork of a file. Returns a buffer allocated with malloc.
+ */
+void synth_appledouble(void **data, size_t *size, const void *rfork,
+                       size_t rsize);
+
 /*
- * write_png writes pixel data to a PNG file.
+ * synth_binhex encodes a file as BinHex 4.0, with run-length encoding, and 64
+ * characters per line. Returns a buffer allocated with malloc.
  */
-void write_png(int dirfd, const char *name, const struct unrez_pixdata *pix);
+void synth_binhex(void **data, size_t *size, const char *name,
+                  const void *dfork, size_t dsize, const void *rfork,
+                  size_t rsize);
 
 #endif
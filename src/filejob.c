@@ -0,0 +1,153 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include "defs.h"
+
+#include "unrez.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+void filejob_start(struct filejob *j, int buffered) {
+    if (buffered) {
+        j->out = open_memstream(&j->outbuf, &j->outsize);
+        if (j->out == NULL) {
+            die_errf(EX_OSERR, errno, "open_memstream");
+        }
+    } else {
+        j->out = stdout;
+    }
+}
+
+void filejob_fail(struct filejob *j, int status, int err, const char *msg,
+                  ...) {
+    va_list ap;
+    char ebuf[256], text[512];
+    j->status = status;
+    j->err = err;
+    j->msg[0] = '\0';
+    if (msg != NULL) {
+        va_start(ap, msg);
+        vsnprintf(j->msg, sizeof(j->msg), msg, ap);
+        va_end(ap);
+    }
+    if (!j->json) {
+        return;
+    }
+    if (err != 0 && unrez_strerror(err, ebuf, sizeof(ebuf)) != 0) {
+        snprintf(ebuf, sizeof(ebuf), "error #%d", err);
+    }
+    snprintf(text, sizeof(text), "%s%s%s", j->msg,
+             j->msg[0] != '\0' && err != 0 ? ": " : "", err != 0 ? ebuf : "");
+    fputs("{\"file\":", j->out);
+    fput_json(j->out, j->file, strlen(j->file));
+    fputs(",\"error\":", j->out);
+    fput_json(j->out, text, strlen(text));
+    fputs("}\n", j->out);
+}
+
+int filejob_finish(struct filejob *j) {
+    if (j->out != stdout) {
+        if (fclose(j->out) != 0) {
+            die_errf(EX_OSERR, errno, "fclose");
+        }
+        fwrite(j->outbuf, 1, j->outsize, stdout);
+        free(j->outbuf);
+    }
+    if (j->status != 0 && !j->json) {
+        fflush(stdout);
+        if (j->msg[0] == '\0') {
+            error_errf(j->err, "%s", j->file);
+        } else if (j->err != 0) {
+            error_errf(j->err, "%s: %s", j->file, j->msg);
+        } else {
+            errorf("%s: %s", j->file, j->msg);
+        }
+    }
+    return j->status;
+}
+
+/*
+ * Get the length of the UTF-8 sequence starting with a byte of 0x80 or more,
+ * or 0 if it is not valid. Overlong sequences, surrogates, and code points past
+ * U+10FFFF are not valid.
+ */
+static int utf8_length(const unsigned char *p, const unsigned char *e) {
+    unsigned lo = 0x80, hi = 0xbf;
+    int i, n;
+    if (*p >= 0xc2 && *p <= 0xdf) {
+        n = 2;
+    } else if (*p >= 0xe0 && *p <= 0xef) {
+        n = 3;
+        if (*p == 0xe0) {
+            lo = 0xa0;
+        } else if (*p == 0xed) {
+            hi = 0x9f;
+        }
+    } else if (*p >= 0xf0 && *p <= 0xf4) {
+        n = 4;
+        if (*p == 0xf0) {
+            lo = 0x90;
+        } else if (*p == 0xf4) {
+            hi = 0x8f;
+        }
+    } else {
+        return 0;
+    }
+    if (e - p < n) {
+        return 0;
+    }
+    for (i = 1; i < n; i++) {
+        if (p[i] < lo || p[i] > hi) {
+            return 0;
+        }
+        lo = 0x80;
+        hi = 0xbf;
+    }
+    return n;
+}
+
+void fput_json(FILE *fp, const char *s, size_t len) {
+    const unsigned char *p = (const unsigned char *)s, *e = p + len;
+    int n;
+    fputc('"', fp);
+    for (; p != e; p++) {
+        switch (*p) {
+        case '"':
+            fputs("\\\"", fp);
+            break;
+        case '\\':
+            fputs("\\\\", fp);
+            break;
+        case '\n':
+            fputs("\\n", fp);
+            break;
+        case '\r':
+            fputs("\\r", fp);
+            break;
+        case '\t':
+            fputs("\\t", fp);
+            break;
+        default:
+            if (*p < 0x20 || *p == 0x7f) {
+                fprintf(fp, "\\u%04x", *p);
+            } else if (*p < 0x80) {
+                fputc(*p, fp);
+            } else if ((n = utf8_length(p, e)) > 0) {
+                fwrite(p, 1, n, fp);
+                p += n - 1;
+            } else {
+                /* Not UTF-8, written as the Latin-1 character. */
+                fprintf(fp, "\\u%04x", *p);
+            }
+            break;
+        }
+    }
+    fputc('"', fp);
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include "defs.h"
+
+#include "unrez.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+/*
+ * Test that lookups give the same results with and without the index, for a
+ * map which lists the same type twice.
+ */
+
+enum {
+    kMapHeaderSize = 30,
+    kMinID = -2,
+    kMaxID = 12
+};
+
+static int test_count;
+static int failure_count;
+
+static const uint32_t kFirst = UNREZ_TYPE('D', 'u', 'p', '1');
+static const uint32_t kSecond = UNREZ_TYPE('D', 'u', 'p', '2');
+static const uint32_t kOther = UNREZ_TYPE('Z', 'z', 'z', 'z');
+
+/*
+ * Build a fork with resources 1-5 in the first type and 3-8 in the second,
+ * then give the second type the same code as the first.
+ */
+static void build(void **data, size_t *size) {
+    struct synth s;
+    uint8_t *p, *map;
+    uint32_t map_offset;
+    int i;
+    synth_init(&s);
+    for (i = 1; i <= 5; i++) {
+        synth_add(&s, kFirst, i, NULL, "first", 5);
+    }
+    for (i = 3; i <= 8; i++) {
+        synth_add(&s, kSecond, i, NULL, "second", 6);
+    }
+    synth_add(&s, kOther, 1, NULL, "other", 5);
+    synth_finish(&s, data, size);
+    synth_destroy(&s);
+    p = *data;
+    map_offset = ((uint32_t)p[4] << 24) | ((uint32_t)p[5] << 16) |
+                 ((uint32_t)p[6] << 8) | p[7];
+    map = p + map_offset + kMapHeaderSize;
+    memcpy(map + 8, map, 4);
+}
+
+static void check(struct unrez_resourcefork *plain,
+                  struct unrez_resourcefork *indexed, uint32_t type_code,
+                  int rsrc_id) {
+    struct unrez_resource *r1, *r2;
+    int e1, e2;
+    test_count++;
+    e1 = unrez_resourcefork_findrsrc(plain, &r1, type_code, rsrc_id);
+    e2 = unrez_resourcefork_findrsrc(indexed, &r2, type_code, rsrc_id);
+    if (e1 != e2) {
+        fprintf(stderr, "#%d: error %d without index, %d with index\n",
+                rsrc_id, e1, e2);
+        failure_count++;
+    } else if (e1 == 0 && (r1->id != r2->id || r1->offset != r2->offset)) {
+        fprintf(stderr, "#%d: found different resources\n", rsrc_id);
+        failure_count++;
+    }
+}
+
+int main(int argc, char **argv) {
+    struct unrez_resourcefork plain, indexed;
+    void *data;
+    size_t size;
+    int i, err;
+    (void)argc;
+    (void)argv;
+    build(&data, &size);
+    err = unrez_resourcefork_openmem(&plain, data, size);
+    if (err == 0) {
+        err = unrez_resourcefork_openmem(&indexed, data, size);
+    }
+    if (err == 0) {
+        err = unrez_resourcefork_buildindex(&indexed);
+    }
+    if (err != 0) {
+        die_errf(EX_SOFTWARE, err, "open");
+    }
+    for (i = kMinID; i <= kMaxID; i++) {
+        check(&plain, &indexed, kFirst, i);
+        check(&plain, &indexed, kSecond, i);
+        check(&plain, &indexed, kOther, i);
+    }
+    unrez_resourcefork_close(&plain);
+    unrez_resourcefork_close(&indexed);
+    free(data);
+    if (failure_count > 0) {
+        fprintf(stderr, "%d of %d tests failed\n", failure_count, test_count);
+        fputs("FAILED\n", stderr);
+        return 1;
+    }
+    printf("%d tests passed\n", test_count);
+    return 0;
+}
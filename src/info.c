@@ -8,30 +8,54 @@
 
 #include "unrez.h"
 
+#include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sysexits.h>
 
+static int opt_jobs = 1;
+static int opt_json;
+
+static void opt_parse_jobs(void *value, const char *option, const char *arg) {
+    (void)value;
+    (void)option;
+    opt_jobs = parse_jobs(arg);
+}
+
 static const struct option kOptions[] = {
-    {"bytes", &opt_bytes, 0, opt_parse_true}, {0},
+    {"bytes", &opt_bytes, 0, opt_parse_true},
+    {"j", NULL, 1, opt_parse_jobs},
+    {"json", &opt_json, 0, opt_parse_true},
+    {0},
 };
 
+static int exit_status;
+
 static void info_usage(FILE *fp) {
     fputs("usage: unrez info [<options>] <file>...\n", fp);
 }
 
-void info_exec(int argc, char **argv) {
-    int i, r;
+static void info_run(struct job *job) {
+    struct filejob *j = (struct filejob *)job;
     struct unrez_forkedfile forks;
-    const char *file, *ds, *rs;
+    const char *ds, *rs;
     char dsize[SIZE_WIDTH], rsize[SIZE_WIDTH];
-    parse_options(kOptions, &argc, &argv);
-    for (i = 0; i < argc; i++) {
-        file = argv[i];
-        r = unrez_forkedfile_open(&forks, file);
-        if (r != 0) {
-            die_errf(r > 0 ? EX_NOINPUT : EX_DATAERR, r, "%s", file);
-        }
+    int r;
+    filejob_start(j, opt_jobs > 1);
+    r = unrez_forkedfile_open(&forks, j->file);
+    if (r != 0) {
+        filejob_fail(j, r > 0 ? EX_NOINPUT : EX_DATAERR, r, NULL);
+        return;
+    }
+    if (opt_json) {
+        fputs("{\"file\":", j->out);
+        fput_json(j->out, j->file, strlen(j->file));
+        fprintf(j->out, ",\"data_size\":%" PRId64 ",\"rsrc_size\":%" PRId64
+                        "}\n",
+                forks.data.size, forks.rsrc.size);
+    } else {
         if (forks.data.size > 0) {
             sprint_size(dsize, sizeof(dsize), forks.data.size);
             ds = dsize;
@@ -44,8 +68,40 @@ void info_exec(int argc, char **argv) {
         } else {
             rs = "--";
         }
-        printf("%10s data,  %10s rsrc  %s\n", ds, rs, file);
-        unrez_forkedfile_close(&forks);
+        fprintf(j->out, "%10s data,  %10s rsrc  %s\n", ds, rs, j->file);
+    }
+    unrez_forkedfile_close(&forks);
+}
+
+static void info_finish(struct job *job) {
+    struct filejob *j = (struct filejob *)job;
+    int status = filejob_finish(j);
+    if (status != 0 && exit_status == 0) {
+        exit_status = status;
+    }
+    free(j);
+}
+
+void info_exec(int argc, char **argv) {
+    struct filejob *j;
+    struct pool *pool;
+    int i;
+    parse_options(kOptions, &argc, &argv);
+    pool = pool_create(opt_jobs);
+    for (i = 0; i < argc; i++) {
+        j = calloc(1, sizeof(*j));
+        if (j == NULL) {
+            die_errf(EX_OSERR, errno, "calloc");
+        }
+        j->job.run = info_run;
+        j->job.finish = info_finish;
+        j->file = argv[i];
+        j->json = opt_json;
+        pool_submit(pool, &j->job);
+    }
+    pool_destroy(pool);
+    if (exit_status != 0) {
+        exit(exit_status);
     }
 }
 
@@ -54,7 +110,16 @@ void info_help(void) {
     fputs(
         "Print information about a file and its resource fork.\n"
         "\n"
+        "A file which cannot be read is reported, and the other files are\n"
+        "still listed. The exit status is from the first failure.\n"
+        "\n"
         "options:\n"
-        "  -bytes        display sizes in bytes instead of using prefixes\n",
+        "  -bytes        display sizes in bytes instead of using prefixes\n"
+        "  -j <n>        read <n> files at once, or 0 for one per CPU, and\n"
+        "                print them in order\n"
+        "  -json         print one JSON object per line for each file, with\n"
+        "                file, data_size, and rsrc_size, or file and error;\n"
+        "                bytes in file names which are not UTF-8 are written\n"
+        "                as \\u00XX, the Latin-1 character with that value\n",
         stdout);
 }
@@ -0,0 +1,79 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include "defs.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+/*
+ * Test that strings are written as valid JSON, keeping valid UTF-8 and
+ * escaping bytes which are not UTF-8.
+ */
+
+struct jcase {
+    const char *input;
+    const char *output;
+};
+
+static const struct jcase kCases[] = {
+    {"", "\"\""},
+    {"plain.bin", "\"plain.bin\""},
+    {"a\"b\\c", "\"a\\\"b\\\\c\""},
+    {"tab\tline\n\x01\x7f", "\"tab\\tline\\n\\u0001\\u007f\""},
+    /* Valid UTF-8, with 2, 3, and 4 byte sequences. */
+    {"caf\xc3\xa9 \xe2\x84\xa2 \xf0\x9f\x98\x80",
+     "\"caf\xc3\xa9 \xe2\x84\xa2 \xf0\x9f\x98\x80\""},
+    /* Mac Roman bullet and copyright sign. */
+    {"\xa5 \xa9", "\"\\u00a5 \\u00a9\""},
+    /* Truncated sequence, then a lone continuation byte. */
+    {"\xe2\x84", "\"\\u00e2\\u0084\""},
+    {"\x80x", "\"\\u0080x\""},
+    /* Overlong, surrogate, and past U+10FFFF. */
+    {"\xc0\xaf", "\"\\u00c0\\u00af\""},
+    {"\xe0\x80\xaf", "\"\\u00e0\\u0080\\u00af\""},
+    {"\xed\xa0\x80", "\"\\u00ed\\u00a0\\u0080\""},
+    {"\xf4\x90\x80\x80", "\"\\u00f4\\u0090\\u0080\\u0080\""},
+};
+
+int main(int argc, char **argv) {
+    const struct jcase *c;
+    FILE *fp;
+    char *buf = NULL;
+    size_t size = 0;
+    int i, failure_count = 0, test_count = 0;
+    (void)argc;
+    (void)argv;
+    for (i = 0; i < (int)(sizeof(kCases) / sizeof(*kCases)); i++) {
+        c = &kCases[i];
+        test_count++;
+        fp = open_memstream(&buf, &size);
+        if (fp == NULL) {
+            die_errf(EX_OSERR, errno, "open_memstream");
+        }
+        fput_json(fp, c->input, strlen(c->input));
+        if (fclose(fp) != 0) {
+            die_errf(EX_OSERR, errno, "fclose");
+        }
+        if (strcmp(buf, c->output) != 0) {
+            fprintf(stderr, "case %d: got %s, expected %s\n", i, buf,
+                    c->output);
+            failure_count++;
+        }
+        free(buf);
+        buf = NULL;
+    }
+    if (failure_count > 0) {
+        fprintf(stderr, "%d of %d tests failed\n", failure_count, test_count);
+        fputs("FAILED\n", stderr);
+        return 1;
+    }
+    printf("%d tests passed\n", test_count);
+    return 0;
+}
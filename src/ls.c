@@ -45,10 +45,27 @@ static int compare_id(const void *x, const void *y) {
     return rx->id - ry->id;
 }
 
+static int opt_files;
 static int opt_flat;
+static int opt_jobs = 1;
+static int opt_json;
 static compare_t opt_sort = compare_id;
 static int opt_reverse;
 
+/* What to list: everything, one type, or one resource. */
+enum { kSelectAll, kSelectType, kSelectRsrc };
+
+static int select_mode;
+static uint32_t select_type;
+static int select_id;
+static int exit_status;
+
+static void opt_parse_jobs(void *value, const char *option, const char *arg) {
+    (void)value;
+    (void)option;
+    opt_jobs = parse_jobs(arg);
+}
+
 static void opt_parse_sort(void *value, const char *option, const char *arg) {
     compare_t v, *ptr = value;
     if (strcmp(arg, "id") == 0) {
@@ -65,23 +82,80 @@ static void opt_parse_sort(void *value, const char *option, const char *arg) {
 
 static const struct option kOptions[] = {
     {"bytes", &opt_bytes, 0, opt_parse_true},
+    {"files", &opt_files, 0, opt_parse_true},
     {"flat", &opt_flat, 0, opt_parse_true},
+    {"j", NULL, 1, opt_parse_jobs},
+    {"json", &opt_json, 0, opt_parse_true},
     {"sort", &opt_sort, 1, opt_parse_sort},
     {"reverse", &opt_reverse, 0, opt_parse_true},
     {0},
 };
 
 static void ls_usage(FILE *fp) {
-    fputs("usage: unrez ls [<options>] <file> [<type> [<id>]]\n", fp);
+    fputs(
+        "usage: unrez ls [<options>] <file> [<type> [<id>]]\n"
+        "       unrez ls [<options>] -files <file>...\n",
+        fp);
 }
 
-static void print_rlist(struct unrez_resourcefork *rfork, struct rlist *rlist) {
-    char ssize[SIZE_WIDTH], sid[8];
-    struct rsrc *rp = rlist->rsrc, *re = rp + rlist->size, *p, *q, t;
-    const char *name, *nptr, *nend;
+/*
+ * Get a resource's name, converted to UTF-8. The buffer should have room for
+ * 256 * 3 bytes. Returns the length, or -1 if the name could not be read.
+ */
+static int get_name(struct filejob *j, struct unrez_resourcefork *rfork,
+                    struct unrez_resource *rsrc, const char *stype,
+                    char *uname, size_t usize) {
+    const char *name, *nptr;
     size_t namelen;
-    char uname[256 * 3], *uptr, *uend, *up;
+    char *uptr;
     int err;
+    err = unrez_resourcefork_getname(rfork, rsrc, &name, &namelen);
+    if (err != 0) {
+        filejob_fail(j, EX_DATAERR, err,
+                     "could not get name for resource %s %d", stype,
+                     rsrc->id);
+        return -1;
+    }
+    nptr = name;
+    uptr = uname;
+    unrez_from_macroman(&uptr, uname + usize, &nptr, name + namelen);
+    return uptr - uname;
+}
+
+/*
+ * Print a resource as a JSON object on its own line. Returns 0 on success, or
+ * -1 on failure.
+ */
+static int json_rsrc(struct filejob *j, struct unrez_resourcefork *rfork,
+                     const char *stype, struct unrez_resource *rsrc,
+                     uint32_t size) {
+    char uname[256 * 3];
+    int namelen;
+    namelen = get_name(j, rfork, rsrc, stype, uname, sizeof(uname));
+    if (namelen < 0) {
+        return -1;
+    }
+    fputs("{\"file\":", j->out);
+    fput_json(j->out, j->file, strlen(j->file));
+    fputs(",\"type\":", j->out);
+    fput_json(j->out, stype, strlen(stype));
+    fprintf(j->out, ",\"id\":%d,\"size\":%lu", rsrc->id,
+            (unsigned long)size);
+    if (namelen > 0) {
+        fputs(",\"name\":", j->out);
+        fput_json(j->out, uname, namelen);
+    }
+    fputs("}\n", j->out);
+    return 0;
+}
+
+static int print_rlist(struct filejob *j, struct unrez_resourcefork *rfork,
+                       struct rlist *rlist) {
+    FILE *out = j->out;
+    char ssize[SIZE_WIDTH], sid[8];
+    struct rsrc *rp = rlist->rsrc, *re = rp + rlist->size, *p, *q, t;
+    char uname[256 * 3], *uptr, *up;
+    int namelen;
     if (opt_sort != NULL) {
         qsort(rp, rlist->size, sizeof(*rp), opt_sort);
     }
@@ -103,90 +177,105 @@ static void print_rlist(struct unrez_resourcefork *rfork, struct rlist *rlist) {
         snprintf(sid, sizeof(sid), "#%d", rp->id);
         sprint_size(ssize, sizeof(ssize), rp->size);
         if (opt_flat) {
-            printf("%s  %7s  %10s", rp->type, sid, ssize);
+            fprintf(out, "%s  %7s  %10s", rp->type, sid, ssize);
         } else {
-            printf("    %7s  %10s", sid, ssize);
+            fprintf(out, "    %7s  %10s", sid, ssize);
         }
-        err = unrez_resourcefork_getname(rfork, rp->rsrc, &name, &namelen);
-        if (err != 0) {
-            fputc('\n', stdout);
-            die_errf(EX_DATAERR, err, "could not get name for resource %s %d",
-                     rp->type, rp->id);
+        namelen = get_name(j, rfork, rp->rsrc, rp->type, uname, sizeof(uname));
+        if (namelen < 0) {
+            fputc('\n', out);
+            return -1;
         }
         if (namelen > 0) {
-            nptr = name;
-            nend = name + namelen;
-            uptr = uname;
-            uend = uname + sizeof(uname);
-            unrez_from_macroman(&uptr, uend, &nptr, nend);
-            fputs("  \"", stdout);
+            uptr = uname + namelen;
+            fputs("  \"", out);
             for (up = uname; up < uptr; up++) {
                 switch (*up) {
                 case '\n':
-                    fputs("\\n", stdout);
+                    fputs("\\n", out);
                     break;
                 case '\r':
-                    fputs("\\r", stdout);
+                    fputs("\\r", out);
                     break;
                 case '\t':
-                    fputs("\\t", stdout);
+                    fputs("\\t", out);
                     break;
                 case '"':
-                    fputs("\\\"", stdout);
+                    fputs("\\\"", out);
                     break;
                 case '\\':
-                    fputs("\\\\", stdout);
+                    fputs("\\\\", out);
                     break;
                 default:
                     if ((*up >= 0 && *up < 0x20) || *up == 0x7f) {
-                        printf("\\x%02x", *up);
+                        fprintf(out, "\\x%02x", *up);
                     } else {
-                        fputc(*up, stdout);
+                        fputc(*up, out);
                     }
                     break;
                 }
             }
-            fputc('"', stdout);
+            fputc('"', out);
         }
-        fputc('\n', stdout);
+        fputc('\n', out);
     }
+    return 0;
 }
 
-static void ls_rsrc(struct unrez_resourcefork *rfork, uint32_t type_code,
-                    int res_id) {
+static int ls_rsrc(struct filejob *j, struct unrez_resourcefork *rfork,
+                   uint32_t type_code, int res_id) {
     char stype[kUnrezTypeWidth], ssize[SIZE_WIDTH];
     int err;
     struct unrez_resource *rsrc;
-    const void *data;
     uint32_t size;
     unrez_type_tostring(stype, sizeof(stype), type_code);
     err = unrez_resourcefork_findrsrc(rfork, &rsrc, type_code, res_id);
-    if (err != 0) {
-        die_errf(EX_DATAERR, err, "could not find resource %s #%d", stype,
-                 res_id);
+    if (err == 0) {
+        err = unrez_resourcefork_getsize(rfork, rsrc, &size);
     }
-    err = unrez_resourcefork_getdata(rfork, rsrc, &data, &size);
     if (err != 0) {
-        die_errf(EX_DATAERR, err, "could not find resource %s #%d", stype,
-                 res_id);
+        filejob_fail(j, EX_DATAERR, err, "could not find resource %s #%d",
+                     stype, res_id);
+        return -1;
+    }
+    if (opt_json) {
+        return json_rsrc(j, rfork, stype, rsrc, size);
     }
     sprint_size(ssize, sizeof(ssize), size);
-    printf("%s  #%d  %s\n", stype, res_id, ssize);
+    fprintf(j->out, "%s  #%d  %s\n", stype, res_id, ssize);
+    return 0;
 }
 
-static void ls_type(struct rlist *rlist, struct unrez_resourcefork *rfork,
-                    struct unrez_resourcetype *type) {
+static int ls_type(struct filejob *j, struct rlist *rlist,
+                   struct unrez_resourcefork *rfork,
+                   struct unrez_resourcetype *type) {
     struct rsrc *r;
     char stype[kUnrezTypeWidth], ssize[SIZE_WIDTH];
     struct unrez_resource *rsrcs, *rsrc;
     int err, i, rsrc_count, ncap;
-    const void *data;
     uint32_t size;
     int64_t total_size = 0;
     void *narr;
     unrez_type_tostring(stype, sizeof(stype), type->type_code);
     rsrc_count = type->count;
     rsrcs = type->resources;
+    if (opt_json) {
+        /* Records are printed as they are read, in the order of the map. */
+        for (i = 0; i < rsrc_count; i++) {
+            rsrc = &rsrcs[i];
+            err = unrez_resourcefork_getsize(rfork, rsrc, &size);
+            if (err != 0) {
+                filejob_fail(j, EX_DATAERR, err,
+                             "could not load resource %s #%d", stype,
+                             rsrc->id);
+                return -1;
+            }
+            if (json_rsrc(j, rfork, stype, rsrc, size) != 0) {
+                return -1;
+            }
+        }
+        return 0;
+    }
     if (rsrc_count > rlist->capacity - rlist->size) {
         ncap = rlist->capacity;
         if (ncap == 0) {
@@ -205,10 +294,11 @@ static void ls_type(struct rlist *rlist, struct unrez_resourcefork *rfork,
     r = &rlist->rsrc[rlist->size];
     for (i = 0; i < rsrc_count; i++) {
         rsrc = &rsrcs[i];
-        err = unrez_resourcefork_getdata(rfork, rsrc, &data, &size);
+        err = unrez_resourcefork_getsize(rfork, rsrc, &size);
         if (err != 0) {
-            die_errf(EX_DATAERR, err, "could not load resource %s #%d", stype,
-                     rsrc->id);
+            filejob_fail(j, EX_DATAERR, err, "could not load resource %s #%d",
+                         stype, rsrc->id);
+            return -1;
         }
         memcpy(r->type, stype, sizeof(r->type));
         r->id = rsrc->id;
@@ -220,90 +310,177 @@ static void ls_type(struct rlist *rlist, struct unrez_resourcefork *rfork,
     rlist->size = r - rlist->rsrc;
     if (!opt_flat) {
         sprint_size(ssize, sizeof(ssize), total_size);
-        printf("type %s (%d resources, %s):\n", stype, rlist->size, ssize);
-        print_rlist(rfork, rlist);
-        fputc('\n', stdout);
+        fprintf(j->out, "type %s (%d resources, %s):\n", stype, rlist->size,
+                ssize);
+        err = print_rlist(j, rfork, rlist);
+        fputc('\n', j->out);
         rlist->size = 0;
+        if (err != 0) {
+            return -1;
+        }
     }
     rlist->total_size += total_size;
+    return 0;
 }
 
-void ls_exec(int argc, char **argv) {
-    char ssize[SIZE_WIDTH], stype[kUnrezTypeWidth];
-    const char *file;
-    uint32_t type_code;
-    int err, res_id = 0, i, type_count;
-    struct unrez_resourcefork rfork;
-    struct unrez_resourcetype *types, *type;
-    struct rlist rlist = {0};
-    parse_options(kOptions, &argc, &argv);
-    if (argc < 1 || argc > 3) {
-        errorf("expected 1-3 arguments");
-        ls_usage(stderr);
-        exit(EX_USAGE);
-    }
-    if (argc >= 2) {
-        err = unrez_type_fromstring(&type_code, argv[1]);
+/* List the selected resources in a file. Returns 0 on success, or -1. */
+static int ls_fork(struct filejob *j, struct unrez_resourcefork *rfork,
+                   struct rlist *rlist) {
+    char stype[kUnrezTypeWidth];
+    struct unrez_resourcetype *type;
+    int err, i;
+    switch (select_mode) {
+    default:
+    case kSelectAll:
+        err = unrez_resourcefork_loadall(rfork);
         if (err != 0) {
-            dief(EX_USAGE, "invalid resource type: '%s'", argv[1]);
+            filejob_fail(j, EX_OSERR, err, "could not load resources");
+            return -1;
         }
-    }
-    if (argc >= 3) {
-        res_id = parse_id(argv[2]);
-    }
-    file = argv[0];
-    err = unrez_resourcefork_open(&rfork, file);
-    if (err != 0) {
-        die_errf(err > 0 ? EX_NOINPUT : EX_DATAERR, err, "%s", file);
-    }
-    switch (argc) {
-    default:
-    case 1:
-        types = rfork.types;
-        type_count = rfork.type_count;
-        for (i = 0; i < type_count; i++) {
-            type = &types[i];
-            err = unrez_resourcefork_loadtype(&rfork, type);
+        for (i = 0; i < rfork->type_count; i++) {
+            type = &rfork->types[i];
+            err = unrez_resourcefork_loadtype(rfork, type);
             if (err != 0) {
                 unrez_type_tostring(stype, sizeof(stype), type->type_code);
-                die_errf(EX_DATAERR, err, "could not load resource type %s",
-                         stype);
+                filejob_fail(j, EX_DATAERR, err,
+                             "could not load resource type %s", stype);
+                return -1;
+            }
+            if (ls_type(j, rlist, rfork, type) != 0) {
+                return -1;
             }
-            ls_type(&rlist, &rfork, type);
         }
-        break;
-    case 2:
-        err = unrez_resourcefork_findtype(&rfork, &type, type_code);
+        return 0;
+    case kSelectType:
+        err = unrez_resourcefork_findtype(rfork, &type, select_type);
         if (err != 0) {
-            unrez_type_tostring(stype, sizeof(stype), type_code);
-            dief(EX_DATAERR, "could not load resource type %s", stype);
+            unrez_type_tostring(stype, sizeof(stype), select_type);
+            filejob_fail(j, EX_DATAERR, 0, "could not load resource type %s",
+                         stype);
+            return -1;
         }
-        ls_type(&rlist, &rfork, type);
-        break;
-    case 3:
-        ls_rsrc(&rfork, type_code, res_id);
-        break;
+        return ls_type(j, rlist, rfork, type);
+    case kSelectRsrc:
+        return ls_rsrc(j, rfork, select_type, select_id);
+    }
+}
+
+static void ls_run(struct job *job) {
+    struct filejob *j = (struct filejob *)job;
+    char ssize[SIZE_WIDTH];
+    struct unrez_forkedfile forks;
+    struct unrez_resourcefork rfork;
+    struct rlist rlist = {0};
+    int err;
+    filejob_start(j, opt_jobs > 1);
+    err = unrez_forkedfile_open(&forks, j->file);
+    if (err != 0) {
+        filejob_fail(j, err > 0 ? EX_NOINPUT : EX_DATAERR, err, NULL);
+        return;
+    }
+    err = unrez_resourcefork_openstream(&rfork, &forks.rsrc);
+    unrez_forkedfile_close(&forks);
+    if (err != 0) {
+        filejob_fail(j, err > 0 ? EX_NOINPUT : EX_DATAERR, err, NULL);
+        return;
+    }
+    if (opt_files && !opt_json) {
+        fprintf(j->out, "%s:\n", j->file);
     }
-    if (opt_flat) {
+    err = ls_fork(j, &rfork, &rlist);
+    if (err == 0 && opt_flat && !opt_json) {
         sprint_size(ssize, sizeof(ssize), rlist.total_size);
-        printf("%d resources, %s:\n", rlist.size, ssize);
-        print_rlist(&rfork, &rlist);
+        fprintf(j->out, "%d resources, %s:\n", rlist.size, ssize);
+        err = print_rlist(j, &rfork, &rlist);
+        if (opt_files) {
+            fputc('\n', j->out);
+        }
     }
     free(rlist.rsrc);
     unrez_resourcefork_close(&rfork);
 }
 
+static void ls_finish(struct job *job) {
+    struct filejob *j = (struct filejob *)job;
+    int status = filejob_finish(j);
+    if (status != 0 && exit_status == 0) {
+        exit_status = status;
+    }
+    free(j);
+}
+
+void ls_exec(int argc, char **argv) {
+    struct filejob *j;
+    struct pool *pool;
+    int err, i, file_count;
+    parse_options(kOptions, &argc, &argv);
+    if (opt_files) {
+        if (argc < 1) {
+            errorf("expected 1 or more arguments");
+            ls_usage(stderr);
+            exit(EX_USAGE);
+        }
+        file_count = argc;
+    } else {
+        if (argc < 1 || argc > 3) {
+            errorf("expected 1-3 arguments");
+            ls_usage(stderr);
+            exit(EX_USAGE);
+        }
+        if (argc >= 2) {
+            err = unrez_type_fromstring(&select_type, argv[1]);
+            if (err != 0) {
+                dief(EX_USAGE, "invalid resource type: '%s'", argv[1]);
+            }
+            select_mode = kSelectType;
+        }
+        if (argc >= 3) {
+            select_id = parse_id(argv[2]);
+            select_mode = kSelectRsrc;
+        }
+        file_count = 1;
+    }
+    pool = pool_create(opt_jobs);
+    for (i = 0; i < file_count; i++) {
+        j = calloc(1, sizeof(*j));
+        if (j == NULL) {
+            die_errf(EX_OSERR, errno, "calloc");
+        }
+        j->job.run = ls_run;
+        j->job.finish = ls_finish;
+        j->file = argv[i];
+        j->json = opt_json;
+        pool_submit(pool, &j->job);
+    }
+    pool_destroy(pool);
+    if (exit_status != 0) {
+        exit(exit_status);
+    }
+}
+
 void ls_help(void) {
     ls_usage(stdout);
     fputs(
         "List resources in a file's resource fork.\n"
         "\n"
+        "With -files, a file which cannot be read is reported, and the other\n"
+        "files are still listed. The exit status is from the first failure.\n"
+        "\n"
         "options:\n"
         "  -bytes        display sizes in bytes instead of using prefixes\n"
         "  -sort <key>   "
         "sort resources, key can be id (default), index, or size\n"
+        "  -files        list every resource in each file given\n"
         "  -flat         "
         "display all resources in one list, instead of one per type\n"
+        "  -j <n>        read <n> files at once, or 0 for one per CPU, and\n"
+        "                print them in order\n"
+        "  -json         print one JSON object per line for each resource,\n"
+        "                with file, type, id, size, and name if it has one,\n"
+        "                in the order of the resource map, or file and\n"
+        "                error if the file cannot be read; bytes in file\n"
+        "                names which are not UTF-8 are written as \\u00XX,\n"
+        "                the Latin-1 character with the same value\n"
         "  -reverse      reverse sort order\n",
         stdout);
 }
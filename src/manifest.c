@@ -0,0 +1,362 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include "defs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+/*
+ * The manifest is a text file with one record per line. Paths are written
+ * with bytes outside printable ASCII, spaces, and '%' escaped as %XX.
+ *
+ *   unrez-manifest 1
+ *   config <config>
+ *   input <path>
+ *   file <dev> <ino> <size> <mtime seconds> <mtime nanoseconds>
+ *   map <hash>
+ *   output <name>
+ *
+ * Each input line is followed by the lines describing that input.
+ */
+
+static const char kMagic[] = "unrez-manifest 1";
+
+/*
+ * Get the nanoseconds of a file's modification time. Darwin has no st_mtim: it
+ * is st_mtimespec with _DARWIN_C_SOURCE, and st_mtimensec without.
+ */
+static long mtime_nsec(const struct stat *s) {
+#if defined __APPLE__
+    return s->st_mtimensec;
+#else
+    return s->st_mtim.tv_nsec;
+#endif
+}
+
+static void set_stat(struct mstat *st, const struct stat *s) {
+    st->dev = s->st_dev;
+    st->ino = s->st_ino;
+    st->size = s->st_size;
+    st->mtime_sec = s->st_mtime;
+    st->mtime_nsec = mtime_nsec(s);
+}
+
+int mstat_get(struct mstat *st, int fd) {
+    struct stat s;
+    if (fstat(fd, &s) != 0) {
+        return errno;
+    }
+    set_stat(st, &s);
+    return 0;
+}
+
+int mstat_getat(struct mstat *st, int dirfd, const char *path) {
+    struct stat s;
+    if (fstatat(dirfd, path, &s, 0) != 0) {
+        return errno;
+    }
+    set_stat(st, &s);
+    return 0;
+}
+
+int mstat_equal(const struct mstat *x, const struct mstat *y) {
+    return x->dev == y->dev && x->ino == y->ino && x->size == y->size &&
+           x->mtime_sec == y->mtime_sec && x->mtime_nsec == y->mtime_nsec;
+}
+
+static char *copy_string(const char *s) {
+    char *r = malloc(strlen(s) + 1);
+    if (r == NULL) {
+        die_errf(EX_OSERR, errno, "malloc");
+    }
+    strcpy(r, s);
+    return r;
+}
+
+static struct manifest *manifest_new(const char *config) {
+    struct manifest *m = malloc(sizeof(*m));
+    if (m == NULL) {
+        die_errf(EX_OSERR, errno, "malloc");
+    }
+    m->config = copy_string(config);
+    m->first = NULL;
+    m->last = &m->first;
+    m->index = dedupe_create();
+    return m;
+}
+
+struct minput *manifest_input(struct manifest *m, const char *path) {
+    struct minput *in, *old;
+    in = calloc(1, sizeof(*in));
+    if (in == NULL) {
+        die_errf(EX_OSERR, errno, "calloc");
+    }
+    in->path = copy_string(path);
+    old = dedupe_add(m->index, in->path, strlen(in->path), in);
+    if (old != NULL) {
+        free(in->path);
+        free(in);
+        return old;
+    }
+    *m->last = in;
+    m->last = &in->next;
+    return in;
+}
+
+void minput_reset(struct minput *in) {
+    int i;
+    for (i = 0; i < in->output_count; i++) {
+        free(in->outputs[i]);
+    }
+    in->file_count = 0;
+    in->has_map = 0;
+    in->map_hash = 0;
+    in->output_count = 0;
+    in->failed = 0;
+}
+
+void minput_addoutput(struct minput *in, const char *name) {
+    char **outputs;
+    int alloc;
+    if (in->output_count >= in->output_alloc) {
+        alloc = in->output_alloc > 0 ? in->output_alloc * 2 : 4;
+        outputs = realloc(in->outputs, sizeof(*outputs) * alloc);
+        if (outputs == NULL) {
+            die_errf(EX_OSERR, errno, "realloc");
+        }
+        in->outputs = outputs;
+        in->output_alloc = alloc;
+    }
+    in->outputs[in->output_count++] = copy_string(name);
+}
+
+static int hex_value(int c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/* Decode an escaped string in place. Returns 0 on success, or -1. */
+static int unescape(char *s) {
+    char *out = s;
+    int hi, lo;
+    for (; *s != '\0'; s++) {
+        if (*s != '%') {
+            *out++ = *s;
+            continue;
+        }
+        hi = hex_value(s[1]);
+        lo = hi >= 0 ? hex_value(s[2]) : -1;
+        if (lo < 0 || (hi == 0 && lo == 0)) {
+            return -1;
+        }
+        *out++ = hi * 16 + lo;
+        s += 2;
+    }
+    *out = '\0';
+    return 0;
+}
+
+static void escape(FILE *fp, const char *s) {
+    const unsigned char *p;
+    for (p = (const unsigned char *)s; *p != '\0'; p++) {
+        if (*p <= ' ' || *p == '%' || *p >= 0x7f) {
+            fprintf(fp, "%%%02x", *p);
+        } else {
+            fputc(*p, fp);
+        }
+    }
+}
+
+/*
+ * Parse one line of the manifest, with the newline removed. Returns 0 on
+ * success, 1 if the manifest has a different config, or -1 if the line is
+ * invalid.
+ */
+static int parse_line(struct manifest *m, struct minput **cur, char *line,
+                      int lineno) {
+    struct mstat st;
+    struct minput *in = *cur;
+    unsigned long hash;
+    char *arg, extra;
+    arg = strchr(line, ' ');
+    if (lineno == 1) {
+        return strcmp(line, kMagic) == 0 ? 0 : -1;
+    }
+    if (arg == NULL) {
+        return -1;
+    }
+    *arg++ = '\0';
+    if (lineno == 2) {
+        if (strcmp(line, "config") != 0 || unescape(arg) != 0) {
+            return -1;
+        }
+        return strcmp(arg, m->config) == 0 ? 0 : 1;
+    }
+    if (strcmp(line, "input") == 0) {
+        if (unescape(arg) != 0) {
+            return -1;
+        }
+        *cur = manifest_input(m, arg);
+        minput_reset(*cur);
+        return 0;
+    }
+    if (in == NULL) {
+        return -1;
+    }
+    if (strcmp(line, "file") == 0) {
+        if (in->file_count >= kMInputMaxFiles ||
+            sscanf(arg,
+                   "%" SCNu64 " %" SCNu64 " %" SCNd64 " %" SCNd64 " %ld %c",
+                   &st.dev, &st.ino, &st.size, &st.mtime_sec, &st.mtime_nsec,
+                   &extra) != 5) {
+            return -1;
+        }
+        in->files[in->file_count++] = st;
+    } else if (strcmp(line, "map") == 0) {
+        if (sscanf(arg, "%lx %c", &hash, &extra) != 1) {
+            return -1;
+        }
+        in->has_map = 1;
+        in->map_hash = hash;
+    } else if (strcmp(line, "output") == 0) {
+        if (unescape(arg) != 0) {
+            return -1;
+        }
+        minput_addoutput(in, arg);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+struct manifest *manifest_read(int dirfd, const char *name,
+                               const char *config) {
+    struct manifest *m = manifest_new(config);
+    struct minput *cur = NULL;
+    FILE *fp;
+    char *line = NULL;
+    size_t alloc = 0;
+    ssize_t len;
+    int fd, r = 0, lineno = 0;
+    fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            die_errf(EX_NOINPUT, errno, "%s", name);
+        }
+        return m;
+    }
+    fp = fdopen(fd, "r");
+    if (fp == NULL) {
+        die_errf(EX_OSERR, errno, "fdopen");
+    }
+    while (r == 0 && (len = getline(&line, &alloc, fp)) > 0) {
+        if (line[len - 1] != '\n') {
+            r = -1;
+            break;
+        }
+        line[len - 1] = '\0';
+        r = parse_line(m, &cur, line, ++lineno);
+    }
+    if (ferror(fp)) {
+        die_errf(EX_IOERR, errno, "%s", name);
+    }
+    free(line);
+    fclose(fp);
+    if (r == 0 && lineno < 2) {
+        r = -1;
+    }
+    if (r != 0) {
+        if (r < 0) {
+            errorf("%s: invalid manifest, converting everything", name);
+        }
+        manifest_destroy(m);
+        m = manifest_new(config);
+    }
+    return m;
+}
+
+void manifest_write(struct manifest *m, int dirfd, const char *name) {
+    struct minput *in;
+    struct mstat *st;
+    char tmp[256];
+    FILE *fp;
+    int fd, i, err;
+    snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", name, (long)getpid());
+    fd = openat(dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        die_errf(EX_CANTCREAT, errno, "%s", tmp);
+    }
+    fp = fdopen(fd, "w");
+    if (fp == NULL) {
+        die_errf(EX_OSERR, errno, "fdopen");
+    }
+    fprintf(fp, "%s\nconfig ", kMagic);
+    escape(fp, m->config);
+    fputc('\n', fp);
+    for (in = m->first; in != NULL; in = in->next) {
+        if (in->failed || in->file_count == 0) {
+            continue;
+        }
+        fputs("input ", fp);
+        escape(fp, in->path);
+        fputc('\n', fp);
+        for (i = 0; i < in->file_count; i++) {
+            st = &in->files[i];
+            fprintf(fp,
+                    "file %" PRIu64 " %" PRIu64 " %" PRId64 " %" PRId64
+                    " %ld\n",
+                    st->dev, st->ino, st->size, st->mtime_sec, st->mtime_nsec);
+        }
+        if (in->has_map) {
+            fprintf(fp, "map %08lx\n", (unsigned long)in->map_hash);
+        }
+        for (i = 0; i < in->output_count; i++) {
+            fputs("output ", fp);
+            escape(fp, in->outputs[i]);
+            fputc('\n', fp);
+        }
+    }
+    err = ferror(fp) ? EIO : 0;
+    if (fclose(fp) != 0 && err == 0) {
+        err = errno;
+    }
+    if (err == 0 && renameat(dirfd, tmp, dirfd, name) != 0) {
+        err = errno;
+    }
+    if (err != 0) {
+        unlinkat(dirfd, tmp, 0);
+        die_errf(EX_CANTCREAT, err, "%s", name);
+    }
+}
+
+void manifest_destroy(struct manifest *m) {
+    struct minput *in, *next;
+    for (in = m->first; in != NULL; in = next) {
+        next = in->next;
+        minput_reset(in);
+        free(in->outputs);
+        free(in->path);
+        free(in);
+    }
+    dedupe_destroy(m->index);
+    free(m->config);
+    free(m);
+}
@@ -0,0 +1,197 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include "defs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+/*
+ * Test that manifests read back as they were written, including unusual
+ * filenames, and that manifests written with a different config, or which are
+ * damaged, read as empty.
+ */
+
+static int test_count;
+static int failure_count;
+static char root[64];
+static int rootfd;
+
+static const char kName[] = "manifest";
+static const char kConfig[] = "test config=1";
+
+static const char *const kPaths[] = {
+    "plain.bin",
+    "dir/with space.bin",
+    "percent%20.bin",
+    "line\nbreak",
+    "\xa5 Mac Roman",
+};
+
+enum {
+    kPathCount = sizeof(kPaths) / sizeof(*kPaths)
+};
+
+static void fill(struct minput *in, int i) {
+    struct mstat *st;
+    int j;
+    char name[64];
+    minput_reset(in);
+    in->file_count = 1 + i % 2;
+    for (j = 0; j < in->file_count; j++) {
+        st = &in->files[j];
+        st->dev = ((uint64_t)0x12345678 << 32 | 0x90abcdef) * (j + 1);
+        st->ino = i * 1000 + j;
+        st->size = (int64_t)1 << (32 + i);
+        st->mtime_sec = 1500000000 + i;
+        st->mtime_nsec = 999999999 - i;
+    }
+    in->has_map = i % 3 != 0;
+    in->map_hash = in->has_map ? 0xdeadbeef ^ i : 0;
+    for (j = 0; j < i; j++) {
+        snprintf(name, sizeof(name), "%s.%d out.png", kPaths[i], j);
+        minput_addoutput(in, name);
+    }
+}
+
+static int same_input(const struct minput *x, const struct minput *y) {
+    int i;
+    if (strcmp(x->path, y->path) != 0 || x->file_count != y->file_count ||
+        x->has_map != y->has_map || x->map_hash != y->map_hash ||
+        x->output_count != y->output_count) {
+        return 0;
+    }
+    for (i = 0; i < x->file_count; i++) {
+        if (!mstat_equal(&x->files[i], &y->files[i])) {
+            return 0;
+        }
+    }
+    for (i = 0; i < x->output_count; i++) {
+        if (strcmp(x->outputs[i], y->outputs[i]) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Count the inputs which would be written. */
+static int count_inputs(struct manifest *m) {
+    struct minput *in;
+    int n = 0;
+    for (in = m->first; in != NULL; in = in->next) {
+        if (!in->failed && in->file_count > 0) {
+            n++;
+        }
+    }
+    return n;
+}
+
+static void expect_empty(const char *what, const char *config) {
+    struct manifest *m;
+    test_count++;
+    m = manifest_read(rootfd, kName, config);
+    if (count_inputs(m) != 0) {
+        fprintf(stderr, "%s: manifest is not empty\n", what);
+        failure_count++;
+    }
+    manifest_destroy(m);
+}
+
+static void test_roundtrip(void) {
+    struct manifest *m, *m2;
+    struct minput *expect[kPathCount], *in;
+    int i;
+    m = manifest_read(rootfd, kName, kConfig);
+    for (i = 0; i < kPathCount; i++) {
+        expect[i] = manifest_input(m, kPaths[i]);
+        fill(expect[i], i);
+    }
+    /* Failed and empty inputs are left out. */
+    manifest_input(m, "failed")->file_count = 1;
+    manifest_input(m, "failed")->failed = 1;
+    manifest_input(m, "empty");
+    manifest_write(m, rootfd, kName);
+
+    m2 = manifest_read(rootfd, kName, kConfig);
+    test_count++;
+    if (count_inputs(m2) != kPathCount) {
+        fprintf(stderr, "roundtrip: read %d inputs, expected %d\n",
+                count_inputs(m2), kPathCount);
+        failure_count++;
+    }
+    for (i = 0; i < kPathCount; i++) {
+        test_count++;
+        in = manifest_input(m2, kPaths[i]);
+        if (!same_input(in, expect[i])) {
+            fprintf(stderr, "roundtrip: input %d is different\n", i);
+            failure_count++;
+        }
+    }
+    manifest_destroy(m2);
+    manifest_destroy(m);
+
+    expect_empty("different config", "test config=2");
+}
+
+/* Write a file with the given contents. */
+static void write_file(const char *data) {
+    FILE *fp = fopen(kName, "w");
+    if (fp == NULL) {
+        die_errf(EX_CANTCREAT, errno, "%s", kName);
+    }
+    fputs(data, fp);
+    if (fclose(fp) != 0) {
+        die_errf(EX_IOERR, errno, "%s", kName);
+    }
+}
+
+static void test_invalid(void) {
+    static const char *const kInvalid[] = {
+        "",
+        "unrez-manifest 2\nconfig test%20config=1\n",
+        "unrez-manifest 1\nconfig test%20config=1\nfile 1 2 3 4 5\n",
+        "unrez-manifest 1\nconfig test%20config=1\ninput a\nfile 1 2 3\n",
+        "unrez-manifest 1\nconfig test%20config=1\ninput a\nmap zz\n",
+        "unrez-manifest 1\nconfig test%20config=1\ninput a%2\n",
+        "unrez-manifest 1\nconfig test%20config=1\ninput a\nfile 1 2 3 4 5",
+    };
+    int i;
+    for (i = 0; i < (int)(sizeof(kInvalid) / sizeof(*kInvalid)); i++) {
+        write_file(kInvalid[i]);
+        expect_empty("invalid manifest", kConfig);
+    }
+    unlink(kName);
+    expect_empty("missing manifest", kConfig);
+}
+
+int main(int argc, char **argv) {
+    (void)argc;
+    (void)argv;
+    strcpy(root, "/tmp/unrez_manifest.XXXXXX");
+    if (mkdtemp(root) == NULL) {
+        die_errf(EX_CANTCREAT, errno, "mkdtemp");
+    }
+    rootfd = open(root, O_RDONLY);
+    if (rootfd == -1 || fchdir(rootfd) != 0) {
+        die_errf(EX_CANTCREAT, errno, "%s", root);
+    }
+    test_roundtrip();
+    test_invalid();
+    close(rootfd);
+    rmdir(root);
+    if (failure_count > 0) {
+        fprintf(stderr, "%d of %d tests failed\n", failure_count, test_count);
+        fputs("FAILED\n", stderr);
+        return 1;
+    }
+    printf("%d tests passed\n", test_count);
+    return 0;
+}
@@ -0,0 +1,347 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include "defs.h"
+
+#include "unrez.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+/*
+ * Test that every SIMD level decodes pictures exactly the same way as the
+ * portable code, including pictures with corrupted or truncated data.
+ */
+
+/* Ways to receive pixel data from the decoder. */
+enum {
+    /* Receive the whole image through the pixels callback. */
+    kModeImage,
+    /* Receive rows through the row callbacks. */
+    kModeRows,
+    /* Receive rows, with 16-bit pixels converted to 32-bit. */
+    kModeExpand,
+    kModeCount
+};
+
+static const char *const kModeNames[] = {"image", "rows", "expand"};
+
+/* The result of decoding a picture. */
+struct result {
+    uint8_t *data;
+    size_t size;
+    int pixel_size;
+    int row_bytes;
+    int height;
+    int y;
+    int error_count;
+    int err;
+    int opcode;
+    char msg[128];
+};
+
+static int cb_header(void *ctx, int version, const struct unrez_rect *frame) {
+    (void)ctx;
+    (void)version;
+    (void)frame;
+    return 0;
+}
+
+static int cb_opcode(void *ctx, int opcode, const void *data, size_t size) {
+    (void)ctx;
+    (void)opcode;
+    (void)data;
+    (void)size;
+    return 0;
+}
+
+static void result_alloc(struct result *r, const struct unrez_pixdata *pix) {
+    free(r->data);
+    r->pixel_size = pix->pixelSize;
+    r->row_bytes = pix->rowBytes;
+    r->height = pix->bounds.bottom - pix->bounds.top;
+    r->size = (size_t)r->row_bytes * r->height;
+    r->data = malloc(r->size);
+    if (r->data == NULL) {
+        die_errf(EX_OSERR, errno, "malloc");
+    }
+    r->y = 0;
+}
+
+static int cb_pixels(void *ctx, int opcode, struct unrez_pixdata *pix) {
+    struct result *r = ctx;
+    (void)opcode;
+    result_alloc(r, pix);
+    memcpy(r->data, pix->data, r->size);
+    return 0;
+}
+
+static int cb_begin_rows(void *ctx, int opcode,
+                         const struct unrez_pixdata *pix) {
+    struct result *r = ctx;
+    (void)opcode;
+    if (pix->data != NULL) {
+        dief(EX_SOFTWARE, "begin_rows: data is not NULL");
+    }
+    result_alloc(r, pix);
+    return 0;
+}
+
+static int cb_row(void *ctx, int y, const void *data) {
+    struct result *r = ctx;
+    if (y != r->y || y >= r->height) {
+        dief(EX_SOFTWARE, "row: got row %d, expected row %d", y, r->y);
+    }
+    memcpy(r->data + (size_t)y * r->row_bytes, data, r->row_bytes);
+    r->y++;
+    return 0;
+}
+
+static int cb_end_rows(void *ctx, int opcode) {
+    struct result *r = ctx;
+    (void)opcode;
+    if (r->y != r->height) {
+        dief(EX_SOFTWARE, "end_rows: got %d rows, expected %d", r->y,
+             r->height);
+    }
+    return 0;
+}
+
+static void cb_error(void *ctx, int err, int opcode, const char *msg) {
+    struct result *r = ctx;
+    r->error_count++;
+    r->err = err;
+    r->opcode = opcode;
+    snprintf(r->msg, sizeof(r->msg), "%s", msg != NULL ? msg : "");
+}
+
+static const struct unrez_pict_callbacks kCallbacks = {
+    NULL, cb_header, cb_opcode, cb_pixels, cb_error,
+    kUnrezRowNative, NULL, NULL, NULL,
+};
+
+static const struct unrez_pict_callbacks kRowCallbacks = {
+    NULL, cb_header, cb_opcode, NULL, cb_error,
+    kUnrezRowNative, cb_begin_rows, cb_row, cb_end_rows,
+};
+
+/*
+ * Decoder shared by all tests, so buffers are reused between pictures of
+ * different sizes and formats.
+ */
+static struct unrez_pict_decoder decoder;
+
+/* Decode a picture. If dec is NULL, use unrez_pict_decode. */
+static void decode(struct result *r, struct unrez_pict_decoder *dec,
+                   const void *data, size_t size, int mode) {
+    struct unrez_pict_callbacks cb = mode == kModeImage ? kCallbacks
+                                                        : kRowCallbacks;
+    memset(r, 0, sizeof(*r));
+    cb.ctx = r;
+    if (mode == kModeExpand) {
+        cb.row_format = kUnrezRowExpand16;
+    }
+    if (dec != NULL) {
+        unrez_pict_decoder_decode(dec, &cb, data, size);
+    } else {
+        unrez_pict_decode(&cb, data, size);
+    }
+}
+
+/* Convert a result with 16-bit pixels to 32-bit pixels. */
+static void expand(struct result *r) {
+    struct unrez_pixdata pix;
+    int err;
+    if (r->pixel_size != 16 || r->error_count != 0) {
+        return;
+    }
+    memset(&pix, 0, sizeof(pix));
+    pix.data = r->data;
+    pix.rowBytes = r->row_bytes;
+    pix.bounds.bottom = r->height;
+    pix.pixelSize = 16;
+    err = unrez_pixdata_16to32(&pix);
+    if (err != 0) {
+        die_errf(EX_SOFTWARE, err, "unrez_pixdata_16to32");
+    }
+    r->data = pix.data;
+    r->row_bytes = pix.rowBytes;
+    r->size = (size_t)r->row_bytes * r->height;
+    r->pixel_size = 32;
+}
+
+static int test_count;
+static int failure_count;
+
+static const char *const kLevelNames[] = {"none", "sse2", "avx2", "neon"};
+
+/*
+ * Check that a result is the same as the expected result. The pixel data is
+ * only compared if there are no errors, since the row callbacks may receive
+ * some rows before an error is found.
+ */
+static void compare(const char *name, int level, int mode,
+                    const struct result *expect, const struct result *r) {
+    test_count++;
+    if (r->error_count != expect->error_count || r->err != expect->err ||
+        r->opcode != expect->opcode || strcmp(r->msg, expect->msg) != 0 ||
+        (expect->error_count == 0 &&
+         (r->size != expect->size || r->pixel_size != expect->pixel_size ||
+          (r->size > 0 && memcmp(r->data, expect->data, r->size) != 0)))) {
+        fprintf(stderr, "%s: %s, %s: results differ from portable code\n",
+                name, kLevelNames[level], kModeNames[mode]);
+        failure_count++;
+    }
+}
+
+/*
+ * Decode a picture with every SIMD level and every way of receiving pixels,
+ * and check that the results are the same as the portable code. Then check
+ * that decoding the picture again does not allocate memory. Returns the number
+ * of errors from decoding.
+ */
+static int check(const char *name, const void *data, size_t size) {
+    struct result ref, refx, r;
+    int level, mode;
+    long alloc_count;
+    unrez_simd_set(kUnrezSimdNone);
+    decode(&ref, NULL, data, size, kModeImage);
+    decode(&refx, NULL, data, size, kModeImage);
+    expand(&refx);
+    for (level = kUnrezSimdNone; level <= kUnrezSimdNEON; level++) {
+        if (unrez_simd_set(level) != level) {
+            continue;
+        }
+        for (mode = 0; mode < kModeCount; mode++) {
+            if (level == kUnrezSimdNone && mode == kModeImage) {
+                continue;
+            }
+            decode(&r, &decoder, data, size, mode);
+            compare(name, level, mode, mode == kModeExpand ? &refx : &ref,
+                    &r);
+            free(r.data);
+        }
+    }
+    alloc_count = decoder.alloc_count;
+    for (mode = 0; mode < kModeCount; mode++) {
+        decode(&r, &decoder, data, size, mode);
+        free(r.data);
+    }
+    test_count++;
+    if (decoder.alloc_count != alloc_count) {
+        fprintf(stderr, "%s: decoder allocated memory for the same picture\n",
+                name);
+        failure_count++;
+    }
+    free(ref.data);
+    free(refx.data);
+    return ref.error_count;
+}
+
+static const int kWidths[] = {
+    1,  2,  3,  7,   8,   9,   15,  16,  17,  31,  32,  33,
+    63, 64, 65, 127, 128, 129, 200, 255, 256, 257, 300, 1000,
+};
+
+struct format {
+    int pixel_size;
+    int flags;
+    const char *name;
+};
+
+static const struct format kFormats[] = {
+    {1, 0, "1-bit"},
+    {1, kSynthUnpacked, "1-bit unpacked"},
+    {8, 0, "8-bit"},
+    {8, kSynthUnpacked, "8-bit unpacked"},
+    {16, 0, "16-bit"},
+    {16, kSynthUnpacked, "16-bit unpacked"},
+    {32, 0, "32-bit"},
+    {32, kSynthUnpacked, "32-bit unpacked"},
+    {32, kSynthAlpha, "32-bit alpha"},
+    {32, kSynthAlpha | kSynthUnpacked, "32-bit alpha unpacked"},
+};
+
+int main(int argc, char **argv) {
+    const struct format *fmt;
+    char name[64];
+    void *data;
+    uint8_t *copy;
+    size_t size, cut;
+    uint32_t seed = 1, state = 1;
+    int i, j, k, n, level, width;
+    (void)argc;
+    (void)argv;
+
+    level = unrez_simd_get();
+    if (level < kUnrezSimdNone || level > kUnrezSimdNEON) {
+        fprintf(stderr, "unrez_simd_get: bad level %d\n", level);
+        return 1;
+    }
+    printf("SIMD level: %s\n", kLevelNames[level]);
+    if (unrez_simd_set(kUnrezSimdNone) != kUnrezSimdNone ||
+        unrez_simd_get() != kUnrezSimdNone) {
+        fputs("unrez_simd_set: could not select portable code\n", stderr);
+        failure_count++;
+    }
+    if (unrez_simd_set(1000) != level || unrez_simd_get() != level) {
+        fputs("unrez_simd_set: unknown level not replaced with default\n",
+              stderr);
+        failure_count++;
+    }
+
+    for (i = 0; i < (int)(sizeof(kFormats) / sizeof(*kFormats)); i++) {
+        fmt = &kFormats[i];
+        for (j = 0; j < (int)(sizeof(kWidths) / sizeof(*kWidths)); j++) {
+            width = kWidths[j];
+            synth_pict(&data, &size, fmt->pixel_size, fmt->flags, width, 12,
+                       seed++);
+            snprintf(name, sizeof(name), "%s, width %d", fmt->name, width);
+            if (check(name, data, size) != 0) {
+                fprintf(stderr, "%s: could not decode\n", name);
+                failure_count++;
+            }
+
+            /* Corrupt the pixel data, which is at the end. */
+            copy = malloc(size);
+            if (copy == NULL) {
+                die_errf(EX_OSERR, errno, "malloc");
+            }
+            for (k = 0; k < 20; k++) {
+                memcpy(copy, data, size);
+                for (n = 0; n < 4; n++) {
+                    state = state * 1103515245u + 12345u;
+                    copy[size - 1 - (state >> 8) % (size / 4)] ^=
+                        1 << ((state >> 4) & 7);
+                }
+                snprintf(name, sizeof(name), "%s, width %d, corrupt #%d",
+                         fmt->name, width, k);
+                check(name, copy, size);
+            }
+            free(copy);
+
+            /* Truncate the picture. */
+            for (cut = size / 2; cut < size; cut += size / 16 + 1) {
+                snprintf(name, sizeof(name), "%s, width %d, size %d",
+                         fmt->name, width, (int)cut);
+                check(name, data, cut);
+            }
+            free(data);
+        }
+    }
+
+    unrez_pict_decoder_destroy(&decoder);
+    if (failure_count > 0) {
+        fprintf(stderr, "%d of %d tests failed\n", failure_count, test_count);
+        fputs("FAILED\n", stderr);
+        return 1;
+    }
+    printf("%d tests passed\n", test_count);
+    return 0;
+}
@@ -10,12 +10,14 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sysexits.h>
+#include <unistd.h>
 
 enum { kToolDump = 1, kTool2Png };
 
@@ -29,15 +31,154 @@ enum {
     kModeRsrcAll,
 };
 
+enum {
+    /* Attempts to find an unused temporary filename. */
+    kTempAttempts = 100,
+    /* Buffer size for copying files. */
+    kCopyBufferSize = 64 * 1024,
+    /* Most memory used for copies of pictures, for -dedupe. */
+    kDedupeMemory = 64 * 1024 * 1024
+};
+
+static int opt_atomic;
+static int opt_incremental;
+static int opt_dedupe;
+static int opt_png_no_index;
+static int opt_png_preset = kPngPresetDefault;
+static int opt_png_level = -1;
+static int opt_png_filters = -1;
+static int opt_png_strategy = -1;
+static struct pngopts png_opts;
 static int opt_id;
+static int opt_jobs = 1;
 static int opt_mode;
 static int opt_no_header;
 static const char *opt_dir;
 static const char *opt_out;
 
 static int error_count;
+/* The exit status for the first system error in a job, or 0. */
+static int fatal_status;
 static int dirfd;
 static int has_dir;
+static struct pool *pool;
+static struct dedupe *dedupe;
+static struct manifest *manifest;
+
+/* Name of the manifest in the output directory, for -incremental. */
+static const char kManifestName[] = ".unrez-manifest";
+
+/*
+ * An input file, shared by all pictures read from it. The input is freed once
+ * every picture is finished. Only used from the main thread.
+ */
+struct input {
+    int refcount;
+    int has_rfork;
+    struct unrez_resourcefork rfork;
+    struct unrez_data fdata;
+    /* Where outputs are recorded, for -incremental. */
+    struct minput *minput;
+};
+
+static struct input *input_new(void) {
+    struct input *in = calloc(1, sizeof(*in));
+    if (in == NULL) {
+        die_errf(EX_OSERR, errno, "calloc");
+    }
+    in->refcount = 1;
+    return in;
+}
+
+static void input_release(struct input *in) {
+    in->refcount--;
+    if (in->refcount > 0) {
+        return;
+    }
+    if (in->has_rfork) {
+        unrez_resourcefork_close(&in->rfork);
+    } else {
+        unrez_data_destroy(&in->fdata);
+    }
+    free(in);
+}
+
+/*
+ * The first picture converted with some contents. Pictures with the same
+ * contents are linked to its output instead of being converted again. The
+ * original keeps a copy of its data to compare against later pictures, so the
+ * input can be freed. Once the copies use kDedupeMemory, new pictures are no
+ * longer recorded, but they are still compared against earlier ones.
+ */
+struct original {
+    char *outfile;
+    void *data;
+    /* Set when the original is finished. */
+    int written;
+    int error_count;
+    struct original *next;
+};
+
+static struct original *original_list;
+static size_t original_memory;
+
+static void original_free_all(void) {
+    struct original *orig;
+    while (original_list != NULL) {
+        orig = original_list;
+        original_list = orig->next;
+        free(orig->data);
+        free(orig->outfile);
+        free(orig);
+    }
+}
+
+/*
+ * A picture decoder and PNG buffer which can be reused. Each job takes a
+ * decoder from the list while it runs, so there is at most one decoder per
+ * thread, and memory is reused from one picture to the next.
+ */
+struct decoder {
+    struct unrez_pict_decoder dec;
+    struct pngbuf png;
+    struct decoder *next;
+};
+
+static pthread_mutex_t decoder_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct decoder *decoder_list;
+
+static struct decoder *decoder_get(void) {
+    struct decoder *d;
+    pthread_mutex_lock(&decoder_lock);
+    d = decoder_list;
+    if (d != NULL) {
+        decoder_list = d->next;
+    }
+    pthread_mutex_unlock(&decoder_lock);
+    if (d == NULL) {
+        d = calloc(1, sizeof(*d));
+    }
+    return d;
+}
+
+static void decoder_put(struct decoder *d) {
+    pthread_mutex_lock(&decoder_lock);
+    d->next = decoder_list;
+    decoder_list = d;
+    pthread_mutex_unlock(&decoder_lock);
+}
+
+/* Free all decoders. Must be called after all jobs are done. */
+static void decoder_free_all(void) {
+    struct decoder *d;
+    while (decoder_list != NULL) {
+        d = decoder_list;
+        decoder_list = d->next;
+        unrez_pict_decoder_destroy(&d->dec);
+        pngbuf_destroy(&d->png);
+        free(d);
+    }
+}
 
 static void make_dir(void) {
     int r, err, fd;
@@ -73,6 +214,12 @@ static void opt_parse_all(void *value, const char *option, const char *arg) {
     opt_mode = kModeRsrcAll;
 }
 
+static void opt_parse_jobs(void *value, const char *option, const char *arg) {
+    (void)value;
+    (void)option;
+    opt_jobs = parse_jobs(arg);
+}
+
 static void opt_parse_dir(void *value, const char *option, const char *arg) {
     (void)value;
     (void)option;
@@ -87,6 +234,33 @@ static void opt_parse_out(void *value, const char *option, const char *arg) {
     opt_out = arg;
 }
 
+static void opt_parse_preset(void *value, const char *option,
+                             const char *arg) {
+    (void)value;
+    (void)option;
+    opt_png_preset = pngopts_parse_preset(arg);
+}
+
+static void opt_parse_level(void *value, const char *option, const char *arg) {
+    (void)value;
+    (void)option;
+    opt_png_level = pngopts_parse_level(arg);
+}
+
+static void opt_parse_filter(void *value, const char *option,
+                             const char *arg) {
+    (void)value;
+    (void)option;
+    opt_png_filters = pngopts_parse_filters(arg);
+}
+
+static void opt_parse_strategy(void *value, const char *option,
+                               const char *arg) {
+    (void)value;
+    (void)option;
+    opt_png_strategy = pngopts_parse_strategy(arg);
+}
+
 static const struct option kOptionsDump[] = {
     {"all-picts", NULL, 0, opt_parse_all},
     {"id", NULL, 1, opt_parse_id},
@@ -96,10 +270,19 @@ static const struct option kOptionsDump[] = {
 
 static const struct option kOptions2Png[] = {
     {"all-picts", NULL, 0, opt_parse_all},
+    {"atomic", &opt_atomic, 0, opt_parse_true},
+    {"dedupe", &opt_dedupe, 0, opt_parse_true},
     {"dir", NULL, 1, opt_parse_dir},
     {"id", NULL, 1, opt_parse_id},
+    {"incremental", &opt_incremental, 0, opt_parse_true},
+    {"j", NULL, 1, opt_parse_jobs},
     {"no-header", &opt_no_header, 0, opt_parse_true},
     {"out", NULL, 1, opt_parse_out},
+    {"png-filter", NULL, 1, opt_parse_filter},
+    {"png-level", NULL, 1, opt_parse_level},
+    {"png-no-index", &opt_png_no_index, 0, opt_parse_true},
+    {"png-preset", NULL, 1, opt_parse_preset},
+    {"png-strategy", NULL, 1, opt_parse_strategy},
     {0},
 };
 
@@ -111,10 +294,34 @@ static void pict2png_usage(FILE *fp) {
     fputs("usage: unrez pict2png [<options>] <file>...\n", fp);
 }
 
+/*
+ * A job converting one picture to PNG. Messages are written to out, which is
+ * standard output when running one job at a time, and a memory buffer
+ * otherwise so that messages appear in order. If the picture is a copy of an
+ * earlier one, same is set and the job links to the earlier output instead.
+ */
 struct pict2png {
-    const char *outfile;
+    struct job job;
+    struct input *input;
+    const void *data;
+    size_t size;
+    char *outfile;
+    struct original *orig;
+    struct original *same;
+    struct wpng *png;
+    struct pngbuf *pngbuf;
+    FILE *out;
+    char *outbuf;
+    size_t outsize;
     int success;
-    int error;
+    int error_count;
+    /*
+     * The exit status for a system error, or 0. Jobs may run on other
+     * threads, so the program exits after all jobs are finished.
+     */
+    int fatal;
+    /* An error writing the PNG file, reported when the job is finished. */
+    struct pngerr err;
 };
 
 static void cb_error(void *ctx, int err, int opcode, const char *msg) {
@@ -122,31 +329,38 @@ static void cb_error(void *ctx, int err, int opcode, const char *msg) {
     char buf[256];
     int r;
     struct pict2png *pp = ctx;
+    FILE *out;
     if (pp != NULL) {
-        pp->error = 1;
+        pp->error_count++;
+        out = pp->out;
+    } else {
+        error_count++;
+        out = stdout;
     }
-    error_count++;
-    fputs("  error: ", stdout);
+    fputs("  error: ", out);
     if (opcode >= 0) {
-        printf("in op $%04x", opcode);
+        fprintf(out, "in op $%04x", opcode);
         opname = unrez_pict_opname(opcode);
         if (opname != NULL) {
-            printf(" %s", opname);
+            fprintf(out, " %s", opname);
         }
-        fputs(": ", stdout);
+        fputs(": ", out);
     }
     r = unrez_strerror(err, buf, sizeof(buf));
     if (r == 0) {
-        fputs(buf, stdout);
+        fputs(buf, out);
     } else {
-        printf("error #%d", err);
+        fprintf(out, "error #%d", err);
     }
     if (msg != NULL) {
-        printf(": %s", msg);
+        fprintf(out, ": %s", msg);
     }
-    fputc('\n', stdout);
+    fputc('\n', out);
     if (err > 0) {
-        exit(EX_OSERR);
+        if (pp == NULL) {
+            exit(EX_OSERR);
+        }
+        pp->fatal = EX_OSERR;
     }
 }
 
@@ -167,33 +381,271 @@ static int pict2png_opcode(void *ctx, int opcode, const void *data,
     return 0;
 }
 
-static int pict2png_pixels(void *ctx, int opcode, struct unrez_pixdata *pix) {
+static int pict2png_begin_rows(void *ctx, int opcode,
+                               const struct unrez_pixdata *pix) {
     struct pict2png *pp = ctx;
-    int err;
+    int r;
     (void)opcode;
-    if (pix->pixelSize == 16) {
-        err = unrez_pixdata_16to32(pix);
-        if (err != 0) {
-            die_errf(EX_SOFTWARE, err, "16to32");
-        }
+    r = wpng_open(&pp->png, has_dir ? dirfd : AT_FDCWD, pp->outfile, pix,
+                  pp->pngbuf, &png_opts, &pp->err);
+    if (r != 0) {
+        pp->fatal = r;
+    }
+    return r;
+}
+
+static int pict2png_row(void *ctx, int y, const void *data) {
+    struct pict2png *pp = ctx;
+    int r;
+    (void)y;
+    r = wpng_row(pp->png, data);
+    if (r != 0) {
+        pp->fatal = r;
+    }
+    return r;
+}
+
+static int pict2png_end_rows(void *ctx, int opcode) {
+    struct pict2png *pp = ctx;
+    int r;
+    (void)opcode;
+    if (pp->fatal) {
+        /* pict2png_run discards the unfinished file. */
+        return 0;
+    }
+    r = wpng_close(pp->png);
+    pp->png = NULL;
+    if (r != 0) {
+        pp->fatal = r;
+        return r;
     }
-    write_png(has_dir ? dirfd : AT_FDCWD, pp->outfile, pix);
     pp->success = 1;
     return 0;
 }
 
 static const struct unrez_pict_callbacks kCallbacks2Png = {
-    NULL, pict2png_header, pict2png_opcode, pict2png_pixels, cb_error,
+    NULL, pict2png_header, pict2png_opcode, NULL, cb_error,
+    kUnrezRowNative, pict2png_begin_rows, pict2png_row, pict2png_end_rows,
 };
 
-static void pict2png_raw(const char *file, int is_rsrc, int rsrc_id,
-                         const void *data, size_t size) {
+static void pict2png_run(struct job *job) {
+    struct pict2png *pp = (struct pict2png *)job;
+    struct unrez_pict_callbacks cb = kCallbacks2Png;
+    struct decoder *d;
+    if (opt_jobs > 1) {
+        pp->out = open_memstream(&pp->outbuf, &pp->outsize);
+        if (pp->out == NULL) {
+            pp->err.code = errno;
+            strcpy(pp->err.msg, "open_memstream");
+            pp->err.status = pp->fatal = EX_OSERR;
+            return;
+        }
+    } else {
+        pp->out = stdout;
+    }
+    cb.ctx = pp;
+    fprintf(pp->out, "writing %s...\n", pp->outfile);
+    d = decoder_get();
+    if (d == NULL) {
+        pp->err.code = errno;
+        strcpy(pp->err.msg, "calloc");
+        pp->err.status = pp->fatal = EX_OSERR;
+        return;
+    }
+    pp->pngbuf = &d->png;
+    unrez_pict_decoder_decode(&d->dec, &cb, pp->data, pp->size);
+    if (pp->png != NULL) {
+        /* The pixel data was incomplete. */
+        wpng_abort(pp->png);
+        pp->png = NULL;
+    }
+    decoder_put(d);
+}
+
+static void pict2png_finish(struct job *job) {
+    struct pict2png *pp = (struct pict2png *)job;
+    if (pp->out != stdout && pp->out != NULL) {
+        if (fclose(pp->out) != 0) {
+            die_errf(EX_OSERR, errno, "fclose");
+        }
+        fwrite(pp->outbuf, 1, pp->outsize, stdout);
+        free(pp->outbuf);
+    }
+    if (pp->err.status != 0) {
+        fflush(stdout);
+        pngerr_report(&pp->err);
+        pp->error_count++;
+    }
+    if (pp->fatal != 0 && fatal_status == 0) {
+        fatal_status = pp->fatal;
+    }
+    error_count += pp->error_count;
+    if (pp->error_count == 0 && !pp->success) {
+        error_count++;
+        fflush(stdout);
+        fputs("  error: picture has no bitmap\n", stderr);
+    }
+    if (pp->orig != NULL) {
+        pp->orig->written = pp->success;
+        pp->orig->error_count = pp->error_count;
+    }
+    if (pp->input->minput != NULL) {
+        if (pp->error_count == 0 && pp->success) {
+            minput_addoutput(pp->input->minput, pp->outfile);
+        } else {
+            pp->input->minput->failed = 1;
+        }
+    }
+    input_release(pp->input);
+    free(pp->outfile);
+    free(pp);
+}
+
+/* Create a temporary file next to the output file, named after it. */
+static char *temp_name(const char *name, int attempt) {
     const char *base;
+    char *tmp;
+    size_t len = strlen(name) + 32;
+    base = strrchr(name, '/');
+    base = base != NULL ? base + 1 : name;
+    tmp = malloc(len);
+    if (tmp == NULL) {
+        die_errf(EX_OSERR, errno, "malloc");
+    }
+    snprintf(tmp, len, "%.*s.%s.%ld.%d.tmp", (int)(base - name), name, base,
+             (long)getpid(), attempt);
+    return tmp;
+}
+
+/* Copy a file to a new file. Returns 0 on success, or an errno value. */
+static int copy_output(int fd, const char *src, const char *dest) {
+    char *buf;
+    ssize_t amt, pos, wamt;
+    int in, out, err = 0;
+    in = openat(fd, src, O_RDONLY);
+    if (in == -1) {
+        return errno;
+    }
+    out = openat(fd, dest, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (out == -1) {
+        err = errno;
+        close(in);
+        return err;
+    }
+    buf = malloc(kCopyBufferSize);
+    if (buf == NULL) {
+        die_errf(EX_OSERR, errno, "malloc");
+    }
+    for (;;) {
+        amt = read(in, buf, kCopyBufferSize);
+        if (amt < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            err = errno;
+            break;
+        }
+        if (amt == 0) {
+            break;
+        }
+        for (pos = 0; pos < amt; pos += wamt) {
+            wamt = write(out, buf + pos, amt - pos);
+            if (wamt < 0) {
+                if (errno != EINTR) {
+                    err = errno;
+                    break;
+                }
+                wamt = 0;
+            }
+        }
+        if (err != 0) {
+            break;
+        }
+    }
+    free(buf);
+    close(in);
+    if (close(out) != 0 && err == 0) {
+        err = errno;
+    }
+    if (err != 0) {
+        unlinkat(fd, dest, 0);
+    }
+    return err;
+}
+
+/*
+ * Give an output file a second name, replacing any file with that name. The
+ * new name is created under a temporary name and renamed into place, so it
+ * never appears partially written. Files are copied if the filesystem does
+ * not support hard links.
+ */
+static void link_output(const char *src, const char *dest) {
+    char *tmp;
+    int i, err, fd = has_dir ? dirfd : AT_FDCWD;
+    for (i = 0;; i++) {
+        tmp = temp_name(dest, i);
+        err = linkat(fd, src, fd, tmp, 0) == 0 ? 0 : errno;
+        if (err == EPERM || err == EMLINK || err == EOPNOTSUPP ||
+            err == EXDEV) {
+            err = copy_output(fd, src, tmp);
+        }
+        if (err != EEXIST || i + 1 >= kTempAttempts) {
+            break;
+        }
+        free(tmp);
+    }
+    if (err != 0) {
+        die_errf(EX_CANTCREAT, err, "%s", tmp);
+    }
+    if (renameat(fd, tmp, fd, dest) != 0) {
+        err = errno;
+        unlinkat(fd, tmp, 0);
+        die_errf(EX_CANTCREAT, err, "%s", dest);
+    }
+    /* If dest was already a link to src, the rename does nothing. */
+    unlinkat(fd, tmp, 0);
+    free(tmp);
+}
+
+static void pict2png_run_same(struct job *job) {
+    (void)job;
+}
+
+/*
+ * Finish a picture which is a copy of an earlier picture. The earlier picture
+ * has finished, since jobs are finished in order.
+ */
+static void pict2png_finish_same(struct job *job) {
+    struct pict2png *pp = (struct pict2png *)job;
+    struct original *orig = pp->same;
+    printf("writing %s (same as %s)...\n", pp->outfile, orig->outfile);
+    if (orig->error_count > 0 || !orig->written) {
+        error_count++;
+        printf("  error: same picture as %s, which could not be converted\n",
+               orig->outfile);
+    }
+    if (orig->written && strcmp(orig->outfile, pp->outfile) != 0) {
+        link_output(orig->outfile, pp->outfile);
+    }
+    if (pp->input->minput != NULL) {
+        if (orig->error_count == 0 && orig->written) {
+            minput_addoutput(pp->input->minput, pp->outfile);
+        } else {
+            pp->input->minput->failed = 1;
+        }
+    }
+    input_release(pp->input);
+    free(pp->outfile);
+    free(pp);
+}
+
+static void pict2png_raw(struct input *in, const char *file, int is_rsrc,
+                         int rsrc_id, const void *data, size_t size) {
+    const char *base, *outfile;
     char buf[1024];
     int err;
-    struct pict2png pp = {0};
-    struct unrez_pict_callbacks cb = kCallbacks2Png;
-    cb.ctx = &pp;
+    struct pict2png *pp;
+    struct original *orig = NULL, *same = NULL;
     if (opt_out == NULL) {
         make_dir();
         base = strrchr(file, '/');
@@ -213,16 +665,55 @@ static void pict2png_raw(const char *file, int is_rsrc, int rsrc_id,
         if ((size_t)err >= sizeof(buf)) {
             dief(EX_SOFTWARE, "filename too long");
         }
-        pp.outfile = buf;
+        outfile = buf;
     } else {
-        pp.outfile = opt_out;
+        outfile = opt_out;
     }
-    printf("writing %s...\n", pp.outfile);
-    unrez_pict_decode(&cb, data, size);
-    if (!pp.error && !pp.success) {
-        error_count++;
-        fputs("  error: picture has no bitmap\n", stderr);
+    pp = calloc(1, sizeof(*pp));
+    if (pp == NULL) {
+        die_errf(EX_OSERR, errno, "calloc");
+    }
+    pp->outfile = malloc(strlen(outfile) + 1);
+    if (pp->outfile == NULL) {
+        die_errf(EX_OSERR, errno, "malloc");
+    }
+    strcpy(pp->outfile, outfile);
+    if (dedupe != NULL) {
+        same = dedupe_find(dedupe, data, size);
+        if (same == NULL && size <= kDedupeMemory - original_memory) {
+            orig = malloc(sizeof(*orig));
+            if (orig == NULL) {
+                die_errf(EX_OSERR, errno, "malloc");
+            }
+            orig->outfile = malloc(strlen(outfile) + 1);
+            orig->data = malloc(size > 0 ? size : 1);
+            if (orig->outfile == NULL || orig->data == NULL) {
+                die_errf(EX_OSERR, errno, "malloc");
+            }
+            strcpy(orig->outfile, outfile);
+            memcpy(orig->data, data, size);
+            orig->written = 0;
+            orig->error_count = 0;
+            orig->next = original_list;
+            original_list = orig;
+            original_memory += size;
+            dedupe_add(dedupe, orig->data, size, orig);
+        }
     }
+    if (same != NULL) {
+        pp->job.run = pict2png_run_same;
+        pp->job.finish = pict2png_finish_same;
+    } else {
+        pp->job.run = pict2png_run;
+        pp->job.finish = pict2png_finish;
+    }
+    pp->orig = orig;
+    pp->same = same;
+    pp->input = in;
+    pp->data = data;
+    pp->size = size;
+    in->refcount++;
+    pool_submit(pool, &pp->job);
 }
 
 static int dump_header(void *ctx, int version, const struct unrez_rect *frame) {
@@ -271,6 +762,7 @@ static int dump_pixels(void *ctx, int opcode, struct unrez_pixdata *pix) {
 
 static const struct unrez_pict_callbacks kCallbacksDump = {
     NULL, dump_header, dump_opcode, dump_pixels, cb_error,
+    kUnrezRowNative, NULL, NULL, NULL,
 };
 
 static void pictdump_raw(const void *data, size_t size) {
@@ -281,9 +773,99 @@ static void pictdump_raw(const void *data, size_t size) {
     fputc('\n', stdout);
 }
 
+/*
+ * Get the identity of the files which an input's forks are read from. Forks
+ * decoded into memory are identified by the input file. Returns the number of
+ * files.
+ */
+static int input_files(struct mstat *files, const char *file,
+                       const struct unrez_forkedfile *forks) {
+    int i, err, count = 0, fds[2];
+    fds[0] = forks->data.file;
+    fds[1] = forks->rsrc.file;
+    for (i = 0; i < 2; i++) {
+        if (fds[i] == -1 || (i == 1 && fds[1] == fds[0])) {
+            continue;
+        }
+        err = mstat_get(&files[count++], fds[i]);
+        if (err != 0) {
+            die_errf(EX_NOINPUT, err, "%s", file);
+        }
+    }
+    if (count == 0) {
+        err = mstat_getat(&files[count++], AT_FDCWD, file);
+        if (err != 0) {
+            die_errf(EX_NOINPUT, err, "%s", file);
+        }
+    }
+    return count;
+}
+
+/*
+ * Check whether an input is the same as when the manifest was written, and
+ * every output made from it is still there. The resource map is only read
+ * if the files have not changed.
+ */
+static int input_unchanged(const struct minput *mi, int count,
+                           const struct mstat *files,
+                           const struct unrez_fork *rsrc) {
+    struct unrez_resourcefork rfork;
+    struct mstat st;
+    uint32_t hash;
+    int i;
+    if (mi->file_count != count) {
+        return 0;
+    }
+    for (i = 0; i < count; i++) {
+        if (!mstat_equal(&mi->files[i], &files[i])) {
+            return 0;
+        }
+    }
+    for (i = 0; i < mi->output_count; i++) {
+        if (mstat_getat(&st, dirfd, mi->outputs[i]) != 0) {
+            return 0;
+        }
+    }
+    if (mi->has_map) {
+        if (unrez_resourcefork_openstream(&rfork, rsrc) != 0) {
+            return 0;
+        }
+        hash = dedupe_hash(rfork.map, rfork.map_size);
+        unrez_resourcefork_close(&rfork);
+        if (hash != mi->map_hash) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Look up an input in the manifest. Returns NULL if the input is unchanged
+ * and can be skipped. Otherwise, returns the manifest entry, reset and with
+ * the input's files, so outputs can be recorded.
+ */
+static struct minput *input_check(const char *file,
+                                  const struct unrez_forkedfile *forks) {
+    struct minput *mi;
+    struct mstat files[kMInputMaxFiles];
+    int count;
+    count = input_files(files, file, forks);
+    mi = manifest_input(manifest, file);
+    if (input_unchanged(mi, count, files, &forks->rsrc)) {
+        printf("%s is unchanged\n", file);
+        return NULL;
+    }
+    minput_reset(mi);
+    mi->file_count = count;
+    memcpy(mi->files, files, sizeof(*files) * count);
+    return mi;
+}
+
 static void pict_data(const char *file) {
+    static const struct unrez_readopts kOpts = {0, kUnrezAdviseSequential, 0};
     struct unrez_forkedfile forks;
-    struct unrez_data fdata;
+    struct input *in;
+    struct minput *mi = NULL;
     int err;
     const void *data;
     size_t size;
@@ -291,13 +873,22 @@ static void pict_data(const char *file) {
     if (err != 0) {
         die_errf(err > 0 ? EX_NOINPUT : EX_DATAERR, err, "%s", file);
     }
-    err = unrez_fork_read(&forks.data, &fdata);
+    if (manifest != NULL) {
+        mi = input_check(file, &forks);
+        if (mi == NULL) {
+            unrez_forkedfile_close(&forks);
+            return;
+        }
+    }
+    in = input_new();
+    in->minput = mi;
+    err = unrez_fork_readopts(&forks.data, &in->fdata, &kOpts);
     if (err != 0) {
         die_errf(EX_OSERR, err, "%s", file);
     }
     unrez_forkedfile_close(&forks);
-    data = fdata.data;
-    size = fdata.size;
+    data = in->fdata.data;
+    size = in->fdata.size;
     if (!opt_no_header) {
         if (size < kUnrezPictHeaderSize) {
             dief(EX_DATAERR, "%s: missing header", file);
@@ -311,18 +902,18 @@ static void pict_data(const char *file) {
         pictdump_raw(data, size);
         break;
     case kTool2Png:
-        pict2png_raw(file, 0, 0, data, size);
+        pict2png_raw(in, file, 0, 0, data, size);
         break;
     }
-    unrez_data_destroy(&fdata);
+    input_release(in);
 }
 
-static void pict_rsrc1(const char *file, struct unrez_resourcefork *rfork,
+static void pict_rsrc1(const char *file, struct input *in,
                        struct unrez_resource *rsrc) {
     const void *data;
     uint32_t size;
     int err;
-    err = unrez_resourcefork_getdata(rfork, rsrc, &data, &size);
+    err = unrez_resourcefork_getdata(&in->rfork, rsrc, &data, &size);
     if (err != 0) {
         die_errf(err > 0 ? EX_OSERR : EX_DATAERR, err, "%s 'PICT' #%d", file,
                  rsrc->id);
@@ -333,28 +924,61 @@ static void pict_rsrc1(const char *file, struct unrez_resourcefork *rfork,
         pictdump_raw(data, size);
         break;
     case kTool2Png:
-        pict2png_raw(file, 1, rsrc->id, data, size);
+        pict2png_raw(in, file, 1, rsrc->id, data, size);
         break;
     }
 }
 
 static void pict_rsrc(const char *file) {
-    struct unrez_resourcefork rfork;
+    struct unrez_readopts opts;
+    struct unrez_forkedfile forks;
+    struct input *in;
     struct unrez_resourcetype *type;
     struct unrez_resource *rsrc;
+    struct minput *mi = NULL;
     int err, i, count;
-    err = unrez_resourcefork_open(&rfork, file);
+    memset(&opts, 0, sizeof(opts));
+    if (opt_mode == kModeRsrc) {
+        opts.advice = kUnrezAdviseRandom;
+    } else {
+        /* Every picture is decoded, so start reading the whole fork now. */
+        opts.advice = kUnrezAdviseSequential;
+        opts.flags = kUnrezReadWillNeed;
+    }
+    err = unrez_forkedfile_open(&forks, file);
+    if (err == 0 && manifest != NULL) {
+        mi = input_check(file, &forks);
+        if (mi == NULL) {
+            unrez_forkedfile_close(&forks);
+            return;
+        }
+    }
+    in = input_new();
+    if (err == 0) {
+        err = unrez_resourcefork_openforkopts(&in->rfork, &forks.rsrc, &opts);
+        unrez_forkedfile_close(&forks);
+    }
     if (err != 0) {
         die_errf(err > 0 ? EX_NOINPUT : EX_DATAERR, err, "%s", file);
     }
+    in->has_rfork = 1;
+    if (mi != NULL) {
+        mi->has_map = 1;
+        mi->map_hash = dedupe_hash(in->rfork.map, in->rfork.map_size);
+        in->minput = mi;
+    }
     if (opt_mode == kModeRsrc) {
-        err = unrez_resourcefork_findrsrc(&rfork, &rsrc, kPictCode, opt_id);
+        err = unrez_resourcefork_findrsrc(&in->rfork, &rsrc, kPictCode, opt_id);
         if (err != 0) {
             die_errf(EX_DATAERR, err, "could not load PICT %d", opt_id);
         }
-        pict_rsrc1(file, &rfork, rsrc);
+        pict_rsrc1(file, in, rsrc);
     } else {
-        err = unrez_resourcefork_findtype(&rfork, &type, kPictCode);
+        err = unrez_resourcefork_loadall(&in->rfork);
+        if (err != 0) {
+            die_errf(EX_OSERR, err, "could not load resources");
+        }
+        err = unrez_resourcefork_findtype(&in->rfork, &type, kPictCode);
         if (err != 0) {
             if (err != kUnrezErrResourceNotFound) {
                 die_errf(EX_DATAERR, err, "could not load PICT resources");
@@ -363,11 +987,11 @@ static void pict_rsrc(const char *file) {
             count = type->count;
             rsrc = type->resources;
             for (i = 0; i < count; i++) {
-                pict_rsrc1(file, &rfork, rsrc);
+                pict_rsrc1(file, in, &rsrc[i]);
             }
         }
     }
-    unrez_resourcefork_close(&rfork);
+    input_release(in);
 }
 
 static void pict_exec(int argc, char **argv) {
@@ -385,6 +1009,21 @@ static void pict_exec(int argc, char **argv) {
             pict_rsrc(argv[i]);
         }
     }
+    if (pool != NULL) {
+        pool_destroy(pool);
+    }
+    if (dedupe != NULL) {
+        dedupe_destroy(dedupe);
+        original_free_all();
+    }
+    if (manifest != NULL) {
+        manifest_write(manifest, dirfd, kManifestName);
+        manifest_destroy(manifest);
+    }
+    decoder_free_all();
+    if (fatal_status != 0) {
+        exit(fatal_status);
+    }
     if (error_count > 0) {
         errorf("some pictures could not be decoded");
         exit(EX_DATAERR);
@@ -397,6 +1036,21 @@ void pictdump_exec(int argc, char **argv) {
     pict_exec(argc, argv);
 }
 
+/*
+ * Describe the options which affect the output files, so changing them
+ * invalidates the manifest.
+ */
+static const char *manifest_config(void) {
+    static char buf[128];
+    snprintf(buf, sizeof(buf),
+             "pict2png mode=%d id=%d no-header=%d no-index=%d level=%d "
+             "filters=%d,%d strategy=%d,%d",
+             opt_mode, opt_mode == kModeRsrc ? opt_id : 0, opt_no_header,
+             opt_png_no_index, png_opts.level, png_opts.filters,
+             png_opts.filters16, png_opts.strategy, png_opts.strategy16);
+    return buf;
+}
+
 void pict2png_exec(int argc, char **argv) {
     tool = kTool2Png;
     parse_options(kOptions2Png, &argc, &argv);
@@ -407,6 +1061,32 @@ void pict2png_exec(int argc, char **argv) {
     } else if (opt_dir == NULL) {
         dief(EX_USAGE, "either -out or -dir must be specified");
     }
+    /* Options given separately override the preset. */
+    pngopts_preset(&png_opts, opt_png_preset);
+    png_opts.flags =
+        (opt_atomic ? kPngAtomic : 0) | (opt_png_no_index ? kPngNoIndex : 0);
+    if (opt_png_level != -1) {
+        png_opts.level = opt_png_level;
+    }
+    if (opt_png_filters != -1) {
+        png_opts.filters = opt_png_filters;
+        png_opts.filters16 = opt_png_filters;
+    }
+    if (opt_png_strategy != -1) {
+        png_opts.strategy = opt_png_strategy;
+        png_opts.strategy16 = opt_png_strategy;
+    }
+    if (opt_dir != NULL && opt_dedupe) {
+        dedupe = dedupe_create();
+    }
+    if (opt_incremental) {
+        if (opt_dir == NULL) {
+            dief(EX_USAGE, "-incremental requires -dir");
+        }
+        make_dir();
+        manifest = manifest_read(dirfd, kManifestName, manifest_config());
+    }
+    pool = pool_create(opt_jobs);
     pict_exec(argc, argv);
 }
 
@@ -429,9 +1109,35 @@ void pict2png_help(void) {
         "\n"
         "options:\n"
         "  -all-picts    dump all PICT resources\n"
+        "  -atomic       write each file under a temporary name, then rename\n"
+        "                it, so files never appear partially written\n"
+        "  -dedupe       write pictures identical to earlier ones as hard\n"
+        "                links to the earlier file, instead of converting\n"
+        "                them again (with -dir)\n"
         "  -dir <dir>    write PNG files to <dir>\n"
         "  -id <id>      dump PICT resource id <id>\n"
+        "  -incremental  skip input files which have not changed since the\n"
+        "                last run with -incremental, using a manifest in the\n"
+        "                output directory\n"
+        "  -j <n>        convert <n> pictures at once, or 0 for one per CPU\n"
         "  -out <file>   write output to <file> (if only one output)\n"
-        "  -no-header    the pictures do not have a 512-byte header\n",
+        "  -no-header    the pictures do not have a 512-byte header\n"
+        "\n"
+        "PNG options:\n"
+        "  -png-preset <preset>\n"
+        "                default, fast (for throughput), or small (smallest\n"
+        "                files, but slower for 32-bit pictures), overridden\n"
+        "                by the options below\n"
+        "  -png-level <n>\n"
+        "                zlib compression level, from 0 to 9\n"
+        "  -png-filter <filter>,...\n"
+        "                row filters to choose from: none, sub, up, avg,\n"
+        "                paeth, or all\n"
+        "  -png-no-index always write 16 and 32-bit pictures as RGB, instead\n"
+        "                of with a palette when they have few colors (only\n"
+        "                checked for pictures up to 4 megapixels)\n"
+        "  -png-strategy <strategy>\n"
+        "                zlib strategy: default, filtered, huffman, rle, or\n"
+        "                fixed\n",
         stdout);
 }
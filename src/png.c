@@ -9,23 +9,251 @@
 #include "unrez.h"
 
 #include <png.h>
+#include <zlib.h>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <setjmp.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sysexits.h>
+#include <unistd.h>
+
+enum {
+    kInitialBufferSize = 64 * 1024,
+    /* Attempts to find an unused temporary filename. */
+    kTempAttempts = 100,
+    /* Slots in the color histogram, a power of two at least 4x the palette. */
+    kHistBits = 10,
+    kHistSize = 1 << kHistBits,
+    /*
+     * Largest direct color picture, in pixels, which is checked for a palette.
+     * This bounds the memory used for the palette indexes.
+     */
+    kMaxIndexedPixels = 4 * 1024 * 1024
+};
+
+/*
+ * A hash table of the colors in a direct color picture, which gives up once
+ * there are too many colors for a palette. Colors from 32-bit pixels are packed
+ * into 32 bits as red, green, blue, and alpha, from least to most significant
+ * byte. Colors from 16-bit pixels are kept as 15-bit values.
+ */
+struct histogram {
+    int count;
+    /* Mask for the bits in each color which are counted. */
+    uint32_t mask;
+    int pixel_size;
+    /* For each slot, the color, and its palette index plus one, or zero. */
+    uint32_t color[kHistSize];
+    uint16_t index[kHistSize];
+    /* The colors, in the order they were found. */
+    uint32_t palette[256];
+};
 
 struct wpng {
     const char *name;
-    int fdes;
+    int dirfd;
+    const struct pngopts *opts;
+    struct pngbuf *buf;
+    struct pngerr *err;
+    png_struct *png;
+    png_info *info;
+    png_color col[256];
+    png_byte trans[256];
+    int width, height, depth, rowbytes, y;
+    /* The pixel size of the rows passed to wpng_row. */
+    int pixel_size;
+    /* Whether direct color rows have an alpha channel. */
+    int alpha;
+    /*
+     * Rows of a direct color picture with an alpha channel are kept until the
+     * end, since the color type depends on whether any alpha values are
+     * nonzero.
+     */
+    unsigned char *rows;
+    /* The colors in the picture so far, or NULL if there are too many. */
+    struct histogram *hist;
+    /*
+     * While the picture might use few enough colors for a palette, the
+     * palette index of each pixel so far, one byte per pixel.
+     */
+    unsigned char *indexes;
+    /* A row of pixels converted back from palette indexes. */
+    unsigned char *unindexed;
+    /*
+     * For indexed pictures written at a different depth, a row of 8-bit
+     * indexes, and a row at the output depth.
+     */
+    unsigned char *index;
+    unsigned char *packed;
+    /* For 16-bit pictures written as RGB, a row of 32-bit pixels. */
+    unsigned char *rgb;
+};
+
+void pngopts_preset(struct pngopts *opts, int preset) {
+    switch (preset) {
+    case kPngPresetFast:
+        opts->level = 1;
+        opts->filters = PNG_FILTER_SUB;
+        opts->strategy = -1;
+        opts->filters16 = -1;
+        opts->strategy16 = -1;
+        break;
+    case kPngPresetSmall:
+        /* Filtering makes 16-bit pictures larger. */
+        opts->level = 9;
+        opts->filters = PNG_ALL_FILTERS;
+        opts->strategy = -1;
+        opts->filters16 = PNG_FILTER_NONE;
+        opts->strategy16 = Z_FILTERED;
+        break;
+    default:
+        opts->level = -1;
+        opts->filters = -1;
+        opts->strategy = -1;
+        opts->filters16 = -1;
+        opts->strategy16 = -1;
+        break;
+    }
+}
+
+/* A name for an option value. */
+struct optname {
+    const char *name;
+    int value;
+};
+
+static const struct optname kPresetNames[] = {
+    {"default", kPngPresetDefault},
+    {"fast", kPngPresetFast},
+    {"small", kPngPresetSmall},
+    {NULL, 0},
+};
+
+static const struct optname kFilterNames[] = {
+    {"none", PNG_FILTER_NONE},   {"sub", PNG_FILTER_SUB},
+    {"up", PNG_FILTER_UP},       {"avg", PNG_FILTER_AVG},
+    {"paeth", PNG_FILTER_PAETH}, {"all", PNG_ALL_FILTERS},
+    {NULL, 0},
+};
+
+static const struct optname kStrategyNames[] = {
+    {"default", Z_DEFAULT_STRATEGY},
+    {"filtered", Z_FILTERED},
+    {"huffman", Z_HUFFMAN_ONLY},
+    {"rle", Z_RLE},
+    {"fixed", Z_FIXED},
+    {NULL, 0},
 };
 
+/* Look up a name of the given length, or return -1. */
+static int find_name(const struct optname *names, const char *s, size_t len) {
+    for (; names->name != NULL; names++) {
+        if (strlen(names->name) == len && memcmp(names->name, s, len) == 0) {
+            return names->value;
+        }
+    }
+    return -1;
+}
+
+int pngopts_parse_preset(const char *s) {
+    int value = find_name(kPresetNames, s, strlen(s));
+    if (value == -1) {
+        dief(EX_USAGE, "unknown PNG preset '%s'", s);
+    }
+    return value;
+}
+
+int pngopts_parse_level(const char *s) {
+    char *end;
+    long value;
+    value = strtol(s, &end, 10);
+    if (!*s || *end || value < 0 || value > 9) {
+        dief(EX_USAGE, "invalid PNG level '%s', must be between 0 and 9", s);
+    }
+    return value;
+}
+
+int pngopts_parse_filters(const char *s) {
+    const char *p = s, *e;
+    int mask = 0, value;
+    for (;;) {
+        e = strchr(p, ',');
+        if (e == NULL) {
+            e = p + strlen(p);
+        }
+        value = find_name(kFilterNames, p, e - p);
+        if (value == -1) {
+            dief(EX_USAGE, "invalid PNG filter list '%s'", s);
+        }
+        mask |= value;
+        if (*e == '\0') {
+            return mask;
+        }
+        p = e + 1;
+    }
+}
+
+int pngopts_parse_strategy(const char *s) {
+    int value = find_name(kStrategyNames, s, strlen(s));
+    if (value == -1) {
+        dief(EX_USAGE, "unknown PNG strategy '%s'", s);
+    }
+    return value;
+}
+
+void pngerr_report(const struct pngerr *err) {
+    if (err->code != 0) {
+        error_errf(err->code, "%s", err->msg);
+    } else {
+        errorf("%s", err->msg);
+    }
+}
+
+static void vset_error(struct pngerr *err, int status, int code,
+                       const char *msg, va_list ap) {
+    err->status = status;
+    err->code = code;
+    vsnprintf(err->msg, sizeof(err->msg), msg, ap);
+}
+
+/* Store an error, and return its exit status. */
+static int set_error(struct pngerr *err, int status, int code, const char *msg,
+                     ...) __attribute__((format(printf, 4, 5)));
+
+static int set_error(struct pngerr *err, int status, int code, const char *msg,
+                     ...) {
+    va_list ap;
+    va_start(ap, msg);
+    vset_error(err, status, code, msg, ap);
+    va_end(ap);
+    return status;
+}
+
+/*
+ * Store an error, and return from the wpng function which was called, through
+ * the LibPNG jump buffer.
+ */
+static void wpng_fail(struct wpng *w, int status, int code, const char *msg,
+                      ...) __attribute__((noreturn, format(printf, 4, 5)));
+
+static void wpng_fail(struct wpng *w, int status, int code, const char *msg,
+                      ...) {
+    va_list ap;
+    va_start(ap, msg);
+    vset_error(w->err, status, code, msg, ap);
+    va_end(ap);
+    png_longjmp(w->png, 1);
+}
+
 static void error_cb(png_struct *pngp, const char *msg) {
-    (void)pngp;
-    dief(EX_SOFTWARE, "libpng: %s\n", msg);
+    struct wpng *w = png_get_error_ptr(pngp);
+    wpng_fail(w, EX_SOFTWARE, 0, "libpng: %s", msg);
 }
 
 static void warning_cb(png_struct *pngp, const char *msg) {
@@ -33,112 +261,634 @@ static void warning_cb(png_struct *pngp, const char *msg) {
     fprintf(stderr, "warning: libpng: %s\n", msg);
 }
 
+void pngbuf_destroy(struct pngbuf *buf) {
+    free(buf->data);
+    buf->data = NULL;
+    buf->size = 0;
+    buf->alloc = 0;
+}
+
 static void write_cb(png_struct *pngp, png_byte *data, png_size_t length) {
     struct wpng *w = png_get_io_ptr(pngp);
-    ssize_t amt;
-    png_size_t pos = 0;
-    int fdes = w->fdes, err;
-    while (pos < length) {
-        amt = write(fdes, data + pos, length - pos);
-        if (amt < 0) {
-            err = errno;
-            if (err == EINTR) {
-                continue;
+    struct pngbuf *buf = w->buf;
+    unsigned char *ndata;
+    size_t nalloc;
+    if (length > buf->alloc - buf->size) {
+        nalloc = buf->alloc > 0 ? buf->alloc : kInitialBufferSize;
+        while (length > nalloc - buf->size) {
+            if (nalloc > (size_t)-1 / 2) {
+                wpng_fail(w, EX_SOFTWARE, 0, "%s: PNG file too large",
+                          w->name);
             }
-            die_errf(EX_CANTCREAT, err, "%s", w->name);
+            nalloc *= 2;
         }
-        pos += amt;
+        ndata = realloc(buf->data, nalloc);
+        if (ndata == NULL) {
+            wpng_fail(w, EX_OSERR, errno, "realloc");
+        }
+        buf->data = ndata;
+        buf->alloc = nalloc;
     }
+    memcpy(buf->data + buf->size, data, length);
+    buf->size += length;
 }
 
 static void flush_cb(png_struct *pngp) {
     (void)pngp;
 }
 
-void write_png(int dirfd, const char *name, const struct unrez_pixdata *pix) {
-    struct wpng w;
-    png_struct *png;
-    png_info *info;
-    int width, height, rowbytes, ctype, depth, i, col_count;
-    const unsigned char *data;
-    png_byte **rows = NULL;
-    png_color *col = NULL;
-    const struct unrez_color *icol;
+/*
+ * Test whether 32-bit pixel data has a meaningful alpha channel. Many pictures
+ * with four components have an alpha channel which is entirely zero, which we
+ * ignore.
+ */
+static int has_alpha(const unsigned char *data, int width, int height,
+                     int rowbytes) {
+    const unsigned char *row;
+    int x, y;
+    if (width > rowbytes >> 2) {
+        width = rowbytes >> 2;
+    }
+    for (y = 0; y < height; y++) {
+        row = data + y * rowbytes;
+        for (x = 0; x < width; x++) {
+            if (row[x * 4 + 3] != 0) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Get the color of a pixel, masked to the bits which are used. */
+static uint32_t read_color(const unsigned char *row, int x, int pixel_size,
+                           uint32_t mask) {
+    const unsigned char *p;
+    if (pixel_size == 16) {
+        return ((const uint16_t *)row)[x] & mask;
+    }
+    p = row + x * 4;
+    return ((uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+            ((uint32_t)p[3] << 24)) &
+           mask;
+}
+
+/*
+ * Add a color to the histogram, and return its palette index, or -1 if there
+ * are too many colors.
+ */
+static int hist_add(struct histogram *h, uint32_t color) {
+    unsigned i = (uint32_t)(color * 0x9e3779b1u) >> (32 - kHistBits);
+    for (;;) {
+        if (h->index[i] == 0) {
+            if (h->count >= 256) {
+                return -1;
+            }
+            h->color[i] = color;
+            h->palette[h->count] = color;
+            h->index[i] = ++h->count;
+            return h->count - 1;
+        }
+        if (h->color[i] == color) {
+            return h->index[i] - 1;
+        }
+        i = (i + 1) & (kHistSize - 1);
+    }
+}
 
-    png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, error_cb,
-                                  warning_cb);
-    if (png == NULL) {
-        dief(EX_SOFTWARE, "cannot initialize LibPNG");
+/*
+ * Add the colors in a row of direct pixels to the histogram, and if out is not
+ * NULL, store their palette indexes in out. Returns 0 if there are too many
+ * colors. Runs of the same color only look up the table once.
+ */
+static int hist_row(struct histogram *h, const unsigned char *row, int width,
+                    unsigned char *out) {
+    uint32_t color, last = 0;
+    int x, index = -1;
+    for (x = 0; x < width; x++) {
+        color = read_color(row, x, h->pixel_size, h->mask);
+        if (index < 0 || color != last) {
+            index = hist_add(h, color);
+            if (index < 0) {
+                return 0;
+            }
+            last = color;
+        }
+        if (out != NULL) {
+            out[x] = index;
+        }
     }
-    info = png_create_info_struct(png);
-    if (info == NULL) {
-        dief(EX_SOFTWARE, "cannot initialize LibPNG");
+    return 1;
+}
+
+/*
+ * Convert a row of palette indexes back to direct pixels. Bits which are not
+ * counted in the histogram are zero, which does not change the output.
+ */
+static void hist_unindex(const struct histogram *h, unsigned char *out,
+                         const unsigned char *in, int width) {
+    uint32_t color;
+    int x;
+    for (x = 0; x < width; x++) {
+        color = h->palette[in[x]];
+        if (h->pixel_size == 16) {
+            ((uint16_t *)out)[x] = color;
+        } else {
+            out[x * 4] = color;
+            out[x * 4 + 1] = color >> 8;
+            out[x * 4 + 2] = color >> 16;
+            out[x * 4 + 3] = color >> 24;
+        }
     }
+}
+
+/* Get the smallest PNG bit depth for a palette with the given size. */
+static int palette_depth(int count) {
+    return count <= 2 ? 1 : count <= 4 ? 2 : count <= 16 ? 4 : 8;
+}
 
-    w.name = name;
-    w.fdes = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    if (w.fdes == -1) {
-        die_errf(EX_CANTCREAT, errno, "%s", name);
+/* Unpack a row of pixels with the given depth into 8-bit values. */
+static void unpack_row(unsigned char *out, const unsigned char *in, int width,
+                       int depth) {
+    int x, shift = 8, mask = (1 << depth) - 1;
+    if (depth == 8) {
+        memcpy(out, in, width);
+        return;
     }
-    png_set_write_fn(png, &w, write_cb, flush_cb);
+    for (x = 0; x < width; x++) {
+        shift -= depth;
+        out[x] = (*in >> shift) & mask;
+        if (shift == 0) {
+            in++;
+            shift = 8;
+        }
+    }
+}
 
-    height = pix->bounds.bottom - pix->bounds.top;
-    width = pix->bounds.right - pix->bounds.left;
-    rowbytes = pix->rowBytes;
+/*
+ * Pack 8-bit values into a row of pixels with the given depth. Values too
+ * large for the depth are truncated.
+ */
+static void pack_row(unsigned char *out, const unsigned char *in, int width,
+                     int depth) {
+    int x, shift = 8, mask = (1 << depth) - 1, acc = 0;
+    if (depth == 8) {
+        memcpy(out, in, width);
+        return;
+    }
+    for (x = 0; x < width; x++) {
+        shift -= depth;
+        acc |= (in[x] & mask) << shift;
+        if (shift == 0) {
+            *out++ = acc;
+            acc = 0;
+            shift = 8;
+        }
+    }
+    if (shift != 8) {
+        *out = acc;
+    }
+}
+
+/* Expand a 5-bit color component to 8 bits, like unrez_pixdata_16to32. */
+static int expand5(uint32_t v) {
+    v &= 31;
+    return (v << 3) | (v >> 2);
+}
+
+/* Allocate the row buffers for writing indexed rows at the output depth. */
+static void alloc_packed(struct wpng *w) {
+    w->index = malloc(w->width);
+    w->packed = malloc(((size_t)w->width * w->depth + 7) / 8);
+    if (w->index == NULL || w->packed == NULL) {
+        wpng_fail(w, EX_OSERR, errno, "malloc");
+    }
+}
+
+/* Write the PNG header. */
+static void wpng_header(struct wpng *w, int ctype) {
+    const struct pngopts *opts = w->opts;
+    png_color_8 sbit;
+    int filters = opts->filters, strategy = opts->strategy;
+    if (w->pixel_size == 16) {
+        if (opts->filters16 != -1) {
+            filters = opts->filters16;
+        }
+        if (opts->strategy16 != -1) {
+            strategy = opts->strategy16;
+        }
+    }
+    /* Indexed and 1-bit pictures are not filtered, as the PNG spec advises. */
+    if (filters != -1 && ctype != PNG_COLOR_TYPE_PALETTE && w->depth == 8) {
+        png_set_filter(w->png, PNG_FILTER_TYPE_BASE, filters);
+    }
+    if (strategy != -1) {
+        png_set_compression_strategy(w->png, strategy);
+    }
+    png_set_IHDR(w->png, w->info, w->width, w->height, w->depth, ctype,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+                 PNG_FILTER_TYPE_DEFAULT);
+    if (w->pixel_size == 16) {
+        /* Record that the colors were expanded from 5 bits. */
+        memset(&sbit, 0, sizeof(sbit));
+        sbit.red = 5;
+        sbit.green = 5;
+        sbit.blue = 5;
+        png_set_sBIT(w->png, w->info, &sbit);
+    }
+    png_write_info(w->png, w->info);
+    switch (ctype) {
+    case PNG_COLOR_TYPE_GRAY:
+        png_set_invert_mono(w->png);
+        break;
+    case PNG_COLOR_TYPE_RGB:
+        png_set_filler(w->png, 0, PNG_FILLER_AFTER);
+        break;
+    }
+}
+
+/* Set up a PNG writer for the given pixel data, after LibPNG is initialized. */
+static void wpng_start(struct wpng *w, const struct unrez_pixdata *pix) {
+    const struct pngopts *opts = w->opts;
+    int i, ctype = -1, col_count;
+    const struct unrez_color *icol;
+
+    png_set_write_fn(w->png, w, write_cb, flush_cb);
+    if (opts->level != -1) {
+        png_set_compression_level(w->png, opts->level);
+    }
+
+    w->height = pix->bounds.bottom - pix->bounds.top;
+    w->width = pix->bounds.right - pix->bounds.left;
+    w->rowbytes = pix->rowBytes;
+    w->pixel_size = pix->pixelSize;
+    if (w->width <= 0 ||
+        (int64_t)w->width * pix->pixelSize > (int64_t)w->rowbytes * 8) {
+        wpng_fail(w, EX_SOFTWARE, 0,
+                  "picture width %d does not fit in %d bytes per row",
+                  w->width, w->rowbytes);
+    }
     switch (pix->pixelSize) {
     case 1:
         ctype = PNG_COLOR_TYPE_GRAY;
-        depth = 1;
+        w->depth = 1;
         break;
+    case 2:
+    case 4:
     case 8:
         ctype = PNG_COLOR_TYPE_PALETTE;
-        depth = 8;
         col_count = pix->ctSize;
         if (col_count == 0) {
-            dief(EX_SOFTWARE, "missing pallette for 8-bit image");
+            wpng_fail(w, EX_SOFTWARE, 0, "missing palette for %d-bit image",
+                      pix->pixelSize);
+        }
+        /* Use the smallest depth which fits the whole palette. */
+        w->depth = palette_depth(col_count);
+        if (w->depth > pix->pixelSize) {
+            w->depth = pix->pixelSize;
+            col_count = 1 << w->depth;
         }
-        col = malloc(sizeof(*col) * col_count);
-        if (col == NULL) {
-            die_errf(EX_SOFTWARE, errno, "malloc");
+        if (w->depth != pix->pixelSize) {
+            alloc_packed(w);
         }
         icol = pix->ctTable;
         for (i = 0; i < col_count; i++) {
-            col[i].red = icol[i].r >> 8;
-            col[i].green = icol[i].g >> 8;
-            col[i].blue = icol[i].b >> 8;
+            w->col[i].red = icol[i].r >> 8;
+            w->col[i].green = icol[i].g >> 8;
+            w->col[i].blue = icol[i].b >> 8;
         }
-        png_set_PLTE(png, info, col, col_count);
+        png_set_PLTE(w->png, w->info, w->col, col_count);
         break;
+    case 16:
     case 32:
-        ctype = PNG_COLOR_TYPE_RGB;
-        depth = 8;
+        w->depth = 8;
+        w->alpha = pix->pixelSize == 32 && pix->cmpCount == 4;
+        if (pix->pixelSize == 16) {
+            /* Rows are expanded to 32 bits as they are written. */
+            w->rgb = malloc((size_t)w->width * 4);
+            if (w->rgb == NULL) {
+                wpng_fail(w, EX_OSERR, errno, "malloc");
+            }
+        }
+        if ((opts->flags & kPngNoIndex) == 0 &&
+            w->height <= kMaxIndexedPixels / w->width) {
+            w->hist = malloc(sizeof(*w->hist));
+            w->indexes = malloc((size_t)w->width * w->height);
+            if (w->hist == NULL || w->indexes == NULL) {
+                wpng_fail(w, EX_OSERR, errno, "malloc");
+            }
+            w->hist->count = 0;
+            w->hist->mask = pix->pixelSize == 16 ? 0x7fff
+                            : w->alpha           ? 0xffffffff
+                                                 : 0x00ffffff;
+            w->hist->pixel_size = pix->pixelSize;
+            memset(w->hist->index, 0, sizeof(w->hist->index));
+        }
+        if (w->alpha) {
+            w->rows = malloc((size_t)w->rowbytes * w->height);
+            if (w->rows == NULL) {
+                wpng_fail(w, EX_OSERR, errno, "malloc");
+            }
+        } else if (w->hist == NULL) {
+            ctype = PNG_COLOR_TYPE_RGB;
+        }
         break;
     default:
-        dief(EX_SOFTWARE, "unknown pixel size: %d", pix->pixelSize);
+        wpng_fail(w, EX_SOFTWARE, 0, "unknown pixel size: %d", pix->pixelSize);
     }
-    png_set_IHDR(png, info, width, height, depth, ctype, PNG_INTERLACE_NONE,
-                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
-    png_write_info(png, info);
-    switch (ctype) {
-    case PNG_COLOR_TYPE_GRAY:
-        png_set_invert_mono(png);
-        break;
-    case PNG_COLOR_TYPE_RGB:
-        png_set_filler(png, 0, PNG_FILLER_AFTER);
-        break;
+    if (ctype != -1) {
+        wpng_header(w, ctype);
+    }
+}
+
+/* Free the memory used by a PNG writer. */
+static void wpng_free(struct wpng *w) {
+    png_destroy_write_struct(&w->png, &w->info);
+    free(w->rows);
+    free(w->hist);
+    free(w->indexes);
+    free(w->unindexed);
+    free(w->index);
+    free(w->packed);
+    free(w->rgb);
+    free(w);
+}
+
+int wpng_open(struct wpng **wp, int dirfd, const char *name,
+              const struct unrez_pixdata *pix, struct pngbuf *buf,
+              const struct pngopts *opts, struct pngerr *err) {
+    struct wpng *w;
+
+    *wp = NULL;
+    w = calloc(1, sizeof(*w));
+    if (w == NULL) {
+        return set_error(err, EX_OSERR, errno, "calloc");
+    }
+    w->name = name;
+    w->dirfd = dirfd;
+    w->opts = opts;
+    w->buf = buf;
+    w->err = err;
+    buf->size = 0;
+    w->png = png_create_write_struct(PNG_LIBPNG_VER_STRING, w, error_cb,
+                                     warning_cb);
+    if (w->png == NULL) {
+        free(w);
+        return set_error(err, EX_SOFTWARE, 0, "cannot initialize LibPNG");
+    }
+    if (setjmp(png_jmpbuf(w->png))) {
+        wpng_free(w);
+        return err->status;
+    }
+    w->info = png_create_info_struct(w->png);
+    if (w->info == NULL) {
+        wpng_fail(w, EX_SOFTWARE, 0, "cannot initialize LibPNG");
+    }
+    wpng_start(w, pix);
+    *wp = w;
+    return 0;
+}
+
+/* Write a row of a direct color picture. */
+static void wpng_direct_row(struct wpng *w, const unsigned char *row) {
+    if (w->rgb != NULL) {
+        unrez_convert_16to32(w->rgb, (const uint16_t *)row, w->width);
+        row = w->rgb;
+    }
+    png_write_row(w->png, row);
+}
+
+/*
+ * Stop looking for a palette in a direct color picture. Without an alpha
+ * channel, the rows before the current one are written from their palette
+ * indexes, and the rest are written as they come.
+ */
+static void wpng_give_up(struct wpng *w) {
+    int y;
+    if (!w->alpha) {
+        wpng_header(w, PNG_COLOR_TYPE_RGB);
+        w->unindexed = malloc(w->rowbytes);
+        if (w->unindexed == NULL) {
+            wpng_fail(w, EX_OSERR, errno, "malloc");
+        }
+        for (y = 0; y < w->y; y++) {
+            hist_unindex(w->hist, w->unindexed,
+                         w->indexes + (size_t)y * w->width, w->width);
+            wpng_direct_row(w, w->unindexed);
+        }
+        free(w->unindexed);
+        w->unindexed = NULL;
+    }
+    /*
+     * Keep the indexes until the writer is freed. Their untouched pages cost
+     * nothing, but freeing a large block makes malloc raise its mmap threshold,
+     * and then the PNG buffer grows on the heap, which keeps the memory freed
+     * as it grows.
+     */
+    free(w->hist);
+    w->hist = NULL;
+}
+
+int wpng_row(struct wpng *w, const void *row) {
+    if (w->y >= w->height) {
+        return set_error(w->err, EX_SOFTWARE, 0, "too many rows in PNG");
+    }
+    if (setjmp(png_jmpbuf(w->png))) {
+        return w->err->status;
+    }
+    if (w->hist != NULL &&
+        !hist_row(w->hist, row, w->width,
+                  w->indexes + (size_t)w->y * w->width)) {
+        wpng_give_up(w);
+    }
+    if (w->rows != NULL) {
+        memcpy(w->rows + (size_t)w->y * w->rowbytes, row, w->rowbytes);
+    } else if (w->hist != NULL) {
+        /* The row is kept as palette indexes. */
+    } else if (w->packed != NULL) {
+        unpack_row(w->index, row, w->width, w->pixel_size);
+        pack_row(w->packed, w->index, w->width, w->depth);
+        png_write_row(w->png, w->packed);
+    } else if (w->rgb != NULL) {
+        wpng_direct_row(w, row);
+    } else {
+        png_write_row(w->png, row);
+    }
+    w->y++;
+    return 0;
+}
+
+/* Write a direct color picture with a palette made from its histogram. */
+static void wpng_indexed(struct wpng *w) {
+    const struct histogram *h = w->hist;
+    uint32_t color;
+    int i, y, alpha = 0;
+    for (i = 0; i < h->count; i++) {
+        color = h->palette[i];
+        if (w->pixel_size == 16) {
+            w->col[i].red = expand5(color >> 10);
+            w->col[i].green = expand5(color >> 5);
+            w->col[i].blue = expand5(color);
+            w->trans[i] = 0;
+        } else {
+            w->col[i].red = color;
+            w->col[i].green = color >> 8;
+            w->col[i].blue = color >> 16;
+            w->trans[i] = color >> 24;
+        }
+        alpha |= w->trans[i];
+    }
+    png_set_PLTE(w->png, w->info, w->col, h->count);
+    if (alpha != 0) {
+        png_set_tRNS(w->png, w->info, w->trans, h->count, NULL);
+    }
+    w->depth = palette_depth(h->count);
+    alloc_packed(w);
+    wpng_header(w, PNG_COLOR_TYPE_PALETTE);
+    for (y = 0; y < w->height; y++) {
+        pack_row(w->packed, w->indexes + (size_t)y * w->width, w->width,
+                 w->depth);
+        png_write_row(w->png, w->packed);
+    }
+}
+
+/*
+ * Create a temporary file next to the output file, named after it and hidden.
+ * Returns the file descriptor, and stores the name, which must be freed, or
+ * returns -1 and stores the error.
+ */
+static int open_temp(struct wpng *w, char **tmpname) {
+    const char *name = w->name, *base;
+    char *tmp;
+    size_t dirlen, len = strlen(name) + 32;
+    int i, fdes;
+    base = strrchr(name, '/');
+    base = base != NULL ? base + 1 : name;
+    dirlen = base - name;
+    tmp = malloc(len);
+    if (tmp == NULL) {
+        set_error(w->err, EX_OSERR, errno, "malloc");
+        return -1;
+    }
+    for (i = 0;; i++) {
+        snprintf(tmp, len, "%.*s.%s.%ld.%d.tmp", (int)dirlen, name, base,
+                 (long)getpid(), i);
+        fdes = openat(w->dirfd, tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+        if (fdes != -1) {
+            break;
+        }
+        if (errno != EEXIST || i + 1 >= kTempAttempts) {
+            set_error(w->err, EX_CANTCREAT, errno, "%s", tmp);
+            free(tmp);
+            return -1;
+        }
+    }
+    *tmpname = tmp;
+    return fdes;
+}
+
+/*
+ * Write the encoded file with a single write, if the system allows. Returns 0
+ * on success, or the exit status for the error.
+ */
+static int wpng_write(struct wpng *w) {
+    const unsigned char *data = w->buf->data;
+    size_t size = w->buf->size, pos = 0;
+    char *tmpname = NULL;
+    const char *name;
+    struct stat st;
+    ssize_t amt;
+    int fdes, err;
+    if ((w->opts->flags & kPngAtomic) != 0) {
+        fdes = open_temp(w, &tmpname);
+        if (fdes == -1) {
+            return w->err->status;
+        }
+        name = tmpname;
+    } else {
+        /*
+         * If the old file is linked to another output, which should not
+         * change, remove it instead of writing through the link.
+         */
+        name = w->name;
+        if (fstatat(w->dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+            S_ISREG(st.st_mode) && st.st_nlink > 1 &&
+            unlinkat(w->dirfd, name, 0) != 0) {
+            err = errno;
+            fdes = -1;
+            goto error;
+        }
+        fdes = openat(w->dirfd, name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fdes == -1) {
+            return set_error(w->err, EX_CANTCREAT, errno, "%s", name);
+        }
     }
+    while (pos < size) {
+        amt = write(fdes, data + pos, size - pos);
+        if (amt < 0) {
+            err = errno;
+            if (err == EINTR) {
+                continue;
+            }
+            goto error;
+        }
+        pos += amt;
+    }
+    if (close(fdes) != 0) {
+        fdes = -1;
+        err = errno;
+        goto error;
+    }
+    if (tmpname != NULL) {
+        if (renameat(w->dirfd, tmpname, w->dirfd, w->name) != 0) {
+            fdes = -1;
+            err = errno;
+            name = w->name;
+            goto error;
+        }
+        free(tmpname);
+    }
+    return 0;
 
-    data = pix->data;
-    rows = malloc(sizeof(*rows) * height);
-    if (rows == NULL) {
-        die_errf(EX_OSERR, errno, "malloc");
+error:
+    if (fdes != -1) {
+        close(fdes);
     }
-    for (i = 0; i < height; i++) {
-        rows[i] = (png_byte *)(data + i * rowbytes);
+    if (tmpname != NULL) {
+        unlinkat(w->dirfd, tmpname, 0);
     }
-    png_write_image(png, rows);
-    png_write_end(png, NULL);
-    free(rows);
-    free(col);
-    png_destroy_write_struct(&png, &info);
+    set_error(w->err, EX_CANTCREAT, err, "%s", name);
+    free(tmpname);
+    return EX_CANTCREAT;
+}
+
+int wpng_close(struct wpng *w) {
+    struct pngerr *err = w->err;
+    int y, r;
+    if (w->y != w->height) {
+        wpng_free(w);
+        return set_error(err, EX_SOFTWARE, 0, "missing rows in PNG");
+    }
+    if (setjmp(png_jmpbuf(w->png))) {
+        wpng_free(w);
+        return err->status;
+    }
+    if (w->hist != NULL) {
+        wpng_indexed(w);
+    } else if (w->rows != NULL) {
+        wpng_header(w, has_alpha(w->rows, w->width, w->height, w->rowbytes)
+                           ? PNG_COLOR_TYPE_RGB_ALPHA
+                           : PNG_COLOR_TYPE_RGB);
+        for (y = 0; y < w->height; y++) {
+            png_write_row(w->png, w->rows + (size_t)y * w->rowbytes);
+        }
+    }
+    png_write_end(w->png, NULL);
+    r = wpng_write(w);
+    wpng_free(w);
+    return r;
+}
+
+void wpng_abort(struct wpng *w) {
+    wpng_free(w);
 }
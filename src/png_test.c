@@ -0,0 +1,403 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include "defs.h"
+
+#include "unrez.h"
+
+#include <png.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+/*
+ * Test that pictures written as PNG files read back with the same colors, and
+ * that small palettes and direct color pictures with few colors are written
+ * with palettes at the smallest bit depth, unless they are very large, and
+ * that errors are returned to the caller.
+ */
+
+static int test_count;
+static int failure_count;
+static char root[64];
+static int rootfd;
+
+enum {
+    kWidth = 37,
+    kHeight = 21
+};
+
+/* A picture to write, and the PNG format it should be written in. */
+struct pngcase {
+    const char *name;
+    int pixel_size;
+    int cmp_count;
+    /* Number of colors in the color table, or distinct colors. */
+    int colors;
+    /* If nonzero, the rows after this one have many more colors. */
+    int many_after;
+    int flags;
+    int png_depth;
+    int png_ctype;
+};
+
+static const struct pngcase kCases[] = {
+    {"1-bit", 1, 1, 2, 0, 0, 1, PNG_COLOR_TYPE_GRAY},
+    {"2-bit", 2, 1, 4, 0, 0, 2, PNG_COLOR_TYPE_PALETTE},
+    {"2-bit, 2 colors", 2, 1, 2, 0, 0, 1, PNG_COLOR_TYPE_PALETTE},
+    {"4-bit, 3 colors", 4, 1, 3, 0, 0, 2, PNG_COLOR_TYPE_PALETTE},
+    {"4-bit", 4, 1, 16, 0, 0, 4, PNG_COLOR_TYPE_PALETTE},
+    {"8-bit, 2 colors", 8, 1, 2, 0, 0, 1, PNG_COLOR_TYPE_PALETTE},
+    {"8-bit, 16 colors", 8, 1, 16, 0, 0, 4, PNG_COLOR_TYPE_PALETTE},
+    {"8-bit, 17 colors", 8, 1, 17, 0, 0, 8, PNG_COLOR_TYPE_PALETTE},
+    {"8-bit", 8, 1, 256, 0, 0, 8, PNG_COLOR_TYPE_PALETTE},
+    {"16-bit, 1 color", 16, 3, 1, 0, 0, 1, PNG_COLOR_TYPE_PALETTE},
+    {"16-bit, 200 colors", 16, 3, 200, 0, 0, 8, PNG_COLOR_TYPE_PALETTE},
+    {"16-bit, many colors", 16, 3, 4, 5, 0, 8, PNG_COLOR_TYPE_RGB},
+    {"16-bit, no index", 16, 3, 5, 0, kPngNoIndex, 8, PNG_COLOR_TYPE_RGB},
+    {"32-bit, 1 color", 32, 3, 1, 0, 0, 1, PNG_COLOR_TYPE_PALETTE},
+    {"32-bit, 5 colors", 32, 3, 5, 0, 0, 4, PNG_COLOR_TYPE_PALETTE},
+    {"32-bit, 256 colors", 32, 3, 256, 0, 0, 8, PNG_COLOR_TYPE_PALETTE},
+    {"32-bit, 257 colors", 32, 3, 257, 0, 0, 8, PNG_COLOR_TYPE_RGB},
+    {"32-bit, many colors", 32, 3, 4, 5, 0, 8, PNG_COLOR_TYPE_RGB},
+    {"32-bit, no index", 32, 3, 5, 0, kPngNoIndex, 8, PNG_COLOR_TYPE_RGB},
+    {"32-bit alpha, 3 colors", 32, 4, 3, 0, 0, 2, PNG_COLOR_TYPE_PALETTE},
+    {"32-bit alpha, many colors", 32, 4, 4, 5, 0, 8,
+     PNG_COLOR_TYPE_RGB_ALPHA},
+    {"32-bit zero alpha, many colors", 32, 4, 4, 5, 0, 8,
+     PNG_COLOR_TYPE_RGB},
+};
+
+static uint32_t next_random(uint32_t *state) {
+    *state = *state * 1103515245u + 12345u;
+    return *state >> 8;
+}
+
+/*
+ * Create a picture, and the RGBA colors it should read back as. Pixels are
+ * chosen from the given number of colors. Alpha is only nonzero in the
+ * pictures named with "alpha".
+ */
+static void make_picture(const struct pngcase *c, struct unrez_pixdata *pix,
+                         unsigned char *expect) {
+    struct unrez_color *table = NULL;
+    unsigned char *data, *p, *e;
+    uint16_t *p16;
+    uint32_t state = 1;
+    int rowbytes, x, y, i, ncolors, index = 0, alpha;
+    memset(pix, 0, sizeof(*pix));
+    rowbytes = ((kWidth * c->pixel_size + 15) / 16) * 2;
+    data = calloc(rowbytes, kHeight);
+    if (data == NULL) {
+        die_errf(EX_OSERR, errno, "calloc");
+    }
+    if (c->pixel_size > 1 && c->pixel_size <= 8) {
+        table = malloc(sizeof(*table) * c->colors);
+        if (table == NULL) {
+            die_errf(EX_OSERR, errno, "malloc");
+        }
+        for (i = 0; i < c->colors; i++) {
+            table[i].v = i;
+            table[i].r = next_random(&state);
+            table[i].g = next_random(&state);
+            table[i].b = next_random(&state);
+        }
+    }
+    alpha = c->cmp_count == 4 && strstr(c->name, "zero") == NULL;
+    for (y = 0; y < kHeight; y++) {
+        ncolors = c->many_after != 0 && y > c->many_after ? 100000 : c->colors;
+        for (x = 0; x < kWidth; x++) {
+            /* Use every color at least once, and make some runs. */
+            index = y * kWidth + x < ncolors ? y * kWidth + x
+                    : x > 0 && next_random(&state) % 3 == 0
+                        ? index
+                        : (int)(next_random(&state) % ncolors);
+            p = data + y * rowbytes;
+            e = expect + (y * kWidth + x) * 4;
+            if (c->pixel_size == 1) {
+                p[x >> 3] |= index << (7 - (x & 7));
+                memset(e, index ? 0 : 255, 3);
+                e[3] = 255;
+            } else if (c->pixel_size <= 8) {
+                i = 8 - c->pixel_size - (x * c->pixel_size & 7);
+                p[x * c->pixel_size >> 3] |= index << i;
+                e[0] = table[index].r >> 8;
+                e[1] = table[index].g >> 8;
+                e[2] = table[index].b >> 8;
+                e[3] = 255;
+            } else if (c->pixel_size == 16) {
+                /* Set the unused high bit, which is ignored. */
+                p16 = (uint16_t *)p;
+                p16[x] = (index * 0x2f1b & 0x7fff) | (x & 1) << 15;
+                e[0] = ((p16[x] >> 7) & 0xf8) | ((p16[x] >> 12) & 7);
+                e[1] = ((p16[x] >> 2) & 0xf8) | ((p16[x] >> 7) & 7);
+                e[2] = ((p16[x] << 3) & 0xf8) | ((p16[x] >> 2) & 7);
+                e[3] = 255;
+            } else {
+                e[0] = p[x * 4] = index;
+                e[1] = p[x * 4 + 1] = index >> 8;
+                e[2] = p[x * 4 + 2] = 0x5a ^ index;
+                e[3] = alpha ? (unsigned char)(index * 7 + 1) : 255;
+                p[x * 4 + 3] = alpha ? e[3] : 0;
+            }
+        }
+    }
+    pix->data = data;
+    pix->rowBytes = rowbytes;
+    pix->bounds.right = kWidth;
+    pix->bounds.bottom = kHeight;
+    pix->pixelSize = c->pixel_size;
+    pix->cmpCount = c->cmp_count;
+    pix->cmpSize = c->pixel_size == 32   ? 8
+                   : c->pixel_size == 16 ? 5
+                                         : c->pixel_size;
+    pix->ctSize = table != NULL ? c->colors : 0;
+    pix->ctTable = table;
+}
+
+static void error_cb(png_struct *pngp, const char *msg) {
+    (void)pngp;
+    dief(EX_SOFTWARE, "libpng: %s", msg);
+}
+
+/*
+ * Read a PNG file as RGBA, and check its format and pixels. Pictures with
+ * 16-bit pixels should record that the colors have 5 significant bits.
+ */
+static void check_png(const struct pngcase *c, const unsigned char *expect) {
+    png_struct *png;
+    png_info *info;
+    png_uint_32 width, height;
+    png_color_8 *sbit;
+    unsigned char *rgba, *rows[kHeight];
+    int depth, ctype, y;
+    FILE *fp;
+    fp = fopen("out.png", "rb");
+    if (fp == NULL) {
+        die_errf(EX_NOINPUT, errno, "out.png");
+    }
+    png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, error_cb, NULL);
+    info = png_create_info_struct(png);
+    if (png == NULL || info == NULL) {
+        dief(EX_SOFTWARE, "cannot initialize LibPNG");
+    }
+    png_init_io(png, fp);
+    png_read_info(png, info);
+    png_get_IHDR(png, info, &width, &height, &depth, &ctype, NULL, NULL,
+                 NULL);
+    if (width != kWidth || height != kHeight) {
+        fprintf(stderr, "%s: size is %dx%d\n", c->name, (int)width,
+                (int)height);
+        failure_count++;
+    } else if (depth != c->png_depth || ctype != c->png_ctype) {
+        fprintf(stderr, "%s: depth %d color type %d, expected %d %d\n",
+                c->name, depth, ctype, c->png_depth, c->png_ctype);
+        failure_count++;
+    } else if ((c->pixel_size == 16) !=
+               (png_get_sBIT(png, info, &sbit) != 0 && sbit->red == 5 &&
+                sbit->green == 5 && sbit->blue == 5)) {
+        fprintf(stderr, "%s: incorrect significant bits\n", c->name);
+        failure_count++;
+    } else {
+        png_set_expand(png);
+        png_set_gray_to_rgb(png);
+        png_set_filler(png, 0xff, PNG_FILLER_AFTER);
+        png_read_update_info(png, info);
+        rgba = malloc(kWidth * kHeight * 4);
+        if (rgba == NULL) {
+            die_errf(EX_OSERR, errno, "malloc");
+        }
+        for (y = 0; y < kHeight; y++) {
+            rows[y] = rgba + y * kWidth * 4;
+        }
+        png_read_image(png, rows);
+        png_read_end(png, NULL);
+        if (memcmp(rgba, expect, kWidth * kHeight * 4) != 0) {
+            fprintf(stderr, "%s: incorrect pixels\n", c->name);
+            failure_count++;
+        }
+        free(rgba);
+    }
+    png_destroy_read_struct(&png, &info, NULL);
+    fclose(fp);
+}
+
+/*
+ * Write a picture to out.png, with rows the given distance apart in memory, or
+ * exit on failure.
+ */
+static void write_png(const struct unrez_pixdata *pix, const void *data,
+                      size_t stride, struct pngbuf *buf,
+                      const struct pngopts *opts) {
+    struct wpng *w;
+    struct pngerr err;
+    int y, r;
+    r = wpng_open(&w, rootfd, "out.png", pix, buf, opts, &err);
+    for (y = 0; r == 0 && y < pix->bounds.bottom - pix->bounds.top; y++) {
+        r = wpng_row(w, (const unsigned char *)data + y * stride);
+        if (r != 0) {
+            wpng_abort(w);
+        }
+    }
+    if (r == 0) {
+        r = wpng_close(w);
+    }
+    if (r != 0) {
+        pngerr_report(&err);
+        exit(r);
+    }
+}
+
+static void test_case(const struct pngcase *c, struct pngbuf *buf) {
+    struct unrez_pixdata pix;
+    struct pngopts opts;
+    unsigned char expect[kWidth * kHeight * 4];
+    test_count++;
+    make_picture(c, &pix, expect);
+    pngopts_preset(&opts, kPngPresetDefault);
+    opts.flags = c->flags;
+    write_png(&pix, pix.data, pix.rowBytes, buf, &opts);
+    check_png(c, expect);
+    free(pix.data);
+    free(pix.ctTable);
+}
+
+/*
+ * Test that a direct color picture too large to check for a palette is
+ * written as RGB, even though it has one color.
+ */
+static void test_large(struct pngbuf *buf) {
+    enum { kLargeWidth = 2048, kLargeHeight = 2049 };
+    struct unrez_pixdata pix;
+    struct pngopts opts;
+    png_struct *png;
+    png_info *info;
+    unsigned char *row;
+    FILE *fp;
+    test_count++;
+    row = calloc(kLargeWidth, 4);
+    if (row == NULL) {
+        die_errf(EX_OSERR, errno, "calloc");
+    }
+    memset(&pix, 0, sizeof(pix));
+    pix.rowBytes = kLargeWidth * 4;
+    pix.bounds.right = kLargeWidth;
+    pix.bounds.bottom = kLargeHeight;
+    pix.pixelSize = 32;
+    pix.cmpCount = 3;
+    pix.cmpSize = 8;
+    pngopts_preset(&opts, kPngPresetFast);
+    opts.flags = 0;
+    write_png(&pix, row, 0, buf, &opts);
+    free(row);
+    fp = fopen("out.png", "rb");
+    if (fp == NULL) {
+        die_errf(EX_NOINPUT, errno, "out.png");
+    }
+    png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, error_cb, NULL);
+    info = png_create_info_struct(png);
+    if (png == NULL || info == NULL) {
+        dief(EX_SOFTWARE, "cannot initialize LibPNG");
+    }
+    png_init_io(png, fp);
+    png_read_info(png, info);
+    if (png_get_color_type(png, info) != PNG_COLOR_TYPE_RGB) {
+        fprintf(stderr, "large: color type %d, expected RGB\n",
+                png_get_color_type(png, info));
+        failure_count++;
+    }
+    png_destroy_read_struct(&png, &info, NULL);
+    fclose(fp);
+}
+
+/*
+ * Test that an error creating the file is returned instead of exiting, and
+ * that an atomic write which fails leaves no temporary file. The file cannot
+ * be renamed into place because a directory has its name.
+ */
+static void test_error(struct pngbuf *buf) {
+    struct unrez_pixdata pix;
+    struct pngopts opts;
+    struct pngerr err;
+    struct wpng *w;
+    struct stat st;
+    unsigned char row[kWidth * 4];
+    char tmp[64];
+    int y, r;
+    test_count++;
+    if (mkdirat(rootfd, "dir.png", 0777) != 0) {
+        die_errf(EX_CANTCREAT, errno, "dir.png");
+    }
+    memset(row, 0, sizeof(row));
+    memset(&pix, 0, sizeof(pix));
+    pix.rowBytes = sizeof(row);
+    pix.bounds.right = kWidth;
+    pix.bounds.bottom = kHeight;
+    pix.pixelSize = 32;
+    pix.cmpCount = 3;
+    pix.cmpSize = 8;
+    pngopts_preset(&opts, kPngPresetDefault);
+    opts.flags = kPngAtomic;
+    r = wpng_open(&w, rootfd, "dir.png", &pix, buf, &opts, &err);
+    for (y = 0; r == 0 && y < kHeight; y++) {
+        r = wpng_row(w, row);
+        if (r != 0) {
+            wpng_abort(w);
+        }
+    }
+    if (r == 0) {
+        r = wpng_close(w);
+    }
+    if (r != EX_CANTCREAT || err.code != EISDIR) {
+        fprintf(stderr, "error: got status %d, code %d, expected %d, %d\n", r,
+                err.code, EX_CANTCREAT, EISDIR);
+        failure_count++;
+    }
+    snprintf(tmp, sizeof(tmp), ".dir.png.%ld.0.tmp", (long)getpid());
+    if (fstatat(rootfd, tmp, &st, 0) == 0) {
+        fprintf(stderr, "error: temporary file %s was not removed\n", tmp);
+        failure_count++;
+        unlinkat(rootfd, tmp, 0);
+    }
+    unlinkat(rootfd, "dir.png", AT_REMOVEDIR);
+}
+
+int main(int argc, char **argv) {
+    struct pngbuf buf = {0};
+    int i;
+    (void)argc;
+    (void)argv;
+    strcpy(root, "/tmp/unrez_png.XXXXXX");
+    if (mkdtemp(root) == NULL) {
+        die_errf(EX_CANTCREAT, errno, "mkdtemp");
+    }
+    rootfd = open(root, O_RDONLY);
+    if (rootfd == -1 || fchdir(rootfd) != 0) {
+        die_errf(EX_CANTCREAT, errno, "%s", root);
+    }
+    for (i = 0; i < (int)(sizeof(kCases) / sizeof(*kCases)); i++) {
+        test_case(&kCases[i], &buf);
+    }
+    test_large(&buf);
+    test_error(&buf);
+    pngbuf_destroy(&buf);
+    unlinkat(rootfd, "out.png", 0);
+    close(rootfd);
+    rmdir(root);
+    if (failure_count > 0) {
+        fprintf(stderr, "%d of %d tests failed\n", failure_count, test_count);
+        fputs("FAILED\n", stderr);
+        return 1;
+    }
+    printf("%d tests passed\n", test_count);
+    return 0;
+}
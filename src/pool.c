@@ -0,0 +1,160 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include "defs.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sysexits.h>
+
+/*
+ * Jobs are kept on two lists. The pending list contains jobs which no worker
+ * has started, and the order list contains every job which has not been
+ * finished, in the order they were submitted. Only the submitting thread
+ * touches the order list and calls finish(), so finish() needs no locking.
+ */
+struct pool {
+    pthread_mutex_t lock;
+    /* Signaled when a job is added to the pending list, or on shutdown. */
+    pthread_cond_t pending_cond;
+    /* Signaled when a job is done. */
+    pthread_cond_t done_cond;
+    struct job *pending_head, **pending_tail;
+    struct job *order_head, **order_tail;
+    int order_count;
+    int limit;
+    int shutdown;
+    int thread_count;
+    pthread_t *threads;
+};
+
+static void check(int r, const char *what) {
+    if (r != 0) {
+        die_errf(EX_OSERR, r, "%s", what);
+    }
+}
+
+static void *pool_worker(void *arg) {
+    struct pool *pool = arg;
+    struct job *job;
+    check(pthread_mutex_lock(&pool->lock), "pthread_mutex_lock");
+    for (;;) {
+        while (pool->pending_head == NULL && !pool->shutdown) {
+            check(pthread_cond_wait(&pool->pending_cond, &pool->lock),
+                  "pthread_cond_wait");
+        }
+        job = pool->pending_head;
+        if (job == NULL) {
+            break;
+        }
+        pool->pending_head = job->next_pending;
+        if (pool->pending_head == NULL) {
+            pool->pending_tail = &pool->pending_head;
+        }
+        check(pthread_mutex_unlock(&pool->lock), "pthread_mutex_unlock");
+        job->run(job);
+        check(pthread_mutex_lock(&pool->lock), "pthread_mutex_lock");
+        job->done = 1;
+        check(pthread_cond_broadcast(&pool->done_cond),
+              "pthread_cond_broadcast");
+    }
+    check(pthread_mutex_unlock(&pool->lock), "pthread_mutex_unlock");
+    return NULL;
+}
+
+struct pool *pool_create(int thread_count) {
+    struct pool *pool;
+    int i;
+    pool = calloc(1, sizeof(*pool));
+    if (pool == NULL) {
+        die_errf(EX_OSERR, errno, "calloc");
+    }
+    pool->pending_tail = &pool->pending_head;
+    pool->order_tail = &pool->order_head;
+    if (thread_count <= 1) {
+        return pool;
+    }
+    /*
+     * Allow some jobs to queue up so workers are not idle while the submitting
+     * thread finishes jobs, but not so many that we load every input at once.
+     */
+    pool->limit = thread_count * 4;
+    check(pthread_mutex_init(&pool->lock, NULL), "pthread_mutex_init");
+    check(pthread_cond_init(&pool->pending_cond, NULL), "pthread_cond_init");
+    check(pthread_cond_init(&pool->done_cond, NULL), "pthread_cond_init");
+    pool->threads = malloc(sizeof(*pool->threads) * thread_count);
+    if (pool->threads == NULL) {
+        die_errf(EX_OSERR, errno, "malloc");
+    }
+    for (i = 0; i < thread_count; i++) {
+        check(pthread_create(&pool->threads[i], NULL, pool_worker, pool),
+              "pthread_create");
+    }
+    pool->thread_count = thread_count;
+    return pool;
+}
+
+/* Wait for the oldest job to be done, then remove it and finish it. */
+static void pool_retire(struct pool *pool) {
+    struct job *job = pool->order_head;
+    check(pthread_mutex_lock(&pool->lock), "pthread_mutex_lock");
+    while (!job->done) {
+        check(pthread_cond_wait(&pool->done_cond, &pool->lock),
+              "pthread_cond_wait");
+    }
+    check(pthread_mutex_unlock(&pool->lock), "pthread_mutex_unlock");
+    pool->order_head = job->next_order;
+    if (pool->order_head == NULL) {
+        pool->order_tail = &pool->order_head;
+    }
+    pool->order_count--;
+    job->finish(job);
+}
+
+void pool_submit(struct pool *pool, struct job *job) {
+    job->next_pending = NULL;
+    job->next_order = NULL;
+    job->done = 0;
+    if (pool->thread_count == 0) {
+        job->run(job);
+        job->finish(job);
+        return;
+    }
+    while (pool->order_count >= pool->limit) {
+        pool_retire(pool);
+    }
+    *pool->order_tail = job;
+    pool->order_tail = &job->next_order;
+    pool->order_count++;
+    check(pthread_mutex_lock(&pool->lock), "pthread_mutex_lock");
+    *pool->pending_tail = job;
+    pool->pending_tail = &job->next_pending;
+    check(pthread_cond_signal(&pool->pending_cond), "pthread_cond_signal");
+    check(pthread_mutex_unlock(&pool->lock), "pthread_mutex_unlock");
+}
+
+void pool_destroy(struct pool *pool) {
+    int i;
+    if (pool->thread_count > 0) {
+        while (pool->order_head != NULL) {
+            pool_retire(pool);
+        }
+        check(pthread_mutex_lock(&pool->lock), "pthread_mutex_lock");
+        pool->shutdown = 1;
+        check(pthread_cond_broadcast(&pool->pending_cond),
+              "pthread_cond_broadcast");
+        check(pthread_mutex_unlock(&pool->lock), "pthread_mutex_unlock");
+        for (i = 0; i < pool->thread_count; i++) {
+            check(pthread_join(pool->threads[i], NULL), "pthread_join");
+        }
+        pthread_cond_destroy(&pool->done_cond);
+        pthread_cond_destroy(&pool->pending_cond);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool->threads);
+    }
+    free(pool);
+}
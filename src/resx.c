@@ -6,16 +6,211 @@
  */
 #include "defs.h"
 
+#include "unrez.h"
+
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+static const char *opt_dir;
+static uint32_t *opt_types;
+static int opt_type_count;
+
+static void opt_parse_dir(void *value, const char *option, const char *arg) {
+    (void)value;
+    (void)option;
+    opt_dir = arg;
+}
+
+static void opt_parse_type(void *value, const char *option, const char *arg) {
+    uint32_t *types;
+    (void)value;
+    (void)option;
+    types = realloc(opt_types, sizeof(*types) * (opt_type_count + 1));
+    if (types == NULL) {
+        die_errf(EX_OSERR, errno, "realloc");
+    }
+    opt_types = types;
+    if (unrez_type_fromstring(&types[opt_type_count], arg) != 0) {
+        dief(EX_USAGE, "invalid type code: '%s'", arg);
+    }
+    opt_type_count++;
+}
+
+static const struct option kOptions[] = {
+    {"dir", NULL, 1, opt_parse_dir},
+    {"type", NULL, 1, opt_parse_type},
+    {0},
+};
+
+static void resx_usage(FILE *fp) {
+    fputs("usage: unrez resx [<options>] <file>\n", fp);
+}
+
+/* A resource to extract. */
+struct xrsrc {
+    uint32_t type_code;
+    struct unrez_resource *rsrc;
+};
+
+static int compare_offset(const void *x, const void *y) {
+    const struct xrsrc *rx = x, *ry = y;
+    if (rx->rsrc->offset < ry->rsrc->offset) {
+        return -1;
+    } else if (rx->rsrc->offset > ry->rsrc->offset) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+static int want_type(uint32_t type_code) {
+    int i;
+    if (opt_type_count == 0) {
+        return 1;
+    }
+    for (i = 0; i < opt_type_count; i++) {
+        if (opt_types[i] == type_code) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int open_dir(void) {
+    int fd;
+    if (mkdir(opt_dir, 0777) != 0 && errno != EEXIST) {
+        die_errf(EX_CANTCREAT, errno, "%s", opt_dir);
+    }
+    fd = open(opt_dir, O_RDONLY);
+    if (fd == -1) {
+        die_errf(EX_CANTCREAT, errno, "%s", opt_dir);
+    }
+    return fd;
+}
+
+/*
+ * Get the output filename for a resource, which is the type and ID. Types
+ * which would not make a plain filename are written in hexadecimal.
+ */
+static void output_name(char *buf, size_t size, uint32_t type_code, int id) {
+    char stype[kUnrezTypeWidth];
+    unrez_type_tostring(stype, sizeof(stype), type_code);
+    if (stype[0] == '.' || strchr(stype, '/') != NULL) {
+        snprintf(stype, sizeof(stype), "0x%08lx", (unsigned long)type_code);
+    }
+    snprintf(buf, size, "%s.%d", stype, id);
+}
 
 void resx_exec(int argc, char **argv) {
-    (void)argc;
-    (void)argv;
+    struct unrez_forkedfile forks;
+    struct unrez_resourcefork rfork;
+    struct unrez_resourcetype *type;
+    struct xrsrc *list;
+    const char *file;
+    char name[kUnrezTypeWidth + 16];
+    int i, j, n, err, dirfd, fd, failed = 0;
+    parse_options(kOptions, &argc, &argv);
+    if (argc != 1) {
+        errorf("expected one argument");
+        resx_usage(stderr);
+        exit(EX_USAGE);
+    }
+    if (opt_dir == NULL) {
+        dief(EX_USAGE, "-dir must be specified");
+    }
+    file = argv[0];
+    /* Only the map is read into memory. Data is copied from the file. */
+    err = unrez_forkedfile_open(&forks, file);
+    if (err != 0) {
+        die_errf(err > 0 ? EX_NOINPUT : EX_DATAERR, err, "%s", file);
+    }
+    err = unrez_resourcefork_openstream(&rfork, &forks.rsrc);
+    if (err != 0) {
+        die_errf(err > 0 ? EX_NOINPUT : EX_DATAERR, err, "%s", file);
+    }
+    unrez_forkedfile_close(&forks);
+    err = unrez_resourcefork_loadall(&rfork);
+    if (err != 0) {
+        die_errf(EX_OSERR, err, "could not load resources");
+    }
+
+    n = 0;
+    for (i = 0; i < rfork.type_count; i++) {
+        if (want_type(rfork.types[i].type_code)) {
+            n += rfork.types[i].count;
+        }
+    }
+    list = malloc(sizeof(*list) * (n > 0 ? n : 1));
+    if (list == NULL) {
+        die_errf(EX_OSERR, errno, "malloc");
+    }
+    n = 0;
+    for (i = 0; i < rfork.type_count; i++) {
+        type = &rfork.types[i];
+        if (!want_type(type->type_code)) {
+            continue;
+        }
+        err = unrez_resourcefork_loadtype(&rfork, type);
+        if (err != 0) {
+            unrez_type_tostring(name, sizeof(name), type->type_code);
+            error_errf(err, "could not load %s resources", name);
+            failed = 1;
+            continue;
+        }
+        for (j = 0; j < type->count; j++) {
+            list[n].type_code = type->type_code;
+            list[n].rsrc = &type->resources[j];
+            n++;
+        }
+    }
+    /* Copy the data in the order it appears in the fork. */
+    qsort(list, n, sizeof(*list), compare_offset);
+
+    dirfd = open_dir();
+    for (i = 0; i < n; i++) {
+        output_name(name, sizeof(name), list[i].type_code, list[i].rsrc->id);
+        fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd == -1) {
+            die_errf(EX_CANTCREAT, errno, "%s", name);
+        }
+        err = unrez_resourcefork_copydata(&rfork, list[i].rsrc, fd);
+        if (err == 0 && close(fd) != 0) {
+            die_errf(EX_IOERR, errno, "%s", name);
+        }
+        if (err != 0) {
+            error_errf(err, "could not extract %s", name);
+            failed = 1;
+            close(fd);
+            unlinkat(dirfd, name, 0);
+        }
+    }
+    close(dirfd);
+    free(list);
+    unrez_resourcefork_close(&rfork);
+    if (failed) {
+        exit(EX_DATAERR);
+    }
 }
 
 void resx_help(void) {
+    resx_usage(stdout);
     fputs(
-        "usage: unrez resx [<options>] <file>\n"
-        "Extract resources from a file's resource fork.\n",
+        "Extract resources from a file's resource fork.\n"
+        "\n"
+        "Each resource is written to its own file, named after its type and\n"
+        "ID, like PICT.128. The data is copied straight from the input file\n"
+        "where the system allows.\n"
+        "\n"
+        "options:\n"
+        "  -dir <dir>    write files to <dir>\n"
+        "  -type <type>  only extract resources with type <type>, which may\n"
+        "                be given more than once\n",
         stdout);
 }
@@ -0,0 +1,368 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include "defs.h"
+
+#include "unrez.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+static int opt_all;
+static int opt_jobs = 1;
+static int opt_depth;
+
+enum {
+    kMaxDepth = 4096,
+    /* Bytes read from the start of each file by the I/O queue. */
+    kHeaderSize = 256,
+    /* Completions collected from the I/O queue at once. */
+    kCompletions = 64
+};
+
+static void opt_parse_jobs(void *value, const char *option, const char *arg) {
+    (void)value;
+    (void)option;
+    opt_jobs = parse_jobs(arg);
+}
+
+static void opt_parse_depth(void *value, const char *option,
+                            const char *arg) {
+    char *end;
+    long depth;
+    (void)value;
+    (void)option;
+    depth = strtol(arg, &end, 10);
+    if (!*arg || *end || depth < 0 || depth > kMaxDepth) {
+        dief(EX_USAGE, "invalid queue depth '%s', must be between 0 and %d",
+             arg, kMaxDepth);
+    }
+    opt_depth = depth;
+}
+
+static const struct option kOptions[] = {
+    {"all", &opt_all, 0, opt_parse_true},
+    {"bytes", &opt_bytes, 0, opt_parse_true},
+    {"depth", NULL, 1, opt_parse_depth},
+    {"j", NULL, 1, opt_parse_jobs},
+    {0},
+};
+
+static void scan_usage(FILE *fp) {
+    fputs("usage: unrez scan [<options>] <dir>...\n", fp);
+}
+
+/*
+ * A directory shared by the jobs for the files in it. The scanner closes its
+ * own descriptor when it leaves the directory, so we keep a duplicate until
+ * the last job is finished. References are only changed on the main thread.
+ */
+struct dirref {
+    int fd;
+    int refcount;
+};
+
+static void dirref_release(struct dirref *d) {
+    if (d != NULL && --d->refcount == 0) {
+        close(d->fd);
+        free(d);
+    }
+}
+
+/* A file to examine. */
+struct scanjob {
+    struct job job;
+    struct dirref *dir;
+    /* The path for output, and the name to open, in one allocation. */
+    char *path;
+    const char *name;
+    /*
+     * With an I/O queue, the file is opened and its header is read before the
+     * job is submitted. If that fails, fd is -1 and the job opens the file
+     * itself, which reports the error.
+     */
+    struct scanjob *next;
+    int io_done;
+    int fd;
+    long header_size;
+    unsigned char header[kHeaderSize];
+    /* Results. */
+    int err;
+    unrez_type_t type;
+    int64_t data_size;
+    int64_t rsrc_size;
+    long rsrc_count;
+};
+
+struct scanstate {
+    struct pool *pool;
+    struct dirref *dir;
+    /*
+     * Jobs with I/O in the queue, in the order they were found. Jobs are
+     * submitted to the pool from the front, so the output is in order.
+     */
+    struct unrez_ioqueue *ioq;
+    struct scanjob *head, *tail;
+    int queued;
+    int failed;
+};
+
+static void scanjob_run(struct job *job) {
+    struct scanjob *sj = (struct scanjob *)job;
+    struct unrez_forkedfile forks;
+    struct unrez_resourcefork rfork;
+    int err, i;
+    /* The scanner has already looked for AppleDouble files. */
+    if (sj->fd != -1) {
+        err = unrez_forkedfile_probefd(&forks, sj->dir->fd, sj->name,
+                                       kUnrezProbeListed, sj->fd, sj->header,
+                                       sj->header_size);
+        sj->fd = -1;
+    } else {
+        err = unrez_forkedfile_probeat(&forks, sj->dir->fd, sj->name,
+                                       kUnrezProbeListed);
+    }
+    if (err != 0) {
+        sj->err = err;
+        return;
+    }
+    sj->type = forks.metadata.type;
+    if (sj->type == kUnrezTypeNone && forks.rsrc.file != -1) {
+        sj->type = kUnrezTypeNative;
+    }
+    sj->data_size = forks.data.size;
+    sj->rsrc_size = forks.rsrc.size;
+    if (forks.rsrc.size > 0) {
+        /* Only the resource map is needed, so don't read the data. */
+        err = unrez_resourcefork_openstream(&rfork, &forks.rsrc);
+        if (err != 0) {
+            sj->err = err;
+        } else {
+            for (i = 0; i < rfork.type_count; i++) {
+                sj->rsrc_count += rfork.types[i].count;
+            }
+            unrez_resourcefork_close(&rfork);
+        }
+    }
+    unrez_forkedfile_close(&forks);
+}
+
+static const char *const kTypeNames[] = {
+    "none", "macbinary", "appledouble", "applesingle", "native", "binhex",
+};
+
+static struct scanstate *scan_state;
+
+static void scanjob_finish(struct job *job) {
+    struct scanjob *sj = (struct scanjob *)job;
+    char dsize[SIZE_WIDTH], rsize[SIZE_WIDTH];
+    const char *ds, *rs;
+    if (sj->err != 0) {
+        error_errf(sj->err, "%s", sj->path);
+        scan_state->failed = 1;
+    } else if (sj->rsrc_size > 0 || opt_all) {
+        if (sj->data_size > 0) {
+            sprint_size(dsize, sizeof(dsize), sj->data_size);
+            ds = dsize;
+        } else {
+            ds = "--";
+        }
+        if (sj->rsrc_size > 0) {
+            sprint_size(rsize, sizeof(rsize), sj->rsrc_size);
+            rs = rsize;
+        } else {
+            rs = "--";
+        }
+        printf("%-11s %10s data,  %10s rsrc, %6ld rsrcs  %s\n",
+               kTypeNames[sj->type], ds, rs, sj->rsrc_count, sj->path);
+    }
+    dirref_release(sj->dir);
+    free(sj->path);
+    free(sj);
+}
+
+static int scan_directory(void *ctx, int dirfd, const char *path) {
+    struct scanstate *st = ctx;
+    struct dirref *d;
+    d = malloc(sizeof(*d));
+    if (d == NULL) {
+        die_errf(EX_OSERR, errno, "malloc");
+    }
+    d->fd = fcntl(dirfd, F_DUPFD_CLOEXEC, 0);
+    if (d->fd == -1) {
+        die_errf(EX_OSERR, errno, "%s", path);
+    }
+    d->refcount = 1;
+    dirref_release(st->dir);
+    st->dir = d;
+    return 0;
+}
+
+/* Submit jobs from the front of the I/O queue which are ready. */
+static void scan_flush(struct scanstate *st) {
+    struct scanjob *sj;
+    while (st->head != NULL && st->head->io_done) {
+        sj = st->head;
+        st->head = sj->next;
+        if (st->head == NULL) {
+            st->tail = NULL;
+        }
+        st->queued--;
+        pool_submit(st->pool, &sj->job);
+    }
+}
+
+/* Handle a finished open or read. */
+static void scan_complete(struct scanstate *st,
+                          const struct unrez_iocompletion *c) {
+    struct scanjob *sj = c->tag;
+    if (sj->fd == -1) {
+        if (c->err == 0) {
+            sj->fd = c->result;
+            if (unrez_ioqueue_read(st->ioq, sj->fd, sj->header,
+                                   sizeof(sj->header), 0, sj) == 0) {
+                return;
+            }
+            close(sj->fd);
+            sj->fd = -1;
+        }
+    } else if (c->err != 0) {
+        close(sj->fd);
+        sj->fd = -1;
+    } else {
+        sj->header_size = c->result;
+    }
+    sj->io_done = 1;
+}
+
+/* Wait for I/O to finish, and submit the jobs which are ready. */
+static void scan_wait(struct scanstate *st) {
+    struct unrez_iocompletion c[kCompletions];
+    int i, n, err;
+    err = unrez_ioqueue_wait(st->ioq, c, kCompletions, &n);
+    if (err != 0) {
+        die_errf(EX_OSERR, err, "I/O queue");
+    }
+    for (i = 0; i < n; i++) {
+        scan_complete(st, &c[i]);
+    }
+    scan_flush(st);
+}
+
+static int scan_file(void *ctx, const struct unrez_scanfile *file) {
+    struct scanstate *st = ctx;
+    struct scanjob *sj;
+    size_t plen = strlen(file->path), nlen = strlen(file->name);
+    sj = calloc(1, sizeof(*sj));
+    if (sj == NULL) {
+        die_errf(EX_OSERR, errno, "calloc");
+    }
+    sj->path = malloc(plen + nlen + 2);
+    if (sj->path == NULL) {
+        die_errf(EX_OSERR, errno, "malloc");
+    }
+    memcpy(sj->path, file->path, plen + 1);
+    memcpy(sj->path + plen + 1, file->name, nlen + 1);
+    sj->name = sj->path + plen + 1;
+    sj->dir = st->dir;
+    sj->dir->refcount++;
+    sj->job.run = scanjob_run;
+    sj->job.finish = scanjob_finish;
+    sj->fd = -1;
+    if (st->ioq == NULL) {
+        pool_submit(st->pool, &sj->job);
+        return 0;
+    }
+    /* Each job in the queue has at most one operation in progress. */
+    while (st->queued >= opt_depth) {
+        scan_wait(st);
+    }
+    if (st->tail != NULL) {
+        st->tail->next = sj;
+    } else {
+        st->head = sj;
+    }
+    st->tail = sj;
+    st->queued++;
+    if (unrez_ioqueue_openat(st->ioq, sj->dir->fd, sj->name, sj) != 0) {
+        sj->io_done = 1;
+        scan_flush(st);
+    }
+    return 0;
+}
+
+static int scan_err(void *ctx, int err, const char *path) {
+    struct scanstate *st = ctx;
+    error_errf(err, "%s", path);
+    st->failed = 1;
+    return 0;
+}
+
+void scan_exec(int argc, char **argv) {
+    struct unrez_scan_callbacks cb;
+    struct scanstate st;
+    int i, r, err;
+    parse_options(kOptions, &argc, &argv);
+    if (argc == 0) {
+        scan_usage(stderr);
+        exit(EX_USAGE);
+    }
+    memset(&st, 0, sizeof(st));
+    scan_state = &st;
+    cb.ctx = &st;
+    cb.directory = scan_directory;
+    cb.file = scan_file;
+    cb.error = scan_err;
+    st.pool = pool_create(opt_jobs);
+    if (opt_depth > 0) {
+        err = unrez_ioqueue_create(&st.ioq, opt_depth, 0);
+        if (err != 0) {
+            die_errf(EX_OSERR, err, "I/O queue");
+        }
+    }
+    for (i = 0; i < argc; i++) {
+        r = unrez_scan(argv[i], &cb);
+        if (r != 0) {
+            error_errf(r, "%s", argv[i]);
+            st.failed = 1;
+        }
+    }
+    if (st.ioq != NULL) {
+        while (st.queued > 0) {
+            scan_wait(&st);
+        }
+        unrez_ioqueue_destroy(st.ioq);
+    }
+    pool_destroy(st.pool);
+    dirref_release(st.dir);
+    if (st.failed) {
+        exit(EX_NOINPUT);
+    }
+}
+
+void scan_help(void) {
+    scan_usage(stdout);
+    fputs(
+        "Find files with resource forks in directory trees.\n"
+        "\n"
+        "AppleDouble files are paired with their data files, MacBinary files\n"
+        "are recognized by the .bin extension, and BinHex files by the .hqx\n"
+        "extension or the BinHex tag line.\n"
+        "\n"
+        "options:\n"
+        "  -all          also list files without a resource fork\n"
+        "  -bytes        display sizes in bytes instead of using prefixes\n"
+        "  -depth <n>    keep up to <n> opens and reads waiting at once,\n"
+        "                using io_uring where available, or 0 to read on\n"
+        "                demand\n"
+        "  -j <n>        examine <n> files at once, or 0 for one per CPU\n",
+        stdout);
+}
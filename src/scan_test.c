@@ -0,0 +1,482 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include "defs.h"
+
+#include "unrez.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+/*
+ * Test that unrez_scan visits a directory tree in order, pairs AppleDouble
+ * files with their data files, and that the files it reports can be opened.
+ * Test that unrez_forkedfile_probeat only looks where the flags allow, and that
+ * files opened and read through an I/O queue give the same results with
+ * unrez_forkedfile_probefd, with and without io_uring.
+ */
+
+static char root[64];
+/* A name too long for the probe's stack buffer, with the directory. */
+static char longname[260];
+static int rootfd;
+static int failure_count;
+
+static void write_file(const char *name, const void *data, size_t size) {
+    int fd;
+    fd = openat(rootfd, name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        die_errf(EX_CANTCREAT, errno, "%s", name);
+    }
+    if (size > 0 && write(fd, data, size) != (ssize_t)size) {
+        die_errf(EX_IOERR, errno, "%s", name);
+    }
+    close(fd);
+}
+
+static void make_dir(const char *name) {
+    if (mkdirat(rootfd, name, 0777) != 0) {
+        die_errf(EX_CANTCREAT, errno, "%s", name);
+    }
+}
+
+/* Files and directories in the test tree, in the order to delete them. */
+static const char *const kFiles[] = {
+    "._a", "a", "b.bin", "._orphan", "plain", "link", "zz",
+    "sub/._c", "sub/c", "sub/z.bin",
+};
+static const char *const kDirs[] = {"sub2", "sub"};
+
+static void make_tree(void) {
+    struct synth s;
+    void *rfork, *data;
+    size_t rsize, size;
+    synth_init(&s);
+    synth_add(&s, UNREZ_TYPE('T', 'E', 'X', 'T'), 128, "name", "hello", 5);
+    synth_finish(&s, &rfork, &rsize);
+    synth_destroy(&s);
+
+    make_dir("sub");
+    make_dir("sub2");
+    write_file("a", "data", 4);
+    write_file("plain", "plain", 5);
+    write_file("zz", "", 0);
+    write_file("sub/c", "data", 4);
+    synth_appledouble(&data, &size, rfork, rsize);
+    write_file("._a", data, size);
+    write_file("._orphan", data, size);
+    write_file("sub/._c", data, size);
+    free(data);
+    synth_macbinary(&data, &size, "b", "data", 4, rfork, rsize);
+    write_file("b.bin", data, size);
+    write_file("sub/z.bin", data, size);
+    free(data);
+    free(rfork);
+    if (symlinkat("sub", rootfd, "link") != 0) {
+        die_errf(EX_CANTCREAT, errno, "link");
+    }
+}
+
+/* Create a file with a long name, or remove it. */
+static void make_long(int create) {
+    char header[sizeof(longname) + 2];
+    struct synth s;
+    void *rfork, *data;
+    size_t rsize, size;
+    memcpy(header, "sub/._", 6);
+    memcpy(header + 6, longname + 4, strlen(longname + 4) + 1);
+    if (!create) {
+        unlinkat(rootfd, longname, 0);
+        unlinkat(rootfd, header, 0);
+        return;
+    }
+    synth_init(&s);
+    synth_add(&s, UNREZ_TYPE('T', 'E', 'X', 'T'), 128, NULL, "x", 1);
+    synth_finish(&s, &rfork, &rsize);
+    synth_destroy(&s);
+    synth_appledouble(&data, &size, rfork, rsize);
+    write_file(longname, "data", 4);
+    write_file(header, data, size);
+    free(data);
+    free(rfork);
+}
+
+static void remove_tree(void) {
+    int i;
+    for (i = 0; i < (int)(sizeof(kFiles) / sizeof(*kFiles)); i++) {
+        unlinkat(rootfd, kFiles[i], 0);
+    }
+    make_long(0);
+    for (i = 0; i < (int)(sizeof(kDirs) / sizeof(*kDirs)); i++) {
+        unlinkat(rootfd, kDirs[i], AT_REMOVEDIR);
+    }
+    close(rootfd);
+    rmdir(root);
+}
+
+/* An expected callback. */
+struct event {
+    /* For directories, the name is NULL. */
+    const char *path;
+    const char *name;
+    int appledouble;
+    unrez_type_t type;
+};
+
+static const struct event kEvents[] = {
+    {"", NULL, 0, 0},
+    {"._orphan", "._orphan", 0, kUnrezTypeAppleDouble},
+    {"a", "._a", 1, kUnrezTypeAppleDouble},
+    {"b.bin", "b.bin", 0, kUnrezTypeMacBinary},
+    {"plain", "plain", 0, kUnrezTypeNone},
+    {"sub", NULL, 0, 0},
+    {"sub/c", "._c", 1, kUnrezTypeAppleDouble},
+    {"sub/z.bin", "z.bin", 0, kUnrezTypeMacBinary},
+    {"", NULL, 0, 0},
+    {"zz", "zz", 0, kUnrezTypeNone},
+};
+
+enum {
+    kEventCount = sizeof(kEvents) / sizeof(*kEvents),
+};
+
+struct state {
+    int count;
+    /* Stop after this many events, or -1. */
+    int stop;
+};
+
+/* Get a path relative to the root, or NULL if it is not inside the root. */
+static const char *relpath(const char *path) {
+    size_t len = strlen(root);
+    if (strncmp(path, root, len) != 0) {
+        return NULL;
+    }
+    path += len;
+    return *path == '/' ? path + 1 : path;
+}
+
+/* Check that the next event is as expected. Returns nonzero to stop. */
+static int check_event(struct state *st, const char *path, const char *name,
+                       int appledouble) {
+    const struct event *e;
+    const char *rel = relpath(path);
+    int n = st->count++;
+    if (n >= kEventCount) {
+        fprintf(stderr, "unexpected event: %s\n", path);
+        failure_count++;
+        return 0;
+    }
+    e = &kEvents[n];
+    if (rel == NULL || strcmp(rel, e->path) != 0 ||
+        (name == NULL) != (e->name == NULL) ||
+        (name != NULL &&
+         (strcmp(name, e->name) != 0 || appledouble != e->appledouble))) {
+        fprintf(stderr, "event %d: got %s %s, expected %s %s\n", n, path,
+                name != NULL ? name : "(dir)", e->path,
+                e->name != NULL ? e->name : "(dir)");
+        failure_count++;
+    }
+    return st->stop >= 0 && st->count >= st->stop ? 99 : 0;
+}
+
+static int cb_directory(void *ctx, int dirfd, const char *path) {
+    (void)dirfd;
+    return check_event(ctx, path, NULL, 0);
+}
+
+static int cb_file(void *ctx, const struct unrez_scanfile *file) {
+    struct state *st = ctx;
+    struct unrez_forkedfile forks;
+    const struct event *e;
+    int n = st->count, err, r;
+    r = check_event(st, file->path, file->name, file->appledouble);
+    if (n >= kEventCount || kEvents[n].name == NULL) {
+        return r;
+    }
+    e = &kEvents[n];
+    err = unrez_forkedfile_probeat(&forks, file->dirfd, file->name,
+                                   kUnrezProbeListed);
+    if (err != 0) {
+        error_errf(err, "%s", file->path);
+        failure_count++;
+        return r;
+    }
+    if (forks.metadata.type != e->type ||
+        (e->type != kUnrezTypeNone && forks.rsrc.size == 0)) {
+        fprintf(stderr, "%s: wrong type or no resource fork\n", file->path);
+        failure_count++;
+    }
+    if (file->appledouble && forks.data.size != 4) {
+        fprintf(stderr, "%s: data fork not found\n", file->path);
+        failure_count++;
+    }
+    unrez_forkedfile_close(&forks);
+    return r;
+}
+
+/* A call to unrez_forkedfile_probeat and its expected result. */
+struct probe {
+    const char *path;
+    int flags;
+    unrez_type_t type;
+    int has_rsrc;
+    int data_size;
+};
+
+static const struct probe kProbes[] = {
+    {"a", 0, kUnrezTypeAppleDouble, 1, 4},
+    /* The listing says there is no AppleDouble file, so it is not opened. */
+    {"a", kUnrezProbeListed, kUnrezTypeNone, 0, 4},
+    {"a", kUnrezProbeListed | kUnrezProbeAppleDouble, kUnrezTypeAppleDouble, 1,
+     4},
+    {"._a", kUnrezProbeListed, kUnrezTypeAppleDouble, 1, 4},
+    {"sub/c", kUnrezProbeNoNative, kUnrezTypeAppleDouble, 1, 4},
+    {"sub/._c", 0, kUnrezTypeAppleDouble, 1, 4},
+    {"sub/z.bin", kUnrezProbeListed | kUnrezProbeNoNative,
+     kUnrezTypeMacBinary, 1, 4},
+    {"plain", kUnrezProbeListed | kUnrezProbeNoNative, kUnrezTypeNone, 0, 5},
+    {longname, 0, kUnrezTypeAppleDouble, 1, 4},
+};
+
+static void test_probe(void) {
+    const struct probe *p;
+    struct unrez_forkedfile forks;
+    int i, err;
+    memcpy(longname, "sub/", 4);
+    memset(longname + 4, 'x', 240);
+    make_long(1);
+    for (i = 0; i < (int)(sizeof(kProbes) / sizeof(*kProbes)); i++) {
+        p = &kProbes[i];
+        err = unrez_forkedfile_probeat(&forks, rootfd, p->path, p->flags);
+        if (err != 0) {
+            error_errf(err, "probe %s", p->path);
+            failure_count++;
+            continue;
+        }
+        if (forks.metadata.type != p->type ||
+            (forks.rsrc.size > 0) != p->has_rsrc ||
+            forks.data.size != p->data_size) {
+            fprintf(stderr, "probe %s, flags %d: incorrect result\n", p->path,
+                    p->flags);
+            failure_count++;
+        }
+        unrez_forkedfile_close(&forks);
+    }
+    err = unrez_forkedfile_probeat(&forks, rootfd, "missing", 0);
+    if (err != ENOENT) {
+        fprintf(stderr, "probe missing: returned %d, expected ENOENT\n", err);
+        failure_count++;
+        if (err == 0) {
+            unrez_forkedfile_close(&forks);
+        }
+    }
+}
+
+/* The state of a probe through the I/O queue. */
+struct ioprobe {
+    const struct probe *probe;
+    int fd;
+    int done;
+    long size;
+    unsigned char header[256];
+};
+
+enum {
+    kProbeCount = sizeof(kProbes) / sizeof(*kProbes),
+    /* Less than the number of probes, so the queue fills up. */
+    kQueueDepth = 4
+};
+
+static void test_ioqueue(int flags) {
+    struct unrez_ioqueue *q;
+    struct unrez_iocompletion c[kQueueDepth];
+    struct ioprobe iop[kProbeCount], *ip;
+    struct unrez_forkedfile forks;
+    const char *mode = flags & kUnrezIoNoUring ? "sync" : "async";
+    int next = 0, done = 0, i, n, err;
+    err = unrez_ioqueue_create(&q, kQueueDepth, flags);
+    if (err != 0) {
+        error_errf(err, "ioqueue %s", mode);
+        failure_count++;
+        return;
+    }
+    if ((flags & kUnrezIoNoUring) != 0 && unrez_ioqueue_isasync(q)) {
+        fprintf(stderr, "ioqueue %s: io_uring was used\n", mode);
+        failure_count++;
+    }
+    for (i = 0; i < kProbeCount; i++) {
+        iop[i].probe = &kProbes[i];
+        iop[i].fd = -1;
+        iop[i].done = 0;
+    }
+    while (done < kProbeCount) {
+        /* Queue opens until the queue is full. */
+        for (; next < kProbeCount; next++) {
+            err = unrez_ioqueue_openat(q, rootfd, kProbes[next].path,
+                                       &iop[next]);
+            if (err == EBUSY) {
+                if (unrez_ioqueue_pending(q) != kQueueDepth) {
+                    fprintf(stderr, "ioqueue %s: full with %d pending\n",
+                            mode, unrez_ioqueue_pending(q));
+                    failure_count++;
+                }
+                break;
+            } else if (err != 0) {
+                die_errf(EX_SOFTWARE, err, "unrez_ioqueue_openat");
+            }
+        }
+        err = unrez_ioqueue_wait(q, c, kQueueDepth, &n);
+        if (err != 0 || n == 0) {
+            die_errf(EX_SOFTWARE, err, "ioqueue %s: wait", mode);
+        }
+        for (i = 0; i < n; i++) {
+            ip = c[i].tag;
+            if (c[i].err != 0) {
+                error_errf(c[i].err, "ioqueue %s %s", mode, ip->probe->path);
+                failure_count++;
+                ip->done = 1;
+                done++;
+            } else if (ip->fd == -1) {
+                ip->fd = c[i].result;
+                err = unrez_ioqueue_read(q, ip->fd, ip->header,
+                                         sizeof(ip->header), 0, ip);
+                if (err != 0) {
+                    die_errf(EX_SOFTWARE, err, "unrez_ioqueue_read");
+                }
+            } else {
+                ip->size = c[i].result;
+                ip->done = 1;
+                done++;
+            }
+        }
+    }
+    if (unrez_ioqueue_pending(q) != 0) {
+        fprintf(stderr, "ioqueue %s: operations still pending\n", mode);
+        failure_count++;
+    }
+    unrez_ioqueue_destroy(q);
+
+    for (i = 0; i < kProbeCount; i++) {
+        ip = &iop[i];
+        if (ip->fd == -1) {
+            continue;
+        }
+        err = unrez_forkedfile_probefd(&forks, rootfd, ip->probe->path,
+                                       ip->probe->flags, ip->fd, ip->header,
+                                       ip->size);
+        if (err != 0) {
+            error_errf(err, "probefd %s", ip->probe->path);
+            failure_count++;
+            continue;
+        }
+        if (forks.metadata.type != ip->probe->type ||
+            (forks.rsrc.size > 0) != ip->probe->has_rsrc ||
+            forks.data.size != ip->probe->data_size) {
+            fprintf(stderr, "probefd %s, flags %d: incorrect result\n",
+                    ip->probe->path, ip->probe->flags);
+            failure_count++;
+        }
+        unrez_forkedfile_close(&forks);
+    }
+
+    /* Failures are reported in the completion. */
+    err = unrez_ioqueue_create(&q, 1, flags);
+    if (err != 0) {
+        die_errf(EX_SOFTWARE, err, "unrez_ioqueue_create");
+    }
+    err = unrez_ioqueue_openat(q, rootfd, "missing", NULL);
+    if (err == 0) {
+        err = unrez_ioqueue_wait(q, c, 1, &n);
+    }
+    if (err != 0 || n != 1 || c[0].err != ENOENT || c[0].result != -1) {
+        fprintf(stderr, "ioqueue %s missing: expected ENOENT\n", mode);
+        failure_count++;
+    }
+    unrez_ioqueue_destroy(q);
+}
+
+static int cb_error(void *ctx, int err, const char *path) {
+    (void)ctx;
+    error_errf(err, "%s", path);
+    failure_count++;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct unrez_scan_callbacks cb;
+    struct state st;
+    char path[80];
+    int r;
+    (void)argc;
+    (void)argv;
+
+    strcpy(root, "/tmp/unrez_scan.XXXXXX");
+    if (mkdtemp(root) == NULL) {
+        die_errf(EX_CANTCREAT, errno, "mkdtemp");
+    }
+    rootfd = open(root, O_RDONLY);
+    if (rootfd == -1) {
+        die_errf(EX_CANTCREAT, errno, "%s", root);
+    }
+    make_tree();
+
+    cb.ctx = &st;
+    cb.directory = cb_directory;
+    cb.file = cb_file;
+    cb.error = cb_error;
+
+    /* Trailing slashes should not appear in paths. */
+    st.count = 0;
+    st.stop = -1;
+    snprintf(path, sizeof(path), "%s//", root);
+    r = unrez_scan(path, &cb);
+    if (r != 0) {
+        error_errf(r, "unrez_scan");
+        failure_count++;
+    }
+    if (st.count != kEventCount) {
+        fprintf(stderr, "got %d events, expected %d\n", st.count,
+                kEventCount);
+        failure_count++;
+    }
+
+    /* A callback can stop the scan. */
+    st.count = 0;
+    st.stop = 6;
+    r = unrez_scan(root, &cb);
+    if (r != 99 || st.count != 6) {
+        fprintf(stderr, "stop: returned %d after %d events\n", r, st.count);
+        failure_count++;
+    }
+
+    /* The root must be a directory. */
+    snprintf(path, sizeof(path), "%s/plain", root);
+    r = unrez_scan(path, &cb);
+    if (r != ENOTDIR) {
+        fprintf(stderr, "scan file: returned %d, expected ENOTDIR\n", r);
+        failure_count++;
+    }
+
+    test_probe();
+    test_ioqueue(0);
+    test_ioqueue(kUnrezIoNoUring);
+
+    remove_tree();
+    if (failure_count > 0) {
+        fputs("FAILED\n", stderr);
+        return 1;
+    }
+    puts("scan tests passed");
+    return 0;
+}
@@ -0,0 +1,591 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include "defs.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+
+/*
+ * See lib/resourcefork.c for a description of the format. The fork is laid out
+ * as: header, reserved space up to 256 bytes, data, map. The map contains the
+ * map header, type list, reference lists, and name list in that order.
+ */
+
+enum {
+    kDataOffset = 256,
+    kMapHeaderSize = 30,
+};
+
+struct synth_entry {
+    uint32_t type_code;
+    int id;
+    int seq;
+    int32_t data_offset;
+    int name_offset;
+};
+
+static void *xrealloc(void *ptr, size_t size) {
+    void *nptr = realloc(ptr, size);
+    if (nptr == NULL) {
+        die_errf(EX_OSERR, errno, "realloc");
+    }
+    return nptr;
+}
+
+static void grow(void **ptr, size_t *cap, size_t need, size_t elemsize) {
+    size_t ncap = *cap;
+    if (need <= ncap) {
+        return;
+    }
+    if (ncap == 0) {
+        ncap = 16;
+    }
+    while (ncap < need) {
+        ncap *= 2;
+    }
+    *ptr = xrealloc(*ptr, ncap * elemsize);
+    *cap = ncap;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void put_u16(uint8_t *p, unsigned v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+void synth_init(struct synth *s) {
+    memset(s, 0, sizeof(*s));
+}
+
+void synth_destroy(struct synth *s) {
+    free(s->entries);
+    free(s->data);
+    free(s->names);
+}
+
+void synth_add(struct synth *s, uint32_t type_code, int id, const char *name,
+               const void *data, size_t size) {
+    struct synth_entry *e;
+    size_t namelen;
+    grow((void **)&s->entries, &s->entry_cap, s->entry_count + 1,
+         sizeof(*s->entries));
+    e = &s->entries[s->entry_count];
+    e->type_code = type_code;
+    e->id = id;
+    e->seq = s->entry_count;
+    e->data_offset = s->data_size;
+    grow((void **)&s->data, &s->data_cap, s->data_size + 4 + size, 1);
+    put_u32(s->data + s->data_size, size);
+    memcpy(s->data + s->data_size + 4, data, size);
+    s->data_size += 4 + size;
+    if (name != NULL) {
+        namelen = strlen(name);
+        if (namelen > 255) {
+            namelen = 255;
+        }
+        e->name_offset = s->names_size;
+        grow((void **)&s->names, &s->names_cap, s->names_size + 1 + namelen,
+             1);
+        s->names[s->names_size] = namelen;
+        memcpy(s->names + s->names_size + 1, name, namelen);
+        s->names_size += 1 + namelen;
+    } else {
+        e->name_offset = -1;
+    }
+    s->entry_count++;
+}
+
+static int compare_entry(const void *x, const void *y) {
+    const struct synth_entry *ex = x, *ey = y;
+    if (ex->type_code != ey->type_code) {
+        return ex->type_code < ey->type_code ? -1 : 1;
+    }
+    return ex->seq - ey->seq;
+}
+
+void synth_finish(struct synth *s, void **data, size_t *size) {
+    struct synth_entry *e = s->entries, *ee = e + s->entry_count, *p, *q;
+    uint8_t *buf, *map, *tptr, *rptr;
+    size_t map_size, total;
+    int type_count, ref_start, toff, noff;
+
+    qsort(e, s->entry_count, sizeof(*e), compare_entry);
+    type_count = 0;
+    for (p = e; p != ee; p++) {
+        if (p == e || p->type_code != p[-1].type_code) {
+            type_count++;
+        }
+    }
+    toff = kMapHeaderSize - 2;
+    ref_start = kMapHeaderSize + 8 * type_count;
+    noff = ref_start + 12 * (int)s->entry_count;
+    map_size = noff + s->names_size;
+    total = kDataOffset + s->data_size + map_size;
+    buf = calloc(total, 1);
+    if (buf == NULL) {
+        die_errf(EX_OSERR, errno, "calloc");
+    }
+
+    put_u32(buf, kDataOffset);
+    put_u32(buf + 4, kDataOffset + s->data_size);
+    put_u32(buf + 8, s->data_size);
+    put_u32(buf + 12, map_size);
+    memcpy(buf + kDataOffset, s->data, s->data_size);
+
+    map = buf + kDataOffset + s->data_size;
+    memcpy(map, buf, 16);
+    put_u16(map + 24, toff);
+    put_u16(map + 26, noff);
+    put_u16(map + 28, type_count - 1);
+    tptr = map + kMapHeaderSize;
+    rptr = map + ref_start;
+    for (p = e; p != ee; tptr += 8) {
+        for (q = p; q != ee && q->type_code == p->type_code; q++) {}
+        put_u32(tptr, p->type_code);
+        put_u16(tptr + 4, (q - p) - 1);
+        put_u16(tptr + 6, (rptr - map) - toff);
+        for (; p != q; p++, rptr += 12) {
+            put_u16(rptr, p->id);
+            put_u16(rptr + 2, p->name_offset);
+            /* Attributes in the high byte, 24-bit offset in the rest. */
+            put_u32(rptr + 4, p->data_offset);
+        }
+    }
+    if (s->names_size > 0) {
+        memcpy(map + noff, s->names, s->names_size);
+    }
+
+    *data = buf;
+    *size = total;
+}
+
+/* A growable byte buffer for building pictures. */
+struct sbuf {
+    uint8_t *data;
+    size_t size, cap;
+};
+
+static uint8_t *sbuf_add(struct sbuf *b, size_t n) {
+    uint8_t *p;
+    grow((void **)&b->data, &b->cap, b->size + n, 1);
+    p = b->data + b->size;
+    b->size += n;
+    return p;
+}
+
+static void sbuf_u8(struct sbuf *b, unsigned v) {
+    *sbuf_add(b, 1) = v;
+}
+
+static void sbuf_u16(struct sbuf *b, unsigned v) {
+    put_u16(sbuf_add(b, 2), v);
+}
+
+static void sbuf_u32(struct sbuf *b, uint32_t v) {
+    put_u32(sbuf_add(b, 4), v);
+}
+
+static void sbuf_rect(struct sbuf *b, int width, int height) {
+    sbuf_u16(b, 0);
+    sbuf_u16(b, 0);
+    sbuf_u16(b, height);
+    sbuf_u16(b, width);
+}
+
+/* Test whether units i and j are equal. */
+static int same(const uint8_t *p, int i, int j, int size) {
+    return memcmp(p + i * size, p + j * size, size) == 0;
+}
+
+/*
+ * Compress data with PackBits, where the data consists of n units, each of
+ * the given size in bytes.
+ */
+static void pack(struct sbuf *b, const uint8_t *p, int n, int size) {
+    int i = 0, j;
+    while (i < n) {
+        for (j = i + 1; j < n && j - i < 128 && same(p, i, j, size); j++) {}
+        if (j - i >= 2) {
+            sbuf_u8(b, 257 - (j - i));
+            memcpy(sbuf_add(b, size), p + i * size, size);
+            i = j;
+            continue;
+        }
+        /* Literal data, until the next run of three or more. */
+        for (j = i + 1; j < n && j - i < 128; j++) {
+            if (j + 2 < n && same(p, j, j + 1, size) &&
+                same(p, j, j + 2, size)) {
+                break;
+            }
+        }
+        sbuf_u8(b, j - i - 1);
+        memcpy(sbuf_add(b, (j - i) * size), p + i * size, (j - i) * size);
+        i = j;
+    }
+}
+
+static uint32_t synth_rand(uint32_t *state) {
+    *state = *state * 1103515245u + 12345u;
+    return *state >> 8;
+}
+
+/*
+ * Fill a row with image-like data: flat areas, noise, and areas copied from the
+ * previous row, so it compresses somewhat like a real picture.
+ */
+static void fill_row(uint8_t *row, const uint8_t *prev, int n, int size,
+                     uint32_t *state) {
+    int i = 0, j, len, mode, k;
+    uint8_t v[2];
+    while (i < n) {
+        len = 1 + synth_rand(state) % 48;
+        if (len > n - i) {
+            len = n - i;
+        }
+        mode = synth_rand(state) % 3;
+        if (mode == 2 && prev == NULL) {
+            mode = 0;
+        }
+        v[0] = synth_rand(state);
+        v[1] = synth_rand(state);
+        for (j = i; j < i + len; j++) {
+            for (k = 0; k < size; k++) {
+                switch (mode) {
+                case 0:
+                    row[j * size + k] = v[k];
+                    break;
+                case 1:
+                    row[j * size + k] = synth_rand(state);
+                    break;
+                default:
+                    row[j * size + k] = prev[j * size + k];
+                    break;
+                }
+            }
+        }
+        i += len;
+    }
+}
+
+void synth_pict(void **data, size_t *size, int pixel_size, int flags,
+                int width, int height, uint32_t seed) {
+    struct sbuf b = {0}, row = {0};
+    uint8_t *cur, *prev, *tmp;
+    uint32_t state = seed;
+    int rowbytes, rowunits, unitsize, cmpcount, packtype, x, y, is_packed;
+
+    switch (pixel_size) {
+    case 1:
+        cmpcount = 1;
+        rowbytes = ((width + 15) >> 4) * 2;
+        rowunits = rowbytes;
+        unitsize = 1;
+        break;
+    case 8:
+        cmpcount = 1;
+        rowbytes = (width + 1) & ~1;
+        rowunits = rowbytes;
+        unitsize = 1;
+        break;
+    case 16:
+        cmpcount = 3;
+        rowbytes = width * 2;
+        rowunits = width;
+        unitsize = 2;
+        break;
+    case 32:
+        cmpcount = (flags & kSynthAlpha) != 0 ? 4 : 3;
+        rowbytes = width * 4;
+        rowunits = width * cmpcount;
+        unitsize = 1;
+        break;
+    default:
+        dief(EX_SOFTWARE, "synth_pict: bad pixel size %d", pixel_size);
+    }
+    cur = calloc(rowunits * unitsize, 1);
+    prev = calloc(rowunits * unitsize, 1);
+    if (cur == NULL || prev == NULL) {
+        die_errf(EX_OSERR, errno, "calloc");
+    }
+
+    /* Picture header, version opcode, and header opcode. */
+    sbuf_u16(&b, 0);
+    sbuf_rect(&b, width, height);
+    sbuf_u16(&b, 0x0011);
+    sbuf_u16(&b, 0x02ff);
+    sbuf_u16(&b, 0x0c00);
+    memset(sbuf_add(&b, 24), 0, 24);
+
+    /* Rows narrower than 8 bytes are never packed. */
+    is_packed = rowbytes >= 8 && (flags & kSynthUnpacked) == 0;
+    if (!is_packed) {
+        packtype = 1;
+    } else {
+        packtype = pixel_size <= 8 ? 0 : pixel_size == 16 ? 3 : 4;
+    }
+    if (pixel_size == 1) {
+        /* BitsRect or PackBitsRect with a BitMap. */
+        sbuf_u16(&b, is_packed ? 0x0098 : 0x0090);
+        sbuf_u16(&b, rowbytes);
+        sbuf_rect(&b, width, height);
+    } else {
+        if (pixel_size == 8) {
+            /* BitsRect or PackBitsRect with a PixMap and color table. */
+            sbuf_u16(&b, is_packed ? 0x0098 : 0x0090);
+        } else {
+            /* DirectBitsRect with a PixMap, and a dummy baseAddr. */
+            sbuf_u16(&b, 0x009a);
+            sbuf_u32(&b, 0xff);
+        }
+        sbuf_u16(&b, rowbytes | 0x8000);
+        sbuf_rect(&b, width, height);
+        sbuf_u16(&b, 0);
+        sbuf_u16(&b, packtype);
+        sbuf_u32(&b, 0);
+        sbuf_u32(&b, 0x00480000);
+        sbuf_u32(&b, 0x00480000);
+        sbuf_u16(&b, pixel_size == 8 ? 0 : 16);
+        sbuf_u16(&b, pixel_size);
+        sbuf_u16(&b, cmpcount);
+        sbuf_u16(&b, pixel_size == 16 ? 5 : 8);
+        memset(sbuf_add(&b, 12), 0, 12);
+        if (pixel_size == 8) {
+            sbuf_u32(&b, 0);
+            sbuf_u16(&b, 0);
+            sbuf_u16(&b, 255);
+            for (x = 0; x < 256; x++) {
+                sbuf_u16(&b, x);
+                sbuf_u16(&b, synth_rand(&state));
+                sbuf_u16(&b, synth_rand(&state));
+                sbuf_u16(&b, synth_rand(&state));
+            }
+        }
+    }
+    sbuf_rect(&b, width, height);
+    sbuf_rect(&b, width, height);
+    sbuf_u16(&b, 0);
+
+    /*
+     * Unpacked 32-bit pixels are still stored as separate components, without
+     * the padding byte.
+     */
+    for (y = 0; y < height; y++) {
+        fill_row(cur, y > 0 ? prev : NULL, rowunits, unitsize, &state);
+        if (pixel_size == 16) {
+            for (x = 0; x < rowunits; x++) {
+                cur[x * 2] &= 0x7f;
+            }
+        }
+        if (!is_packed) {
+            memcpy(sbuf_add(&b, rowunits * unitsize), cur, rowunits * unitsize);
+        } else {
+            row.size = 0;
+            pack(&row, cur, rowunits, unitsize);
+            if (rowbytes > 250) {
+                sbuf_u16(&b, row.size);
+            } else {
+                sbuf_u8(&b, row.size);
+            }
+            memcpy(sbuf_add(&b, row.size), row.data, row.size);
+        }
+        tmp = prev;
+        prev = cur;
+        cur = tmp;
+    }
+
+    /* Opcodes are aligned to 16 bits. */
+    if ((b.size & 1) != 0) {
+        sbuf_u8(&b, 0);
+    }
+    sbuf_u16(&b, 0x00ff);
+    free(cur);
+    free(prev);
+    free(row.data);
+    *data = b.data;
+    *size = b.size;
+}
+
+/* CRC-16/XMODEM, used by MacBinary II headers and BinHex. */
+static unsigned crc16(const uint8_t *p, size_t n) {
+    unsigned crc = 0;
+    size_t i;
+    int bit;
+    for (i = 0; i < n; i++) {
+        crc ^= p[i] << 8;
+        for (bit = 0; bit < 8; bit++) {
+            crc = (crc & 0x8000) != 0 ? (crc << 1) ^ 0x1021 : crc << 1;
+            crc &= 0xffff;
+        }
+    }
+    return crc;
+}
+
+void synth_macbinary(void **data, size_t *size, const char *name,
+                     const void *dfork, size_t dsize, const void *rfork,
+                     size_t rsize) {
+    uint8_t *buf;
+    size_t namelen, doff, roff, total;
+    namelen = strlen(name);
+    if (namelen > 63) {
+        namelen = 63;
+    }
+    doff = 128;
+    roff = doff + ((dsize + 127) & ~(size_t)127);
+    total = roff + ((rsize + 127) & ~(size_t)127);
+    buf = calloc(total, 1);
+    if (buf == NULL) {
+        die_errf(EX_OSERR, errno, "calloc");
+    }
+    buf[1] = namelen;
+    memcpy(buf + 2, name, namelen);
+    memcpy(buf + 65, "BINAUNRZ", 8);
+    put_u32(buf + 83, dsize);
+    put_u32(buf + 87, rsize);
+    buf[122] = 129;
+    buf[123] = 129;
+    put_u16(buf + 124, crc16(buf, 124));
+    memcpy(buf + doff, dfork, dsize);
+    memcpy(buf + roff, rfork, rsize);
+    *data = buf;
+    *size = total;
+}
+
+void synth_appledouble(void **data, size_t *size, const void *rfork,
+                       size_t rsize) {
+    static const uint8_t kMagic[4] = {0x00, 0x05, 0x16, 0x07};
+    /* The header has two entries: Finder info, then the resource fork. */
+    enum { kHeaderSize = 26 + 12 * 2, kFinderInfoSize = 32 };
+    uint8_t *buf;
+    size_t total = kHeaderSize + kFinderInfoSize + rsize;
+    buf = calloc(total, 1);
+    if (buf == NULL) {
+        die_errf(EX_OSERR, errno, "calloc");
+    }
+    memcpy(buf, kMagic, 4);
+    put_u32(buf + 4, 0x00020000);
+    memcpy(buf + 8, "Unix            ", 16);
+    put_u16(buf + 24, 2);
+    put_u32(buf + 26, 9);
+    put_u32(buf + 30, kHeaderSize);
+    put_u32(buf + 34, kFinderInfoSize);
+    put_u32(buf + 38, 2);
+    put_u32(buf + 42, kHeaderSize + kFinderInfoSize);
+    put_u32(buf + 46, rsize);
+    memcpy(buf + kHeaderSize, "BINAUNRZ", 8);
+    memcpy(buf + kHeaderSize + kFinderInfoSize, rfork, rsize);
+    *data = buf;
+    *size = total;
+}
+
+/* Add a byte to a run-length encoded stream, escaping the marker. */
+static void rle_byte(struct sbuf *b, unsigned c) {
+    sbuf_u8(b, c);
+    if (c == 0x90) {
+        sbuf_u8(b, 0);
+    }
+}
+
+/* Run-length encode data for BinHex. */
+static void rle_encode(struct sbuf *b, const uint8_t *p, size_t n) {
+    size_t i = 0, j, run, k;
+    while (i < n) {
+        for (j = i + 1; j < n && p[j] == p[i]; j++) {
+        }
+        run = j - i;
+        rle_byte(b, p[i]);
+        run--;
+        /* Long runs are split, and each part repeats the same byte. */
+        while (run >= 2) {
+            k = run < 254 ? run : 254;
+            sbuf_u8(b, 0x90);
+            sbuf_u8(b, k + 1);
+            run -= k;
+        }
+        if (run > 0) {
+            rle_byte(b, p[i]);
+        }
+        i = j;
+    }
+}
+
+void synth_binhex(void **data, size_t *size, const char *name,
+                  const void *dfork, size_t dsize, const void *rfork,
+                  size_t rsize) {
+    static const char kAlphabet[] =
+        "!\"#$%&'()*+,-012345689@ABCDEFGHIJKLMNPQRSTUVXYZ[`abcdefhijklmpqr";
+    static const char kTag[] =
+        "(This file must be converted with BinHex 4.0)\n\n:";
+    struct sbuf raw, rle, out;
+    size_t namelen, i, pos, col;
+    uint32_t acc;
+    int nbits;
+    namelen = strlen(name);
+    if (namelen > 63) {
+        namelen = 63;
+    }
+    memset(&raw, 0, sizeof(raw));
+    sbuf_u8(&raw, namelen);
+    memcpy(sbuf_add(&raw, namelen), name, namelen);
+    sbuf_u8(&raw, 0);
+    memcpy(sbuf_add(&raw, 8), "BINAUNRZ", 8);
+    sbuf_u16(&raw, 0);
+    sbuf_u32(&raw, dsize);
+    sbuf_u32(&raw, rsize);
+    sbuf_u16(&raw, crc16(raw.data, raw.size));
+    pos = raw.size;
+    if (dsize > 0) {
+        memcpy(sbuf_add(&raw, dsize), dfork, dsize);
+    }
+    sbuf_u16(&raw, crc16(raw.data + pos, dsize));
+    pos = raw.size;
+    if (rsize > 0) {
+        memcpy(sbuf_add(&raw, rsize), rfork, rsize);
+    }
+    sbuf_u16(&raw, crc16(raw.data + pos, rsize));
+
+    memset(&rle, 0, sizeof(rle));
+    rle_encode(&rle, raw.data, raw.size);
+    free(raw.data);
+
+    /* Lines are 64 characters, and the first line includes the colon. */
+    memset(&out, 0, sizeof(out));
+    memcpy(sbuf_add(&out, sizeof(kTag) - 1), kTag, sizeof(kTag) - 1);
+    col = 1;
+    acc = 0;
+    nbits = 0;
+    for (i = 0; i <= rle.size; i++) {
+        if (i < rle.size) {
+            acc = (acc << 8) | rle.data[i];
+            nbits += 8;
+        } else if (nbits > 0) {
+            acc <<= 6 - nbits;
+            nbits = 6;
+        }
+        while (nbits >= 6) {
+            nbits -= 6;
+            if (col == 64) {
+                sbuf_u8(&out, '\n');
+                col = 0;
+            }
+            sbuf_u8(&out, kAlphabet[(acc >> nbits) & 63]);
+            col++;
+        }
+    }
+    sbuf_u8(&out, ':');
+    sbuf_u8(&out, '\n');
+    free(rle.data);
+    *data = out.data;
+    *size = out.size;
+}
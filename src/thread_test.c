@@ -0,0 +1,301 @@
+/*
+ * Copyright 2017 Dietrich Epp.
+ *
+ * This file is part of UnRez. UnRez is licensed under the terms of the MIT
+ * license. For more information, see LICENSE.txt.
+ */
+#include "defs.h"
+
+#include "unrez.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+/*
+ * Stress test for sharing one open resource fork between threads. Every thread
+ * starts on a fresh fork at the same time and looks up, loads, and checks
+ * resources in a random order, so lazily loaded data is loaded by several
+ * threads at once.
+ */
+
+enum {
+    kTypeCount = 60,
+    kPerType = 40,
+    kThreadCount = 16,
+    kOpCount = 3000,
+    kRoundCount = 20,
+};
+
+static uint32_t type_code(int t) {
+    return UNREZ_TYPE('T', 'a' + t / 26, 'a' + t % 26, '!');
+}
+
+static int rsrc_id(int j) {
+    return j * 3 - 20;
+}
+
+static uint32_t rsrc_size(int t, int j) {
+    return (t * 31 + j) % 200;
+}
+
+static int rsrc_byte(int t, int j, int k) {
+    return (t * 7 + j * 13 + k) & 0xff;
+}
+
+static void rsrc_name(char *buf, size_t size, int t, int j) {
+    snprintf(buf, size, "r%d.%d", t, j);
+}
+
+struct test {
+    struct unrez_resourcefork rfork;
+    pthread_barrier_t barrier;
+    int failed;
+};
+
+struct worker {
+    struct test *test;
+    uint32_t seed;
+};
+
+static void fail(struct test *test, int err, const char *what, int t, int j) {
+    char buf[256];
+    if (__atomic_exchange_n(&test->failed, 1, __ATOMIC_RELAXED)) {
+        return;
+    }
+    buf[0] = '\0';
+    if (err != 0) {
+        unrez_strerror(err, buf, sizeof(buf));
+    }
+    fprintf(stderr, "type %d, resource %d: %s %s\n", t, j, what, buf);
+}
+
+/* Check the contents of a resource. Returns 0 on success. */
+static int check_data(struct unrez_resourcefork *rfork,
+                      struct unrez_resource *rsrc, int t, int j) {
+    unsigned char buf[256];
+    const unsigned char *data;
+    const void *ptr;
+    uint32_t size, k;
+    int err;
+    if (rfork->data != NULL) {
+        err = unrez_resourcefork_getdata(rfork, rsrc, &ptr, &size);
+        data = ptr;
+    } else {
+        err = unrez_resourcefork_getsize(rfork, rsrc, &size);
+        if (err == 0 && size <= sizeof(buf)) {
+            err = unrez_resourcefork_readdata(rfork, rsrc, 0, buf, size);
+        }
+        data = buf;
+    }
+    if (err != 0 || size != rsrc_size(t, j)) {
+        return 1;
+    }
+    for (k = 0; k < size; k++) {
+        if (data[k] != rsrc_byte(t, j, k)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *worker_run(void *arg) {
+    struct worker *w = arg;
+    struct test *test = w->test;
+    struct unrez_resourcefork *rfork = &test->rfork;
+    struct unrez_resourcetype *type;
+    struct unrez_resource *rsrc;
+    const char *name;
+    char ename[16];
+    size_t namelen;
+    uint32_t seed = w->seed, size;
+    int i, t, j, err;
+    pthread_barrier_wait(&test->barrier);
+    for (i = 0;
+         i < kOpCount && !__atomic_load_n(&test->failed, __ATOMIC_RELAXED);
+         i++) {
+        seed = seed * 1103515245u + 12345u;
+        t = (seed >> 8) % kTypeCount;
+        j = (seed >> 16) % kPerType;
+        switch ((seed >> 4) % 16) {
+        case 0:
+            err = unrez_resourcefork_buildindex(rfork);
+            if (err != 0) {
+                fail(test, err, "buildindex", t, j);
+            }
+            break;
+        case 1:
+            err = unrez_resourcefork_loadall(rfork);
+            if (err != 0) {
+                fail(test, err, "loadall", t, j);
+            }
+            break;
+        case 2:
+        case 3:
+        case 4:
+            err = unrez_resourcefork_findtype(rfork, &type, type_code(t));
+            if (err != 0 || type->type_code != type_code(t) ||
+                type->count != kPerType) {
+                fail(test, err, "findtype", t, j);
+                break;
+            }
+            err = unrez_resourcefork_findrsrc(rfork, &rsrc, type_code(t),
+                                              rsrc_id(j));
+            if (err != 0) {
+                fail(test, err, "findrsrc", t, j);
+                break;
+            }
+            err = unrez_resourcefork_getsize(rfork, rsrc, &size);
+            if (err != 0 || size != rsrc_size(t, j)) {
+                fail(test, err, "getsize", t, j);
+            }
+            break;
+        case 5:
+        case 6:
+            err = unrez_resourcefork_findrsrc(rfork, &rsrc, type_code(t),
+                                              rsrc_id(j));
+            if (err != 0) {
+                fail(test, err, "findrsrc", t, j);
+                break;
+            }
+            err = unrez_resourcefork_getname(rfork, rsrc, &name, &namelen);
+            rsrc_name(ename, sizeof(ename), t, j);
+            if (err != 0 || namelen != strlen(ename) ||
+                memcmp(name, ename, namelen) != 0) {
+                fail(test, err, "getname", t, j);
+            }
+            break;
+        default:
+            err = unrez_resourcefork_findrsrc(rfork, &rsrc, type_code(t),
+                                              rsrc_id(j));
+            if (err != 0 || rsrc->id != rsrc_id(j)) {
+                fail(test, err, "findrsrc", t, j);
+                break;
+            }
+            if (check_data(rfork, rsrc, t, j) != 0) {
+                fail(test, 0, "bad data", t, j);
+            }
+            break;
+        }
+    }
+    return NULL;
+}
+
+/* Run one round of the test on an open fork. */
+static int run_round(struct test *test, uint32_t seed) {
+    pthread_t threads[kThreadCount];
+    struct worker workers[kThreadCount];
+    int i, r;
+    test->failed = 0;
+    r = pthread_barrier_init(&test->barrier, NULL, kThreadCount);
+    if (r != 0) {
+        die_errf(EX_OSERR, r, "pthread_barrier_init");
+    }
+    for (i = 0; i < kThreadCount; i++) {
+        workers[i].test = test;
+        workers[i].seed = seed + i * 7919;
+        r = pthread_create(&threads[i], NULL, worker_run, &workers[i]);
+        if (r != 0) {
+            die_errf(EX_OSERR, r, "pthread_create");
+        }
+    }
+    for (i = 0; i < kThreadCount; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    pthread_barrier_destroy(&test->barrier);
+    unrez_resourcefork_close(&test->rfork);
+    return test->failed;
+}
+
+/* Ways to read the fork, which must not change what the threads see. */
+static const struct unrez_readopts kReadOpts[] = {
+    {0, kUnrezAdviseNormal, kUnrezReadNoMmap},
+    {1, kUnrezAdviseSequential, kUnrezReadWillNeed},
+    {1, kUnrezAdviseRandom, kUnrezReadPopulate},
+    {0, kUnrezAdviseNormal, kUnrezReadNoMmap | kUnrezReadHugePages},
+};
+
+int main(int argc, char **argv) {
+    struct synth s;
+    struct test test;
+    struct unrez_fork fork;
+    unsigned char payload[256];
+    char name[16], path[] = "/tmp/unrez_thread_test.XXXXXX";
+    void *data;
+    size_t size, pos;
+    ssize_t amt;
+    int t, j, k, round, err, fdes, failure = 0;
+    (void)argc;
+    (void)argv;
+
+    synth_init(&s);
+    for (t = 0; t < kTypeCount; t++) {
+        for (j = 0; j < kPerType; j++) {
+            for (k = 0; k < (int)rsrc_size(t, j); k++) {
+                payload[k] = rsrc_byte(t, j, k);
+            }
+            rsrc_name(name, sizeof(name), t, j);
+            synth_add(&s, type_code(t), rsrc_id(j), name, payload,
+                      rsrc_size(t, j));
+        }
+    }
+    synth_finish(&s, &data, &size);
+    synth_destroy(&s);
+
+    fdes = mkstemp(path);
+    if (fdes == -1) {
+        die_errf(EX_CANTCREAT, errno, "%s", path);
+    }
+    unlink(path);
+    for (pos = 0; pos < size; pos += amt) {
+        amt = write(fdes, (char *)data + pos, size - pos);
+        if (amt < 0) {
+            die_errf(EX_IOERR, errno, "write");
+        }
+    }
+    fork.file = fdes;
+    fork.offset = 0;
+    fork.size = size;
+    fork.mem = NULL;
+
+    for (round = 0; round < kRoundCount; round++) {
+        err = unrez_resourcefork_openmem(&test.rfork, data, size);
+        if (err != 0) {
+            die_errf(EX_SOFTWARE, err, "openmem");
+        }
+        if (run_round(&test, round * 1000)) {
+            fprintf(stderr, "round %d: memory fork failed\n", round);
+            failure = 1;
+        }
+        err = unrez_resourcefork_openstream(&test.rfork, &fork);
+        if (err != 0) {
+            die_errf(EX_SOFTWARE, err, "openstream");
+        }
+        if (run_round(&test, round * 1000 + 1)) {
+            fprintf(stderr, "round %d: streaming fork failed\n", round);
+            failure = 1;
+        }
+        err = unrez_resourcefork_openforkopts(
+            &test.rfork, &fork,
+            &kReadOpts[round % (sizeof(kReadOpts) / sizeof(*kReadOpts))]);
+        if (err != 0) {
+            die_errf(EX_SOFTWARE, err, "openforkopts");
+        }
+        if (run_round(&test, round * 1000 + 2)) {
+            fprintf(stderr, "round %d: fork read with options failed\n",
+                    round);
+            failure = 1;
+        }
+    }
+    close(fdes);
+    free(data);
+    if (failure) {
+        fputs("FAILED\n", stderr);
+        return 1;
+    }
+    return 0;
+}
@@ -35,9 +35,9 @@ static const struct command kCommands[] = {
      pict2png_help},
     {"pictdump", "dump QuickDraw picture opcodes", pictdump_exec,
      pictdump_help},
-    /*
     {"resx", "extract resources from a resource fork", resx_exec, resx_help},
-    */
+    {"scan", "find files with resource forks in directories", scan_exec,
+     scan_help},
     {"version", "print the version", version_exec, version_help},
 };
 
@@ -11,6 +11,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sysexits.h>
+#include <unistd.h>
+
+enum { kMaxJobs = 256 };
 
 void errorf(const char *msg, ...) {
     va_list ap;
@@ -83,3 +86,25 @@ int parse_id(const char *s) {
     }
     return value;
 }
+
+int parse_jobs(const char *s) {
+    char *end;
+    long value;
+    value = strtol(s, &end, 10);
+    if (!*s || *end || value < 0) {
+        dief(EX_USAGE, "invalid job count '%s'", s);
+    }
+    if (value > kMaxJobs) {
+        dief(EX_USAGE, "job count %ld too large, must be at most %d", value,
+             kMaxJobs);
+    }
+    if (value == 0) {
+        value = sysconf(_SC_NPROCESSORS_ONLN);
+        if (value < 1) {
+            value = 1;
+        } else if (value > kMaxJobs) {
+            value = kMaxJobs;
+        }
+    }
+    return value;
+}